@@ -0,0 +1,101 @@
+/*
+ * Copyright (c) 2014 Mohamed Aslan <maslan@sce.carleton.ca>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+
+#include <stdlib.h>	/* malloc(3) */
+#include <string.h>	/* memcpy(3), strlen(3) */
+
+#include "arena.h"
+
+/* enough for any of the structs handed out */
+#define ARENA_ALIGN	16
+#define ALIGN(n)	(((n) + ARENA_ALIGN - 1) & ~((size_t)ARENA_ALIGN - 1))
+#define BLOCK_HDR	ALIGN(sizeof(struct arena_block))
+
+struct arena_block {
+	struct arena_block *next;
+	size_t size;	/* usable bytes after the header */
+	size_t used;
+};
+
+int
+arena_new(struct arena **ap)
+{
+	struct arena *a;
+
+	if ((a = malloc(sizeof(struct arena))) == NULL)
+		return EXIT_FAILURE;
+	a->blocks = NULL;
+	a->next = ARENA_BLOCK;
+	a->size = 0;
+	*ap = a;
+	return EXIT_SUCCESS;
+}
+
+void
+arena_free(struct arena *a)
+{
+	struct arena_block *b, *next;
+
+	if (a == NULL)
+		return;
+	for (b = a->blocks ; b != NULL ; b = next) {
+		next = b->next;
+		free(b);
+	}
+	free(a);
+}
+
+void *
+arena_alloc(struct arena *a, size_t len)
+{
+	struct arena_block *b = a->blocks;
+	size_t size;
+	void *ptr;
+
+	len = ALIGN(len);
+	if (b == NULL || b->size - b->used < len) {
+		size = a->next;
+		if (a->next < ARENA_MAXBLOCK)
+			a->next *= 2;
+		if (size - BLOCK_HDR < len)
+			size = BLOCK_HDR + len;
+		if ((b = malloc(size)) == NULL)
+			return NULL;
+		b->size = size - BLOCK_HDR;
+		b->used = 0;
+		b->next = a->blocks;
+		a->blocks = b;
+		a->size += size;
+	}
+	ptr = (char *)b + BLOCK_HDR + b->used;
+	b->used += len;
+	return ptr;
+}
+
+char *
+arena_strdup(struct arena *a, const char *str)
+{
+	char *dst;
+	size_t len;
+
+	len = strlen(str) + 1;
+	if ((dst = arena_alloc(a, len)) == NULL)
+		return NULL;
+	memcpy(dst, str, len);
+	return dst;
+}
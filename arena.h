@@ -0,0 +1,42 @@
+/*
+ * Copyright (c) 2014 Mohamed Aslan <maslan@sce.carleton.ca>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <sys/types.h>
+
+#define ARENA_BLOCK	4096		/* size of the first block */
+#define ARENA_MAXBLOCK	(1024 * 1024)	/* blocks stop doubling there */
+
+/*
+ * a bump allocator, what is allocated from an arena is only released
+ * with the whole arena.
+ */
+struct arena_block;
+
+struct arena {
+	struct arena_block *blocks;	/* the current block first */
+	size_t next;			/* size of the next block */
+	size_t size;			/* bytes held by all blocks */
+};
+
+int arena_new(struct arena **);
+void arena_free(struct arena *);
+void *arena_alloc(struct arena *, size_t);
+char *arena_strdup(struct arena *, const char *);
+
+#endif
@@ -48,9 +48,24 @@ main(int argc, char **argv)
 	else if (!strcmp(argv[1], "commit")) {
 		cmd_commit(argc - 1, argv + 1);
 	}
+	else if (!strcmp(argv[1], "commit-graph")) {
+		cmd_commit_graph(argc - 1, argv + 1);
+	}
+	else if (!strcmp(argv[1], "compress")) {
+		cmd_compress(argc - 1, argv + 1);
+	}
+	else if (!strcmp(argv[1], "dedup")) {
+		cmd_dedup(argc - 1, argv + 1);
+	}
 	else if (!strcmp(argv[1], "diff")) {
 		cmd_diff(argc - 1, argv + 1);
 	}
+	else if (!strcmp(argv[1], "fsck")) {
+		cmd_fsck(argc - 1, argv + 1);
+	}
+	else if (!strcmp(argv[1], "gc")) {
+		cmd_gc(argc - 1, argv + 1);
+	}
 	else if (!strcmp(argv[1], "help")) {
 		cmd_help(argc - 1, argv + 1);
 	}
@@ -63,6 +78,12 @@ main(int argc, char **argv)
 	else if (!strcmp(argv[1], "log")) {
 		cmd_log(argc - 1, argv + 1);
 	}
+	else if (!strcmp(argv[1], "repack")) {
+		cmd_repack(argc - 1, argv + 1);
+	}
+	else if (!strcmp(argv[1], "tag")) {
+		cmd_tag(argc - 1, argv + 1);
+	}
 	else if (!strcmp(argv[1], "version")) {
 		cmd_version(argc - 1, argv + 1);
 	}
@@ -0,0 +1,234 @@
+/*
+ * Copyright (c) 2014 Mohamed Aslan <maslan@sce.carleton.ca>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * throughput of the SHA-256 implementations used for object ids, a
+ * check that each of them gives the same digests as SHA256Data(3), and
+ * the cost of each fsync policy when the fs objdb stores small objects
+ */
+
+#include <sys/types.h>
+
+#include <err.h>	/* err(3) */
+#include <fts.h>	/* fts_open(3) */
+#include <limits.h>	/* PATH_MAX */
+#include <stdio.h>	/* printf(3) */
+#include <stdlib.h>	/* malloc(3), arc4random_buf(3), mkdtemp(3) */
+#include <string.h>	/* strcmp(3) */
+#include <time.h>	/* clock_gettime(2) */
+#include <unistd.h>	/* rmdir(2), unlink(2) */
+
+#include <sha2.h>	/* SHA256Data() */
+
+#include "config.h"
+#include "hash.h"
+#include "objdb.h"
+
+#define BENCH_TOTAL	(256 * 1024 * 1024)	/* bytes hashed per run */
+#define SYNC_OBJECTS	256			/* objects stored per policy */
+#define SYNC_SIZE	4096
+
+int objdb_baseline_get_ops(struct objdb_ops **);
+
+static const char *names[] = { "generic", "avx2", "sha-ni", "armv8" };
+static const char *policies[] = { "none", "batch", "full" };
+static const size_t sizes[] = { 64, 1024, 4096, 65536, 1024 * 1024 };
+/* objects per batch: loose one by one, loose together, spilled to a pack */
+static const size_t batches[] = { 1, 32, SYNC_OBJECTS };
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+to_hex(const u_int8_t *digest, char *hex)
+{
+	int i;
+
+	for (i = 0 ; i < SHA256_DIGEST_LENGTH ; i++)
+		snprintf(hex + i * 2, 3, "%02x", digest[i]);
+}
+
+/*
+ * compares single and multi-buffer digests of every length up to a few
+ * blocks against the reference implementation
+ */
+static int
+check(const u_int8_t *buf)
+{
+	char ref[SHA256_DIGEST_STRING_LENGTH], hex[SHA256_DIGEST_STRING_LENGTH];
+	const void *data[HASH_LANES];
+	u_int8_t digest[SHA256_DIGEST_LENGTH], digests[HASH_LANES][SHA256_DIGEST_LENGTH];
+	size_t i, j, lens[HASH_LANES];
+	int bad = 0;
+
+	for (i = 0 ; i < 300 ; i++) {
+		SHA256Data(buf, i, ref);
+		hash_data(buf, i, digest);
+		to_hex(digest, hex);
+		if (strcmp(ref, hex))
+			bad++;
+		for (j = 0 ; j < HASH_LANES ; j++) {
+			data[j] = buf + j;
+			lens[j] = (i + j * 37) % 300;
+		}
+		hash_many(data, lens, HASH_LANES, digests);
+		for (j = 0 ; j < HASH_LANES ; j++) {
+			SHA256Data(data[j], lens[j], ref);
+			to_hex(digests[j], hex);
+			if (strcmp(ref, hex))
+				bad++;
+		}
+	}
+	return bad;
+}
+
+static void
+rm_tree(const char *dir)
+{
+	char *paths[2];
+	FTS *fts;
+	FTSENT *e;
+
+	paths[0] = (char *)dir;
+	paths[1] = NULL;
+	if ((fts = fts_open(paths, FTS_PHYSICAL | FTS_NOCHDIR, NULL)) == NULL)
+		err(1, "%s", dir);
+	while ((e = fts_read(fts)) != NULL) {
+		if (e->fts_info == FTS_DP)
+			rmdir(e->fts_path);
+		else if (e->fts_info != FTS_D)
+			unlink(e->fts_path);
+	}
+	fts_close(fts);
+}
+
+/*
+ * stores SYNC_OBJECTS objects of SYNC_SIZE bytes, per batches of n, in
+ * a new fs objdb under dir with the fsync variable set to the policy.
+ * the objdb is closed within the time taken, that is where the objects
+ * left to a group sync reach the disk when no head moves.
+ */
+static double
+store_run(const char *dir, int policy, size_t n, const u_int8_t *buf)
+{
+	char path[PATH_MAX];
+	size_t i;
+	double t;
+	FILE *fp;
+	struct objdb_ops *ops;
+	struct objdb_ctx *ctx;
+	struct file *f;
+
+	if (snprintf(path, sizeof(path), "%s/config", dir) >= (int)sizeof(path))
+		errx(1, "%s: path too long", dir);
+	if ((fp = fopen(path, "w")) == NULL)
+		err(1, "%s", path);
+	fprintf(fp, "fsync = %s\n", policies[policy]);
+	fclose(fp);
+	if (baseline_config_load(path) == EXIT_FAILURE)
+		errx(1, "%s: cannot be loaded", path);
+	if (objdb_baseline_get_ops(&ops) == EXIT_FAILURE)
+		errx(1, "no fs objdb");
+	t = now();
+	if (ops->open(&ctx, "db", dir) == EXIT_FAILURE || ops->init(ctx) == EXIT_FAILURE)
+		errx(1, "%s/db: cannot be created", dir);
+	for (i = 0 ; i < SYNC_OBJECTS ; i++) {
+		if (i % n == 0 && ops->begin_batch(ctx) == EXIT_FAILURE)
+			errx(1, "begin_batch failed");
+		f = baseline_file_new();
+		f->loc = LOC_MEM;
+		if ((f->buffer = malloc(SYNC_SIZE)) == NULL)
+			err(1, "malloc");
+		/* a distinct object each time */
+		memcpy(f->buffer, buf + i, SYNC_SIZE);
+		f->size = SYNC_SIZE;
+		if (ops->insert_file(ctx, f) == EXIT_FAILURE)
+			errx(1, "insert_file failed");
+		baseline_file_free(f);
+		if ((i % n == n - 1 || i == SYNC_OBJECTS - 1) && ops->commit_batch(ctx) == EXIT_FAILURE)
+			errx(1, "commit_batch failed");
+	}
+	if (ops->close(ctx) == EXIT_FAILURE)
+		errx(1, "close failed");
+	t = now() - t;
+	free(ops);
+	if (snprintf(path, sizeof(path), "%s/db", dir) >= (int)sizeof(path))
+		errx(1, "%s: path too long", dir);
+	rm_tree(path);
+	if (snprintf(path, sizeof(path), "%s/config", dir) >= (int)sizeof(path))
+		errx(1, "%s: path too long", dir);
+	unlink(path);
+	return t;
+}
+
+int
+main(int argc, char **argv)
+{
+	const void *data[HASH_LANES];
+	u_int8_t *buf, digest[SHA256_DIGEST_LENGTH], digests[HASH_LANES][SHA256_DIGEST_LENGTH];
+	char dir[PATH_MAX];
+	size_t i, j, n, lens[HASH_LANES];
+	double t;
+
+	if ((buf = malloc(sizes[sizeof(sizes) / sizeof(sizes[0]) - 1] + HASH_LANES)) == NULL)
+		err(1, "malloc");
+	arc4random_buf(buf, sizes[sizeof(sizes) / sizeof(sizes[0]) - 1] + HASH_LANES);
+	printf("default: %s\n", hash_impl());
+	for (i = 0 ; i < sizeof(names) / sizeof(names[0]) ; i++) {
+		if (hash_select(names[i]) == EXIT_FAILURE)
+			continue;
+		printf("%s: %s\n", names[i], check(buf) ? "MISMATCH" : "ok");
+		for (j = 0 ; j < sizeof(sizes) / sizeof(sizes[0]) ; j++) {
+			t = now();
+			for (n = 0 ; n < BENCH_TOTAL / sizes[j] ; n++)
+				hash_data(buf, sizes[j], digest);
+			t = now() - t;
+			printf("\t%8zu bytes: %8.1f MB/s\n", sizes[j], BENCH_TOTAL / t / 1e6);
+		}
+		/* bulk add of small files */
+		for (j = 0 ; j < HASH_LANES ; j++) {
+			data[j] = buf + j;
+			lens[j] = 4096;
+		}
+		t = now();
+		for (n = 0 ; n < BENCH_TOTAL / (4096 * HASH_LANES) ; n++)
+			hash_many(data, lens, HASH_LANES, digests);
+		t = now() - t;
+		printf("\t%3dx4096 bytes: %8.1f MB/s (hash_many)\n", HASH_LANES, BENCH_TOTAL / t / 1e6);
+	}
+	/* on the file system given, the one of the repository matters */
+	if (snprintf(dir, sizeof(dir), "%s/blbench.XXXXXX", argc > 1 ? argv[1] : ".") >= (int)sizeof(dir))
+		errx(1, "%s: path too long", argv[1]);
+	if (mkdtemp(dir) == NULL)
+		err(1, "mkdtemp");
+	printf("fsync, fs objdb storing %d objects of %d bytes:\n", SYNC_OBJECTS, SYNC_SIZE);
+	for (i = 0 ; i < sizeof(policies) / sizeof(policies[0]) ; i++) {
+		for (j = 0 ; j < sizeof(batches) / sizeof(batches[0]) ; j++) {
+			t = store_run(dir, i, batches[j], buf);
+			printf("\t%5s, %3zu per batch: %8.3f ms/object, %8.1f ms total\n", policies[i],
+			    batches[j], t * 1000 / SYNC_OBJECTS, t * 1000);
+		}
+	}
+	rmdir(dir);
+	free(buf);
+	return 0;
+}
@@ -0,0 +1,83 @@
+#!/bin/sh
+#
+# Copyright (c) 2014 Mohamed Aslan <maslan@sce.carleton.ca>
+#
+# Permission to use, copy, modify, and distribute this software for any
+# purpose with or without fee is hereby granted, provided that the above
+# copyright notice and this permission notice appear in all copies.
+#
+# THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+# WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+# MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+# ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+# WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+# ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+# OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+#
+
+#
+# runs the same session against every objdb backend and compares what
+# they print with what the fs backend prints. commits differ by their
+# dates, so do their ids, both are masked.
+#
+# usage: compare.sh [path to baseline]
+#
+
+BL=${1:-baseline}
+BACKENDS="fs log mem"
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/blcompare.XXXXXX") || exit 1
+trap 'rm -rf "$WORK"' EXIT
+
+session() {
+	mkdir -p "$WORK/$1/repo/sub" && cd "$WORK/$1/repo" || return 1
+	$BL init -d "$1" >/dev/null || return 1
+	echo hello > a.txt
+	echo world > sub/b.txt
+	i=0
+	while [ $i -lt 500 ]; do
+		echo "line $i of a file large enough to be compressed"
+		i=$((i + 1))
+	done > big.txt
+	$BL add . >/dev/null && $BL commit -m first >/dev/null || return 1
+	echo hello again >> a.txt
+	echo new > sub/c.txt
+	$BL add . >/dev/null && $BL commit -m second >/dev/null || return 1
+	echo "== log"
+	$BL log -f '%n %m\n'
+	echo "== ls"
+	$BL ls -R
+	echo "== cat"
+	$BL cat a.txt
+	$BL cat sub/c.txt
+	$BL cat big.txt | cmp - big.txt && echo "big.txt matches"
+	echo "== diff"
+	$BL diff $($BL log -n 1 -f '%i')
+	echo "== branch"
+	$BL branch -c topic
+	$BL branch -s topic
+	echo topic > t.txt
+	$BL add t.txt >/dev/null && $BL commit -m third >/dev/null
+	$BL branch -l
+	$BL log -f '%m\n'
+	$BL branch -s master
+	$BL log -f '%m\n'
+	echo "== tag"
+	$BL tag first-tag
+	$BL tag
+	$BL log -c first-tag -f '%m\n'
+}
+
+status=0
+for db in $BACKENDS; do
+	(session "$db") 2>&1 | sed -E 's/[0-9a-f]{64}/<id>/g; s/^(Date|date).*/<date>/' \
+	    > "$WORK/$db.out"
+	if [ "$db" = fs ]; then
+		echo "fs: $(wc -l < "$WORK/fs.out") lines"
+	elif diff -u "$WORK/fs.out" "$WORK/$db.out"; then
+		echo "$db: same as fs"
+	else
+		echo "$db: differs from fs"
+		status=1
+	fi
+done
+exit $status
@@ -0,0 +1,82 @@
+#!/bin/sh
+#
+# Copyright (c) 2014 Mohamed Aslan <maslan@sce.carleton.ca>
+#
+# Permission to use, copy, modify, and distribute this software for any
+# purpose with or without fee is hereby granted, provided that the above
+# copyright notice and this permission notice appear in all copies.
+#
+# THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+# WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+# MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+# ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+# WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+# ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+# OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+#
+
+#
+# checks that an add large enough to be written to a pack stores its
+# files compressed, as an add small enough to be written loose does,
+# and that repack keeps them that way.
+#
+# usage: spill.sh [path to baseline]
+#
+
+BL=${1:-baseline}
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/blspill.XXXXXX") || exit 1
+trap 'rm -rf "$WORK"' EXIT
+
+# size in bytes of the objects under the directories, indexes aside
+bytes() {
+	find "$@" -type f ! -name '*.idx' ! -name multi-pack-index -exec cat {} + |
+	    wc -c | tr -d ' '
+}
+
+# the objects of a repository, loose or packed
+objects() {
+	bytes "$1"/.baseline/db/files "$1"/.baseline/db/dirs "$1"/.baseline/db/commits \
+	    "$1"/.baseline/db/packs
+}
+
+# a repository holding n files of compressible text
+add_files() {
+	mkdir -p "$WORK/$1" && cd "$WORK/$1" || return 1
+	$BL init >/dev/null || return 1
+	i=0
+	while [ $i -lt $2 ]; do
+		seq 1 20000 | sed "s/^/file $i line /" > f$i.txt
+		i=$((i + 1))
+	done
+	$BL add . >/dev/null && $BL commit -m files >/dev/null
+}
+
+status=0
+(add_files loose 10) || exit 1
+(add_files spill 100) || exit 1
+content=$(cat "$WORK"/spill/f*.txt | wc -c | tr -d ' ')
+loose=$(bytes "$WORK/loose/.baseline/db/files")
+packed=$(bytes "$WORK/spill/.baseline/db/packs")
+echo "10 files written loose: $loose bytes"
+echo "100 files written to a pack: $packed bytes of $content"
+# per file, the pack may not take more than twice the loose objects
+if [ $loose -eq 0 ] || [ $((packed * 10)) -gt $((loose * 100 * 2)) ]; then
+	echo "the pack is not compressed"
+	status=1
+fi
+for repo in loose spill; do
+	before=$(objects "$WORK/$repo")
+	(cd "$WORK/$repo" && $BL repack >/dev/null) || exit 1
+	after=$(objects "$WORK/$repo")
+	echo "$repo: $before bytes of objects before repack, $after after"
+	# but for the header of the new pack
+	if [ $after -gt $((before + 16)) ]; then
+		echo "$repo: repack made the objects larger"
+		status=1
+	fi
+done
+(cd "$WORK/spill" && $BL fsck >/dev/null && $BL cat f42.txt | cmp -s - f42.txt) || {
+	echo "the packed files do not read back"
+	status=1
+}
+exit $status
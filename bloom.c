@@ -0,0 +1,191 @@
+/*
+ * Copyright (c) 2014 Mohamed Aslan <maslan@sce.carleton.ca>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>	/* mmap(2) */
+#include <sys/stat.h>	/* fstat(2) */
+
+#include <endian.h>	/* htobe*(3), be*toh(3) */
+#include <fcntl.h>	/* open(2) */
+#include <stdio.h>	/* asprintf(3), rename(2) */
+#include <stdlib.h>	/* calloc(3) */
+#include <string.h>	/* mem*(3) */
+#include <unistd.h>	/* close(2), unlink(2) */
+
+#include "bloom.h"
+
+/*
+ * the first 16 bytes of an id make two independent hashes
+ */
+static void
+id_hashes(const struct objid *id, u_int64_t *h1, u_int64_t *h2)
+{
+	int i;
+
+	*h1 = *h2 = 0;
+	for (i = 0 ; i < 8 ; i++) {
+		*h1 = (*h1 << 8) | id->bytes[i];
+		*h2 = (*h2 << 8) | id->bytes[i + 8];
+	}
+	*h2 |= 1;
+}
+
+int
+bloom_new(u_int64_t expected, struct bloom **bp)
+{
+	struct bloom *b;
+	struct bloom_header *hdr;
+	u_int64_t nbits;
+
+	nbits = expected * BLOOM_BITS_PER;
+	if (nbits < BLOOM_MIN_BITS)
+		nbits = BLOOM_MIN_BITS;
+	nbits = (nbits + 63) & ~63ULL;
+	if ((b = calloc(1, sizeof(struct bloom))) == NULL)
+		return EXIT_FAILURE;
+	b->len = sizeof(struct bloom_header) + nbits / 8;
+	if ((b->map = calloc(1, b->len)) == NULL) {
+		free(b);
+		return EXIT_FAILURE;
+	}
+	hdr = (struct bloom_header *)b->map;
+	memcpy(hdr->magic, BLOOM_MAGIC, sizeof(hdr->magic));
+	hdr->version = htobe32(BLOOM_VERSION);
+	hdr->nbits = htobe64(nbits);
+	b->nbits = nbits;
+	b->bits = b->map + sizeof(struct bloom_header);
+	*bp = b;
+	return EXIT_SUCCESS;
+}
+
+/*
+ * replaces the filter at path atomically
+ */
+int
+bloom_write(struct bloom *b, const char *path)
+{
+	char *tmp = NULL;
+	size_t off;
+	ssize_t n;
+	int fd;
+
+	asprintf(&tmp, "%s.XXXXXX", path);
+	if ((fd = mkstemp(tmp)) == -1) {
+		free(tmp);
+		return EXIT_FAILURE;
+	}
+	for (off = 0 ; off < b->len ; off += n)
+		if ((n = write(fd, b->map + off, b->len - off)) == -1)
+			break;
+	close(fd);
+	if (off != b->len || rename(tmp, path) == -1) {
+		unlink(tmp);
+		free(tmp);
+		return EXIT_FAILURE;
+	}
+	free(tmp);
+	return EXIT_SUCCESS;
+}
+
+int
+bloom_open(const char *path, struct bloom **bp)
+{
+	int fd;
+	struct stat s;
+	struct bloom *b;
+	struct bloom_header *hdr;
+
+	if ((fd = open(path, O_RDWR)) == -1)
+		return EXIT_FAILURE;
+	if (fstat(fd, &s) == -1 || (size_t)s.st_size < sizeof(struct bloom_header)) {
+		close(fd);
+		return EXIT_FAILURE;
+	}
+	if ((b = calloc(1, sizeof(struct bloom))) == NULL) {
+		close(fd);
+		return EXIT_FAILURE;
+	}
+	b->len = s.st_size;
+	b->map = mmap(NULL, b->len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (b->map == MAP_FAILED) {
+		free(b);
+		return EXIT_FAILURE;
+	}
+	b->mapped = 1;
+	hdr = (struct bloom_header *)b->map;
+	b->nbits = be64toh(hdr->nbits);
+	if (memcmp(hdr->magic, BLOOM_MAGIC, sizeof(hdr->magic)) ||
+	    be32toh(hdr->version) != BLOOM_VERSION || b->nbits == 0 ||
+	    b->nbits / 8 != b->len - sizeof(struct bloom_header)) {
+		bloom_close(b);
+		return EXIT_FAILURE;
+	}
+	b->bits = b->map + sizeof(struct bloom_header);
+	*bp = b;
+	return EXIT_SUCCESS;
+}
+
+void
+bloom_close(struct bloom *b)
+{
+	if (b == NULL)
+		return;
+	if (b->mapped)
+		munmap(b->map, b->len);
+	else
+		free(b->map);
+	free(b);
+}
+
+/*
+ * other processes may be adding ids at the same time, bits are set
+ * atomically so that none gets lost.
+ */
+void
+bloom_add(struct bloom *b, const struct objid *id)
+{
+	u_int64_t h1, h2, bit;
+	int i;
+
+	if (b == NULL)
+		return;
+	id_hashes(id, &h1, &h2);
+	for (i = 0 ; i < BLOOM_K ; i++) {
+		bit = (h1 + i * h2) % b->nbits;
+		__sync_fetch_and_or(&b->bits[bit / 8], 1 << (bit % 8));
+	}
+}
+
+/*
+ * 0 if the id was never added, 1 if it may have been
+ */
+int
+bloom_maybe(struct bloom *b, const struct objid *id)
+{
+	u_int64_t h1, h2, bit;
+	int i;
+
+	if (b == NULL)
+		return 1;
+	id_hashes(id, &h1, &h2);
+	for (i = 0 ; i < BLOOM_K ; i++) {
+		bit = (h1 + i * h2) % b->nbits;
+		if (!(b->bits[bit / 8] & (1 << (bit % 8))))
+			return 0;
+	}
+	return 1;
+}
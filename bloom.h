@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2014 Mohamed Aslan <maslan@sce.carleton.ca>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _BLOOM_H_
+#define _BLOOM_H_
+
+#include <sys/types.h>
+
+#include "objects.h"
+
+#define BLOOM_MAGIC	"BLBF"
+#define BLOOM_VERSION	1
+#define BLOOM_K		7	/* hashes per id */
+#define BLOOM_BITS_PER	10	/* bits per expected id, about 1% false positives */
+#define BLOOM_MIN_BITS	(1024 * 1024)
+
+/*
+ * a bloom filter over the ids of every object of the database, mapped
+ * shared so that inserts update it in place. ids are SHA-256 digests,
+ * their bits are used as the hashes.
+ *
+ * on-disk format, integers are big-endian:
+ *	struct bloom_header, then nbits / 8 bytes of bits.
+ */
+struct bloom_header {
+	char magic[4];
+	u_int32_t version;
+	u_int64_t nbits;
+};
+
+struct bloom {
+	u_int8_t *map;
+	size_t len;
+	int mapped;		/* or malloc'ed by bloom_new() */
+	u_int64_t nbits;
+	u_int8_t *bits;
+};
+
+int bloom_new(u_int64_t, struct bloom **);
+int bloom_write(struct bloom *, const char *);
+int bloom_open(const char *, struct bloom **);
+void bloom_close(struct bloom *);
+void bloom_add(struct bloom *, const struct objid *);
+int bloom_maybe(struct bloom *, const struct objid *);
+
+#endif
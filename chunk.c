@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2014 Mohamed Aslan <maslan@sce.carleton.ca>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "chunk.h"
+
+/*
+ * normalized chunking: cut points are harder to find before CHUNK_AVG
+ * and easier after it, which keeps chunk sizes close to the average.
+ * the gear hash only keeps the last 64 bytes in its high bits, hence
+ * the masks.
+ */
+#define MASK_S		0xffffc00000000000ULL	/* 18 bits */
+#define MASK_L		0xfffc000000000000ULL	/* 14 bits */
+
+static u_int64_t gear[256];
+static pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+
+/*
+ * the table must never change, or boundaries (and so dedup) would be
+ * lost between versions.
+ */
+static void
+gear_init(void)
+{
+	u_int64_t x = 0x62617365696e65ULL, z;
+	int i;
+
+	/* splitmix64 */
+	for (i = 0 ; i < 256 ; i++) {
+		z = (x += 0x9e3779b97f4a7c15ULL);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		gear[i] = z ^ (z >> 31);
+	}
+}
+
+/*
+ * returns the length of the first chunk of buf, len should be at least
+ * CHUNK_MAX unless buf holds the end of the file.
+ */
+size_t
+chunk_next(const u_int8_t *buf, size_t len)
+{
+	u_int64_t fp = 0;
+	size_t i, n, normal;
+
+	pthread_once(&gear_once, gear_init);
+	if (len <= CHUNK_MIN)
+		return len;
+	n = (len > CHUNK_MAX) ? CHUNK_MAX : len;
+	normal = (n > CHUNK_AVG) ? CHUNK_AVG : n;
+	for (i = CHUNK_MIN ; i < normal ; i++) {
+		fp = (fp << 1) + gear[buf[i]];
+		if (!(fp & MASK_S))
+			return i + 1;
+	}
+	for ( ; i < n ; i++) {
+		fp = (fp << 1) + gear[buf[i]];
+		if (!(fp & MASK_L))
+			return i + 1;
+	}
+	return n;
+}
@@ -0,0 +1,36 @@
+/*
+ * Copyright (c) 2014 Mohamed Aslan <maslan@sce.carleton.ca>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _CHUNK_H_
+#define _CHUNK_H_
+
+#include <sys/types.h>
+
+/*
+ * large files are cut into content-defined chunks (FastCDC), each chunk
+ * is stored once as a regular file object and the file itself becomes
+ * a manifest: an OBJ_CHUNKED header followed by one line per chunk,
+ *
+ *	<chunk id> <chunk size>\n
+ */
+#define CHUNK_MIN	(16 * 1024)
+#define CHUNK_AVG	(64 * 1024)
+#define CHUNK_MAX	(256 * 1024)
+#define CHUNK_THRESHOLD	(4 * 1024 * 1024)	/* default, smaller files stay whole */
+
+size_t chunk_next(const u_int8_t *, size_t);
+
+#endif
@@ -33,8 +33,7 @@
 int
 cmd_branch(int argc, char **argv)
 {
-	char *branch = NULL;
-	char *head = NULL;
+	char *branch = NULL, hex[OBJID_HEXLEN + 1];
 	enum {
 		O_LISTCUR,
 		O_LISTALL,
@@ -42,6 +41,7 @@ cmd_branch(int argc, char **argv)
 		O_SWITCH
 	} op = O_LISTCUR;
 	int ch, error = 0, exist = 0;
+	struct objid head;
 	struct session s;
 
 	baseline_session_begin(&s, 0);
@@ -77,7 +77,7 @@ cmd_branch(int argc, char **argv)
 		/* get current branch's head */
 		if (s.db_ops->branch_get_head(s.db_ctx, s.branch, &head) == EXIT_FAILURE)
 			errx(EXIT_FAILURE, "error, failed to find branch head.");
-		if (head == NULL)
+		if (objid_is_null(&head))
 			errx(EXIT_FAILURE, "error, branch \'%s\' does not contain any commits.", s.branch);
 		/* create a new branch from the current one */
 		if (s.db_ops->branch_create_from(s.db_ctx, branch, s.branch) == EXIT_FAILURE)
@@ -92,8 +92,8 @@ cmd_branch(int argc, char **argv)
 		/* list current branch */
 		if (s.db_ops->branch_get_head(s.db_ctx, s.branch, &head) == EXIT_FAILURE)
 			errx(EXIT_FAILURE, "error, failed to find branch head.");
-		printf("current branch: %s\nhead: %s\n", s.branch, head);
-		free(head);
+		printf("current branch: %s\nhead: %s\n", s.branch,
+		    objid_is_null(&head) ? "(null)" : objid_hex(&head, hex));
 		break;
 	case O_SWITCH:
 		if (s.db_ops->branch_if_exists(s.db_ctx, branch, &exist) == EXIT_FAILURE)
@@ -27,27 +27,13 @@
 #include "objects.h"
 
 
-static struct dirent*
-lookup(struct dir *dir, const char *name)
-{
-	struct dirent *ent;
-
-	ent = dir->children;
-	while (ent != NULL) {
-		if (!strcmp(ent->name, name))
-			return ent;
-		ent = ent->next;
-	}
-	return NULL;
-}
-
 int
 cmd_cat(int argc, char **argv)
 {
-	char *comm_id = NULL, *path;
-	char *id = NULL, *p1, *p2;
+	char *path, *p1, *p2;
 	char buf[1024];
-	int ch, n;
+	int ch, explicit = 0;
+	struct objid comm_id, id;
 	struct session s;
 	struct commit *comm;
 	struct dir *dir;
@@ -60,7 +46,9 @@ cmd_cat(int argc, char **argv)
 	while ((ch = getopt(argc, argv, "c:")) != -1) {
 		switch(ch) {
 		case 'c':
-			comm_id = strdup(optarg);
+			explicit = 1;
+			if (baseline_session_resolve(&s, O_COMMIT, optarg, &comm_id) == EXIT_FAILURE)
+				errx(EXIT_FAILURE, "error, invalid commit id \'%s\'.", optarg);
 			break;
 		default:
 			return EXIT_FAILURE;
@@ -75,21 +63,21 @@ cmd_cat(int argc, char **argv)
 		errx(EXIT_FAILURE, "error, incorrect number of arguments specified.");
 
 	/* no commit specified, use current branch head */ 
-	if (comm_id == NULL) {
+	if (!explicit) {
 		if (s.db_ops->branch_get_head(s.db_ctx, s.branch, &comm_id) == EXIT_FAILURE)
 			errx(EXIT_FAILURE, "error, branch \'%s\' was not found.", s.branch);
-		if (comm_id == NULL)
+		if (objid_is_null(&comm_id))
 			errx(EXIT_FAILURE, "error, branch \'%s\' has zero commits.", s.branch);
 	}
 
 	path = strdup(argv[0]);
 
 	comm = baseline_commit_new();
-	if (s.db_ops->select_commit(s.db_ctx, comm_id, comm) == EXIT_FAILURE)
-		errx(EXIT_FAILURE, "error, commit \'%s\' was not found.", comm_id);
+	if (s.db_ops->select_commit(s.db_ctx, &comm_id, comm) == EXIT_FAILURE)
+		errx(EXIT_FAILURE, "error, commit \'%s\' was not found.", objid_hex(&comm_id, buf));
 
 	dir = baseline_dir_new();
-	s.db_ops->select_dir(s.db_ctx, comm->dir, dir);
+	s.db_ops->select_dir(s.db_ctx, &comm->dir, dir);
 
 	p1 = p2 = path;
 	while (1) {
@@ -105,16 +93,15 @@ cmd_cat(int argc, char **argv)
 #ifdef DEBUG
 			printf("[DEBUG] looking up directory \'%s\'.\n", p1);
 #endif
-			if ((ent = lookup(dir, p1)) == NULL)
+			if ((ent = baseline_dir_lookup(dir, p1)) == NULL)
 				errx(EXIT_FAILURE, "error, no such a file or directory \'%s\'.", argv[0]);
 			if (!S_ISDIR(ent->mode))
 				errx(EXIT_FAILURE, "error, \'%s\' is not a directory.", p1);
-			free(id);
-			id = strdup(ent->id);
+			id = ent->id;
 
 			baseline_dir_free(dir);
 			dir = baseline_dir_new();
-			s.db_ops->select_dir(s.db_ctx, id, dir);
+			s.db_ops->select_dir(s.db_ctx, &id, dir);
 
 			p1 = ++p2;
 			p2 = p1;
@@ -127,15 +114,15 @@ cmd_cat(int argc, char **argv)
 #ifdef DEBUG
 			printf("[DEBUG] lookuping up file \'%s\'\n", p1);
 #endif
-			if ((ent = lookup(dir, p1)) == NULL)
+			if ((ent = baseline_dir_lookup(dir, p1)) == NULL)
 				errx(EXIT_FAILURE, "error, no such a file or directory \'%s\'.", argv[0]);
 			if (S_ISDIR(ent->mode))
 				errx(EXIT_FAILURE, "error, \'%s\' is a directory, to list directories use \'ls\' command instead.", p1);
 
 			file = baseline_file_new();
-			s.db_ops->select_file(s.db_ctx, ent->id, file);
+			s.db_ops->select_file(s.db_ctx, &ent->id, file);
 #ifdef DEBUG
-			printf("[DEBUG] file found with id \'%s\'.\n", file->id);
+			printf("[DEBUG] file found with id \'%s\'.\n", objid_hex(&file->id, buf));
 #endif
 			break;
 		}
@@ -145,12 +132,9 @@ cmd_cat(int argc, char **argv)
 	}
 
 	/* output file to stdout */
-	while ((n = read(file->fd, buf, sizeof(buf))) > 0) {
-		write(1, buf, n);
-	}
-	if (n == -1)
+	if (baseline_file_send(file, STDOUT_FILENO) == -1)
 		errx(EXIT_FAILURE, "error, failed to read file.");
-	close(file->fd);
+	baseline_file_close(file);
 
 	free(path);
 	baseline_dir_free(dir);
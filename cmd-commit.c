@@ -24,6 +24,7 @@
 #include "defaults.h"
 #include "session.h"
 #include "config.h"
+#include "helper.h"
 #include "cmd.h"
 
 
@@ -108,10 +109,10 @@ cmd_commit(int argc, char **argv)
 {
 	char *commit_msg = NULL, *msg_file = NULL;
 	char *exec;
-	char *branch_head, *workdir_head;
 	const char *editor;
 	int ch;
 	int flag_msg = 0, flag_error = 0, flag_force = 0;
+	struct objid branch_head, workdir_head;
 	struct session s;
 
 	baseline_session_begin(&s, 0);
@@ -170,9 +171,13 @@ cmd_commit(int argc, char **argv)
 		errx(EXIT_FAILURE, "error, failed to query the status of the current branch.");
 	if (s.dc_ops->workdir_get(s.dc_ctx, &workdir_head) == EXIT_FAILURE)
 		errx(EXIT_FAILURE, "error, failed to query the status of the working directory.");
-	/* check if it's the first commit ever */
-	if ((branch_head == NULL && workdir_head == NULL) || (strcmp(branch_head, workdir_head) == 0) || flag_force)
+	/* both are null before the first commit ever */
+	if (objid_cmp(&branch_head, &workdir_head) == 0 || flag_force)
 		goto next;
+	else if (!objid_is_null(&workdir_head) && !objid_is_null(&branch_head) &&
+	    baseline_helper_is_ancestor(s.db_ops, s.db_ctx, &workdir_head, &branch_head) == 1)
+		errx(EXIT_FAILURE, "error, the working directory is behind the head of the current branch.\n"
+			"you can:\n\t[1] checkout the last head, or\n\t[2] use -f to force commit");
 	else
 		errx(EXIT_FAILURE, "error, the heads of the current branch and working directory do not match.\n"
 			"you can:\n\t[1] switch to the correct branch, or\n\t[2] checkout the last head, or\n\t[3] use -f to force commit");
@@ -0,0 +1,39 @@
+/*
+ * Copyright (c) 2014 Mohamed Aslan <maslan@sce.carleton.ca>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h> /* EXIT_FAILURE */
+#include <err.h>    /* errx(3) */
+
+#include "session.h"
+#include "cmd.h"
+
+int
+cmd_dedup(int argc, char **argv)
+{
+	struct session s;
+
+	baseline_session_begin(&s, 0);
+
+	if (s.db_ops->dedup == NULL)
+		errx(EXIT_FAILURE, "error, the object database does not support dedup.");
+	if (s.db_ops->dedup(s.db_ctx) == EXIT_FAILURE)
+		errx(EXIT_FAILURE, "error, failed to dedup the object database.");
+
+	baseline_session_end(&s);
+	return EXIT_SUCCESS;
+}
@@ -26,6 +26,7 @@
 #include "cmd.h"
 #include "session.h"
 
+#include "arena.h"
 #include "objects.h"
 
 #include "common.h"
@@ -44,11 +45,11 @@ make_tmpdir()
 }
 
 static char *
-make_fifo(const char *path, const char *name)
+make_fifo(const char *path, const struct objid *id)
 {
-	char *fifo_name = NULL;
+	char *fifo_name = NULL, hex[OBJID_HEXLEN + 1];
 
-	asprintf(&fifo_name, "%s/%s", path, name); 
+	asprintf(&fifo_name, "%s/%s", path, objid_hex(id, hex));
 	if (mkfifo(fifo_name, S_IRUSR | S_IWUSR) == -1) {
 		errx(EXIT_FAILURE, "error, failed to create FIFO \'%s\'.", fifo_name);
 	}
@@ -69,13 +70,7 @@ open_fifo(const char *fifo)
 static void
 copy_to_fifo(struct file *f, int fifo)
 {
-	char buf[2048];
-	ssize_t n;
-
-	while ((n = read(f->fd, buf, sizeof(buf))) > 0) {
-		write(fifo, buf, n);
-	}
-	if (n == -1) {
+	if (baseline_file_send(f, fifo) == -1) {
 		errx(EXIT_FAILURE, "error, failed to read file.");
 	}
 }
@@ -121,9 +116,10 @@ ext_diff_proc(struct session *s, struct dirent *ent, char *fifo)
 	fifo_fd = open_fifo(fifo);
 
 	f = baseline_file_new();
-	s->db_ops->select_file(s->db_ctx, ent->id, f);
+	s->db_ops->select_file(s->db_ctx, &ent->id, f);
 
 	copy_to_fifo(f, fifo_fd);
+	baseline_file_close(f);
 	close(fifo_fd);
 	unlink(fifo);
 
@@ -147,7 +143,7 @@ ext_diff(struct session *s, const char *tmpdir, struct dirent *ent1, struct dire
 		asprintf(&dir1, "%s/XXXXXXX", tmpdir);
 		if (mkdtemp(dir1) == NULL)
 			errx(EXIT_FAILURE, "error, failed to create a temporary directory (%s).", dir1);
-		fifo1 = make_fifo(dir1, ent1->id);
+		fifo1 = make_fifo(dir1, &ent1->id);
 		//free(dir1);
 		if (strlen(path) > 0)
 			asprintf(&label1, "%s/%s", path, ent1->name);
@@ -158,7 +154,7 @@ ext_diff(struct session *s, const char *tmpdir, struct dirent *ent1, struct dire
 		asprintf(&dir2, "%s/XXXXXXX", tmpdir);
 		if (mkdtemp(dir2) == NULL)
 			errx(EXIT_FAILURE, "error, failed to create a temporary directory (%s).", dir2);
-		fifo2 = make_fifo(dir2, ent2->id);
+		fifo2 = make_fifo(dir2, &ent2->id);
 		//free(dir);
 		if (strlen(path) > 0)
 			asprintf(&label2, "%s/%s", path, ent2->name);
@@ -205,26 +201,76 @@ ext_diff(struct session *s, const char *tmpdir, struct dirent *ent1, struct dire
 	free(fifo2);
 }
 
+/*
+ * reads the subdirectories diff_r() is about to walk all at once, those
+ * left unchanged are skipped as it does
+ */
+static void
+prefetch(struct session *s, struct dir *d1, struct dir *d2)
+{
+	size_t i1 = 0, i2 = 0, n = 0, n1, n2;
+	int cmp;
+	struct dirent *ent1, *ent2;
+	struct objid *ids;
+
+	n1 = (d1 != NULL) ? d1->n_children : 0;
+	n2 = (d2 != NULL) ? d2->n_children : 0;
+	if (s->db_ops->prefetch_dirs == NULL ||
+	    (ids = reallocarray(NULL, n1 + n2, sizeof(struct objid))) == NULL)
+		return;
+	while (i1 < n1 || i2 < n2) {
+		ent1 = (i1 < n1) ? &d1->children[i1] : NULL;
+		ent2 = (i2 < n2) ? &d2->children[i2] : NULL;
+		if (ent1 == NULL)
+			cmp = 1;
+		else if (ent2 == NULL)
+			cmp = -1;
+		else
+			cmp = strcmp(ent1->name, ent2->name);
+		if (cmp == 0 && !objid_cmp(&ent1->id, &ent2->id)) {
+			i1++;
+			i2++;
+			continue;
+		}
+		if (cmp <= 0) {
+			if (S_ISDIR(ent1->mode))
+				ids[n++] = ent1->id;
+			i1++;
+		}
+		if (cmp >= 0) {
+			if (S_ISDIR(ent2->mode))
+				ids[n++] = ent2->id;
+			i2++;
+		}
+	}
+	s->db_ops->prefetch_dirs(s->db_ctx, ids, n);
+	free(ids);
+}
 
 static void
 diff_r(struct session *s, struct dir *d1, struct dir *d2, const char *p, const char *tmpdir)
 {
 	char *pnext = NULL;
+	size_t i1 = 0, i2 = 0, n1 = 0, n2 = 0;
 	struct dir *child1, *child2;
-	struct dirent *ent1 = NULL, *ent2 = NULL;
+	struct dirent *ent1, *ent2;
 
 	if (d1 == NULL && d2 == NULL)
 		return;
 	if (p == NULL || tmpdir == NULL)
 		return;
 	if (d1 != NULL)
-		ent1 = d1->children;
+		n1 = d1->n_children;
 	if (d2 != NULL)
-		ent2 = d2->children;
+		n2 = d2->n_children;
 	if (*p == '/')
 		p++;
+	prefetch(s, d1, d2);
 
+	/* both are sorted by name */
 	while (1) {
+		ent1 = (i1 < n1) ? &d1->children[i1] : NULL;
+		ent2 = (i2 < n2) ? &d2->children[i2] : NULL;
 		if (ent1 == NULL && ent2 == NULL)
 			break;
 		else if (ent1 == NULL) {
@@ -233,15 +279,15 @@ diff_r(struct session *s, struct dir *d1, struct dir *d2, const char *p, const c
 				ext_diff(s, tmpdir, NULL, ent2, p);
 			else if (S_ISDIR(ent2->mode)) {
 				asprintf(&pnext, "%s/%s", p, ent2->name);
-				child2 = baseline_dir_new();
-				s->db_ops->select_dir(s->db_ctx, ent2->id, child2);
+				child2 = baseline_dir_new_in(d2->arena);
+				s->db_ops->select_dir(s->db_ctx, &ent2->id, child2);
 				diff_r(s, NULL, child2, pnext, tmpdir);
 				baseline_dir_free(child2);
 				free(pnext);
 			}
 			else
 				errx(EXIT_FAILURE, "error, file mode not supported.");
-			ent2 = ent2->next;
+			i2++;
 		}
 		else if (ent2 == NULL) {
 			/* --- ent1 */
@@ -249,18 +295,18 @@ diff_r(struct session *s, struct dir *d1, struct dir *d2, const char *p, const c
 				ext_diff(s, tmpdir, ent1, NULL, p);
 			else if (S_ISDIR(ent1->mode)) {
 				asprintf(&pnext, "%s/%s", p, ent1->name);
-				child1 = baseline_dir_new();
-				s->db_ops->select_dir(s->db_ctx, ent1->id, child1);
+				child1 = baseline_dir_new_in(d1->arena);
+				s->db_ops->select_dir(s->db_ctx, &ent1->id, child1);
 				diff_r(s, child1, NULL, pnext, tmpdir);
 				baseline_dir_free(child1);
 				free(pnext);
 			}
 			else
 				errx(EXIT_FAILURE, "error, file mode not supported.");
-			ent1 = ent1->next;
+			i1++;
 		}
 		else if (!strcmp(ent1->name, ent2->name)) {
-			if (strcmp(ent1->id, ent2->id)) {
+			if (objid_cmp(&ent1->id, &ent2->id)) {
 				/* *** ent1 & ent2 */
 				if (S_ISREG(ent1->mode) && S_ISREG(ent2->mode))
 					ext_diff(s, tmpdir, ent1, ent2, p);
@@ -269,8 +315,8 @@ diff_r(struct session *s, struct dir *d1, struct dir *d2, const char *p, const c
 					ext_diff(s, tmpdir, ent1, NULL, p);
 					/* add new dir */
 					asprintf(&pnext, "%s/%s", p, ent2->name);
-					child2 = baseline_dir_new();
-					s->db_ops->select_dir(s->db_ctx, ent2->id, child2);
+					child2 = baseline_dir_new_in(d2->arena);
+					s->db_ops->select_dir(s->db_ctx, &ent2->id, child2);
 					diff_r(s, NULL, child2, pnext, tmpdir);
 					baseline_dir_free(child2);
 					free(pnext);
@@ -278,8 +324,8 @@ diff_r(struct session *s, struct dir *d1, struct dir *d2, const char *p, const c
 				else if (S_ISDIR(ent1->mode) && S_ISREG(ent2->mode)) {
 					/* delete old dir */
 					asprintf(&pnext, "%s/%s", p, ent1->name);
-					child1 = baseline_dir_new();
-					s->db_ops->select_dir(s->db_ctx, ent1->id, child1);
+					child1 = baseline_dir_new_in(d1->arena);
+					s->db_ops->select_dir(s->db_ctx, &ent1->id, child1);
 					diff_r(s, child1, NULL, pnext, tmpdir);
 					baseline_dir_free(child1);
 					free(pnext);
@@ -288,10 +334,10 @@ diff_r(struct session *s, struct dir *d1, struct dir *d2, const char *p, const c
 				}
 				else if (S_ISDIR(ent1->mode) && S_ISDIR(ent2->mode)) {
 					asprintf(&pnext, "%s/%s", p, ent1->name);
-					child1 = baseline_dir_new();
-					child2 = baseline_dir_new();
-					s->db_ops->select_dir(s->db_ctx, ent1->id, child1);
-					s->db_ops->select_dir(s->db_ctx, ent2->id, child2);
+					child1 = baseline_dir_new_in(d1->arena);
+					child2 = baseline_dir_new_in(d2->arena);
+					s->db_ops->select_dir(s->db_ctx, &ent1->id, child1);
+					s->db_ops->select_dir(s->db_ctx, &ent2->id, child2);
 					diff_r(s, child1, child2, pnext, tmpdir);
 					baseline_dir_free(child1);
 					baseline_dir_free(child2);
@@ -300,8 +346,8 @@ diff_r(struct session *s, struct dir *d1, struct dir *d2, const char *p, const c
 				else
 					errx(EXIT_FAILURE, "error, file mode not supported.");
 			}
-			ent1 = ent1->next;
-			ent2 = ent2->next;
+			i1++;
+			i2++;
 		}
 		else if (strcmp(ent1->name, ent2->name) < 0) {
 			/* --- ent1 */
@@ -309,15 +355,15 @@ diff_r(struct session *s, struct dir *d1, struct dir *d2, const char *p, const c
 				ext_diff(s, tmpdir, ent1, NULL, p);
 			else if (S_ISDIR(ent1->mode)) {
 				asprintf(&pnext, "%s/%s", p, ent1->name);
-				child1 = baseline_dir_new();
-				s->db_ops->select_dir(s->db_ctx, ent1->id, child1);
+				child1 = baseline_dir_new_in(d1->arena);
+				s->db_ops->select_dir(s->db_ctx, &ent1->id, child1);
 				diff_r(s, child1, NULL, pnext, tmpdir);
 				baseline_dir_free(child1);
 				free(pnext);
 			}
 			else
 				errx(EXIT_FAILURE, "error, file mode not supported.");
-			ent1 = ent1->next;
+			i1++;
 		}
 		else if (strcmp(ent1->name, ent2->name) > 0) {
 			/* +++ ent2 */
@@ -325,15 +371,15 @@ diff_r(struct session *s, struct dir *d1, struct dir *d2, const char *p, const c
 				ext_diff(s, tmpdir, NULL, ent2, p);
 			else if (S_ISDIR(ent2->mode)) {
 				asprintf(&pnext, "%s/%s", p, ent2->name);
-				child2 = baseline_dir_new();
-				s->db_ops->select_dir(s->db_ctx, ent2->id, child2);
+				child2 = baseline_dir_new_in(d2->arena);
+				s->db_ops->select_dir(s->db_ctx, &ent2->id, child2);
 				diff_r(s, NULL, child2, pnext, tmpdir);
 				baseline_dir_free(child2);
 				free(pnext);
 			}
 			else
 				errx(EXIT_FAILURE, "error, file mode not supported.");
-			ent2 = ent2->next;
+			i2++;
 		}
 	}
 }
@@ -341,34 +387,42 @@ diff_r(struct session *s, struct dir *d1, struct dir *d2, const char *p, const c
 int
 cmd_diff(int argc, char **argv)
 {
-	char *old = NULL, *new = NULL;
 	char *tmpdir = NULL;
+	struct objid old, new;
 	struct session s;
+	struct arena *arena;
 	struct commit *comm_old, *comm_new;
 	struct dir *dir_old, *dir_new;
 
 	baseline_session_begin(&s, 0);
 
 	if (argc == 2) {
-		new = strdup(argv[1]);
+		if (baseline_session_resolve(&s, O_COMMIT, argv[1], &new) == EXIT_FAILURE)
+			errx(EXIT_FAILURE, "error, invalid commit id \'%s\'.", argv[1]);
+		memset(&old, 0, sizeof(old));
 	}
 	else if (argc == 3) {
-		old = strdup(argv[1]);
-		new = strdup(argv[2]);
+		if (baseline_session_resolve(&s, O_COMMIT, argv[1], &old) == EXIT_FAILURE)
+			errx(EXIT_FAILURE, "error, invalid commit id \'%s\'.", argv[1]);
+		if (baseline_session_resolve(&s, O_COMMIT, argv[2], &new) == EXIT_FAILURE)
+			errx(EXIT_FAILURE, "error, invalid commit id \'%s\'.", argv[2]);
 	}
 	else {
 		errx(EXIT_FAILURE, "wrong number of arguments (%d)\n", argc);
 	}
 
 	tmpdir = make_tmpdir();
+	/* all the dirs of the walk are released at once */
+	if (arena_new(&arena) == EXIT_FAILURE)
+		errx(EXIT_FAILURE, "error, out of memory.");
 
 	comm_new = baseline_commit_new();
-	s.db_ops->select_commit(s.db_ctx, new, comm_new);
+	s.db_ops->select_commit(s.db_ctx, &new, comm_new);
 
-	dir_new = baseline_dir_new();
-	s.db_ops->select_dir(s.db_ctx, comm_new->dir, dir_new);
+	dir_new = baseline_dir_new_in(arena);
+	s.db_ops->select_dir(s.db_ctx, &comm_new->dir, dir_new);
 
-	if (old == NULL) {
+	if (objid_is_null(&old)) {
 		if (comm_new->n_parents > 0)
 			old = comm_new->parents[0];
 		else
@@ -376,10 +430,10 @@ cmd_diff(int argc, char **argv)
 	}
 
 	comm_old = baseline_commit_new();
-	s.db_ops->select_commit(s.db_ctx, old, comm_old);
+	s.db_ops->select_commit(s.db_ctx, &old, comm_old);
 
-	dir_old = baseline_dir_new();
-	s.db_ops->select_dir(s.db_ctx, comm_old->dir, dir_old);
+	dir_old = baseline_dir_new_in(arena);
+	s.db_ops->select_dir(s.db_ctx, &comm_old->dir, dir_old);
 
 	diff_r(&s, dir_old, dir_new, "", tmpdir);
 
@@ -387,10 +441,9 @@ cmd_diff(int argc, char **argv)
 	baseline_dir_free(dir_new);
 
 ret:
+	arena_free(arena);
 	remove(tmpdir);
 	free(tmpdir);
-	free(old);
-	free(new);
 	baseline_session_end(&s);
 	return EXIT_SUCCESS;
 }
@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2014 Mohamed Aslan <maslan@sce.carleton.ca>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h> /* EXIT_FAILURE */
+#include <unistd.h> /* getopt(3) */
+#include <err.h>    /* errx(3) */
+
+#include "session.h"
+#include "cmd.h"
+
+int
+cmd_fsck(int argc, char **argv)
+{
+	int ch, flags = 0, retval = EXIT_SUCCESS;
+	struct session s;
+
+	baseline_session_begin(&s, 0);
+
+	while ((ch = getopt(argc, argv, "c")) != -1) {
+		switch (ch) {
+		case 'c':
+			flags |= OBJDB_FSCK_CONNECTIVITY;
+			break;
+		default:
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (s.db_ops->fsck == NULL)
+		errx(EXIT_FAILURE, "error, the object database does not support checking.");
+	if (s.db_ops->fsck(s.db_ctx, flags) == EXIT_FAILURE)
+		retval = EXIT_FAILURE;
+	if (s.dc_ops->fsck != NULL && s.dc_ops->fsck(s.dc_ctx) == EXIT_FAILURE)
+		retval = EXIT_FAILURE;
+	if (retval == EXIT_FAILURE)
+		errx(EXIT_FAILURE, "error, the repository is damaged.");
+
+	baseline_session_end(&s);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2014 Mohamed Aslan <maslan@sce.carleton.ca>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h> /* EXIT_FAILURE, strtonum(3) */
+#include <unistd.h> /* getopt(3) */
+#include <err.h>    /* errx(3) */
+#include <limits.h> /* INT_MAX */
+
+#include "config.h"
+#include "defaults.h"
+#include "session.h"
+#include "cmd.h"
+
+/*
+ * what is staged is kept, the dircache is asked once gc holds the lock
+ */
+static int
+dircache_roots(void *arg, struct objdb_root **roots, size_t *n)
+{
+	struct session *s = arg;
+
+	if (s->dc_ops->roots == NULL)
+		return EXIT_FAILURE;
+	return s->dc_ops->roots(s->dc_ctx, roots, n);
+}
+
+int
+cmd_gc(int argc, char **argv)
+{
+	int ch;
+	const char *val, *errstr = NULL;
+	time_t grace = BASELINE_GC_GRACE;
+	struct session s;
+
+	baseline_session_begin(&s, 0);
+
+	/* in seconds, the objects just written may not be staged yet */
+	if ((val = baseline_config_get_val("gcgrace")) != NULL && *val != '\0') {
+		grace = strtonum(val, 0, INT_MAX, &errstr);
+		if (errstr != NULL)
+			errx(EXIT_FAILURE, "error, gcgrace (%s) is %s.", val, errstr);
+	}
+	while ((ch = getopt(argc, argv, "g:")) != -1) {
+		switch (ch) {
+		case 'g':
+			grace = strtonum(optarg, 0, INT_MAX, &errstr);
+			if (errstr != NULL)
+				errx(EXIT_FAILURE, "error, number (%s) is %s.", optarg, errstr);
+			break;
+		default:
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (s.db_ops->gc == NULL)
+		errx(EXIT_FAILURE, "error, the object database does not support garbage collection.");
+	if (s.db_ops->gc(s.db_ctx, dircache_roots, &s, grace) == EXIT_FAILURE)
+		errx(EXIT_FAILURE, "error, failed to collect the garbage of the object database.");
+
+	baseline_session_end(&s);
+	return EXIT_SUCCESS;
+}
@@ -29,10 +29,17 @@ cmd_help(int argc, char **argv)
 	printf("\tcat [c]\t\twrite the content of a committed file to the stdout\n");
 	printf("\tcheckout\tcheck out a commit into the working directory\n");
 	printf("\tcommit [m]\tcommit the staged contents in the dircache to the repository\n");
+	printf("\tcommit-graph\twrite the commit graph used to walk the history\n");
+	printf("\tcompress\tcompress the loose objects stored uncompressed\n");
+	printf("\tdedup\t\tchunk large files and report the dedup ratio\n");
+	printf("\tfsck [c]\tcheck the integrity of the object database\n");
+	printf("\tgc [g]\t\tremove the loose objects no branch or tag reaches\n");
 	printf("\thelp\t\tdisplay this list\n");
-	printf("\tinit\t\tinitialize a new repository in the current directory\n");
+	printf("\tinit [d]\tinitialize a new repository in the current directory\n");
 	printf("\tlog\t\tdisplay the commit logs\n");
 	printf("\tls\t\tlist the content of a commit\n");
+	printf("\trepack [g]\tpack the refs and the loose objects, or compact the log\n");
+	printf("\ttag [c]\t\tlist tags, or tag a commit\n");
 	printf("\tversion\t\tdisplay information about the installed version of baseline\n");
 	return EXIT_SUCCESS;
 }
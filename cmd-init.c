@@ -33,7 +33,7 @@
  * creates a new repository in the given path.
  */
 static int
-init(struct session *s) {
+init(struct session *s, const char *objdb) {
 	char *baseline_path, *config_path;
 
 	/* create '.baseline' dir */
@@ -45,6 +45,9 @@ init(struct session *s) {
 	asprintf(&config_path, "%s/config", baseline_path);
 	if (baseline_config_create(config_path) == EXIT_FAILURE)
 		return EXIT_FAILURE;
+	/* the backend is chosen once and for all */
+	if (objdb != NULL && baseline_config_set(config_path, "objdb", objdb) == EXIT_FAILURE)
+		return EXIT_FAILURE;
 	/* FIXME: error checks */
 
 	/* let objdb initialize it's structures too */
@@ -62,16 +65,35 @@ init(struct session *s) {
 int
 cmd_init(int argc, char **argv)
 {
+	char *objdb = NULL;
+	int ch;
 	struct session s;
 
 	baseline_session_begin(&s, SESSION_NONINIT);
+
+	/* parse command line options */
+	while ((ch = getopt(argc, argv, "d:")) != -1) {
+		switch(ch) {
+		case 'd':
+			objdb = optarg;
+			break;
+		default:
+			return EXIT_FAILURE;
+		}
+	}
+	if (objdb != NULL) {
+		free(s.db_ops);
+		if (baseline_session_objdb(objdb, &(s.db_ops)) == EXIT_FAILURE)
+			errx(EXIT_FAILURE, "error, unknown objdb \'%s\'.", objdb);
+	}
+
 	s.repo_rootdir = baseline_repo_get_rootdir();
 
 	if (s.repo_rootdir != NULL)
 		errx(EXIT_SUCCESS, "repository already initialized.");
 	if (exists(s.repo_baselinedir))
 		errx(EXIT_FAILURE, "error, corrupted repository already exists.");
-	if (init(&s) == EXIT_FAILURE) 
+	if (init(&s, objdb) == EXIT_FAILURE) 
 		errx(EXIT_FAILURE, "error, could not initialize repository.");
 	printf("baseline: repository successfully initialized at \'%s\'.\n", s.cwd);
 
@@ -17,12 +17,13 @@
 #include <stdio.h> /* printf(3) */
 #include <stdlib.h> /* EXIT_SUCCESS, strtonum(3) */
 #include <string.h> /* strdup(3) */
-#include <time.h> /* ctime(3) */
+#include <time.h> /* ctime(3), strptime(3) */
 #include <unistd.h> /* getopt(3) */
 #include <err.h> /* errx(3) */
 #include <limits.h> /* INT_MAX */
 
 #include "cmd.h"
+#include "graph.h"
 #include "session.h"
 
 #include "objects.h"
@@ -39,22 +40,50 @@ static char *default_fmt =
 	"\ttime: %ct\n"
 	"message:\n%m\n";
 
+/*
+ * YYYY-MM-DD, in local time
+ */
+static time_t
+parse_date(const char *str)
+{
+	char *end;
+	struct tm tm;
+
+	memset(&tm, 0, sizeof(tm));
+	if ((end = strptime(str, "%Y-%m-%d", &tm)) == NULL || *end != '\0')
+		errx(EXIT_FAILURE, "error, invalid date \'%s\', expected YYYY-MM-DD.", str);
+	tm.tm_isdst = -1;
+	return mktime(&tm);
+}
+
+/*
+ * only these need more than the commit graph
+ */
+static int
+needs_commit(const char *fmtstr)
+{
+	return strstr(fmtstr, "%a") != NULL || strstr(fmtstr, "%cn") != NULL ||
+	    strstr(fmtstr, "%ce") != NULL || strstr(fmtstr, "%m") != NULL;
+}
 
 int
 cmd_log(int argc, char **argv)
 {
-	char *head = NULL, *fmtstr = NULL;
+	char *fmtstr = NULL, hex[OBJID_HEXLEN + 1];
 	char timestr[26];
 	const char *errstr;
 	int ch, done = 0, i, k = 0, kmax = 0;
-	int fmt = 0, limited = 0, explicit = 0;
+	int fmt = 0, limited = 0, explicit = 0, need_comm;
+	time_t since = 0, until = 0;
+	struct objid head;
 	struct session s;
 	struct commit *comm;
+	struct graph_commit gc;
 
 	baseline_session_begin(&s, 0);
 
 	/* parse command line options */
-	while ((ch = getopt(argc, argv, "f:n:c:")) != -1) {
+	while ((ch = getopt(argc, argv, "f:n:c:s:u:")) != -1) {
 		switch (ch) {
 		case 'f':
 			fmt = 1;
@@ -68,7 +97,15 @@ cmd_log(int argc, char **argv)
 			break;
 		case 'c':
 			explicit = 1;
-			head = strdup(optarg);
+			if (baseline_session_resolve(&s, O_COMMIT, optarg, &head) == EXIT_FAILURE)
+				errx(EXIT_FAILURE, "error, invalid commit id \'%s\'.", optarg);
+			break;
+		case 's':
+			since = parse_date(optarg);
+			break;
+		case 'u':
+			/* the whole day is included */
+			until = parse_date(optarg) + 24 * 60 * 60 - 1;
 			break;
 		default:
 			exit(EXIT_FAILURE);
@@ -78,27 +115,45 @@ cmd_log(int argc, char **argv)
 	argv += optind;
 
 	if (!explicit) {
-		s.db_ops->branch_get_head(s.db_ctx, s.branch, &head);
-		if (head == NULL)
+		if (s.db_ops->branch_get_head(s.db_ctx, s.branch, &head) == EXIT_FAILURE ||
+		    objid_is_null(&head))
 			goto ret;
 	}
 
 	if (!fmt)
 		fmtstr = default_fmt;
+	need_comm = needs_commit(fmtstr);
 
 	do {
-		k++;
-		if ((limited) && (k > kmax))
+		if ((limited) && (k >= kmax))
 			break;
-		comm = baseline_commit_new();
-		s.db_ops->select_commit(s.db_ctx, head, comm);
+		/* the commit itself is only read if it is not in the graph, or printed */
+		comm = NULL;
+		if (s.db_ops->select_commit_graph == NULL ||
+		    s.db_ops->select_commit_graph(s.db_ctx, &head, &gc) == EXIT_FAILURE) {
+			comm = baseline_commit_new();
+			if (s.db_ops->select_commit(s.db_ctx, &head, comm) == EXIT_FAILURE)
+				errx(EXIT_FAILURE, "error, failed to read commit \'%s\'.", objid_hex(&head, hex));
+			gc.has_parent = comm->n_parents > 0;
+			if (gc.has_parent)
+				gc.parent = comm->parents[0];
+			gc.time = comm->committer.timestamp;
+		}
+		if ((since && gc.time < since) || (until && gc.time > until))
+			goto next;
+		k++;
+		if (need_comm && comm == NULL) {
+			comm = baseline_commit_new();
+			if (s.db_ops->select_commit(s.db_ctx, &head, comm) == EXIT_FAILURE)
+				errx(EXIT_FAILURE, "error, failed to read commit \'%s\'.", objid_hex(&head, hex));
+		}
 		for (i = 0 ; i<strlen(fmtstr) ; i++) {
 			if ((i < strlen(fmtstr) - 1) && (fmtstr[i] == '%') && (fmtstr[i + 1] == 'n')) {
 				printf("%d", k);
 				i++;
 			}
 			else if ((i < strlen(fmtstr) - 1) && (fmtstr[i] == '%') && (fmtstr[i + 1] == 'i')) {
-				printf("%s", comm->id);
+				printf("%s", objid_hex(&head, hex));
 				i++;
 			}
 			else if ((i < strlen(fmtstr) - 2) && (fmtstr[i] == '%') && (fmtstr[i + 1] == 'a') && (fmtstr[i+2] == 'n')) {
@@ -126,7 +181,7 @@ cmd_log(int argc, char **argv)
 			}
 			else if ((i < strlen(fmtstr) - 2) && (fmtstr[i] == '%') && (fmtstr[i + 1] == 'c') && (fmtstr[i+2] == 't')) {
 				bzero(timestr, sizeof(timestr));
-				ctime_r(&(comm->committer.timestamp), timestr);
+				ctime_r(&gc.time, timestr);
 				timestr[sizeof(timestr) - 2] = '\0';
 				printf("%s", timestr);
 				i += 2;
@@ -146,15 +201,16 @@ cmd_log(int argc, char **argv)
 			else
 				printf("%c", fmtstr[i]);
 		}
-		if (comm->n_parents == 0)
+next:
+		if (!gc.has_parent)
 			done = 1;
 		else
-			head = strdup(comm->parents[0]);
-		baseline_commit_free(comm);
+			head = gc.parent;
+		if (comm != NULL)
+			baseline_commit_free(comm);
 	} while (!done);
 
 ret:
-	free(head);
 	if (fmt)
 		free(fmtstr);
 	baseline_session_end(&s);
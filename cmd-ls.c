@@ -19,10 +19,12 @@
 #include <string.h> /* strdup(3) */
 #include <unistd.h> /* getopt(3) */
 #include <sys/stat.h> /* S_ISDIR */
+#include <err.h> /* errx(3) */
 
 #include "cmd.h"
 #include "session.h"
 
+#include "arena.h"
 #include "objects.h"
 
 
@@ -30,19 +32,30 @@ void
 ls(struct session *s, struct dir* d, const char *prefix, int is_recursive)
 {
 	char *nextprefix = NULL;
+	size_t i, n = 0;
 	struct dir *child;
 	struct dirent *ent;
+	struct objid *ids;
 
 	if (d == NULL)
 		return;
-	ent = d->children;
-	while (ent != NULL) {
+	/* all the subdirectories are read at once */
+	if (is_recursive && s->db_ops->prefetch_dirs != NULL &&
+	    (ids = reallocarray(NULL, d->n_children, sizeof(struct objid))) != NULL) {
+		for (i = 0 ; i < d->n_children ; i++)
+			if (S_ISDIR(d->children[i].mode))
+				ids[n++] = d->children[i].id;
+		s->db_ops->prefetch_dirs(s->db_ctx, ids, n);
+		free(ids);
+	}
+	for (i = 0 ; i < d->n_children ; i++) {
+		ent = &d->children[i];
 		if (S_ISDIR(ent->mode)) {
 			printf("%s%s/\n", prefix, ent->name);
 			if (is_recursive) {
 				asprintf(&nextprefix, "%s%s/", prefix, ent->name);
-				child = baseline_dir_new();
-				s->db_ops->select_dir(s->db_ctx, ent->id, child);
+				child = baseline_dir_new_in(d->arena);
+				s->db_ops->select_dir(s->db_ctx, &ent->id, child);
 				ls(s, child, nextprefix, is_recursive);
 				baseline_dir_free(child);
 				free(nextprefix);
@@ -51,17 +64,18 @@ ls(struct session *s, struct dir* d, const char *prefix, int is_recursive)
 		else {
 			printf("%s%s\n", prefix, ent->name);
 		}
-		ent = ent->next;
 	}
 }
 
 int
 cmd_ls(int argc, char **argv)
 {
-	char *head = NULL;
+	char hex[OBJID_HEXLEN + 1];
 	int ch;
 	int recursive = 0, explicit = 0;
+	struct objid head;
 	struct session s;
+	struct arena *arena;
 	struct commit *comm;
 	struct dir *dir;
 
@@ -75,7 +89,8 @@ cmd_ls(int argc, char **argv)
 			break;
 		case 'c':
 			explicit = 1;
-			head = strdup(optarg);
+			if (baseline_session_resolve(&s, O_COMMIT, optarg, &head) == EXIT_FAILURE)
+				errx(EXIT_FAILURE, "error, invalid commit id \'%s\'.", optarg);
 			break;
 		default:
 			exit(EXIT_FAILURE);
@@ -85,21 +100,25 @@ cmd_ls(int argc, char **argv)
 	argv += optind;
 
 	if (!explicit) {
-		s.db_ops->branch_get_head(s.db_ctx, s.branch, &head);
-		if (head == NULL)
+		if (s.db_ops->branch_get_head(s.db_ctx, s.branch, &head) == EXIT_FAILURE ||
+		    objid_is_null(&head))
 			goto ret;
 	}
 
 	comm = baseline_commit_new();
-	s.db_ops->select_commit(s.db_ctx, head, comm);
+	s.db_ops->select_commit(s.db_ctx, &head, comm);
 
-	dir = baseline_dir_new();
-	s.db_ops->select_dir(s.db_ctx, comm->dir, dir);
+	/* all the dirs of the walk are released at once */
+	if (arena_new(&arena) == EXIT_FAILURE)
+		errx(EXIT_FAILURE, "error, out of memory.");
+	dir = baseline_dir_new_in(arena);
+	s.db_ops->select_dir(s.db_ctx, &comm->dir, dir);
 
-	printf("commit: %s\n", comm->id);
+	printf("commit: %s\n", objid_hex(&comm->id, hex));
 	ls(&s, dir, "", recursive);
 
 	baseline_dir_free(dir);
+	arena_free(arena);
 
 ret:
 	baseline_session_end(&s);
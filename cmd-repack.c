@@ -0,0 +1,61 @@
+/*
+ * Copyright (c) 2014 Mohamed Aslan <maslan@sce.carleton.ca>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h> /* EXIT_FAILURE, strtonum(3) */
+#include <unistd.h> /* getopt(3) */
+#include <err.h>    /* errx(3) */
+
+#include "refs.h"
+#include "session.h"
+#include "cmd.h"
+
+int
+cmd_repack(int argc, char **argv)
+{
+	char *db_dir;
+	int ch, factor = 0;
+	const char *errstr = NULL;
+	struct session s;
+
+	baseline_session_begin(&s, 0);
+
+	while ((ch = getopt(argc, argv, "g:")) != -1) {
+		switch (ch) {
+		case 'g':
+			/* each pack at least that many times larger than the previous */
+			factor = strtonum(optarg, 2, 1024, &errstr);
+			if (errstr != NULL)
+				errx(EXIT_FAILURE, "error, factor (%s) is %s.", optarg, errstr);
+			break;
+		default:
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	/* the refs are packed whatever the objdb backend */
+	if ((db_dir = baseline_session_db_dir(&s)) == NULL || refs_pack(db_dir, 1) == EXIT_FAILURE)
+		errx(EXIT_FAILURE, "error, failed to pack the refs.");
+	free(db_dir);
+	if (s.db_ops->repack == NULL)
+		errx(EXIT_FAILURE, "error, the object database does not support packing.");
+	if (s.db_ops->repack(s.db_ctx, factor) == EXIT_FAILURE)
+		errx(EXIT_FAILURE, "error, failed to repack the object database.");
+
+	baseline_session_end(&s);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) 2014 Mohamed Aslan <maslan@sce.carleton.ca>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h> /* EXIT_FAILURE */
+#include <unistd.h> /* getopt(3) */
+#include <err.h>    /* errx(3) */
+
+#include "refs.h"
+#include "session.h"
+#include "cmd.h"
+
+/*
+ * lists the tags, or tags a commit with all the names given at once
+ */
+int
+cmd_tag(int argc, char **argv)
+{
+	char *db_dir, hex[OBJID_HEXLEN + 1];
+	int ch, i, explicit = 0;
+	struct objid id;
+	struct session s;
+	struct commit *comm;
+	struct refs_tx *tx;
+
+	baseline_session_begin(&s, 0);
+
+	while ((ch = getopt(argc, argv, "c:")) != -1) {
+		switch (ch) {
+		case 'c':
+			explicit = 1;
+			if (baseline_session_resolve(&s, O_COMMIT, optarg, &id) == EXIT_FAILURE)
+				errx(EXIT_FAILURE, "error, invalid commit id \'%s\'.", optarg);
+			break;
+		default:
+			exit(EXIT_FAILURE);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if ((db_dir = baseline_session_db_dir(&s)) == NULL)
+		errx(EXIT_FAILURE, "error, failed to find the object database.");
+	if (argc == 0) {
+		if (explicit)
+			errx(EXIT_FAILURE, "error, no tag name is specified.");
+		if (refs_tag_ls(db_dir) == EXIT_FAILURE)
+			errx(EXIT_FAILURE, "error, failed to list tags.");
+		free(db_dir);
+		baseline_session_end(&s);
+		return EXIT_SUCCESS;
+	}
+
+	/* no commit specified, use current branch head */
+	if (!explicit) {
+		if (s.db_ops->branch_get_head(s.db_ctx, s.branch, &id) == EXIT_FAILURE)
+			errx(EXIT_FAILURE, "error, branch \'%s\' was not found.", s.branch);
+		if (objid_is_null(&id))
+			errx(EXIT_FAILURE, "error, branch \'%s\' has zero commits.", s.branch);
+	}
+	comm = baseline_commit_new();
+	if (s.db_ops->select_commit(s.db_ctx, &id, comm) == EXIT_FAILURE)
+		errx(EXIT_FAILURE, "error, commit \'%s\' was not found.", objid_hex(&id, hex));
+	baseline_commit_free(comm);
+
+	/* either all the tags are created, or none */
+	if ((tx = refs_tx_begin(db_dir)) == NULL)
+		errx(EXIT_FAILURE, "error, failed to create tags.");
+	for (i = 0 ; i < argc ; i++)
+		if (refs_tx_create(tx, REFS_TAGS, argv[i], &id) == EXIT_FAILURE)
+			errx(EXIT_FAILURE, "error, invalid tag name \'%s\'.", argv[i]);
+	if (refs_tx_commit(tx, objdb_fsync(s.db_ctx) != OBJDB_FSYNC_NONE) == EXIT_FAILURE)
+		errx(EXIT_FAILURE, "error, failed to create tags, one of them may exist already.");
+
+	free(db_dir);
+	baseline_session_end(&s);
+	return EXIT_SUCCESS;
+}
@@ -22,11 +22,18 @@ int cmd_branch(int, char **);
 int cmd_cat(int, char **);
 int cmd_checkout(int, char **);
 int cmd_commit(int, char **);
+int cmd_commit_graph(int, char **);
+int cmd_compress(int, char **);
+int cmd_dedup(int, char **);
 int cmd_diff(int, char **);
+int cmd_fsck(int, char **);
+int cmd_gc(int, char **);
 int cmd_help(int, char **);
 int cmd_init(int, char **);
 int cmd_log(int, char **);
 int cmd_ls(int, char **);
+int cmd_repack(int, char **);
+int cmd_tag(int, char **);
 int cmd_version(int, char **);
 
 #endif
@@ -0,0 +1,501 @@
+/*
+ * Copyright (c) 2014 Mohamed Aslan <maslan@sce.carleton.ca>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "compress.h"
+
+#define CHUNK_SIZE	COMPRESS_PROBE
+#define MIN_SIZE	128	/* not worth a header below that */
+#define MAX_ENTROPY	7.5	/* bits per byte */
+#define MAX_RATIO	1032	/* deflate cannot do better than that */
+#define COPY_MAX	(1024 * 1024 * 1024)
+
+struct inflate_stream {
+	int fd;
+	int eof;
+	z_stream zs;
+	u_int8_t in[CHUNK_SIZE];
+};
+
+static int
+write_all(int fd, const void *buf, size_t len)
+{
+	const u_int8_t *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		if ((n = write(fd, p, len)) == -1)
+			return EXIT_FAILURE;
+		p += n;
+		len -= n;
+	}
+	return EXIT_SUCCESS;
+}
+
+/*
+ * reads until buf is full or the end of the file object
+ */
+static ssize_t
+read_full(struct file *f, u_int8_t *buf, size_t len)
+{
+	size_t off = 0;
+	ssize_t n;
+
+	while (off < len) {
+		if ((n = baseline_file_read(f, buf + off, len - off)) == -1)
+			return -1;
+		if (n == 0)
+			break;
+		off += n;
+	}
+	return off;
+}
+
+void
+compress_put_header(u_int8_t *hdr, int kind, u_int64_t size)
+{
+	int i;
+
+	memcpy(hdr, OBJ_MAGIC, OBJ_MAGIC_LEN);
+	hdr[OBJ_MAGIC_LEN] = kind;
+	for (i = 0 ; i < 8 ; i++)
+		hdr[OBJ_HDR_LEN - 1 - i] = (size >> (8 * i)) & 0xff;
+}
+
+/*
+ * a quick look at the byte distribution of the first chunk, content
+ * that is already compressed (or encrypted) is stored as is.
+ */
+int
+compress_probe(const u_int8_t *buf, size_t len)
+{
+	size_t i, count[256];
+	double p, entropy = 0;
+
+	if (len < MIN_SIZE)
+		return 0;
+	memset(count, 0, sizeof(count));
+	for (i = 0 ; i < len ; i++)
+		count[buf[i]]++;
+	for (i = 0 ; i < 256 ; i++) {
+		if (count[i] == 0)
+			continue;
+		p = (double)count[i] / len;
+		entropy -= p * log2(p);
+	}
+	return entropy < MAX_ENTROPY;
+}
+
+/*
+ * writes the content of a file object to fd, compressing it on the fly
+ * unless level is 0 or the probe says it is not worth it. fd must be
+ * seekable since the size is only known at the end.
+ */
+int
+compress_write(struct file *f, int fd, int level, size_t *stored)
+{
+	u_int8_t *in, *out, hdr[OBJ_HDR_LEN];
+	u_int64_t size;
+	ssize_t n;
+	size_t total;
+	int flush, zret, retval = EXIT_FAILURE;
+	z_stream zs;
+
+	if ((in = malloc(CHUNK_SIZE)) == NULL)
+		return EXIT_FAILURE;
+	if ((out = malloc(CHUNK_SIZE)) == NULL) {
+		free(in);
+		return EXIT_FAILURE;
+	}
+	if ((n = read_full(f, in, CHUNK_SIZE)) == -1)
+		goto ret;
+
+	if (level <= 0 || !compress_probe(in, n)) {
+		total = 0;
+		size = 0;
+		/* raw content must not be mistaken for a header */
+		if (n >= OBJ_MAGIC_LEN && !memcmp(in, OBJ_MAGIC, OBJ_MAGIC_LEN)) {
+			compress_put_header(hdr, OBJ_STORED, 0);
+			if (write_all(fd, hdr, sizeof(hdr)) == EXIT_FAILURE)
+				goto ret;
+			total += sizeof(hdr);
+		}
+		while (n > 0) {
+			if (write_all(fd, in, n) == EXIT_FAILURE)
+				goto ret;
+			size += n;
+			total += n;
+#ifdef __linux__
+			/* the rest of a file is copied by the kernel when it can */
+			if (f->loc == LOC_FS && n == CHUNK_SIZE) {
+				ssize_t c;
+
+				while ((c = copy_file_range(f->fd, NULL, fd, NULL, COPY_MAX, 0)) > 0) {
+					size += c;
+					total += c;
+				}
+				if (c == 0)
+					break;
+				if (errno != EXDEV && errno != EINVAL && errno != ENOSYS &&
+				    errno != EOPNOTSUPP)
+					goto ret;
+			}
+#endif
+			if ((n = read_full(f, in, CHUNK_SIZE)) == -1)
+				goto ret;
+		}
+		if (total > size) {
+			compress_put_header(hdr, OBJ_STORED, size);
+			if (pwrite(fd, hdr, sizeof(hdr), 0) != sizeof(hdr))
+				goto ret;
+		}
+		*stored = total;
+		retval = EXIT_SUCCESS;
+		goto ret;
+	}
+
+	memset(&zs, 0, sizeof(zs));
+	if (deflateInit(&zs, level) != Z_OK)
+		goto ret;
+	compress_put_header(hdr, OBJ_DEFLATE, 0);
+	if (write_all(fd, hdr, sizeof(hdr)) == EXIT_FAILURE)
+		goto end;
+	total = sizeof(hdr);
+	size = 0;
+	do {
+		size += n;
+		flush = (n < CHUNK_SIZE) ? Z_FINISH : Z_NO_FLUSH;
+		zs.next_in = in;
+		zs.avail_in = n;
+		do {
+			zs.next_out = out;
+			zs.avail_out = CHUNK_SIZE;
+			if ((zret = deflate(&zs, flush)) == Z_STREAM_ERROR)
+				goto end;
+			if (write_all(fd, out, CHUNK_SIZE - zs.avail_out) == EXIT_FAILURE)
+				goto end;
+			total += CHUNK_SIZE - zs.avail_out;
+		} while (zs.avail_out == 0);
+		if (flush == Z_FINISH)
+			break;
+		if ((n = read_full(f, in, CHUNK_SIZE)) == -1)
+			goto end;
+	} while (1);
+	if (zret != Z_STREAM_END)
+		goto end;
+	compress_put_header(hdr, OBJ_DEFLATE, size);
+	if (pwrite(fd, hdr, sizeof(hdr), 0) != sizeof(hdr))
+		goto end;
+	*stored = total;
+	retval = EXIT_SUCCESS;
+end:
+	deflateEnd(&zs);
+ret:
+	free(in);
+	free(out);
+	return retval;
+}
+
+/*
+ * same as compress_write() for content held in memory. *out is set to
+ * NULL when the content is to be stored as is.
+ */
+int
+compress_buffer(const char *data, size_t len, int level, char **out, size_t *outlen)
+{
+	size_t probe = len < CHUNK_SIZE ? len : CHUNK_SIZE;
+	uLongf zlen;
+	u_int8_t *buf;
+
+	*out = NULL;
+	*outlen = len;
+	if (level <= 0 || !compress_probe((const u_int8_t *)data, probe)) {
+		/* raw content must not be mistaken for a header */
+		if (len < OBJ_MAGIC_LEN || memcmp(data, OBJ_MAGIC, OBJ_MAGIC_LEN))
+			return EXIT_SUCCESS;
+		if ((buf = malloc(OBJ_HDR_LEN + len)) == NULL)
+			return EXIT_FAILURE;
+		compress_put_header(buf, OBJ_STORED, len);
+		memcpy(buf + OBJ_HDR_LEN, data, len);
+		*out = (char *)buf;
+		*outlen = OBJ_HDR_LEN + len;
+		return EXIT_SUCCESS;
+	}
+	zlen = compressBound(len);
+	if ((buf = malloc(OBJ_HDR_LEN + zlen)) == NULL)
+		return EXIT_FAILURE;
+	if (compress2(buf + OBJ_HDR_LEN, &zlen, (const Bytef *)data, len, level) != Z_OK) {
+		free(buf);
+		return EXIT_FAILURE;
+	}
+	compress_put_header(buf, OBJ_DEFLATE, len);
+	*out = (char *)buf;
+	*outlen = OBJ_HDR_LEN + zlen;
+	return EXIT_SUCCESS;
+}
+
+/*
+ * returns EXIT_SUCCESS if buf starts with a header
+ */
+int
+compress_header(const void *buf, size_t len, int *kind, size_t *size)
+{
+	const u_int8_t *p = buf;
+	u_int64_t s = 0;
+	int i;
+
+	if (len < OBJ_HDR_LEN || memcmp(p, OBJ_MAGIC, OBJ_MAGIC_LEN))
+		return EXIT_FAILURE;
+	if (p[OBJ_MAGIC_LEN] != OBJ_STORED && p[OBJ_MAGIC_LEN] != OBJ_DEFLATE &&
+	    p[OBJ_MAGIC_LEN] != OBJ_CHUNKED)
+		return EXIT_FAILURE;
+	for (i = OBJ_MAGIC_LEN + 1 ; i < OBJ_HDR_LEN ; i++)
+		s = (s << 8) | p[i];
+	if (s > SIZE_MAX - 1)
+		return EXIT_FAILURE;
+	*kind = p[OBJ_MAGIC_LEN];
+	*size = s;
+	return EXIT_SUCCESS;
+}
+
+static ssize_t
+inflate_read(void *stream, void *buf, size_t len)
+{
+	struct inflate_stream *s = stream;
+	ssize_t n;
+	int zret;
+
+	if (s->eof || len == 0)
+		return 0;
+	s->zs.next_out = buf;
+	s->zs.avail_out = len;
+	while (s->zs.avail_out == len) {
+		if (s->zs.avail_in == 0) {
+			if ((n = read(s->fd, s->in, sizeof(s->in))) == -1)
+				return -1;
+			/* truncated object */
+			if (n == 0)
+				return -1;
+			s->zs.next_in = s->in;
+			s->zs.avail_in = n;
+		}
+		zret = inflate(&s->zs, Z_NO_FLUSH);
+		if (zret == Z_STREAM_END) {
+			s->eof = 1;
+			break;
+		}
+		if (zret != Z_OK)
+			return -1;
+	}
+	return len - s->zs.avail_out;
+}
+
+static void
+inflate_close(void *stream)
+{
+	struct inflate_stream *s = stream;
+
+	inflateEnd(&s->zs);
+	close(s->fd);
+	free(s);
+}
+
+/*
+ * sets up a file object to read the content of a loose object, fd is
+ * owned by the file object afterwards.
+ */
+int
+compress_open(int fd, struct file *f)
+{
+	u_int8_t hdr[OBJ_HDR_LEN];
+	ssize_t n;
+	size_t size;
+	int kind;
+	struct inflate_stream *s;
+
+	if ((n = pread(fd, hdr, sizeof(hdr), 0)) == -1)
+		return EXIT_FAILURE;
+	if (compress_header(hdr, n, &kind, &size) == EXIT_FAILURE) {
+		f->loc = LOC_FS;
+		f->fd = fd;
+		return EXIT_SUCCESS;
+	}
+	/* manifests are left to the object database */
+	if (kind == OBJ_CHUNKED)
+		return EXIT_FAILURE;
+	if (lseek(fd, OBJ_HDR_LEN, SEEK_SET) == -1)
+		return EXIT_FAILURE;
+	if (kind == OBJ_STORED) {
+		f->loc = LOC_FS;
+		f->fd = fd;
+		return EXIT_SUCCESS;
+	}
+	if ((s = calloc(1, sizeof(struct inflate_stream))) == NULL)
+		return EXIT_FAILURE;
+	if (inflateInit(&s->zs) != Z_OK) {
+		free(s);
+		return EXIT_FAILURE;
+	}
+	s->fd = fd;
+	f->loc = LOC_STREAM;
+	f->stream = s;
+	f->stream_read = inflate_read;
+	f->stream_close = inflate_close;
+	f->stream_send = NULL;
+	return EXIT_SUCCESS;
+}
+
+/*
+ * turns the whole content of a loose object into the form kept in packs:
+ * plain content, except that the OBJ_STORED and OBJ_CHUNKED headers are
+ * kept since plain content starting with OBJ_MAGIC would be ambiguous.
+ * raw is consumed and *out is NUL terminated.
+ */
+int
+compress_decode(char *raw, size_t rawlen, char **out, size_t *outlen)
+{
+	size_t size;
+	int kind, retval;
+
+	if (compress_header(raw, rawlen, &kind, &size) == EXIT_FAILURE) {
+		*out = raw;
+		*outlen = rawlen;
+		return EXIT_SUCCESS;
+	}
+	if (kind != OBJ_DEFLATE) {
+		if (kind == OBJ_STORED && size != rawlen - OBJ_HDR_LEN) {
+			free(raw);
+			return EXIT_FAILURE;
+		}
+		*out = raw;
+		*outlen = rawlen;
+		return EXIT_SUCCESS;
+	}
+	retval = compress_inflate(raw, rawlen, out, outlen);
+	free(raw);
+	return retval;
+}
+
+/*
+ * same as compress_decode() for an OBJ_DEFLATE object, raw is left as
+ * is so that it can be read from a mapping
+ */
+int
+compress_inflate(const char *raw, size_t rawlen, char **out, size_t *outlen)
+{
+	char *buf;
+	size_t size;
+	int kind, zret;
+	z_stream zs;
+
+	if (compress_header(raw, rawlen, &kind, &size) == EXIT_FAILURE || kind != OBJ_DEFLATE)
+		return EXIT_FAILURE;
+	/* do not trust the header with the size of the allocation */
+	if (size / MAX_RATIO > rawlen)
+		return EXIT_FAILURE;
+	if ((buf = malloc(OBJ_HDR_LEN + size + 1)) == NULL)
+		return EXIT_FAILURE;
+	memset(&zs, 0, sizeof(zs));
+	if (inflateInit(&zs) != Z_OK) {
+		free(buf);
+		return EXIT_FAILURE;
+	}
+	zs.next_in = (u_int8_t *)raw + OBJ_HDR_LEN;
+	zs.avail_in = rawlen - OBJ_HDR_LEN;
+	zs.next_out = (u_int8_t *)buf + OBJ_HDR_LEN;
+	zs.avail_out = size;
+	zret = inflate(&zs, Z_FINISH);
+	inflateEnd(&zs);
+	if (zret != Z_STREAM_END || zs.avail_out != 0) {
+		free(buf);
+		return EXIT_FAILURE;
+	}
+	buf[OBJ_HDR_LEN + size] = '\0';
+	if (size >= OBJ_MAGIC_LEN && !memcmp(buf + OBJ_HDR_LEN, OBJ_MAGIC, OBJ_MAGIC_LEN)) {
+		compress_put_header((u_int8_t *)buf, OBJ_STORED, size);
+		*outlen = OBJ_HDR_LEN + size;
+	} else {
+		memmove(buf, buf + OBJ_HDR_LEN, size + 1);
+		*outlen = size;
+	}
+	*out = buf;
+	return EXIT_SUCCESS;
+}
+
+/*
+ * the first *len bytes of an OBJ_DEFLATE object in the form kept in
+ * packs, only as much as needed is inflated
+ */
+int
+compress_peek(const char *raw, size_t rawlen, void *buf, size_t *len)
+{
+	u_int8_t *out, hdr[OBJ_HDR_LEN];
+	size_t size, want, n;
+	int kind, zret, retval = EXIT_FAILURE;
+	z_stream zs;
+
+	if (compress_header(raw, rawlen, &kind, &size) == EXIT_FAILURE || kind != OBJ_DEFLATE)
+		return EXIT_FAILURE;
+	/* enough to tell content that needs an OBJ_STORED header */
+	want = *len > OBJ_MAGIC_LEN ? *len : OBJ_MAGIC_LEN;
+	if (want > size)
+		want = size;
+	if (want == 0) {
+		*len = 0;
+		return EXIT_SUCCESS;
+	}
+	if ((out = malloc(want)) == NULL)
+		return EXIT_FAILURE;
+	memset(&zs, 0, sizeof(zs));
+	if (inflateInit(&zs) != Z_OK) {
+		free(out);
+		return EXIT_FAILURE;
+	}
+	zs.next_in = (u_int8_t *)raw + OBJ_HDR_LEN;
+	zs.avail_in = rawlen - OBJ_HDR_LEN;
+	zs.next_out = out;
+	zs.avail_out = want;
+	zret = inflate(&zs, Z_SYNC_FLUSH);
+	inflateEnd(&zs);
+	if ((zret != Z_OK && zret != Z_STREAM_END) || zs.avail_out != 0)
+		goto ret;
+	if (want >= OBJ_MAGIC_LEN && !memcmp(out, OBJ_MAGIC, OBJ_MAGIC_LEN)) {
+		compress_put_header(hdr, OBJ_STORED, size);
+		n = *len < OBJ_HDR_LEN ? *len : OBJ_HDR_LEN;
+		memcpy(buf, hdr, n);
+		if (*len - n < want)
+			want = *len - n;
+		memcpy((u_int8_t *)buf + n, out, want);
+		*len = n + want;
+	} else {
+		if (want < *len)
+			*len = want;
+		memcpy(buf, out, *len);
+	}
+	retval = EXIT_SUCCESS;
+ret:
+	free(out);
+	return retval;
+}
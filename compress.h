@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2014 Mohamed Aslan <maslan@sce.carleton.ca>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _COMPRESS_H_
+#define _COMPRESS_H_
+
+#include <sys/types.h>
+
+#include "objects.h"
+
+/*
+ * loose file objects are either stored raw, as they always were, or
+ * start with a 12 bytes header:
+ *
+ *	"\x89BL", a kind byte, the size of the content (64-bit big-endian)
+ *
+ * OBJ_DEFLATE is followed by a zlib stream, OBJ_STORED by the content
+ * itself and is only used when raw content would look like a header,
+ * OBJ_CHUNKED by the manifest of a chunked file (see chunk.h).
+ */
+#define OBJ_MAGIC	"\x89" "BL"
+#define OBJ_MAGIC_LEN	3
+#define OBJ_HDR_LEN	12
+#define OBJ_STORED	'S'
+#define OBJ_DEFLATE	'Z'
+#define OBJ_CHUNKED	'C'
+
+#define COMPRESS_LEVEL	6	/* default, 0 disables compression */
+#define COMPRESS_PROBE	65536	/* bytes looked at by the entropy probe */
+
+void compress_put_header(u_int8_t *, int, u_int64_t);
+int compress_probe(const u_int8_t *, size_t);
+int compress_write(struct file *, int, int, size_t *);
+int compress_buffer(const char *, size_t, int, char **, size_t *);
+int compress_header(const void *, size_t, int *, size_t *);
+int compress_open(int, struct file *);
+int compress_decode(char *, size_t, char **, size_t *);
+int compress_inflate(const char *, size_t, char **, size_t *);
+int compress_peek(const char *, size_t, void *, size_t *);
+
+#endif
@@ -20,7 +20,7 @@
 
 #include "config.h"
 
-#define N_OPTIONS	3
+#define N_OPTIONS	14
 
 static const char config_sample[] =
 "#\n"
@@ -40,7 +40,18 @@ struct option {
 static struct option options[] = {
 	{.key = "username", .val = ""},
 	{.key = "useremail", .val = ""},
-	{.key = "editor", .val = ""}
+	{.key = "editor", .val = ""},
+	{.key = "packwindow", .val = ""},
+	{.key = "packdepth", .val = ""},
+	{.key = "packthreads", .val = ""},
+	{.key = "compresslevel", .val = ""},
+	{.key = "dedupthreshold", .val = ""},
+	{.key = "cachesize", .val = ""},
+	{.key = "fsync", .val = ""},
+	{.key = "iodepth", .val = ""},
+	{.key = "objdb", .val = ""},
+	{.key = "snapshot", .val = ""},
+	{.key = "gcgrace", .val = ""}
 };
 
 static char*
@@ -66,6 +77,24 @@ baseline_config_create(const char *path)
 	return EXIT_SUCCESS;
 }
 
+/*
+ * appends a variable to the configuration file
+ */
+int
+baseline_config_set(const char *path, const char *key, const char *val)
+{
+	FILE *fp;
+	int retval = EXIT_SUCCESS;
+	if (path == NULL || key == NULL || val == NULL)
+		return EXIT_FAILURE;
+	if ((fp = fopen(path, "a")) == NULL)
+		return EXIT_FAILURE;
+	if (fprintf(fp, "%s = %s\n", key, val) < 0)
+		retval = EXIT_FAILURE;
+	if (fclose(fp) == EOF)
+		retval = EXIT_FAILURE;
+	return retval;
+}
 
 int
 baseline_config_load(const char *path)
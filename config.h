@@ -18,6 +18,7 @@
 #define CONFIG_H_
 
 int baseline_config_create(const char *);
+int baseline_config_set(const char *, const char *, const char *);
 int baseline_config_load(const char *);
 const char* baseline_config_get_val(const char *);
 
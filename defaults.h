@@ -21,6 +21,8 @@
 #define BASELINE_DB		"db"
 #define BASELINE_CONFIGFILE	"config"
 #define BASELINE_DIRCACHE	"dircache"
+#define BASELINE_OBJDB		"fs"
 #define DEFAULT_BRANCH		"master"
+#define BASELINE_GC_GRACE	(14 * 24 * 60 * 60)	/* seconds */
 
 #endif
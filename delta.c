@@ -0,0 +1,335 @@
+/*
+ * Copyright (c) 2014 Mohamed Aslan <maslan@sce.carleton.ca>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/*
+ * a delta turns a base object into a target object, it is made of two
+ * varints (base size, target size) followed by a stream of:
+ *
+ *	0xxxxxxx		insert the next x bytes (1 to 127)
+ *	1sssoooo [o..] [s..]	copy from the base, each set bit says a byte
+ *				of the little-endian offset (4) or size (3)
+ *				follows.
+ *
+ * matches are found by hashing the base in blocks of DELTA_BLOCK bytes
+ * and sliding a rolling hash of the same width over the target.
+ */
+
+#include <sys/types.h>
+
+#include <stdlib.h>	/* malloc(3) */
+#include <string.h>	/* mem*(3) */
+
+#include "delta.h"
+
+#define DELTA_BLOCK	16
+#define DELTA_MAXCOPY	0xffffff
+#define DELTA_MAXINSERT	127
+#define DELTA_CHAIN	8		/* candidates checked per hash bucket */
+#define HASH_MULT	0x01000193U
+
+struct delta_index {
+	u_int32_t mask;
+	u_int32_t *buckets;	/* block number + 1, 0 means empty */
+	u_int32_t *next;
+};
+
+struct delta_out {
+	char *buf;
+	size_t len;
+	size_t max;
+};
+
+static u_int32_t
+block_hash(const unsigned char *p)
+{
+	u_int32_t h = 0;
+	int i;
+
+	for (i = 0 ; i < DELTA_BLOCK ; i++)
+		h = h * HASH_MULT + p[i];
+	return h;
+}
+
+static int
+put_byte(struct delta_out *out, unsigned char c)
+{
+	if (out->len == out->max)
+		return -1;
+	out->buf[out->len++] = c;
+	return 0;
+}
+
+static int
+put_varint(struct delta_out *out, size_t v)
+{
+	do {
+		if (put_byte(out, (v & 0x7f) | (v > 0x7f ? 0x80 : 0)) == -1)
+			return -1;
+		v >>= 7;
+	} while (v > 0);
+	return 0;
+}
+
+static int
+get_varint(const unsigned char **p, const unsigned char *end, size_t *v)
+{
+	int shift = 0;
+
+	*v = 0;
+	while (*p < end && shift < 64) {
+		*v |= (size_t)(**p & 0x7f) << shift;
+		if (!(*(*p)++ & 0x80))
+			return 0;
+		shift += 7;
+	}
+	return -1;
+}
+
+static int
+put_insert(struct delta_out *out, const char *data, size_t len)
+{
+	size_t n;
+
+	while (len > 0) {
+		n = len > DELTA_MAXINSERT ? DELTA_MAXINSERT : len;
+		if (out->len + 1 + n > out->max)
+			return -1;
+		out->buf[out->len++] = n;
+		memcpy(out->buf + out->len, data, n);
+		out->len += n;
+		data += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int
+put_copy(struct delta_out *out, size_t off, size_t len)
+{
+	unsigned char cmd, args[7];
+	size_t n;
+	int i, nargs;
+
+	while (len > 0) {
+		n = len > DELTA_MAXCOPY ? DELTA_MAXCOPY : len;
+		cmd = 0x80;
+		nargs = 0;
+		for (i = 0 ; i < 4 ; i++) {
+			if ((off >> (8 * i)) & 0xff) {
+				cmd |= 1 << i;
+				args[nargs++] = (off >> (8 * i)) & 0xff;
+			}
+		}
+		for (i = 0 ; i < 3 ; i++) {
+			if ((n >> (8 * i)) & 0xff) {
+				cmd |= 0x10 << i;
+				args[nargs++] = (n >> (8 * i)) & 0xff;
+			}
+		}
+		if (put_byte(out, cmd) == -1)
+			return -1;
+		for (i = 0 ; i < nargs ; i++)
+			if (put_byte(out, args[i]) == -1)
+				return -1;
+		off += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int
+index_base(struct delta_index *idx, const unsigned char *base, size_t blen)
+{
+	u_int32_t h, i, nblocks, size = 1;
+
+	nblocks = blen / DELTA_BLOCK;
+	while (size < nblocks)
+		size <<= 1;
+	idx->mask = size - 1;
+	idx->buckets = calloc(size, sizeof(u_int32_t));
+	idx->next = calloc(nblocks + 1, sizeof(u_int32_t));
+	if (idx->buckets == NULL || idx->next == NULL) {
+		free(idx->buckets);
+		free(idx->next);
+		return -1;
+	}
+	/* later blocks first, so that chains start with the earliest one */
+	for (i = nblocks ; i > 0 ; i--) {
+		h = block_hash(base + (size_t)(i - 1) * DELTA_BLOCK) & idx->mask;
+		idx->next[i] = idx->buckets[h];
+		idx->buckets[h] = i;
+	}
+	return 0;
+}
+
+/*
+ * builds a delta from base to target, fails if it would not fit in
+ * maxlen bytes.
+ */
+int
+delta_create(const char *base, size_t blen, const char *trg, size_t tlen,
+    size_t maxlen, char **delta, size_t *dlen)
+{
+	const unsigned char *b = (const unsigned char *)base;
+	const unsigned char *t = (const unsigned char *)trg;
+	size_t pos = 0, lit = 0, best_len, best_off, off, len;
+	u_int32_t h, pow = 1, blk;
+	int i, chain;
+	struct delta_index idx;
+	struct delta_out out;
+
+	if (blen < DELTA_BLOCK || tlen < DELTA_BLOCK || maxlen == 0)
+		return EXIT_FAILURE;
+	if (blen > 0xffffffffUL)
+		return EXIT_FAILURE;
+	if (index_base(&idx, b, blen) == -1)
+		return EXIT_FAILURE;
+	out.max = maxlen;
+	out.len = 0;
+	if ((out.buf = malloc(maxlen)) == NULL)
+		goto fail;
+	if (put_varint(&out, blen) == -1 || put_varint(&out, tlen) == -1)
+		goto fail;
+
+	for (i = 0 ; i < DELTA_BLOCK - 1 ; i++)
+		pow *= HASH_MULT;
+	h = block_hash(t);
+	while (pos + DELTA_BLOCK <= tlen) {
+		best_len = 0;
+		best_off = 0;
+		chain = 0;
+		for (blk = idx.buckets[h & idx.mask] ; blk != 0 && chain < DELTA_CHAIN ; blk = idx.next[blk], chain++) {
+			off = (size_t)(blk - 1) * DELTA_BLOCK;
+			if (memcmp(b + off, t + pos, DELTA_BLOCK))
+				continue;
+			len = DELTA_BLOCK;
+			while (off + len < blen && pos + len < tlen && b[off + len] == t[pos + len])
+				len++;
+			if (len > best_len) {
+				best_len = len;
+				best_off = off;
+			}
+		}
+		if (best_len == 0) {
+			/* slide the window by one byte */
+			if (pos + DELTA_BLOCK < tlen)
+				h = (h - t[pos] * pow) * HASH_MULT + t[pos + DELTA_BLOCK];
+			pos++;
+			lit++;
+			continue;
+		}
+		/* grow the match backwards into the pending literals */
+		while (lit > 0 && best_off > 0 && b[best_off - 1] == t[pos - 1]) {
+			best_off--;
+			pos--;
+			lit--;
+			best_len++;
+		}
+		if (put_insert(&out, trg + pos - lit, lit) == -1)
+			goto fail;
+		if (put_copy(&out, best_off, best_len) == -1)
+			goto fail;
+		lit = 0;
+		pos += best_len;
+		if (pos + DELTA_BLOCK <= tlen)
+			h = block_hash(t + pos);
+	}
+	lit += tlen - pos;
+	if (put_insert(&out, trg + tlen - lit, lit) == -1)
+		goto fail;
+
+	free(idx.buckets);
+	free(idx.next);
+	*delta = out.buf;
+	*dlen = out.len;
+	return EXIT_SUCCESS;
+fail:
+	free(idx.buckets);
+	free(idx.next);
+	free(out.buf);
+	return EXIT_FAILURE;
+}
+
+int
+delta_result_size(const char *delta, size_t dlen, size_t *size)
+{
+	const unsigned char *p = (const unsigned char *)delta, *end = p + dlen;
+	size_t bsize;
+
+	if (get_varint(&p, end, &bsize) == -1 || get_varint(&p, end, size) == -1)
+		return EXIT_FAILURE;
+	return EXIT_SUCCESS;
+}
+
+/*
+ * the result is NUL terminated, olen does not account for it
+ */
+int
+delta_apply(const char *base, size_t blen, const char *delta, size_t dlen,
+    char **outp, size_t *olen)
+{
+	const unsigned char *p = (const unsigned char *)delta, *end = p + dlen;
+	unsigned char cmd;
+	size_t bsize, tsize, off, len, n = 0;
+	char *out;
+	int i;
+
+	if (get_varint(&p, end, &bsize) == -1 || get_varint(&p, end, &tsize) == -1)
+		return EXIT_FAILURE;
+	if (bsize != blen)
+		return EXIT_FAILURE;
+	if ((out = malloc(tsize + 1)) == NULL)
+		return EXIT_FAILURE;
+	while (p < end) {
+		cmd = *p++;
+		if (cmd & 0x80) {
+			off = len = 0;
+			for (i = 0 ; i < 4 ; i++)
+				if (cmd & (1 << i)) {
+					if (p == end)
+						goto fail;
+					off |= (size_t)*p++ << (8 * i);
+				}
+			for (i = 0 ; i < 3 ; i++)
+				if (cmd & (0x10 << i)) {
+					if (p == end)
+						goto fail;
+					len |= (size_t)*p++ << (8 * i);
+				}
+			if (len == 0 || off > blen || len > blen - off || len > tsize - n)
+				goto fail;
+			memcpy(out + n, base + off, len);
+		}
+		else {
+			len = cmd;
+			if (len == 0 || len > (size_t)(end - p) || len > tsize - n)
+				goto fail;
+			memcpy(out + n, p, len);
+			p += len;
+		}
+		n += len;
+	}
+	if (n != tsize)
+		goto fail;
+	out[n] = '\0';
+	*outp = out;
+	*olen = n;
+	return EXIT_SUCCESS;
+fail:
+	free(out);
+	return EXIT_FAILURE;
+}
@@ -24,8 +24,10 @@
 #include <fcntl.h>	/* O_* macros */
 #include <fts.h>	/* fts_*(3) */
 
+#include "arena.h"
 #include "defaults.h"
 #include "config.h"
+#include "hash.h"
 #include "objdb.h"
 #include "dircache.h"
 #include "objects.h"
@@ -39,8 +41,10 @@ static int simple_insert(struct dircache_ctx *, const char *);
 static int simple_commit(struct dircache_ctx *, const char *);
 static int simple_branch_get(struct dircache_ctx *, char **);
 static int simple_branch_set(struct dircache_ctx *, const char *);
-static int simple_workdir_get(struct dircache_ctx *, char **);
-static int simple_workdir_set(struct dircache_ctx *, const char *);
+static int simple_workdir_get(struct dircache_ctx *, struct objid *);
+static int simple_workdir_set(struct dircache_ctx *, const struct objid *);
+static int simple_roots(struct dircache_ctx *, struct objdb_root **, size_t *);
+static int simple_fsck(struct dircache_ctx *);
 
 static struct dircache_ops simple_ops = {
 	.name = "simple",
@@ -55,9 +59,10 @@ static struct dircache_ops simple_ops = {
 	.branch_set = simple_branch_set,
 	.workdir_get = simple_workdir_get,
 	.workdir_set = simple_workdir_set,
-	.fsck = NULL,
+	.fsck = simple_fsck,
 	.compress = NULL,
-	.dedup = NULL
+	.dedup = NULL,
+	.roots = simple_roots
 };
 
 int
@@ -239,16 +244,61 @@ ret:
 	return EXIT_SUCCESS;
 }
 
+/*
+ * inserts a batch of opened files into the objects database and writes
+ * their entries in the dircache, the files and cache paths are freed
+ */
 static int
-simple_insert(struct dircache_ctx *dc_ctx, const char *path)
+flush_files(struct dircache_ctx *dc_ctx, struct file **files, char **cache_paths, mode_t *modes, size_t n)
 {
-	char *objid, *paths[2], *cache_path;
+	char hex[OBJID_HEXLEN + 1];
+	int retval = EXIT_SUCCESS;
+	size_t i;
+	FILE *fp;
+
+	if (n == 0)
+		return EXIT_SUCCESS;
+	if (dc_ctx->db_ops->insert_files != NULL)
+		retval = dc_ctx->db_ops->insert_files(dc_ctx->db_ctx, files, n);
+	else
+		for (i = 0 ; i < n && retval == EXIT_SUCCESS ; i++)
+			retval = dc_ctx->db_ops->insert_file(dc_ctx->db_ctx, files[i]);
+	for (i = 0 ; i < n ; i++) {
+		close(files[i]->fd);
+		objid_hex(&files[i]->id, hex);
+#ifdef DEBUG
+		printf("\t ID = %s\n", hex);
+#endif
+		if (retval == EXIT_SUCCESS) {
+			if ((fp = fopen(cache_paths[i], "w")) == NULL)
+				retval = EXIT_FAILURE;
+			else {
+#ifdef DEBUG
+				printf("[DEBUG] dircache: created file %s\n", cache_paths[i]);
+#endif
+				fprintf(fp, "F %s %06o\n", hex, modes[i]);
+				fclose(fp);
+			}
+		}
+		baseline_file_free(files[i]);
+		free(cache_paths[i]);
+	}
+	return retval;
+}
+
+static int
+insert_path(struct dircache_ctx *dc_ctx, const char *path)
+{
+	char objid[OBJID_HEXLEN + 1], *paths[2], *cache_path;
 	char *dc_path, *p;
+	char *cache_paths[HASH_LANES];
+	size_t n = 0;
+	mode_t modes[HASH_LANES];
 	struct stat s, fs;
 	FILE *fp;
 	FTS *dir;
 	FTSENT *entry;
-	struct file *file;
+	struct file *file, *files[HASH_LANES];
 
 	dc_path = get_dircache_path(dc_ctx);
 	if (stat(path, &s) == -1)
@@ -294,27 +344,20 @@ simple_insert(struct dircache_ctx *dc_ctx, const char *path)
 				file->loc = LOC_FS;
 				if ((file->fd = open(entry->fts_path, O_RDONLY, 0)) == -1)
 					return EXIT_FAILURE;
-				dc_ctx->db_ops->insert_file(dc_ctx->db_ctx, file);
-				close(file->fd);
-				objid = strdup(file->id);
-				baseline_file_free(file);
-#ifdef DEBUG
-				printf("\t ID = %s\n", objid);
-#endif
 				/* FIXME: path check is required */
-				asprintf(&cache_path, "%s/%s", dc_path, dir_diff(entry->fts_path, dc_ctx->repo_rootpath));
-				if ((fp = fopen(cache_path, "w")) == NULL) {
-					free(cache_path);
-					return EXIT_FAILURE;
+				asprintf(&cache_paths[n], "%s/%s", dc_path, dir_diff(entry->fts_path, dc_ctx->repo_rootpath));
+				files[n] = file;
+				modes[n] = fs.st_mode;
+				/* files are inserted in batches, so they can be hashed together */
+				if (++n == HASH_LANES) {
+					if (flush_files(dc_ctx, files, cache_paths, modes, n) == EXIT_FAILURE)
+						return EXIT_FAILURE;
+					n = 0;
 				}
-#ifdef DEBUG
-				printf("[DEBUG] dircache: created file %s\n", cache_path);
-#endif
-				fprintf(fp, "F %s %06o\n", objid, fs.st_mode);
-				fclose(fp);
-				free(cache_path);
 			}
 		}
+		if (flush_files(dc_ctx, files, cache_paths, modes, n) == EXIT_FAILURE)
+			return EXIT_FAILURE;
 		fts_close(dir);
 	}
 	else {
@@ -328,7 +371,7 @@ simple_insert(struct dircache_ctx *dc_ctx, const char *path)
 			return EXIT_FAILURE;
 		dc_ctx->db_ops->insert_file(dc_ctx->db_ctx, file);
 		close(file->fd);
-		objid = strdup(file->id);
+		objid_hex(&file->id, objid);
 		baseline_file_free(file);
 
 		if (mkdirp(dc_path, dir_diff(path, dc_ctx->repo_rootpath)) == EXIT_FAILURE)
@@ -340,12 +383,30 @@ simple_insert(struct dircache_ctx *dc_ctx, const char *path)
 		}
 		fprintf(fp, "F %s %06o\n", objid, fs.st_mode);
 		fclose(fp);
-		free(objid);
 		free(cache_path);
 	}
 	return EXIT_SUCCESS;
 }
 
+/*
+ * the objects of a whole tree go through one batch
+ */
+static int
+simple_insert(struct dircache_ctx *dc_ctx, const char *path)
+{
+	struct objdb_ops *ops = dc_ctx->db_ops;
+
+	if (ops->begin_batch == NULL)
+		return insert_path(dc_ctx, path);
+	if (ops->begin_batch(dc_ctx->db_ctx) == EXIT_FAILURE)
+		return EXIT_FAILURE;
+	if (insert_path(dc_ctx, path) == EXIT_FAILURE) {
+		ops->abort_batch(dc_ctx->db_ctx);
+		return EXIT_FAILURE;
+	}
+	return ops->commit_batch(dc_ctx->db_ctx);
+}
+
 static int
 gen_dindex(struct dircache_ctx *dc_ctx, char **didx)
 {
@@ -397,8 +458,8 @@ gen_dindex(struct dircache_ctx *dc_ctx, char **didx)
 static int
 simple_commit(struct dircache_ctx *dc_ctx, const char *msgfile)
 {
-	char *cur_branch, *cur_head;
-	char *objid, *path, *paths[2], tmp_objid[1024];
+	char *cur_branch, hex[OBJID_HEXLEN + 1];
+	char *path, *paths[2], tmp_objid[1024];
 	char *dircache_path, *didx_path;
 	struct stat s;
 	FILE *didx_fp, *fp;
@@ -408,6 +469,8 @@ simple_commit(struct dircache_ctx *dc_ctx, const char *msgfile)
 	size_t size;
 	ssize_t len;
 	char type;
+	struct objid cur_head, dir_id, ent_id;
+	struct arena *arena;
 	struct dir *ndir;
 	struct dirent *ent;
 	struct commit *com;
@@ -424,11 +487,21 @@ simple_commit(struct dircache_ctx *dc_ctx, const char *msgfile)
 	if (dc_ctx->db_ops->branch_get_head(dc_ctx->db_ctx, cur_branch, &cur_head) == EXIT_FAILURE)
 		return EXIT_FAILURE;
 
+	/*
+	 * the dirs and the commit are written at once, before the head
+	 * moves. a batch left open on failure is discarded with the db.
+	 */
+	if (dc_ctx->db_ops->begin_batch != NULL &&
+	    dc_ctx->db_ops->begin_batch(dc_ctx->db_ctx) == EXIT_FAILURE)
+		return EXIT_FAILURE;
+
 	/* FIXME: empty dirache directory */
 	gen_dindex(dc_ctx, &didx_path);
 	if ((didx_fp = fopen(didx_path, "r")) == NULL)
 		return EXIT_FAILURE;
-	objid = NULL;
+	/* the dirs of the whole tree are released at once */
+	if (arena_new(&arena) == EXIT_FAILURE)
+		return EXIT_FAILURE;
 	size = 0;
 	path = NULL;	/* if not set to NULL, realloc() will get pissed. And, it can waste your day! */
 	while ((len = getline(&path, &size, didx_fp)) != -1) {
@@ -436,7 +509,7 @@ simple_commit(struct dircache_ctx *dc_ctx, const char *msgfile)
 			path[len-1] = 0;
 			--len;
 		}
-		ndir = baseline_dir_new();
+		ndir = baseline_dir_new_in(arena);
 
 		paths[0] = (char *)path;
 		paths[1] = NULL;
@@ -453,23 +526,23 @@ simple_commit(struct dircache_ctx *dc_ctx, const char *msgfile)
 #endif
 				if ((fp = fopen(entry->fts_path, "r")) == NULL)
 					return EXIT_FAILURE;
-				fscanf(fp, "%c %s %o", &type, tmp_objid, &mode);
+				if (fscanf(fp, "%c %1023s %o", &type, tmp_objid, &mode) != 3 ||
+				    objid_parse(tmp_objid, &ent_id) == EXIT_FAILURE)
+					return EXIT_FAILURE;
 				if (type == 'F') {
-					ent = (struct dirent *)calloc(1, sizeof(struct dirent));
-					ent->id = strdup(tmp_objid);
-					ent->name = strdup(entry->fts_name);
+					if ((ent = baseline_dir_add(ndir, entry->fts_name)) == NULL)
+						return EXIT_FAILURE;
+					ent->id = ent_id;
 					ent->mode = mode;
 					ent->type = T_FILE;
-					baseline_dir_append(ndir, ent);
 					printf("[+] F %06o\t%s\n", mode, entry->fts_name);
 				}
 				else if (type == 'D') {
-					ent = (struct dirent *)calloc(1, sizeof(struct dirent));
-					ent->id = strdup(tmp_objid);
-					ent->name = strdup(entry->fts_name);
+					if ((ent = baseline_dir_add(ndir, entry->fts_name)) == NULL)
+						return EXIT_FAILURE;
+					ent->id = ent_id;
 					ent->mode = mode;
 					ent->type = T_DIR;
-					baseline_dir_append(ndir, ent);
 					/* FIXME: dir mode are copied from dircache, hence not preserved */
 					printf("[+] D %06o\t%s\n", mode, entry->fts_name);
 				}
@@ -483,12 +556,13 @@ simple_commit(struct dircache_ctx *dc_ctx, const char *msgfile)
 			}
 		}
 		fts_close(dir);
+		/* ids must not depend on the order fts_read() returned */
+		baseline_dir_sort(ndir);
 		dc_ctx->db_ops->insert_dir(dc_ctx->db_ctx, ndir);
-		free(objid);
-		objid = strdup(ndir->id);
+		dir_id = ndir->id;
 		baseline_dir_free(ndir);
 #ifdef DEBUG
-		printf("dir \'%s\' commited with ID = %s\n", path, objid);
+		printf("dir \'%s\' commited with ID = %s\n", path, objid_hex(&dir_id, hex));
 #endif
 		if (stat(path, &s) == -1)
 			return EXIT_FAILURE;
@@ -497,10 +571,11 @@ simple_commit(struct dircache_ctx *dc_ctx, const char *msgfile)
 			return EXIT_FAILURE;
 		if ((fp = fopen(path, "w")) == NULL)
 			return EXIT_FAILURE;
-		fprintf(fp, "%c %s %06o", 'D', objid, s.st_mode);
+		fprintf(fp, "%c %s %06o", 'D', objid_hex(&dir_id, hex), s.st_mode);
 		fclose(fp);
 	}
 	fclose(didx_fp);
+	arena_free(arena);
 	unlink(didx_path);
 	/* temp */
 	unlink(dircache_path);
@@ -508,20 +583,28 @@ simple_commit(struct dircache_ctx *dc_ctx, const char *msgfile)
 		return EXIT_FAILURE;
 	}
 	/* generate commit */
-	if ((com = baseline_helper_commit_build(dc_ctx, objid, cur_head, msgfile)) == NULL)
+	if ((com = baseline_helper_commit_build(dc_ctx, &dir_id,
+	    objid_is_null(&cur_head) ? NULL : &cur_head, msgfile)) == NULL)
 		return EXIT_FAILURE;
 	/* insert the commit into the db */
 	dc_ctx->db_ops->insert_commit(dc_ctx->db_ctx, com);
-	printf("commit id: %s\n", com->id);
-	unlink(path);
+	if (dc_ctx->db_ops->commit_batch != NULL &&
+	    dc_ctx->db_ops->commit_batch(dc_ctx->db_ctx) == EXIT_FAILURE)
+		return EXIT_FAILURE;
 	/* update the branch's head */
-	dc_ctx->db_ops->branch_set_head(dc_ctx->db_ctx, cur_branch, com->id);
+	if (dc_ctx->db_ops->branch_set_head(dc_ctx->db_ctx, cur_branch, &com->id) == EXIT_FAILURE) {
+		fprintf(stderr, "error, could not update the head of branch %s.\n", cur_branch);
+		free(cur_branch);
+		free(path);
+		baseline_commit_free(com);
+		return EXIT_FAILURE;
+	}
+	printf("commit id: %s\n", objid_hex(&com->id, hex));
+	unlink(path);
 	/* update the working dir */
-	simple_workdir_set(dc_ctx, com->id);
+	simple_workdir_set(dc_ctx, &com->id);
 	free(cur_branch);
-	free(cur_head);
 	free(path);
-	free(objid);
 	baseline_commit_free(com);
 	return EXIT_SUCCESS;
 }
@@ -566,10 +649,12 @@ simple_branch_set(struct dircache_ctx *dc_ctx, const char *branch_name)
 }
 
 static int
-simple_workdir_get(struct dircache_ctx *dc_ctx, char **commit_id)
+simple_workdir_get(struct dircache_ctx *dc_ctx, struct objid *commit_id)
 {
-	char *fname;
+	char *fname, *line = NULL;
+	int retval = EXIT_SUCCESS;
 	size_t size = 0;
+	ssize_t len;
 	FILE *fp;
 
 	if (dc_ctx == NULL || commit_id == NULL)
@@ -577,21 +662,25 @@ simple_workdir_get(struct dircache_ctx *dc_ctx, char **commit_id)
 	asprintf(&fname, "%s/workdir", dc_ctx->repo_baselinepath);
 	if ((fp = fopen(fname, "r")) == NULL)
 		return EXIT_FAILURE;
-	*commit_id = NULL;
-	if (getline(commit_id, &size, fp) == -1) {
-		/* assuming the file is empty */
-		/* FIXME: check for errors */
-		*commit_id = NULL;
+	memset(commit_id, 0, sizeof(*commit_id));
+	/* assuming the file is empty */
+	/* FIXME: check for errors */
+	if ((len = getline(&line, &size, fp)) > 0) {
+		if (line[len - 1] == '\n')
+			line[len - 1] = '\0';
+		if (objid_parse(line, commit_id) == EXIT_FAILURE)
+			retval = EXIT_FAILURE;
 	}
+	free(line);
 	fclose(fp);
 	free(fname);
-	return EXIT_SUCCESS;
+	return retval;
 }
 
 static int
-simple_workdir_set(struct dircache_ctx *dc_ctx, const char *commit_id)
+simple_workdir_set(struct dircache_ctx *dc_ctx, const struct objid *commit_id)
 {
-	char *fname;
+	char *fname, hex[OBJID_HEXLEN + 1];
 	FILE *fp;
 
 	if (dc_ctx == NULL || commit_id == NULL)
@@ -599,9 +688,132 @@ simple_workdir_set(struct dircache_ctx *dc_ctx, const char *commit_id)
 	asprintf(&fname, "%s/workdir", dc_ctx->repo_baselinepath);
 	if ((fp = fopen(fname, "w")) == NULL)
 		return EXIT_FAILURE;
-	fprintf(fp, "%s", commit_id);
+	fprintf(fp, "%s", objid_hex(commit_id, hex));
 	fclose(fp);
 	free(fname);
 	return EXIT_SUCCESS;
 }
 
+
+static int
+roots_add(struct objdb_root **roots, size_t *n, size_t *max, enum objtype type, const struct objid *id)
+{
+	struct objdb_root *tmp;
+
+	if (*n == *max) {
+		*max = *max ? *max * 2 : 64;
+		if ((tmp = reallocarray(*roots, *max, sizeof(struct objdb_root))) == NULL)
+			return EXIT_FAILURE;
+		*roots = tmp;
+	}
+	(*roots)[*n].type = type;
+	(*roots)[*n].id = *id;
+	(*n)++;
+	return EXIT_SUCCESS;
+}
+
+/*
+ * the workdir commit and the staged files and dirs, none of which a
+ * branch may reach yet
+ */
+static int
+simple_roots(struct dircache_ctx *dc_ctx, struct objdb_root **roots, size_t *n)
+{
+	char *dircache_path, *paths[2], tmp_objid[1024];
+	char type;
+	int retval = EXIT_FAILURE;
+	unsigned int mode;
+	size_t max = 0;
+	struct objid id;
+	FILE *fp;
+	FTS *dir;
+	FTSENT *entry;
+
+	*roots = NULL;
+	*n = 0;
+	if (simple_workdir_get(dc_ctx, &id) == EXIT_FAILURE)
+		return EXIT_FAILURE;
+	if (!objid_is_null(&id) && roots_add(roots, n, &max, O_COMMIT, &id) == EXIT_FAILURE)
+		goto ret;
+	dircache_path = get_dircache_path(dc_ctx);
+	paths[0] = dircache_path;
+	paths[1] = NULL;
+	if ((dir = fts_open(paths, FTS_NOCHDIR, 0)) == NULL) {
+		free(dircache_path);
+		goto ret;
+	}
+	while ((entry = fts_read(dir)) != NULL) {
+		if (entry->fts_info != FTS_F)
+			continue;
+		if ((fp = fopen(entry->fts_path, "r")) == NULL)
+			break;
+		if (fscanf(fp, "%c %1023s %o", &type, tmp_objid, &mode) != 3 ||
+		    objid_parse(tmp_objid, &id) == EXIT_FAILURE || (type != 'F' && type != 'D')) {
+			fclose(fp);
+			break;
+		}
+		fclose(fp);
+		if (roots_add(roots, n, &max, type == 'F' ? O_FILE : O_DIR, &id) == EXIT_FAILURE)
+			break;
+	}
+	/* an entry that cannot be read may be all that keeps an object */
+	if (entry == NULL)
+		retval = EXIT_SUCCESS;
+	fts_close(dir);
+	free(dircache_path);
+ret:
+	if (retval == EXIT_FAILURE) {
+		free(*roots);
+		*roots = NULL;
+		*n = 0;
+	}
+	return retval;
+}
+
+/*
+ * the workdir commit and what is staged must be in the object database
+ */
+static int
+simple_fsck(struct dircache_ctx *dc_ctx)
+{
+	char hex[OBJID_HEXLEN + 1];
+	int retval = EXIT_SUCCESS, found;
+	size_t i, n;
+	struct objdb_root *roots;
+	struct commit *comm;
+	struct dir *dir;
+	struct file *file;
+
+	if (simple_roots(dc_ctx, &roots, &n) == EXIT_FAILURE) {
+		fprintf(stderr, "error, the dircache cannot be read.\n");
+		return EXIT_FAILURE;
+	}
+	for (i = 0 ; i < n ; i++) {
+		switch (roots[i].type) {
+		case O_COMMIT:
+			comm = baseline_commit_new();
+			found = dc_ctx->db_ops->select_commit(dc_ctx->db_ctx, &roots[i].id, comm) == EXIT_SUCCESS;
+			baseline_commit_free(comm);
+			break;
+		case O_DIR:
+			dir = baseline_dir_new();
+			found = dc_ctx->db_ops->select_dir(dc_ctx->db_ctx, &roots[i].id, dir) == EXIT_SUCCESS;
+			baseline_dir_free(dir);
+			break;
+		default:
+			file = baseline_file_new();
+			if ((found = dc_ctx->db_ops->select_file(dc_ctx->db_ctx, &roots[i].id, file) == EXIT_SUCCESS))
+				baseline_file_close(file);
+			baseline_file_free(file);
+			break;
+		}
+		if (found)
+			continue;
+		fprintf(stderr, "error, the %s %s is missing.\n",
+		    roots[i].type == O_COMMIT ? "workdir commit" : "staged object",
+		    objid_hex(&roots[i].id, hex));
+		retval = EXIT_FAILURE;
+	}
+	free(roots);
+	return retval;
+}
@@ -38,11 +38,13 @@ struct dircache_ops {
 	int (*commit)(struct dircache_ctx *, const char *);
 	int (*branch_get)(struct dircache_ctx *, char **);
 	int (*branch_set)(struct dircache_ctx *, const char *);
-	int (*workdir_get)(struct dircache_ctx *, char **);
-	int (*workdir_set)(struct dircache_ctx *, const char *);
+	int (*workdir_get)(struct dircache_ctx *, struct objid *);
+	int (*workdir_set)(struct dircache_ctx *, const struct objid *);
 	int (*fsck)(struct dircache_ctx *);
 	int (*compress)(struct dircache_ctx *);
 	int (*dedup)(struct dircache_ctx *);
+	/* optional, the objects it refers to, for gc */
+	int (*roots)(struct dircache_ctx *, struct objdb_root **, size_t *);
 };
 
 #endif
@@ -0,0 +1,407 @@
+/*
+ * Copyright (c) 2014 Mohamed Aslan <maslan@sce.carleton.ca>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>	/* mmap(2) */
+#include <sys/stat.h>	/* fstat(2) */
+
+#include <endian.h>	/* htobe*(3), be*toh(3) */
+#include <fcntl.h>	/* open(2) */
+#include <stdio.h>	/* asprintf(3), rename(2) */
+#include <stdlib.h>	/* calloc(3), qsort(3) */
+#include <string.h>	/* mem*(3) */
+#include <unistd.h>	/* close(2), unlink(2) */
+
+#include "graph.h"
+
+#define GEN_UNKNOWN	0xffffffff
+
+static void
+tail_decode(const struct graph_tail_record *r, struct graph_commit *c)
+{
+	memcpy(c->id.bytes, r->id, OBJID_LEN);
+	memcpy(c->dir.bytes, r->dir, OBJID_LEN);
+	memcpy(c->parent.bytes, r->parent, OBJID_LEN);
+	c->has_parent = be32toh(r->has_parent);
+	c->generation = be32toh(r->generation);
+	c->time = be64toh(r->time);
+}
+
+static void
+tail_encode(const struct graph_commit *c, struct graph_tail_record *r)
+{
+	memcpy(r->id, c->id.bytes, OBJID_LEN);
+	memcpy(r->dir, c->dir.bytes, OBJID_LEN);
+	memcpy(r->parent, c->parent.bytes, OBJID_LEN);
+	r->has_parent = htobe32(c->has_parent);
+	r->generation = htobe32(c->generation);
+	r->time = htobe64(c->time);
+}
+
+/*
+ * a missing or truncated tail only loses what log can find anyway by
+ * reading the commits
+ */
+static int
+load_tail(struct graph *g)
+{
+	struct graph_tail_record r;
+	struct graph_commit *tail;
+	size_t max = 0;
+	int fd;
+
+	if ((fd = open(g->tail_path, O_RDONLY)) == -1)
+		return EXIT_SUCCESS;
+	while (read(fd, &r, sizeof(r)) == sizeof(r)) {
+		if (g->ntail == max) {
+			max = max ? max * 2 : 64;
+			if ((tail = reallocarray(g->tail, max, sizeof(struct graph_commit))) == NULL) {
+				close(fd);
+				return EXIT_FAILURE;
+			}
+			g->tail = tail;
+		}
+		tail_decode(&r, &g->tail[g->ntail++]);
+	}
+	close(fd);
+	return EXIT_SUCCESS;
+}
+
+static int
+map_graph(struct graph *g)
+{
+	int fd;
+	size_t need;
+	struct stat s;
+	const struct graph_header *hdr;
+
+	if ((fd = open(g->path, O_RDONLY)) == -1)
+		return EXIT_SUCCESS;
+	if (fstat(fd, &s) == -1 || (size_t)s.st_size < sizeof(struct graph_header)) {
+		close(fd);
+		return EXIT_FAILURE;
+	}
+	g->len = s.st_size;
+	g->map = mmap(NULL, g->len, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (g->map == MAP_FAILED) {
+		g->map = NULL;
+		return EXIT_FAILURE;
+	}
+	hdr = (const struct graph_header *)g->map;
+	g->count = be32toh(hdr->count);
+	need = sizeof(struct graph_header) + GRAPH_FANOUT * sizeof(u_int32_t) +
+	    (size_t)g->count * (OBJID_LEN + sizeof(struct graph_record));
+	if (memcmp(hdr->magic, GRAPH_MAGIC, sizeof(hdr->magic)) ||
+	    be32toh(hdr->version) != GRAPH_VERSION || g->len != need)
+		return EXIT_FAILURE;
+	g->fanout = (const u_int32_t *)(g->map + sizeof(struct graph_header));
+	g->ids = (const u_int8_t *)(g->fanout + GRAPH_FANOUT);
+	g->records = (const struct graph_record *)(g->ids + (size_t)g->count * OBJID_LEN);
+	if (be32toh(g->fanout[GRAPH_FANOUT - 1]) != g->count)
+		return EXIT_FAILURE;
+	return EXIT_SUCCESS;
+}
+
+static void
+unmap_graph(struct graph *g)
+{
+	if (g->map != NULL)
+		munmap(g->map, g->len);
+	g->map = NULL;
+	g->len = 0;
+	g->count = 0;
+}
+
+/*
+ * a graph that was never written is empty
+ */
+int
+graph_open(const char *path, struct graph **gp)
+{
+	struct graph *g;
+
+	if ((g = calloc(1, sizeof(struct graph))) == NULL)
+		return EXIT_FAILURE;
+	g->path = strdup(path);
+	asprintf(&g->tail_path, "%s.tail", path);
+	if (g->path == NULL || g->tail_path == NULL ||
+	    map_graph(g) == EXIT_FAILURE || load_tail(g) == EXIT_FAILURE) {
+		graph_close(g);
+		return EXIT_FAILURE;
+	}
+	*gp = g;
+	return EXIT_SUCCESS;
+}
+
+void
+graph_close(struct graph *g)
+{
+	if (g == NULL)
+		return;
+	unmap_graph(g);
+	free(g->tail);
+	free(g->tail_path);
+	free(g->path);
+	free(g);
+}
+
+static int
+find(struct graph *g, const struct objid *id, u_int32_t *pos)
+{
+	u_int32_t lo, hi, mid;
+	int cmp;
+
+	if (g->count == 0)
+		return EXIT_FAILURE;
+	lo = (id->bytes[0] == 0) ? 0 : be32toh(g->fanout[id->bytes[0] - 1]);
+	hi = be32toh(g->fanout[id->bytes[0]]);
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		cmp = memcmp(g->ids + (size_t)mid * OBJID_LEN, id->bytes, OBJID_LEN);
+		if (cmp == 0) {
+			*pos = mid;
+			return EXIT_SUCCESS;
+		}
+		if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return EXIT_FAILURE;
+}
+
+/*
+ * commits whose history is not complete in the graph have a generation
+ * of 0, they are not found either.
+ */
+int
+graph_lookup(struct graph *g, const struct objid *id, struct graph_commit *c)
+{
+	const struct graph_record *r;
+	u_int32_t pos, parent;
+	size_t i;
+
+	if (g == NULL)
+		return EXIT_FAILURE;
+	if (find(g, id, &pos) == EXIT_SUCCESS) {
+		r = &g->records[pos];
+		if ((c->generation = be32toh(r->generation)) == 0)
+			return EXIT_FAILURE;
+		c->id = *id;
+		memcpy(c->dir.bytes, r->dir, OBJID_LEN);
+		parent = be32toh(r->parent);
+		if ((c->has_parent = (parent != GRAPH_NONE)))
+			memcpy(c->parent.bytes, g->ids + (size_t)parent * OBJID_LEN, OBJID_LEN);
+		else
+			memset(c->parent.bytes, 0, OBJID_LEN);
+		c->time = be64toh(r->time);
+		return EXIT_SUCCESS;
+	}
+	/* the most recent commits are looked up the most */
+	for (i = g->ntail ; i > 0 ; i--) {
+		if (objid_cmp(&g->tail[i - 1].id, id) == 0) {
+			*c = g->tail[i - 1];
+			return EXIT_SUCCESS;
+		}
+	}
+	return EXIT_FAILURE;
+}
+
+/*
+ * rewrites the graph with the tail folded in
+ */
+static int
+fold(struct graph *g)
+{
+	struct graph_commit *all;
+	size_t n = 0;
+	u_int32_t i;
+	int retval;
+
+	if ((all = calloc((size_t)g->count + g->ntail, sizeof(struct graph_commit))) == NULL)
+		return EXIT_FAILURE;
+	for (i = 0 ; i < g->count ; i++) {
+		memcpy(all[n].id.bytes, g->ids + (size_t)i * OBJID_LEN, OBJID_LEN);
+		if (graph_lookup(g, &all[n].id, &all[n]) == EXIT_SUCCESS)
+			n++;
+	}
+	memcpy(all + n, g->tail, g->ntail * sizeof(struct graph_commit));
+	n += g->ntail;
+	retval = graph_write(g->path, all, n);
+	free(all);
+	if (retval == EXIT_FAILURE)
+		return EXIT_FAILURE;
+	unmap_graph(g);
+	free(g->tail);
+	g->tail = NULL;
+	g->ntail = 0;
+	return map_graph(g);
+}
+
+/*
+ * appends c to the tail, its generation is set here. a commit whose
+ * parent is not in the graph is not added, nor are its descendants
+ * until the graph is written again.
+ */
+int
+graph_add(struct graph *g, struct graph_commit *c)
+{
+	struct graph_commit parent, *tail;
+	struct graph_tail_record r;
+	int fd;
+
+	if (g == NULL)
+		return EXIT_FAILURE;
+	if (graph_lookup(g, &c->id, &parent) == EXIT_SUCCESS)
+		return EXIT_SUCCESS;
+	if (!c->has_parent)
+		c->generation = 1;
+	else if (graph_lookup(g, &c->parent, &parent) == EXIT_SUCCESS)
+		c->generation = parent.generation + 1;
+	else
+		return EXIT_FAILURE;
+	if ((tail = reallocarray(g->tail, g->ntail + 1, sizeof(struct graph_commit))) == NULL)
+		return EXIT_FAILURE;
+	g->tail = tail;
+	tail_encode(c, &r);
+	if ((fd = open(g->tail_path, O_WRONLY | O_APPEND | O_CREAT, S_IRUSR | S_IWUSR)) == -1)
+		return EXIT_FAILURE;
+	if (write(fd, &r, sizeof(r)) != sizeof(r)) {
+		close(fd);
+		return EXIT_FAILURE;
+	}
+	close(fd);
+	g->tail[g->ntail++] = *c;
+	if (g->ntail >= GRAPH_TAIL_MAX)
+		return fold(g);
+	return EXIT_SUCCESS;
+}
+
+static int
+commit_cmp(const void *a, const void *b)
+{
+	return objid_cmp(&((const struct graph_commit *)a)->id, &((const struct graph_commit *)b)->id);
+}
+
+/*
+ * writes a whole new graph of the n commits, sorting them, and drops
+ * the tail it replaces
+ */
+int
+graph_write(const char *path, struct graph_commit *commits, size_t n)
+{
+	char *tmp = NULL, *tail_path = NULL;
+	u_int8_t *buf = NULL;
+	u_int32_t *fanout, *parent = NULL, *gen = NULL, *stack = NULL, j;
+	size_t i, k, len, sp, off;
+	ssize_t nw;
+	int fd = -1, retval = EXIT_FAILURE;
+	struct graph_header *hdr;
+	struct graph_record *r;
+	struct graph_commit key, *found;
+	u_int8_t *ids;
+
+	qsort(commits, n, sizeof(struct graph_commit), commit_cmp);
+	for (i = 0, k = 0 ; i < n ; i++)
+		if (k == 0 || objid_cmp(&commits[k - 1].id, &commits[i].id) != 0)
+			commits[k++] = commits[i];
+	n = k;
+	if (n >= GRAPH_NONE)
+		return EXIT_FAILURE;
+	parent = calloc(n + 1, sizeof(u_int32_t));
+	gen = calloc(n + 1, sizeof(u_int32_t));
+	stack = calloc(n + 1, sizeof(u_int32_t));
+	if (parent == NULL || gen == NULL || stack == NULL)
+		goto ret;
+	/* commits with a parent that is missing are marked incomplete, as 0 */
+	for (i = 0 ; i < n ; i++) {
+		gen[i] = GEN_UNKNOWN;
+		parent[i] = GRAPH_NONE;
+		if (!commits[i].has_parent)
+			continue;
+		key.id = commits[i].parent;
+		found = bsearch(&key, commits, n, sizeof(struct graph_commit), commit_cmp);
+		if (found == NULL)
+			gen[i] = 0;
+		else
+			parent[i] = found - commits;
+	}
+	for (i = 0 ; i < n ; i++) {
+		/* climb to a known generation, then come back down */
+		for (sp = 0, j = i ; gen[j] == GEN_UNKNOWN ; j = parent[j]) {
+			stack[sp++] = j;
+			if (parent[j] == GRAPH_NONE)
+				break;
+		}
+		while (sp > 0) {
+			j = stack[--sp];
+			if (parent[j] == GRAPH_NONE)
+				gen[j] = 1;
+			else
+				gen[j] = (gen[parent[j]] == 0) ? 0 : gen[parent[j]] + 1;
+		}
+	}
+
+	len = sizeof(struct graph_header) + GRAPH_FANOUT * sizeof(u_int32_t) +
+	    n * (OBJID_LEN + sizeof(struct graph_record));
+	if ((buf = calloc(1, len)) == NULL)
+		goto ret;
+	hdr = (struct graph_header *)buf;
+	memcpy(hdr->magic, GRAPH_MAGIC, sizeof(hdr->magic));
+	hdr->version = htobe32(GRAPH_VERSION);
+	hdr->count = htobe32(n);
+	fanout = (u_int32_t *)(buf + sizeof(struct graph_header));
+	ids = (u_int8_t *)(fanout + GRAPH_FANOUT);
+	r = (struct graph_record *)(ids + n * OBJID_LEN);
+	for (i = 0 ; i < n ; i++) {
+		fanout[commits[i].id.bytes[0]]++;
+		memcpy(ids + i * OBJID_LEN, commits[i].id.bytes, OBJID_LEN);
+		memcpy(r[i].dir, commits[i].dir.bytes, OBJID_LEN);
+		r[i].parent = htobe32(parent[i]);
+		r[i].generation = htobe32(gen[i]);
+		r[i].time = htobe64(commits[i].time);
+	}
+	for (i = 1 ; i < GRAPH_FANOUT ; i++)
+		fanout[i] += fanout[i - 1];
+	for (i = 0 ; i < GRAPH_FANOUT ; i++)
+		fanout[i] = htobe32(fanout[i]);
+
+	asprintf(&tmp, "%s.XXXXXX", path);
+	if (tmp == NULL || (fd = mkstemp(tmp)) == -1)
+		goto ret;
+	for (off = 0 ; off < len ; off += nw)
+		if ((nw = write(fd, buf + off, len - off)) == -1)
+			break;
+	close(fd);
+	if (off != len || rename(tmp, path) == -1) {
+		unlink(tmp);
+		goto ret;
+	}
+	/* what the tail held is in the graph now */
+	asprintf(&tail_path, "%s.tail", path);
+	if (tail_path != NULL)
+		unlink(tail_path);
+	retval = EXIT_SUCCESS;
+ret:
+	free(tail_path);
+	free(tmp);
+	free(buf);
+	free(stack);
+	free(gen);
+	free(parent);
+	return retval;
+}
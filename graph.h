@@ -0,0 +1,100 @@
+/*
+ * Copyright (c) 2014 Mohamed Aslan <maslan@sce.carleton.ca>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _GRAPH_H_
+#define _GRAPH_H_
+
+#include <sys/types.h>
+
+#include <time.h>
+
+#include "objects.h"
+
+#define GRAPH_MAGIC	"BLCG"
+#define GRAPH_VERSION	1
+#define GRAPH_FANOUT	256
+#define GRAPH_NONE	0xffffffff	/* no parent */
+#define GRAPH_TAIL_MAX	256	/* appended commits before a rewrite */
+
+/*
+ * what walking the history needs of a commit, without parsing it.
+ *
+ * on-disk format, integers are big-endian:
+ *	struct graph_header
+ *	fanout: GRAPH_FANOUT u_int32_t, the number of ids whose first
+ *	    byte is at most i
+ *	count ids, sorted
+ *	count struct graph_record, in the order of the ids
+ * commits added since are appended to a tail file, one
+ * struct graph_tail_record each, and folded into the graph once
+ * there are GRAPH_TAIL_MAX of them.
+ *
+ * generation numbers are 1 for root commits and one more than their
+ * parent's otherwise: a commit can only be an ancestor of commits of a
+ * higher generation.
+ */
+struct graph_header {
+	char magic[4];
+	u_int32_t version;
+	u_int32_t count;
+	u_int32_t reserved;
+};
+
+struct graph_record {
+	u_int8_t dir[OBJID_LEN];
+	u_int32_t parent;	/* position, or GRAPH_NONE */
+	u_int32_t generation;
+	u_int64_t time;		/* committer's timestamp */
+};
+
+struct graph_tail_record {
+	u_int8_t id[OBJID_LEN];
+	u_int8_t dir[OBJID_LEN];
+	u_int8_t parent[OBJID_LEN];
+	u_int32_t has_parent;
+	u_int32_t generation;
+	u_int64_t time;
+};
+
+struct graph_commit {
+	struct objid id;
+	struct objid dir;
+	struct objid parent;
+	int has_parent;
+	u_int32_t generation;
+	time_t time;
+};
+
+struct graph {
+	char *path;
+	char *tail_path;
+	u_int8_t *map;
+	size_t len;
+	u_int32_t count;
+	const u_int32_t *fanout;
+	const u_int8_t *ids;
+	const struct graph_record *records;
+	struct graph_commit *tail;
+	size_t ntail;
+};
+
+int graph_open(const char *, struct graph **);
+void graph_close(struct graph *);
+int graph_lookup(struct graph *, const struct objid *, struct graph_commit *);
+int graph_add(struct graph *, struct graph_commit *);
+int graph_write(const char *, struct graph_commit *, size_t);
+
+#endif
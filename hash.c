@@ -0,0 +1,501 @@
+/*
+ * Copyright (c) 2014 Mohamed Aslan <maslan@sce.carleton.ca>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+
+#include <pthread.h>	/* pthread_once(3) */
+#include <stdlib.h>	/* EXIT_* */
+#include <string.h>	/* mem*(3), strcmp(3) */
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HASH_X86
+#include <cpuid.h>
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#define HASH_ARM
+#include <arm_neon.h>
+#include <sys/auxv.h>	/* getauxval(3), elf_aux_info(3) */
+#ifndef HWCAP_SHA2
+#define HWCAP_SHA2	(1 << 6)
+#endif
+#if defined(__clang__)
+#define ARM_SHA_TARGET	__attribute__((target("crypto")))
+#else
+#define ARM_SHA_TARGET	__attribute__((target("+crypto")))
+#endif
+#endif
+
+#include "hash.h"
+
+typedef void (*blocks_fn)(u_int32_t *, const u_int8_t *, size_t);
+
+struct hash_impl {
+	const char *name;
+	blocks_fn blocks;
+	int multi;		/* hash_many() runs lanes in parallel */
+	int (*supported)(void);
+};
+
+static const u_int32_t K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const u_int32_t H0[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+#define ROTR(x, n)	(((x) >> (n)) | ((x) << (32 - (n))))
+#define CH(x, y, z)	(((x) & (y)) ^ (~(x) & (z)))
+#define MAJ(x, y, z)	(((x) & (y)) ^ ((x) & (z)) ^ ((y) & (z)))
+#define BSIG0(x)	(ROTR(x, 2) ^ ROTR(x, 13) ^ ROTR(x, 22))
+#define BSIG1(x)	(ROTR(x, 6) ^ ROTR(x, 11) ^ ROTR(x, 25))
+#define SSIG0(x)	(ROTR(x, 7) ^ ROTR(x, 18) ^ ((x) >> 3))
+#define SSIG1(x)	(ROTR(x, 17) ^ ROTR(x, 19) ^ ((x) >> 10))
+
+static u_int32_t
+load_be32(const u_int8_t *p)
+{
+	return ((u_int32_t)p[0] << 24) | ((u_int32_t)p[1] << 16) | ((u_int32_t)p[2] << 8) | p[3];
+}
+
+static void
+blocks_generic(u_int32_t *state, const u_int8_t *data, size_t nblocks)
+{
+	u_int32_t a, b, c, d, e, f, g, h, t1, t2, w[64];
+	int t;
+
+	for ( ; nblocks > 0 ; nblocks--, data += HASH_BLOCK) {
+		for (t = 0 ; t < 16 ; t++)
+			w[t] = load_be32(data + 4 * t);
+		for ( ; t < 64 ; t++)
+			w[t] = SSIG1(w[t - 2]) + w[t - 7] + SSIG0(w[t - 15]) + w[t - 16];
+		a = state[0]; b = state[1]; c = state[2]; d = state[3];
+		e = state[4]; f = state[5]; g = state[6]; h = state[7];
+		for (t = 0 ; t < 64 ; t++) {
+			t1 = h + BSIG1(e) + CH(e, f, g) + K[t] + w[t];
+			t2 = BSIG0(a) + MAJ(a, b, c);
+			h = g; g = f; f = e; e = d + t1;
+			d = c; c = b; b = a; a = t1 + t2;
+		}
+		state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+		state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+	}
+}
+
+static int
+always(void)
+{
+	return 1;
+}
+
+#ifdef HASH_X86
+static int
+has_shani(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_SSE4_1))
+		return 0;
+	if (__get_cpuid_max(0, NULL) < 7)
+		return 0;
+	__cpuid_count(7, 0, eax, ebx, ecx, edx);
+	return (ebx & (1 << 29)) != 0;
+}
+
+static int
+has_avx2(void)
+{
+	unsigned int eax, ebx, ecx, edx, xcr0, xcr0_hi;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return 0;
+	/* the OS must save the ymm registers */
+	if (!(ecx & bit_OSXSAVE) || !(ecx & bit_AVX))
+		return 0;
+	__asm__ volatile("xgetbv" : "=a" (xcr0), "=d" (xcr0_hi) : "c" (0));
+	if ((xcr0 & 0x6) != 0x6)
+		return 0;
+	if (__get_cpuid_max(0, NULL) < 7)
+		return 0;
+	__cpuid_count(7, 0, eax, ebx, ecx, edx);
+	return (ebx & bit_AVX2) != 0;
+}
+
+/*
+ * SHA-NI keeps the state as ABEF/CDGH and does two rounds per
+ * instruction, message words are scheduled four at a time.
+ */
+__attribute__((target("sha,sse4.1")))
+static void
+blocks_shani(u_int32_t *state, const u_int8_t *data, size_t nblocks)
+{
+	const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+	__m128i state0, state1, abef, cdgh, msg, tmp, x[4];
+	int j;
+
+	tmp = _mm_loadu_si128((const __m128i *)&state[0]);
+	state1 = _mm_loadu_si128((const __m128i *)&state[4]);
+	tmp = _mm_shuffle_epi32(tmp, 0xb1);		/* CDAB */
+	state1 = _mm_shuffle_epi32(state1, 0x1b);	/* EFGH */
+	state0 = _mm_alignr_epi8(tmp, state1, 8);	/* ABEF */
+	state1 = _mm_blend_epi16(state1, tmp, 0xf0);	/* CDGH */
+
+	for ( ; nblocks > 0 ; nblocks--, data += HASH_BLOCK) {
+		abef = state0;
+		cdgh = state1;
+		for (j = 0 ; j < 16 ; j++) {
+			if (j < 4)
+				x[j] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16 * j)), mask);
+			else {
+				tmp = _mm_add_epi32(_mm_sha256msg1_epu32(x[j % 4], x[(j + 1) % 4]),
+				    _mm_alignr_epi8(x[(j + 3) % 4], x[(j + 2) % 4], 4));
+				x[j % 4] = _mm_sha256msg2_epu32(tmp, x[(j + 3) % 4]);
+			}
+			msg = _mm_add_epi32(x[j % 4], _mm_loadu_si128((const __m128i *)&K[4 * j]));
+			state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+			msg = _mm_shuffle_epi32(msg, 0x0e);
+			state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+		}
+		state0 = _mm_add_epi32(state0, abef);
+		state1 = _mm_add_epi32(state1, cdgh);
+	}
+
+	tmp = _mm_shuffle_epi32(state0, 0x1b);		/* FEBA */
+	state1 = _mm_shuffle_epi32(state1, 0xb1);	/* DCHG */
+	state0 = _mm_blend_epi16(tmp, state1, 0xf0);	/* DCBA */
+	state1 = _mm_alignr_epi8(state1, tmp, 8);	/* HGFE */
+	_mm_storeu_si128((__m128i *)&state[0], state0);
+	_mm_storeu_si128((__m128i *)&state[4], state1);
+}
+
+#define V_ROTR(x, n)	_mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - (n)))
+#define V_ADD(a, b)	_mm256_add_epi32(a, b)
+#define V_XOR3(a, b, c)	_mm256_xor_si256(_mm256_xor_si256(a, b), c)
+
+/*
+ * one block of each of eight messages, lane i of s[n] is word n of the
+ * state of message i. lanes cleared in active keep their state.
+ */
+__attribute__((target("avx2")))
+static void
+block_x8_avx2(__m256i *s, const u_int8_t **blocks, __m256i active)
+{
+	__m256i w[64], v[8], t1, t2, s0, s1;
+	int t, i;
+
+	for (t = 0 ; t < 16 ; t++)
+		w[t] = _mm256_set_epi32(load_be32(blocks[7] + 4 * t), load_be32(blocks[6] + 4 * t),
+		    load_be32(blocks[5] + 4 * t), load_be32(blocks[4] + 4 * t),
+		    load_be32(blocks[3] + 4 * t), load_be32(blocks[2] + 4 * t),
+		    load_be32(blocks[1] + 4 * t), load_be32(blocks[0] + 4 * t));
+	for ( ; t < 64 ; t++) {
+		s0 = V_XOR3(V_ROTR(w[t - 15], 7), V_ROTR(w[t - 15], 18), _mm256_srli_epi32(w[t - 15], 3));
+		s1 = V_XOR3(V_ROTR(w[t - 2], 17), V_ROTR(w[t - 2], 19), _mm256_srli_epi32(w[t - 2], 10));
+		w[t] = V_ADD(V_ADD(s1, w[t - 7]), V_ADD(s0, w[t - 16]));
+	}
+	for (i = 0 ; i < 8 ; i++)
+		v[i] = s[i];
+	for (t = 0 ; t < 64 ; t++) {
+		/* h + BSIG1(e) + CH(e, f, g) + K[t] + w[t] */
+		t1 = V_ADD(V_ADD(v[7], V_XOR3(V_ROTR(v[4], 6), V_ROTR(v[4], 11), V_ROTR(v[4], 25))),
+		    V_ADD(_mm256_xor_si256(_mm256_and_si256(v[4], v[5]), _mm256_andnot_si256(v[4], v[6])),
+		    V_ADD(_mm256_set1_epi32(K[t]), w[t])));
+		/* BSIG0(a) + MAJ(a, b, c) */
+		t2 = V_ADD(V_XOR3(V_ROTR(v[0], 2), V_ROTR(v[0], 13), V_ROTR(v[0], 22)),
+		    V_XOR3(_mm256_and_si256(v[0], v[1]), _mm256_and_si256(v[0], v[2]),
+		    _mm256_and_si256(v[1], v[2])));
+		v[7] = v[6]; v[6] = v[5]; v[5] = v[4]; v[4] = V_ADD(v[3], t1);
+		v[3] = v[2]; v[2] = v[1]; v[1] = v[0]; v[0] = V_ADD(t1, t2);
+	}
+	for (i = 0 ; i < 8 ; i++)
+		s[i] = _mm256_blendv_epi8(s[i], V_ADD(s[i], v[i]), active);
+}
+
+/*
+ * messages are padded into private tails, the shorter ones idle while
+ * the longest one is hashed.
+ */
+__attribute__((target("avx2")))
+static void
+many_avx2(const void **data, const size_t *len, size_t n, u_int8_t (*digests)[SHA256_DIGEST_LENGTH])
+{
+	u_int8_t tail[HASH_LANES][2 * HASH_BLOCK];
+	const u_int8_t *blocks[HASH_LANES];
+	size_t full[HASH_LANES], total[HASH_LANES], b, nblocks = 0, rest;
+	u_int32_t lanes[HASH_LANES], word[HASH_LANES];
+	u_int64_t bits;
+	__m256i s[8];
+	int i, j;
+
+	for (i = 0 ; i < HASH_LANES ; i++) {
+		if ((size_t)i >= n) {
+			full[i] = total[i] = 0;
+			continue;
+		}
+		full[i] = len[i] / HASH_BLOCK;
+		rest = len[i] % HASH_BLOCK;
+		total[i] = full[i] + (rest + 9 > HASH_BLOCK ? 2 : 1);
+		memset(tail[i], 0, sizeof(tail[i]));
+		memcpy(tail[i], (const u_int8_t *)data[i] + full[i] * HASH_BLOCK, rest);
+		tail[i][rest] = 0x80;
+		bits = (u_int64_t)len[i] * 8;
+		for (j = 0 ; j < 8 ; j++)
+			tail[i][(total[i] - full[i]) * HASH_BLOCK - 1 - j] = bits >> (8 * j);
+		if (total[i] > nblocks)
+			nblocks = total[i];
+	}
+	for (j = 0 ; j < 8 ; j++)
+		s[j] = _mm256_set1_epi32(H0[j]);
+	for (b = 0 ; b < nblocks ; b++) {
+		for (i = 0 ; i < HASH_LANES ; i++) {
+			lanes[i] = (b < total[i]) ? 0xffffffff : 0;
+			if (b < full[i])
+				blocks[i] = (const u_int8_t *)data[i] + b * HASH_BLOCK;
+			else if (b < total[i])
+				blocks[i] = tail[i] + (b - full[i]) * HASH_BLOCK;
+			else
+				blocks[i] = tail[0];
+		}
+		block_x8_avx2(s, blocks, _mm256_loadu_si256((const __m256i *)lanes));
+	}
+	for (j = 0 ; j < 8 ; j++) {
+		_mm256_storeu_si256((__m256i *)word, s[j]);
+		for (i = 0 ; (size_t)i < n ; i++) {
+			digests[i][4 * j] = word[i] >> 24;
+			digests[i][4 * j + 1] = word[i] >> 16;
+			digests[i][4 * j + 2] = word[i] >> 8;
+			digests[i][4 * j + 3] = word[i];
+		}
+	}
+}
+#endif
+
+#ifdef HASH_ARM
+static int
+has_armsha(void)
+{
+#if defined(__linux__)
+	return (getauxval(AT_HWCAP) & HWCAP_SHA2) != 0;
+#elif defined(__OpenBSD__) || defined(__FreeBSD__)
+	unsigned long hwcap = 0;
+
+	if (elf_aux_info(AT_HWCAP, &hwcap, sizeof(hwcap)) != 0)
+		return 0;
+	return (hwcap & HWCAP_SHA2) != 0;
+#else
+	return 0;
+#endif
+}
+
+ARM_SHA_TARGET
+static void
+blocks_armsha(u_int32_t *state, const u_int8_t *data, size_t nblocks)
+{
+	uint32x4_t state0, state1, abcd, efgh, msg, tmp, x[4];
+	int j;
+
+	state0 = vld1q_u32(&state[0]);
+	state1 = vld1q_u32(&state[4]);
+	for ( ; nblocks > 0 ; nblocks--, data += HASH_BLOCK) {
+		abcd = state0;
+		efgh = state1;
+		for (j = 0 ; j < 16 ; j++) {
+			if (j < 4)
+				x[j] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 16 * j)));
+			else
+				x[j % 4] = vsha256su1q_u32(vsha256su0q_u32(x[j % 4], x[(j + 1) % 4]),
+				    x[(j + 2) % 4], x[(j + 3) % 4]);
+			msg = vaddq_u32(x[j % 4], vld1q_u32(&K[4 * j]));
+			tmp = state0;
+			state0 = vsha256hq_u32(state0, state1, msg);
+			state1 = vsha256h2q_u32(state1, tmp, msg);
+		}
+		state0 = vaddq_u32(state0, abcd);
+		state1 = vaddq_u32(state1, efgh);
+	}
+	vst1q_u32(&state[0], state0);
+	vst1q_u32(&state[4], state1);
+}
+#endif
+
+/* in order of preference */
+static struct hash_impl impls[] = {
+#ifdef HASH_X86
+	{ "sha-ni", blocks_shani, 0, has_shani },
+	{ "avx2", blocks_generic, 1, has_avx2 },
+#endif
+#ifdef HASH_ARM
+	{ "armv8", blocks_armsha, 0, has_armsha },
+#endif
+	{ "generic", blocks_generic, 0, always }
+};
+
+static struct hash_impl *impl;
+static pthread_once_t impl_once = PTHREAD_ONCE_INIT;
+
+static void
+impl_init(void)
+{
+	size_t i;
+
+	for (i = 0 ; i < sizeof(impls) / sizeof(impls[0]) ; i++) {
+		if (impls[i].supported()) {
+			impl = &impls[i];
+			return;
+		}
+	}
+}
+
+static struct hash_impl *
+get_impl(void)
+{
+	pthread_once(&impl_once, impl_init);
+	return impl;
+}
+
+const char *
+hash_impl(void)
+{
+	return get_impl()->name;
+}
+
+/*
+ * forces an implementation, for benchmarks
+ */
+int
+hash_select(const char *name)
+{
+	size_t i;
+
+	get_impl();
+	for (i = 0 ; i < sizeof(impls) / sizeof(impls[0]) ; i++) {
+		if (!strcmp(impls[i].name, name) && impls[i].supported()) {
+			impl = &impls[i];
+			return EXIT_SUCCESS;
+		}
+	}
+	return EXIT_FAILURE;
+}
+
+void
+hash_init(struct hash_ctx *ctx)
+{
+	memcpy(ctx->state, H0, sizeof(H0));
+	ctx->count = 0;
+	ctx->buflen = 0;
+}
+
+void
+hash_update(struct hash_ctx *ctx, const void *data, size_t len)
+{
+	const u_int8_t *p = data;
+	blocks_fn blocks = get_impl()->blocks;
+	size_t n;
+
+	ctx->count += len;
+	if (ctx->buflen > 0) {
+		n = HASH_BLOCK - ctx->buflen;
+		if (n > len)
+			n = len;
+		memcpy(ctx->buf + ctx->buflen, p, n);
+		ctx->buflen += n;
+		p += n;
+		len -= n;
+		if (ctx->buflen < HASH_BLOCK)
+			return;
+		blocks(ctx->state, ctx->buf, 1);
+		ctx->buflen = 0;
+	}
+	if (len >= HASH_BLOCK) {
+		n = len / HASH_BLOCK;
+		blocks(ctx->state, p, n);
+		p += n * HASH_BLOCK;
+		len -= n * HASH_BLOCK;
+	}
+	if (len > 0) {
+		memcpy(ctx->buf, p, len);
+		ctx->buflen = len;
+	}
+}
+
+void
+hash_final(struct hash_ctx *ctx, u_int8_t *digest)
+{
+	u_int8_t pad[2 * HASH_BLOCK];
+	u_int64_t bits = ctx->count * 8;
+	size_t n;
+	int i;
+
+	n = (ctx->buflen + 9 > HASH_BLOCK) ? 2 * HASH_BLOCK : HASH_BLOCK;
+	memset(pad, 0, sizeof(pad));
+	memcpy(pad, ctx->buf, ctx->buflen);
+	pad[ctx->buflen] = 0x80;
+	for (i = 0 ; i < 8 ; i++)
+		pad[n - 1 - i] = bits >> (8 * i);
+	get_impl()->blocks(ctx->state, pad, n / HASH_BLOCK);
+	for (i = 0 ; i < 8 ; i++) {
+		digest[4 * i] = ctx->state[i] >> 24;
+		digest[4 * i + 1] = ctx->state[i] >> 16;
+		digest[4 * i + 2] = ctx->state[i] >> 8;
+		digest[4 * i + 3] = ctx->state[i];
+	}
+	explicit_bzero(ctx, sizeof(*ctx));
+}
+
+void
+hash_data(const void *data, size_t len, u_int8_t *digest)
+{
+	struct hash_ctx ctx;
+
+	hash_init(&ctx);
+	hash_update(&ctx, data, len);
+	hash_final(&ctx, digest);
+}
+
+/*
+ * hashes n messages, in parallel when the implementation can
+ */
+void
+hash_many(const void **data, const size_t *len, size_t n, u_int8_t (*digests)[SHA256_DIGEST_LENGTH])
+{
+	size_t i;
+
+#ifdef HASH_X86
+	size_t batch;
+
+	if (get_impl()->multi) {
+		for (i = 0 ; i < n ; i += batch) {
+			batch = (n - i > HASH_LANES) ? HASH_LANES : n - i;
+			/* a lone message is not worth the padding */
+			if (batch == 1)
+				break;
+			many_avx2(data + i, len + i, batch, digests + i);
+		}
+		for ( ; i < n ; i++)
+			hash_data(data[i], len[i], digests[i]);
+		return;
+	}
+#endif
+	for (i = 0 ; i < n ; i++)
+		hash_data(data[i], len[i], digests[i]);
+}
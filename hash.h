@@ -0,0 +1,49 @@
+/*
+ * Copyright (c) 2014 Mohamed Aslan <maslan@sce.carleton.ca>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _HASH_H_
+#define _HASH_H_
+
+#include <sys/types.h>
+
+#include <sha2.h>	/* SHA256_DIGEST_LENGTH */
+
+/*
+ * SHA-256 for object ids, using the SHA extensions of the CPU when it
+ * has them (x86 SHA-NI, ARMv8 crypto extensions). hash_many() hashes
+ * up to HASH_LANES messages at once with AVX2 on x86 CPUs that have no
+ * SHA extensions. every implementation gives the same digests as
+ * SHA256Final(3).
+ */
+#define HASH_BLOCK	64
+#define HASH_LANES	8
+
+struct hash_ctx {
+	u_int32_t state[8];
+	u_int64_t count;	/* bytes */
+	u_int8_t buf[HASH_BLOCK];
+	size_t buflen;
+};
+
+void hash_init(struct hash_ctx *);
+void hash_update(struct hash_ctx *, const void *, size_t);
+void hash_final(struct hash_ctx *, u_int8_t *);
+void hash_data(const void *, size_t, u_int8_t *);
+void hash_many(const void **, const size_t *, size_t, u_int8_t (*)[SHA256_DIGEST_LENGTH]);
+const char *hash_impl(void);
+int hash_select(const char *);
+
+#endif
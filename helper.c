@@ -21,10 +21,11 @@
 
 #include "helper.h"
 #include "config.h"
+#include "graph.h"
 
 /* TODO: add support for multiple parents */
 struct commit *
-baseline_helper_commit_build(struct dircache_ctx *dc_ctx, const char *dir_id, const char *parent_head, const char *msg_file)
+baseline_helper_commit_build(struct dircache_ctx *dc_ctx, const struct objid *dir_id, const struct objid *parent_head, const char *msg_file)
 {
         char *line = NULL;
         const char *user_name, *user_email;
@@ -42,7 +43,7 @@ baseline_helper_commit_build(struct dircache_ctx *dc_ctx, const char *dir_id, co
                 return NULL;
         if (stat(msg_file, &s) == -1)
                 return NULL;
-        comm->dir = strdup(dir_id);
+        comm->dir = *dir_id;
         comm->author.name = strdup(user_name);
         comm->author.email = strdup(user_email);
 	if ((comm->author.timestamp = time(NULL)) == (time_t)-1)
@@ -52,7 +53,7 @@ baseline_helper_commit_build(struct dircache_ctx *dc_ctx, const char *dir_id, co
 	if ((comm->committer.timestamp = time(NULL)) == (time_t)-1)
 		return NULL;
         if (parent_head != NULL) {
-                comm->parents[0] = strdup(parent_head);
+                comm->parents[0] = *parent_head;
                 comm->n_parents = 1;
         }
         else {
@@ -71,3 +72,44 @@ baseline_helper_commit_build(struct dircache_ctx *dc_ctx, const char *dir_id, co
 	return comm;
 }
 
+/*
+ * returns 1 if anc is desc or one of its first parents, 0 otherwise and
+ * -1 on error. with a commit graph, the walk stops as soon as it gets
+ * below the generation of anc, and commit objects are not read at all.
+ */
+int
+baseline_helper_is_ancestor(struct objdb_ops *ops, struct objdb_ctx *ctx, const struct objid *anc,
+    const struct objid *desc)
+{
+	int anc_known = 0, retval = 1;
+	struct objid cur = *desc;
+	struct graph_commit ga, gc;
+	struct commit *comm;
+
+	if (ops->select_commit_graph != NULL &&
+	    ops->select_commit_graph(ctx, anc, &ga) == EXIT_SUCCESS)
+		anc_known = 1;
+	for (;;) {
+		if (objid_cmp(&cur, anc) == 0)
+			return 1;
+		if (ops->select_commit_graph != NULL &&
+		    ops->select_commit_graph(ctx, &cur, &gc) == EXIT_SUCCESS) {
+			if (anc_known && gc.generation <= ga.generation)
+				return 0;
+			if (!gc.has_parent)
+				return 0;
+			cur = gc.parent;
+			continue;
+		}
+		comm = baseline_commit_new();
+		if (ops->select_commit(ctx, &cur, comm) == EXIT_FAILURE)
+			retval = -1;
+		else if (comm->n_parents == 0)
+			retval = 0;
+		else
+			cur = comm->parents[0];
+		baseline_commit_free(comm);
+		if (retval != 1)
+			return retval;
+	}
+}
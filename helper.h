@@ -19,7 +19,9 @@
 
 #include "objects.h"
 #include "dircache.h"
+#include "objdb.h"
 
-struct commit* baseline_helper_commit_build(struct dircache_ctx *, const char *, const char *, const char *);
+struct commit* baseline_helper_commit_build(struct dircache_ctx *, const struct objid *, const struct objid *, const char *);
+int baseline_helper_is_ancestor(struct objdb_ops *, struct objdb_ctx *, const struct objid *, const struct objid *);
 
 #endif
@@ -0,0 +1,523 @@
+/*
+ * Copyright (c) 2014 Mohamed Aslan <maslan@sce.carleton.ca>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>	/* fstat(2) */
+
+#include <errno.h>	/* errno */
+#include <fcntl.h>	/* open(2) */
+#include <pthread.h>	/* pthread_*(3) */
+#include <stdlib.h>	/* EXIT_*, malloc(3) */
+#include <string.h>	/* memset(3) */
+#include <time.h>	/* nanosleep(2) */
+#include <unistd.h>	/* pread(2), pwrite(2), close(2) */
+
+#ifdef __linux__
+#include <sys/mman.h>	/* mmap(2) */
+#include <sys/syscall.h>	/* syscall(2) */
+#include <linux/io_uring.h>
+#ifdef __NR_io_uring_setup
+#define IOQ_URING
+#endif
+#endif
+
+#include "ioq.h"
+
+#define IOQ_MAXDEPTH	4096
+
+/* request states */
+#define S_OPEN		0
+#define S_READ		1
+#define S_WRITE		2
+#define S_CLOSE		3
+#define S_DONE		4
+
+struct ioq {
+	unsigned int depth;
+#ifdef IOQ_URING
+	int ring;		/* -1 without io_uring */
+	void *sq_map;
+	size_t sq_map_len;
+	void *cq_map;
+	size_t cq_map_len;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int sq_mask;
+	unsigned int *sq_array;
+	struct io_uring_sqe *sqes;
+	size_t sqes_len;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int cq_mask;
+	struct io_uring_cqe *cqes;
+	unsigned int pending;	/* queued, not yet submitted */
+#endif
+};
+
+struct worker {
+	struct ioq_req *reqs;
+	size_t n;
+	size_t next;
+	pthread_mutex_t lock;
+};
+
+/*
+ * allocates the buffer of a read once the size of the file is known
+ */
+static int
+read_alloc(struct ioq_req *r)
+{
+	struct stat s;
+
+	if (r->path != NULL) {
+		if (fstat(r->fd, &s) == -1)
+			return errno;
+		r->len = s.st_size;
+	}
+	if ((r->buf = malloc(r->len + 1)) == NULL)
+		return ENOMEM;
+	r->buf[r->len] = '\0';
+	return 0;
+}
+
+/*
+ * the plain system call version of a request
+ */
+static void
+req_run(struct ioq_req *r)
+{
+	ssize_t n;
+
+	r->error = 0;
+	r->done = 0;
+	if (r->op == IOQ_WRITE) {
+		for ( ; r->done < r->len ; r->done += n)
+			if ((n = pwrite(r->fd, r->buf + r->done, r->len - r->done,
+			    r->off + r->done)) == -1) {
+				r->error = errno;
+				return;
+			}
+		return;
+	}
+	r->buf = NULL;
+	if (r->path != NULL && (r->fd = open(r->path, O_RDONLY)) == -1) {
+		r->error = errno;
+		return;
+	}
+	if ((r->error = read_alloc(r)) == 0) {
+		for ( ; r->done < r->len ; r->done += n) {
+			if ((n = pread(r->fd, r->buf + r->done, r->len - r->done,
+			    r->off + r->done)) <= 0) {
+				r->error = n == 0 ? EIO : errno;
+				break;
+			}
+		}
+	}
+	if (r->path != NULL) {
+		close(r->fd);
+		r->fd = -1;
+	}
+	if (r->error) {
+		free(r->buf);
+		r->buf = NULL;
+	}
+}
+
+static void *
+worker_run(void *arg)
+{
+	size_t i;
+	struct worker *w = arg;
+
+	for (;;) {
+		pthread_mutex_lock(&w->lock);
+		i = w->next++;
+		pthread_mutex_unlock(&w->lock);
+		if (i >= w->n)
+			break;
+		req_run(&w->reqs[i]);
+	}
+	return NULL;
+}
+
+/*
+ * one thread per request in flight, the caller being one of them
+ */
+static int
+run_threads(struct ioq *q, struct ioq_req *reqs, size_t n)
+{
+	pthread_t *threads;
+	size_t i, t, nthreads;
+	struct worker w;
+
+	nthreads = n < q->depth ? n : q->depth;
+	if (nthreads <= 1) {
+		for (i = 0 ; i < n ; i++)
+			req_run(&reqs[i]);
+		return EXIT_SUCCESS;
+	}
+	if ((threads = calloc(nthreads - 1, sizeof(pthread_t))) == NULL)
+		return EXIT_FAILURE;
+	w.reqs = reqs;
+	w.n = n;
+	w.next = 0;
+	pthread_mutex_init(&w.lock, NULL);
+	for (t = 0 ; t < nthreads - 1 ; t++)
+		if (pthread_create(&threads[t], NULL, worker_run, &w) != 0)
+			break;
+	worker_run(&w);
+	while (t-- > 0)
+		pthread_join(threads[t], NULL);
+	pthread_mutex_destroy(&w.lock);
+	free(threads);
+	return EXIT_SUCCESS;
+}
+
+#ifdef IOQ_URING
+static int
+uring_setup(struct ioq *q)
+{
+	int ops[] = { IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_WRITE, IORING_OP_CLOSE };
+	size_t i, probe_len;
+	struct io_uring_params p;
+	struct io_uring_probe *probe;
+
+	memset(&p, 0, sizeof(p));
+	if ((q->ring = syscall(__NR_io_uring_setup, q->depth, &p)) == -1)
+		return EXIT_FAILURE;
+	/* kernels with io_uring but without these opcodes */
+	probe_len = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+	if ((probe = calloc(1, probe_len)) == NULL)
+		return EXIT_FAILURE;
+	if (syscall(__NR_io_uring_register, q->ring, IORING_REGISTER_PROBE, probe, 256) == -1) {
+		free(probe);
+		return EXIT_FAILURE;
+	}
+	for (i = 0 ; i < sizeof(ops) / sizeof(ops[0]) ; i++) {
+		if (ops[i] > probe->last_op || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+			free(probe);
+			return EXIT_FAILURE;
+		}
+	}
+	free(probe);
+
+	q->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	q->cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (q->cq_map_len > q->sq_map_len)
+			q->sq_map_len = q->cq_map_len;
+		q->cq_map_len = 0;
+	}
+	if ((q->sq_map = mmap(NULL, q->sq_map_len, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, q->ring, IORING_OFF_SQ_RING)) == MAP_FAILED) {
+		q->sq_map = NULL;
+		return EXIT_FAILURE;
+	}
+	if (q->cq_map_len == 0)
+		q->cq_map = q->sq_map;
+	else if ((q->cq_map = mmap(NULL, q->cq_map_len, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, q->ring, IORING_OFF_CQ_RING)) == MAP_FAILED) {
+		q->cq_map = NULL;
+		return EXIT_FAILURE;
+	}
+	q->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	if ((q->sqes = mmap(NULL, q->sqes_len, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, q->ring, IORING_OFF_SQES)) == MAP_FAILED) {
+		q->sqes = NULL;
+		return EXIT_FAILURE;
+	}
+	q->sq_head = (unsigned int *)((char *)q->sq_map + p.sq_off.head);
+	q->sq_tail = (unsigned int *)((char *)q->sq_map + p.sq_off.tail);
+	q->sq_mask = *(unsigned int *)((char *)q->sq_map + p.sq_off.ring_mask);
+	q->sq_array = (unsigned int *)((char *)q->sq_map + p.sq_off.array);
+	q->cq_head = (unsigned int *)((char *)q->cq_map + p.cq_off.head);
+	q->cq_tail = (unsigned int *)((char *)q->cq_map + p.cq_off.tail);
+	q->cq_mask = *(unsigned int *)((char *)q->cq_map + p.cq_off.ring_mask);
+	q->cqes = (struct io_uring_cqe *)((char *)q->cq_map + p.cq_off.cqes);
+	/* the depth asked for may have been rounded up */
+	q->depth = p.sq_entries;
+	return EXIT_SUCCESS;
+}
+
+static void
+uring_teardown(struct ioq *q)
+{
+	if (q->sqes != NULL)
+		munmap(q->sqes, q->sqes_len);
+	if (q->cq_map != NULL && q->cq_map != q->sq_map)
+		munmap(q->cq_map, q->cq_map_len);
+	if (q->sq_map != NULL)
+		munmap(q->sq_map, q->sq_map_len);
+	if (q->ring != -1)
+		close(q->ring);
+	q->ring = -1;
+	q->sqes = NULL;
+	q->sq_map = q->cq_map = NULL;
+}
+
+/*
+ * queues the next step of request i, there is always room as each
+ * request has at most one step in flight
+ */
+static void
+uring_queue(struct ioq *q, struct ioq_req *reqs, size_t i)
+{
+	unsigned int tail, idx;
+	struct io_uring_sqe *sqe;
+	struct ioq_req *r = &reqs[i];
+
+	tail = *q->sq_tail + q->pending;
+	idx = tail & q->sq_mask;
+	sqe = &q->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->user_data = i;
+	switch (r->state) {
+	case S_OPEN:
+		sqe->opcode = IORING_OP_OPENAT;
+		sqe->fd = AT_FDCWD;
+		sqe->addr = (unsigned long)r->path;
+		sqe->open_flags = O_RDONLY;
+		break;
+	case S_READ:
+	case S_WRITE:
+		sqe->opcode = r->state == S_READ ? IORING_OP_READ : IORING_OP_WRITE;
+		sqe->fd = r->fd;
+		sqe->addr = (unsigned long)(r->buf + r->done);
+		sqe->len = r->len - r->done;
+		sqe->off = r->off + r->done;
+		break;
+	case S_CLOSE:
+		sqe->opcode = IORING_OP_CLOSE;
+		sqe->fd = r->fd;
+		break;
+	}
+	q->sq_array[idx] = idx;
+	q->pending++;
+}
+
+/*
+ * moves request r past the step that completed with res, returns 1 when
+ * it is over
+ */
+static int
+uring_step(struct ioq_req *r, int res)
+{
+	switch (r->state) {
+	case S_OPEN:
+		if (res < 0) {
+			r->error = -res;
+			return 1;
+		}
+		r->fd = res;
+		if ((r->error = read_alloc(r)) != 0 || r->len == 0)
+			r->state = S_CLOSE;
+		else
+			r->state = S_READ;
+		return 0;
+	case S_READ:
+	case S_WRITE:
+		if (res <= 0)
+			r->error = res == 0 ? EIO : -res;
+		else if ((r->done += res) < r->len)
+			return 0;
+		if (r->path == NULL)
+			return 1;
+		r->state = S_CLOSE;
+		return 0;
+	case S_CLOSE:
+		r->fd = -1;
+		return 1;
+	}
+	return 1;
+}
+
+/*
+ * once io_uring_enter(2) failed, waits for the steps the kernel took
+ * from the ring, it may still be reading into their buffers. the steps
+ * it did not take are dropped. the files opened for the first next
+ * requests are closed and their reads freed, so that they can start
+ * over elsewhere.
+ */
+static void
+uring_drain(struct ioq *q, struct ioq_req *reqs, size_t next, unsigned int busy)
+{
+	size_t i;
+	unsigned int head;
+	struct io_uring_cqe *cqe;
+	struct ioq_req *r;
+	struct timespec ts = { 0, 1000000 };
+
+	q->pending = 0;
+	__atomic_store_n(q->sq_tail, __atomic_load_n(q->sq_head, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+	while (busy > 0) {
+		head = *q->cq_head;
+		for ( ; head != __atomic_load_n(q->cq_tail, __ATOMIC_ACQUIRE) ; head++, busy--) {
+			cqe = &q->cqes[head & q->cq_mask];
+			r = &reqs[cqe->user_data];
+			if (r->state == S_OPEN && cqe->res >= 0) {
+				r->fd = cqe->res;
+				r->state = S_CLOSE;
+			} else if (r->state == S_CLOSE)
+				r->fd = -1;
+		}
+		__atomic_store_n(q->cq_head, head, __ATOMIC_RELEASE);
+		/* polled if the ring cannot even be waited on */
+		if (busy > 0 && syscall(__NR_io_uring_enter, q->ring, 0, 1, IORING_ENTER_GETEVENTS,
+		    NULL, 0) == -1 && errno != EINTR)
+			nanosleep(&ts, NULL);
+	}
+	for (i = 0 ; i < next ; i++) {
+		r = &reqs[i];
+		if (r->op != IOQ_READ)
+			continue;
+		if (r->path != NULL && r->state != S_OPEN && r->fd != -1) {
+			close(r->fd);
+			r->fd = -1;
+		}
+		free(r->buf);
+		r->buf = NULL;
+	}
+}
+
+static int
+uring_run(struct ioq *q, struct ioq_req *reqs, size_t n)
+{
+	size_t i, next = 0, inflight = 0, left = n;
+	unsigned int head, submit, start, reaped = 0;
+	int ret;
+	struct io_uring_cqe *cqe;
+	struct ioq_req *r;
+
+	/* every step the kernel takes from the ring ends up in one cqe */
+	start = __atomic_load_n(q->sq_head, __ATOMIC_ACQUIRE);
+
+	while (left > 0) {
+		for ( ; next < n && inflight < q->depth ; next++, inflight++) {
+			r = &reqs[next];
+			r->error = 0;
+			r->done = 0;
+			if (r->op == IOQ_WRITE)
+				r->state = S_WRITE;
+			else {
+				r->buf = NULL;
+				r->state = r->path != NULL ? S_OPEN : S_READ;
+				if (r->path == NULL)
+					r->error = read_alloc(r);
+			}
+			/* nothing to wait for */
+			if (r->error || (r->state != S_OPEN && r->len == 0)) {
+				inflight--;
+				left--;
+				continue;
+			}
+			uring_queue(q, reqs, next);
+		}
+		if (left == 0)
+			break;
+		__atomic_store_n(q->sq_tail, *q->sq_tail + q->pending, __ATOMIC_RELEASE);
+		q->pending = 0;
+		/* including what an interrupted call left behind */
+		submit = *q->sq_tail - __atomic_load_n(q->sq_head, __ATOMIC_ACQUIRE);
+		do
+			ret = syscall(__NR_io_uring_enter, q->ring, submit, 1, IORING_ENTER_GETEVENTS,
+			    NULL, 0);
+		while (ret == -1 && errno == EINTR);
+		if (ret == -1) {
+			uring_drain(q, reqs, next,
+			    __atomic_load_n(q->sq_head, __ATOMIC_ACQUIRE) - start - reaped);
+			/* the ring is given up, the threads run everything again */
+			uring_teardown(q);
+			return run_threads(q, reqs, n);
+		}
+		head = *q->cq_head;
+		while (head != __atomic_load_n(q->cq_tail, __ATOMIC_ACQUIRE)) {
+			cqe = &q->cqes[head & q->cq_mask];
+			i = cqe->user_data;
+			if (uring_step(&reqs[i], cqe->res)) {
+				if (reqs[i].error && reqs[i].op == IOQ_READ) {
+					free(reqs[i].buf);
+					reqs[i].buf = NULL;
+				}
+				inflight--;
+				left--;
+			} else
+				uring_queue(q, reqs, i);
+			head++;
+			reaped++;
+		}
+		__atomic_store_n(q->cq_head, head, __ATOMIC_RELEASE);
+	}
+	return EXIT_SUCCESS;
+}
+#endif
+
+int
+ioq_new(unsigned int depth, struct ioq **qp)
+{
+	struct ioq *q;
+
+	if ((q = calloc(1, sizeof(struct ioq))) == NULL)
+		return EXIT_FAILURE;
+	if (depth == 0)
+		depth = 1;
+	q->depth = depth < IOQ_MAXDEPTH ? depth : IOQ_MAXDEPTH;
+#ifdef IOQ_URING
+	q->ring = -1;
+	/* not worth a ring, nor allowed everywhere */
+	if (q->depth > 1 && uring_setup(q) == EXIT_FAILURE)
+		uring_teardown(q);
+#endif
+	*qp = q;
+	return EXIT_SUCCESS;
+}
+
+void
+ioq_free(struct ioq *q)
+{
+	if (q == NULL)
+		return;
+#ifdef IOQ_URING
+	uring_teardown(q);
+#endif
+	free(q);
+}
+
+/*
+ * runs all the requests, a failed one has its error set. fails only
+ * when the queue itself does, then none of the requests can be trusted
+ * but none is left in flight either.
+ */
+int
+ioq_run(struct ioq *q, struct ioq_req *reqs, size_t n)
+{
+	if (q == NULL || (reqs == NULL && n > 0))
+		return EXIT_FAILURE;
+#ifdef IOQ_URING
+	if (q->ring != -1)
+		return uring_run(q, reqs, n);
+#endif
+	return run_threads(q, reqs, n);
+}
+
+const char *
+ioq_impl(const struct ioq *q)
+{
+#ifdef IOQ_URING
+	if (q->ring != -1)
+		return "io_uring";
+#endif
+	return q->depth > 1 ? "threads" : "sync";
+}
@@ -0,0 +1,57 @@
+/*
+ * Copyright (c) 2014 Mohamed Aslan <maslan@sce.carleton.ca>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _IOQ_H_
+#define _IOQ_H_
+
+#include <sys/types.h>
+
+#define IOQ_DEPTH	32	/* default number of requests in flight */
+
+/*
+ * a queue that keeps up to its depth of object reads and writes in
+ * flight, for storage that only gets busy with many requests pending.
+ * it uses io_uring(7) where the kernel has it, otherwise, or once the
+ * ring failed, it hands the requests to as many threads making plain
+ * system calls. a depth of 1 runs them one after the other in the
+ * caller.
+ */
+enum ioq_op {
+	IOQ_READ,	/* a whole file by path, or len bytes of fd at off */
+	IOQ_WRITE	/* len bytes of buf to fd at off */
+};
+
+struct ioq_req {
+	enum ioq_op op;
+	const char *path;
+	int fd;
+	off_t off;
+	char *buf;	/* allocated by reads, NUL terminated */
+	size_t len;
+	int error;	/* an errno(2) value, 0 on success */
+	/* private */
+	int state;
+	size_t done;
+};
+
+struct ioq;
+
+int ioq_new(unsigned int, struct ioq **);
+void ioq_free(struct ioq *);
+int ioq_run(struct ioq *, struct ioq_req *, size_t);
+const char *ioq_impl(const struct ioq *);
+
+#endif
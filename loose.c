@@ -0,0 +1,219 @@
+/*
+ * Copyright (c) 2014 Mohamed Aslan <maslan@sce.carleton.ca>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>	/* mmap(2) */
+#include <sys/stat.h>	/* fstat(2) */
+
+#include <endian.h>	/* htobe*(3), be*toh(3) */
+#include <fcntl.h>	/* open(2) */
+#include <stdint.h>	/* UINT32_MAX */
+#include <stdio.h>	/* asprintf(3), rename(2) */
+#include <stdlib.h>	/* calloc(3), qsort(3) */
+#include <string.h>	/* mem*(3) */
+#include <unistd.h>	/* close(2), unlink(2) */
+
+#include "loose.h"
+
+static size_t
+loose_len(size_t count)
+{
+	return sizeof(struct loose_header) + LOOSE_FANOUT * sizeof(u_int32_t) +
+	    count * sizeof(struct loose_entry);
+}
+
+static int
+loose_set(struct loose_idx *idx)
+{
+	const struct loose_header *hdr;
+
+	if (idx->len < sizeof(struct loose_header))
+		return EXIT_FAILURE;
+	hdr = (const struct loose_header *)idx->buf;
+	idx->count = be32toh(hdr->count);
+	if (memcmp(hdr->magic, LOOSE_MAGIC, sizeof(hdr->magic)) ||
+	    be32toh(hdr->version) != LOOSE_VERSION || idx->len != loose_len(idx->count))
+		return EXIT_FAILURE;
+	idx->fanout = (const u_int32_t *)(idx->buf + sizeof(struct loose_header));
+	idx->entries = (const struct loose_entry *)(idx->fanout + LOOSE_FANOUT);
+	if (be32toh(idx->fanout[LOOSE_FANOUT - 1]) != idx->count)
+		return EXIT_FAILURE;
+	return EXIT_SUCCESS;
+}
+
+static void
+stamps_encode(const struct timespec *ts, struct loose_header *hdr)
+{
+	int i;
+
+	for (i = 0 ; i < LOOSE_NDIRS ; i++) {
+		hdr->stamps[i][0] = htobe64(ts[i].tv_sec);
+		hdr->stamps[i][1] = htobe64(ts[i].tv_nsec);
+	}
+}
+
+/*
+ * maps the index, it fails when it is missing, damaged or older than
+ * one of the directories
+ */
+int
+loose_open(const char *path, const struct timespec *ts, struct loose_idx **idxp)
+{
+	int fd;
+	struct stat s;
+	struct loose_header stamps;
+	struct loose_idx *idx;
+
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return EXIT_FAILURE;
+	if (fstat(fd, &s) == -1 || (idx = calloc(1, sizeof(struct loose_idx))) == NULL) {
+		close(fd);
+		return EXIT_FAILURE;
+	}
+	idx->len = s.st_size;
+	idx->buf = mmap(NULL, idx->len, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (idx->buf == MAP_FAILED) {
+		free(idx);
+		return EXIT_FAILURE;
+	}
+	idx->mapped = 1;
+	stamps_encode(ts, &stamps);
+	if (loose_set(idx) == EXIT_FAILURE || memcmp(stamps.stamps,
+	    ((const struct loose_header *)idx->buf)->stamps, sizeof(stamps.stamps)) != 0) {
+		loose_close(idx);
+		return EXIT_FAILURE;
+	}
+	*idxp = idx;
+	return EXIT_SUCCESS;
+}
+
+static int
+entry_cmp(const void *a, const void *b)
+{
+	const struct loose_entry *x = a, *y = b;
+	int cmp;
+
+	if ((cmp = memcmp(x->id, y->id, OBJID_LEN)) != 0)
+		return cmp;
+	return (int)x->type - (int)y->type;
+}
+
+/*
+ * lays out the n entries as they are written, sorting them
+ */
+int
+loose_build(const struct timespec *ts, struct loose_entry *ents, size_t n, struct loose_idx **idxp)
+{
+	size_t i;
+	u_int32_t *fanout;
+	struct loose_header *hdr;
+	struct loose_idx *idx;
+
+	if (n > UINT32_MAX || (idx = calloc(1, sizeof(struct loose_idx))) == NULL)
+		return EXIT_FAILURE;
+	idx->len = loose_len(n);
+	if ((idx->buf = calloc(1, idx->len)) == NULL) {
+		free(idx);
+		return EXIT_FAILURE;
+	}
+	qsort(ents, n, sizeof(struct loose_entry), entry_cmp);
+	hdr = (struct loose_header *)idx->buf;
+	memcpy(hdr->magic, LOOSE_MAGIC, sizeof(hdr->magic));
+	hdr->version = htobe32(LOOSE_VERSION);
+	hdr->count = htobe32(n);
+	stamps_encode(ts, hdr);
+	fanout = (u_int32_t *)(idx->buf + sizeof(struct loose_header));
+	for (i = 0 ; i < n ; i++)
+		fanout[ents[i].id[0]]++;
+	for (i = 1 ; i < LOOSE_FANOUT ; i++)
+		fanout[i] += fanout[i - 1];
+	for (i = 0 ; i < LOOSE_FANOUT ; i++)
+		fanout[i] = htobe32(fanout[i]);
+	memcpy(fanout + LOOSE_FANOUT, ents, n * sizeof(struct loose_entry));
+	if (loose_set(idx) == EXIT_FAILURE) {
+		loose_close(idx);
+		return EXIT_FAILURE;
+	}
+	*idxp = idx;
+	return EXIT_SUCCESS;
+}
+
+int
+loose_write(const char *path, const struct loose_idx *idx)
+{
+	char *tmp = NULL;
+	size_t off;
+	ssize_t nw;
+	int fd, retval = EXIT_FAILURE;
+
+	asprintf(&tmp, "%s.XXXXXX", path);
+	if (tmp == NULL || (fd = mkstemp(tmp)) == -1)
+		goto ret;
+	for (off = 0 ; off < idx->len ; off += nw)
+		if ((nw = write(fd, idx->buf + off, idx->len - off)) == -1)
+			break;
+	close(fd);
+	if (off != idx->len || rename(tmp, path) == -1) {
+		unlink(tmp);
+		goto ret;
+	}
+	retval = EXIT_SUCCESS;
+ret:
+	free(tmp);
+	return retval;
+}
+
+/*
+ * adds the objects of the type whose ids start with the prefix
+ */
+int
+loose_match(const struct loose_idx *idx, enum objtype type, struct objid_match *m)
+{
+	u_int32_t lo, hi, mid;
+	const u_int8_t *prefix = m->prefix.bytes;
+	struct objid id;
+
+	lo = (prefix[0] == 0) ? 0 : be32toh(idx->fanout[prefix[0] - 1]);
+	hi = be32toh(idx->fanout[prefix[0]]);
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (memcmp(idx->entries[mid].id, prefix, OBJID_LEN) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	for ( ; lo < idx->count && objid_match_test(m, idx->entries[lo].id) ; lo++) {
+		if (idx->entries[lo].type != type)
+			continue;
+		memcpy(id.bytes, idx->entries[lo].id, OBJID_LEN);
+		if (objid_match_add(m, &id) == EXIT_FAILURE)
+			return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+void
+loose_close(struct loose_idx *idx)
+{
+	if (idx == NULL)
+		return;
+	if (idx->mapped)
+		munmap(idx->buf, idx->len);
+	else
+		free(idx->buf);
+	free(idx);
+}
@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2014 Mohamed Aslan <maslan@sce.carleton.ca>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _LOOSE_H_
+#define _LOOSE_H_
+
+#include <sys/types.h>
+
+#include <time.h>
+
+#include "objects.h"
+
+#define LOOSE_MAGIC	"BLLI"
+#define LOOSE_VERSION	1
+#define LOOSE_FANOUT	256
+#define LOOSE_NDIRS	3	/* files, dirs and commits */
+#define LOOSE_RACY	2	/* seconds, dirs changed since are not trusted */
+
+/*
+ * the ids of the loose objects, sorted, so that an abbreviated id is
+ * found by a binary search rather than by reading the directories.
+ *
+ * on-disk format, integers are big-endian:
+ *	struct loose_header
+ *	fanout: LOOSE_FANOUT u_int32_t, the number of ids whose first
+ *	    byte is at most i
+ *	count struct loose_entry, sorted by id
+ *
+ * the header holds the modification times of the directories the ids
+ * were read from, the index is stale as soon as one of them changes.
+ */
+struct loose_header {
+	char magic[4];
+	u_int32_t version;
+	u_int32_t count;
+	u_int32_t reserved;
+	u_int64_t stamps[LOOSE_NDIRS][2];	/* seconds, nanoseconds */
+};
+
+struct loose_entry {
+	u_int8_t id[OBJID_LEN];
+	u_int8_t type;
+	u_int8_t pad[7];
+};
+
+/* the index as read from its file or built in memory */
+struct loose_idx {
+	u_int8_t *buf;
+	size_t len;
+	int mapped;
+	u_int32_t count;
+	const u_int32_t *fanout;
+	const struct loose_entry *entries;
+};
+
+int loose_open(const char *, const struct timespec *, struct loose_idx **);
+int loose_build(const struct timespec *, struct loose_entry *, size_t, struct loose_idx **);
+int loose_write(const char *, const struct loose_idx *);
+int loose_match(const struct loose_idx *, enum objtype, struct objid_match *);
+void loose_close(struct loose_idx *);
+
+#endif
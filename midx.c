@@ -0,0 +1,387 @@
+/*
+ * Copyright (c) 2014 Mohamed Aslan <maslan@sce.carleton.ca>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>	/* mmap(2) */
+#include <sys/stat.h>	/* fstat(2) */
+
+#include <endian.h>	/* htobe*(3), be*toh(3) */
+#include <fcntl.h>	/* open(2) */
+#include <stdint.h>	/* UINT32_MAX */
+#include <stdio.h>	/* asprintf(3), rename(2) */
+#include <stdlib.h>	/* calloc(3), qsort(3) */
+#include <string.h>	/* mem*(3) */
+#include <unistd.h>	/* close(2), fsync(2), unlink(2) */
+
+#include "midx.h"
+
+static size_t
+midx_len(u_int32_t npacks, u_int32_t count)
+{
+	return sizeof(struct midx_header) + (size_t)npacks * OBJID_LEN +
+	    MIDX_FANOUT * sizeof(u_int32_t) + (size_t)count * sizeof(struct midx_entry);
+}
+
+/*
+ * maps the index and finds the packs it names among those loaded, it
+ * fails when it is missing, damaged or names a pack that is gone
+ */
+int
+midx_open(const char *dir, struct pack *packs, struct midx **mp)
+{
+	char *path = NULL;
+	int fd;
+	u_int32_t i;
+	const u_int8_t *names;
+	const struct midx_header *hdr;
+	struct stat s;
+	struct objid name;
+	struct midx *m;
+	struct pack *p;
+
+	asprintf(&path, "%s/%s", dir, MIDX_FILE);
+	if (path == NULL || (fd = open(path, O_RDONLY)) == -1) {
+		free(path);
+		return EXIT_FAILURE;
+	}
+	free(path);
+	if (fstat(fd, &s) == -1 || (m = calloc(1, sizeof(struct midx))) == NULL) {
+		close(fd);
+		return EXIT_FAILURE;
+	}
+	m->len = s.st_size;
+	if (m->len < sizeof(struct midx_header))
+		m->addr = MAP_FAILED;
+	else
+		m->addr = mmap(NULL, m->len, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (m->addr == MAP_FAILED) {
+		free(m);
+		return EXIT_FAILURE;
+	}
+	hdr = (const struct midx_header *)m->addr;
+	m->npacks = be32toh(hdr->npacks);
+	m->count = be32toh(hdr->count);
+	if (memcmp(hdr->magic, MIDX_MAGIC, sizeof(hdr->magic)) ||
+	    be32toh(hdr->version) != MIDX_VERSION || m->npacks == 0 ||
+	    m->len != midx_len(m->npacks, m->count))
+		goto fail;
+	names = m->addr + sizeof(struct midx_header);
+	m->fanout = (const u_int32_t *)(names + (size_t)m->npacks * OBJID_LEN);
+	m->entries = (const struct midx_entry *)(m->fanout + MIDX_FANOUT);
+	if (be32toh(m->fanout[MIDX_FANOUT - 1]) != m->count)
+		goto fail;
+	if ((m->packs = calloc(m->npacks, sizeof(struct pack *))) == NULL)
+		goto fail;
+	for (i = 0 ; i < m->npacks ; i++) {
+		for (p = packs ; p != NULL ; p = p->next)
+			if (pack_name(p, &name) == EXIT_SUCCESS &&
+			    !memcmp(name.bytes, names + (size_t)i * OBJID_LEN, OBJID_LEN))
+				break;
+		if (p == NULL)
+			goto fail;
+		m->packs[i] = p;
+	}
+	for (i = 0 ; i < m->npacks ; i++)
+		m->packs[i]->indexed = 1;
+	*mp = m;
+	return EXIT_SUCCESS;
+fail:
+	midx_close(m);
+	return EXIT_FAILURE;
+}
+
+/*
+ * before the packs are closed
+ */
+void
+midx_close(struct midx *m)
+{
+	u_int32_t i;
+
+	if (m == NULL)
+		return;
+	if (m->packs != NULL)
+		for (i = 0 ; i < m->npacks ; i++)
+			if (m->packs[i] != NULL)
+				m->packs[i]->indexed = 0;
+	munmap(m->addr, m->len);
+	free(m->packs);
+	free(m);
+}
+
+static int
+key_cmp(const u_int8_t *id, enum objtype type, const struct midx_entry *e)
+{
+	int cmp;
+
+	if ((cmp = memcmp(id, e->id, OBJID_LEN)) != 0)
+		return cmp;
+	return (int)type - (int)e->type;
+}
+
+/*
+ * binary search in the fan-out bucket of the id's first byte
+ */
+static const struct midx_entry *
+search(const struct midx *m, enum objtype type, const u_int8_t *id)
+{
+	u_int32_t lo, hi, mid;
+	int cmp;
+
+	lo = (id[0] == 0) ? 0 : be32toh(m->fanout[id[0] - 1]);
+	hi = be32toh(m->fanout[id[0]]);
+	if (lo > hi || hi > m->count)
+		return NULL;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if ((cmp = key_cmp(id, type, &m->entries[mid])) == 0)
+			return &m->entries[mid];
+		if (cmp < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return NULL;
+}
+
+/*
+ * the entry of the pack an entry of the index points to, NULL if it
+ * does not hold the same object
+ */
+static const struct pack_idx_entry *
+entry_get(const struct midx *m, const struct midx_entry *me, struct pack **packp)
+{
+	u_int32_t n, pos;
+	const struct pack_idx_entry *e;
+
+	n = be32toh(me->pack);
+	pos = be32toh(me->pos);
+	if (n >= m->npacks || pos >= m->packs[n]->count)
+		return NULL;
+	e = &m->packs[n]->entries[pos];
+	if (memcmp(e->id, me->id, OBJID_LEN) || e->type != me->type)
+		return NULL;
+	*packp = m->packs[n];
+	return e;
+}
+
+/*
+ * nothing is written to the index once open, lookups may run on several
+ * threads at once
+ */
+const struct pack_idx_entry *
+midx_lookup(struct midx *m, enum objtype type, const struct objid *id, struct pack **packp)
+{
+	u_int32_t i;
+	const struct midx_entry *me;
+	const struct pack_idx_entry *e;
+
+	if (m == NULL || id == NULL)
+		return NULL;
+	if ((me = search(m, type, id->bytes)) == NULL)
+		return NULL;
+	if ((e = entry_get(m, me, packp)) != NULL)
+		return e;
+	/* a wrong entry, the packs it covers are searched one by one */
+	for (i = 0 ; i < m->npacks ; i++)
+		if ((e = pack_lookup(m->packs[i], type, id)) != NULL) {
+			*packp = m->packs[i];
+			return e;
+		}
+	return NULL;
+}
+
+/*
+ * adds the objects of the type whose ids start with the prefix, they
+ * follow the first id not lower than the prefix
+ */
+int
+midx_match(struct midx *m, enum objtype type, struct objid_match *match)
+{
+	u_int32_t lo, hi, mid;
+	const u_int8_t *prefix = match->prefix.bytes;
+	struct objid id;
+
+	if (m == NULL)
+		return EXIT_SUCCESS;
+	lo = (prefix[0] == 0) ? 0 : be32toh(m->fanout[prefix[0] - 1]);
+	hi = be32toh(m->fanout[prefix[0]]);
+	if (lo > hi || hi > m->count)
+		return EXIT_SUCCESS;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (memcmp(m->entries[mid].id, prefix, OBJID_LEN) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	for ( ; lo < m->count && objid_match_test(match, m->entries[lo].id) ; lo++) {
+		if (m->entries[lo].type != type)
+			continue;
+		memcpy(id.bytes, m->entries[lo].id, OBJID_LEN);
+		if (objid_match_add(match, &id) == EXIT_FAILURE)
+			return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+/*
+ * the number of entries that are out of order, in the wrong fan-out
+ * bucket or do not match their pack, plus the number of objects of the
+ * packs the index does not find
+ */
+size_t
+midx_verify(struct midx *m)
+{
+	size_t bad = 0;
+	u_int32_t i, k, lo, hi;
+	const struct midx_entry *me;
+	struct pack *p;
+
+	for (i = 0 ; i < m->count ; i++) {
+		me = &m->entries[i];
+		lo = (me->id[0] == 0) ? 0 : be32toh(m->fanout[me->id[0] - 1]);
+		hi = be32toh(m->fanout[me->id[0]]);
+		if (i < lo || i >= hi ||
+		    (i > 0 && key_cmp(m->entries[i - 1].id, m->entries[i - 1].type, me) >= 0) ||
+		    entry_get(m, me, &p) == NULL)
+			bad++;
+	}
+	for (i = 0 ; i < m->npacks ; i++) {
+		p = m->packs[i];
+		for (k = 0 ; k < p->count ; k++)
+			if (search(m, p->entries[k].type, p->entries[k].id) == NULL)
+				bad++;
+	}
+	return bad;
+}
+
+static int
+entry_cmp(const void *a, const void *b)
+{
+	const struct midx_entry *e1 = a, *e2 = b;
+	int cmp;
+
+	if ((cmp = key_cmp(e1->id, e1->type, e2)) != 0)
+		return cmp;
+	/* the same object in several packs, keep the first pack */
+	return (e1->pack > e2->pack) - (e1->pack < e2->pack);
+}
+
+/*
+ * indexes every object of the packs, replacing the index by a rename
+ */
+int
+midx_write(const char *dir, struct pack *packs, int sync)
+{
+	char *path = NULL, *tmp = NULL;
+	int fd, retval = EXIT_FAILURE;
+	size_t i, n, count = 0;
+	u_int32_t k, npacks = 0, fanout[MIDX_FANOUT];
+	struct midx_header hdr;
+	struct midx_entry *ents = NULL;
+	struct objid name;
+	struct pack *p;
+	FILE *fp = NULL;
+
+	for (p = packs ; p != NULL ; p = p->next) {
+		npacks++;
+		count += p->count;
+	}
+	if (npacks == 0 || count > UINT32_MAX)
+		return EXIT_FAILURE;
+	if (count > 0 && (ents = reallocarray(NULL, count, sizeof(struct midx_entry))) == NULL)
+		return EXIT_FAILURE;
+	for (p = packs, i = 0, n = 0 ; p != NULL ; p = p->next, n++) {
+		for (k = 0 ; k < p->count ; k++, i++) {
+			memcpy(ents[i].id, p->entries[k].id, OBJID_LEN);
+			ents[i].pack = n;
+			ents[i].pos = k;
+			ents[i].type = p->entries[k].type;
+			memset(ents[i].pad, 0, sizeof(ents[i].pad));
+		}
+	}
+	/* sort and drop duplicates */
+	qsort(ents, count, sizeof(struct midx_entry), entry_cmp);
+	for (i = 0, n = 0 ; i < count ; i++) {
+		if (n > 0 && key_cmp(ents[n - 1].id, ents[n - 1].type, &ents[i]) == 0)
+			continue;
+		ents[n++] = ents[i];
+	}
+	count = n;
+
+	memset(fanout, 0, sizeof(fanout));
+	for (i = 0 ; i < count ; i++) {
+		fanout[ents[i].id[0]]++;
+		ents[i].pack = htobe32(ents[i].pack);
+		ents[i].pos = htobe32(ents[i].pos);
+	}
+	for (i = 1 ; i < MIDX_FANOUT ; i++)
+		fanout[i] += fanout[i - 1];
+	for (i = 0 ; i < MIDX_FANOUT ; i++)
+		fanout[i] = htobe32(fanout[i]);
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, MIDX_MAGIC, sizeof(hdr.magic));
+	hdr.version = htobe32(MIDX_VERSION);
+	hdr.npacks = htobe32(npacks);
+	hdr.count = htobe32(count);
+
+	asprintf(&path, "%s/%s", dir, MIDX_FILE);
+	asprintf(&tmp, "%s/%s.XXXXXX", dir, MIDX_FILE);
+	if (path == NULL || tmp == NULL)
+		goto ret;
+	if ((fd = mkstemp(tmp)) == -1) {
+		free(tmp);
+		tmp = NULL;
+		goto ret;
+	}
+	if ((fp = fdopen(fd, "w")) == NULL) {
+		close(fd);
+		goto ret;
+	}
+	if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1)
+		goto ret;
+	for (p = packs ; p != NULL ; p = p->next)
+		if (pack_name(p, &name) == EXIT_FAILURE || fwrite(name.bytes, OBJID_LEN, 1, fp) != 1)
+			goto ret;
+	if (fwrite(fanout, sizeof(fanout), 1, fp) != 1)
+		goto ret;
+	if (count > 0 && fwrite(ents, sizeof(struct midx_entry), count, fp) != count)
+		goto ret;
+	if (fflush(fp) != 0 || (sync && fsync(fileno(fp)) == -1))
+		goto ret;
+	if (fclose(fp) != 0) {
+		fp = NULL;
+		goto ret;
+	}
+	fp = NULL;
+	if (rename(tmp, path) == -1)
+		goto ret;
+	free(tmp);
+	tmp = NULL;
+	retval = EXIT_SUCCESS;
+ret:
+	if (fp != NULL)
+		fclose(fp);
+	if (tmp != NULL) {
+		unlink(tmp);
+		free(tmp);
+	}
+	free(path);
+	free(ents);
+	return retval;
+}
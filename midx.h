@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2014 Mohamed Aslan <maslan@sce.carleton.ca>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _MIDX_H_
+#define _MIDX_H_
+
+#include <sys/types.h>
+
+#include "objects.h"
+#include "pack.h"
+
+#define MIDX_FILE	"multi-pack-index"
+#define MIDX_MAGIC	"BLMX"
+#define MIDX_VERSION	1
+#define MIDX_FANOUT	256
+
+/*
+ * one index over the objects of several packs, so that an object is
+ * found by a single binary search rather than one per pack.
+ *
+ * on-disk format, integers are big-endian:
+ *	struct midx_header
+ *	npacks pack names, OBJID_LEN bytes each
+ *	fanout: MIDX_FANOUT u_int32_t, the number of objects whose first
+ *	    byte is at most i
+ *	count struct midx_entry, sorted by id then type
+ *
+ * an object stored in several packs is listed once. a pack is never
+ * rewritten under its name, the index only holds while every pack it
+ * names is there.
+ */
+struct midx_header {
+	char magic[4];
+	u_int32_t version;
+	u_int32_t npacks;
+	u_int32_t count;
+};
+
+struct midx_entry {
+	u_int8_t id[OBJID_LEN];
+	u_int32_t pack;		/* the number of the pack in the names */
+	u_int32_t pos;		/* of the object in the index of that pack */
+	u_int8_t type;
+	u_int8_t pad[3];
+};
+
+struct midx {
+	u_int8_t *addr;
+	size_t len;
+	u_int32_t npacks;
+	u_int32_t count;
+	const u_int32_t *fanout;
+	const struct midx_entry *entries;
+	struct pack **packs;	/* by number */
+};
+
+int midx_open(const char *, struct pack *, struct midx **);
+void midx_close(struct midx *);
+const struct pack_idx_entry *midx_lookup(struct midx *, enum objtype, const struct objid *, struct pack **);
+int midx_match(struct midx *, enum objtype, struct objid_match *);
+size_t midx_verify(struct midx *);
+int midx_write(const char *, struct pack *, int);
+
+#endif
@@ -0,0 +1,336 @@
+/*
+ * Copyright (c) 2014 Mohamed Aslan <maslan@sce.carleton.ca>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+
+#include <stdlib.h>	/* malloc(3), calloc(3) */
+#include <string.h>	/* mem*(3), str*(3) */
+
+#include "objcache.h"
+
+struct objcache_entry {
+	enum objtype type;
+	struct objid id;
+	size_t size;
+	union {
+		struct dir *dir;
+		struct commit *commit;
+	};
+	struct objcache_entry *hnext;	/* bucket chain */
+	struct objcache_entry *prev;	/* LRU list */
+	struct objcache_entry *next;
+};
+
+/*
+ * appends a string to a block sized beforehand
+ */
+static char *
+str_put(char **pos, const char *str)
+{
+	char *dst = *pos;
+	size_t len;
+
+	if (str == NULL)
+		return NULL;
+	len = strlen(str) + 1;
+	memcpy(dst, str, len);
+	*pos += len;
+	return dst;
+}
+
+static size_t
+str_size(const char *str)
+{
+	return (str == NULL) ? 0 : strlen(str) + 1;
+}
+
+/*
+ * ids are digests, any of their bytes is as good as a hash
+ */
+static size_t
+bucket_of(const struct objcache *c, enum objtype type, const struct objid *id)
+{
+	u_int32_t h;
+
+	memcpy(&h, id->bytes, sizeof(h));
+	return (h ^ type) & (c->nbuckets - 1);
+}
+
+/*
+ * appends copies of the entries of src to dst, names go to the arena of dst
+ */
+static int
+dir_copy_into(struct dir *dst, const struct dir *src, size_t *size)
+{
+	size_t i;
+	struct dirent *it, *ent;
+
+	dst->id = src->id;
+	*size = sizeof(struct dir);
+	if (baseline_dir_reserve(dst, dst->n_children + src->n_children) == EXIT_FAILURE)
+		return EXIT_FAILURE;
+	for (i = 0 ; i < src->n_children ; i++) {
+		it = &src->children[i];
+		if ((ent = baseline_dir_add(dst, it->name)) == NULL)
+			return EXIT_FAILURE;
+		ent->id = it->id;
+		ent->type = it->type;
+		ent->mode = it->mode;
+		*size += sizeof(struct dirent) + str_size(it->name);
+	}
+	return EXIT_SUCCESS;
+}
+
+/*
+ * commit copies keep their strings in a single block, like parsed ones
+ */
+static struct commit *
+commit_copy(const struct commit *src, size_t *size)
+{
+	char *pos;
+	size_t len;
+	struct commit *c;
+
+	if ((c = baseline_commit_new()) == NULL)
+		return NULL;
+	len = str_size(src->author.name) + str_size(src->author.email) +
+	    str_size(src->committer.name) + str_size(src->committer.email) +
+	    str_size(src->message);
+	if ((pos = malloc(len + 1)) == NULL) {
+		baseline_commit_free(c);
+		return NULL;
+	}
+	*c = *src;
+	c->strings = pos;
+	c->author.name = str_put(&pos, src->author.name);
+	c->author.email = str_put(&pos, src->author.email);
+	c->committer.name = str_put(&pos, src->committer.name);
+	c->committer.email = str_put(&pos, src->committer.email);
+	c->message = str_put(&pos, src->message);
+	*size = sizeof(struct commit) + len;
+	return c;
+}
+
+static void
+lru_unlink(struct objcache *c, struct objcache_entry *e)
+{
+	if (e->prev != NULL)
+		e->prev->next = e->next;
+	else
+		c->head = e->next;
+	if (e->next != NULL)
+		e->next->prev = e->prev;
+	else
+		c->tail = e->prev;
+	e->prev = e->next = NULL;
+}
+
+static void
+lru_push(struct objcache *c, struct objcache_entry *e)
+{
+	e->prev = NULL;
+	e->next = c->head;
+	if (c->head != NULL)
+		c->head->prev = e;
+	c->head = e;
+	if (c->tail == NULL)
+		c->tail = e;
+}
+
+static void
+entry_free(struct objcache_entry *e)
+{
+	if (e->type == O_DIR)
+		baseline_dir_free(e->dir);
+	else
+		baseline_commit_free(e->commit);
+	free(e);
+}
+
+static void
+evict(struct objcache *c, struct objcache_entry *e)
+{
+	struct objcache_entry **pp;
+
+	for (pp = &c->buckets[bucket_of(c, e->type, &e->id)] ; *pp != e ; pp = &(*pp)->hnext)
+		;
+	*pp = e->hnext;
+	lru_unlink(c, e);
+	c->used -= e->size;
+	c->count--;
+	entry_free(e);
+}
+
+static struct objcache_entry *
+lookup(struct objcache *c, enum objtype type, const struct objid *id)
+{
+	struct objcache_entry *e;
+
+	for (e = c->buckets[bucket_of(c, type, id)] ; e != NULL ; e = e->hnext) {
+		if (e->type == type && objid_cmp(&e->id, id) == 0) {
+			lru_unlink(c, e);
+			lru_push(c, e);
+			c->hits++;
+			return e;
+		}
+	}
+	c->misses++;
+	return NULL;
+}
+
+/*
+ * takes ownership of the copy in e
+ */
+static void
+insert(struct objcache *c, struct objcache_entry *e)
+{
+	size_t b;
+
+	/* an object bigger than the whole budget is not worth it */
+	if (e->size > c->budget) {
+		entry_free(e);
+		return;
+	}
+	while (c->used + e->size > c->budget && c->tail != NULL) {
+		evict(c, c->tail);
+		c->evictions++;
+	}
+	b = bucket_of(c, e->type, &e->id);
+	e->hnext = c->buckets[b];
+	c->buckets[b] = e;
+	lru_push(c, e);
+	c->used += e->size;
+	c->count++;
+}
+
+int
+objcache_new(size_t budget, struct objcache **cp)
+{
+	struct objcache *c;
+
+	if ((c = calloc(1, sizeof(struct objcache))) == NULL)
+		return EXIT_FAILURE;
+	/* about one bucket per small object within the budget */
+	c->nbuckets = 1024;
+	while (c->nbuckets < budget / 1024 && c->nbuckets < (1 << 20))
+		c->nbuckets <<= 1;
+	if ((c->buckets = calloc(c->nbuckets, sizeof(struct objcache_entry *))) == NULL) {
+		free(c);
+		return EXIT_FAILURE;
+	}
+	c->budget = budget;
+	*cp = c;
+	return EXIT_SUCCESS;
+}
+
+void
+objcache_free(struct objcache *c)
+{
+	struct objcache_entry *e, *next;
+
+	if (c == NULL)
+		return;
+	for (e = c->head ; e != NULL ; e = next) {
+		next = e->next;
+		entry_free(e);
+	}
+	free(c->buckets);
+	free(c);
+}
+
+int
+objcache_get_dir(struct objcache *c, const struct objid *id, struct dir *d)
+{
+	struct objcache_entry *e;
+	size_t size;
+
+	if (c == NULL || (e = lookup(c, O_DIR, id)) == NULL)
+		return EXIT_FAILURE;
+	return dir_copy_into(d, e->dir, &size);
+}
+
+void
+objcache_put_dir(struct objcache *c, const struct dir *d)
+{
+	struct objcache_entry *e;
+
+	if (c == NULL || (e = calloc(1, sizeof(struct objcache_entry))) == NULL)
+		return;
+	e->type = O_DIR;
+	e->id = d->id;
+	if ((e->dir = baseline_dir_new()) == NULL) {
+		free(e);
+		return;
+	}
+	if (dir_copy_into(e->dir, d, &e->size) == EXIT_FAILURE) {
+		baseline_dir_free(e->dir);
+		free(e);
+		return;
+	}
+	e->size += sizeof(struct objcache_entry);
+	insert(c, e);
+}
+
+int
+objcache_get_commit(struct objcache *c, const struct objid *id, struct commit *comm)
+{
+	struct objcache_entry *e;
+	struct commit *copy;
+	size_t size;
+
+	if (c == NULL || (e = lookup(c, O_COMMIT, id)) == NULL)
+		return EXIT_FAILURE;
+	if ((copy = commit_copy(e->commit, &size)) == NULL)
+		return EXIT_FAILURE;
+	/* the strings now belong to comm */
+	*comm = *copy;
+	free(copy);
+	return EXIT_SUCCESS;
+}
+
+/*
+ * tells whether an object is cached without counting a hit, nor making
+ * it the most recently used
+ */
+int
+objcache_has(const struct objcache *c, enum objtype type, const struct objid *id)
+{
+	struct objcache_entry *e;
+
+	if (c == NULL)
+		return 0;
+	for (e = c->buckets[bucket_of(c, type, id)] ; e != NULL ; e = e->hnext)
+		if (e->type == type && objid_cmp(&e->id, id) == 0)
+			return 1;
+	return 0;
+}
+
+void
+objcache_put_commit(struct objcache *c, const struct commit *comm)
+{
+	struct objcache_entry *e;
+
+	if (c == NULL || (e = calloc(1, sizeof(struct objcache_entry))) == NULL)
+		return;
+	e->type = O_COMMIT;
+	e->id = comm->id;
+	if ((e->commit = commit_copy(comm, &e->size)) == NULL) {
+		free(e);
+		return;
+	}
+	e->size += sizeof(struct objcache_entry);
+	insert(c, e);
+}
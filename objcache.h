@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2014 Mohamed Aslan <maslan@sce.carleton.ca>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _OBJCACHE_H_
+#define _OBJCACHE_H_
+
+#include <sys/types.h>
+
+#include "objects.h"
+
+#define OBJCACHE_SIZE	(32 * 1024 * 1024)	/* default budget, in bytes */
+
+/*
+ * an LRU cache of deserialized dirs and commits, keyed by type and id.
+ * objects are handed out as copies, the caller frees them as usual.
+ * the memory charged for an object is an estimate of what its copy
+ * takes, the least recently used ones are evicted above the budget.
+ */
+struct objcache_entry;
+
+struct objcache {
+	struct objcache_entry **buckets;
+	size_t nbuckets;
+	struct objcache_entry *head;	/* most recently used */
+	struct objcache_entry *tail;
+	size_t count;
+	size_t used;
+	size_t budget;
+	unsigned long long hits;
+	unsigned long long misses;
+	unsigned long long evictions;
+};
+
+int objcache_new(size_t, struct objcache **);
+void objcache_free(struct objcache *);
+int objcache_get_dir(struct objcache *, const struct objid *, struct dir *);
+void objcache_put_dir(struct objcache *, const struct dir *);
+int objcache_get_commit(struct objcache *, const struct objid *, struct commit *);
+void objcache_put_commit(struct objcache *, const struct commit *);
+int objcache_has(const struct objcache *, enum objtype, const struct objid *);
+
+#endif
@@ -14,39 +14,68 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <sys/file.h>	/* flock(2) */
 #include <sys/stat.h>	/* stat(3) */
 
+#include <endian.h>	/* be64toh(3) */
+#include <errno.h>	/* errno */
+#include <limits.h>	/* INT_MAX */
+#include <pthread.h>	/* pthread_*(3) */
 #include <stdio.h>	/* rename(2) */
 #include <stdlib.h>	/* malloc(2) */
 #include <string.h>	/* str*(2) , mem*(2) */
-#include <unistd.h>	/* access(2) */
-
-#include <sha2.h>	/* SHA256*() */
+#include <time.h>	/* clock_gettime(2) */
+#include <unistd.h>	/* access(2), fsync(2) */
 
 #include <fts.h>        /* fts_*(3) */
 
 #include "defaults.h"
+#include "bloom.h"
+#include "chunk.h"
+#include "compress.h"
+#include "config.h"
+#include "graph.h"
+#include "hash.h"
+#include "ioq.h"
+#include "loose.h"
+#include "midx.h"
+#include "objcache.h"
 #include "objects.h"
 #include "objdb.h"
+#include "pack.h"
+#include "refs.h"
+#include "serialize.h"
 
 int objdb_baseline_get_ops(struct objdb_ops **);
-static char * get_objdb_dir(struct objdb_ctx *);
 static int objdb_bl_open(struct objdb_ctx **, const char *, const char *);
 static int objdb_bl_close(struct objdb_ctx *);
 static int objdb_bl_init(struct objdb_ctx *);
 static int objdb_bl_insert_file(struct objdb_ctx *, struct file *);
+static int objdb_bl_insert_files(struct objdb_ctx *, struct file **, size_t);
 static int objdb_bl_insert_dir(struct objdb_ctx *, struct dir *);
 static int objdb_bl_insert_commit(struct objdb_ctx *, struct commit *);
-static int objdb_bl_select_file(struct objdb_ctx *, const char *, struct file *);
-static int objdb_bl_select_dir(struct objdb_ctx *, const char *, struct dir *);
-static int objdb_bl_select_commit(struct objdb_ctx *, const char *, struct commit *);
+static int objdb_bl_select_file(struct objdb_ctx *, const struct objid *, struct file *);
+static int objdb_bl_select_dir(struct objdb_ctx *, const struct objid *, struct dir *);
+static int objdb_bl_select_commit(struct objdb_ctx *, const struct objid *, struct commit *);
+static int objdb_bl_resolve(struct objdb_ctx *, enum objtype, struct objid_match *);
+static int objdb_bl_prefetch_dirs(struct objdb_ctx *, const struct objid *, size_t);
+static int objdb_bl_select_commit_graph(struct objdb_ctx *, const struct objid *, struct graph_commit *);
+static int objdb_bl_commit_graph_write(struct objdb_ctx *);
+static int objdb_bl_begin_batch(struct objdb_ctx *);
+static int objdb_bl_commit_batch(struct objdb_ctx *);
+static int objdb_bl_abort_batch(struct objdb_ctx *);
 static int objdb_bl_remove(struct objdb_ctx *, const char *, const char *);
 static int objdb_bl_branch_create(struct objdb_ctx *, const char *);
 static int objdb_bl_branch_create_from(struct objdb_ctx *, const char *, const char *);
 static int objdb_bl_branch_if_exists(struct objdb_ctx *, const char *, int *);
-static int objdb_bl_branch_set_head(struct objdb_ctx *, const char *, const char *);
-static int objdb_bl_branch_get_head(struct objdb_ctx *, const char *, char **);
+static int objdb_bl_branch_set_head(struct objdb_ctx *, const char *, const struct objid *);
+static int objdb_bl_branch_get_head(struct objdb_ctx *, const char *, struct objid *);
 static int objdb_bl_branch_ls(struct objdb_ctx *);
+static int objdb_bl_compress(struct objdb_ctx *);
+static int objdb_bl_dedup(struct objdb_ctx *);
+static int objdb_bl_repack(struct objdb_ctx *, int);
+static int objdb_bl_gc(struct objdb_ctx *, int (*)(void *, struct objdb_root **, size_t *), void *, time_t);
+static int objdb_bl_fsck(struct objdb_ctx *, int);
 
 
 static const struct objdb_ops baseline_objdb_ops = {
@@ -56,11 +85,19 @@ static const struct objdb_ops baseline_objdb_ops = {
 	.open = objdb_bl_open,
 	.close = objdb_bl_close,
 	.insert_file = objdb_bl_insert_file,
+	.insert_files = objdb_bl_insert_files,
 	.insert_dir = objdb_bl_insert_dir,
 	.insert_commit = objdb_bl_insert_commit,
 	.select_file = objdb_bl_select_file,
 	.select_dir = objdb_bl_select_dir,
 	.select_commit = objdb_bl_select_commit,
+	.resolve = objdb_bl_resolve,
+	.prefetch_dirs = objdb_bl_prefetch_dirs,
+	.select_commit_graph = objdb_bl_select_commit_graph,
+	.commit_graph_write = objdb_bl_commit_graph_write,
+	.begin_batch = objdb_bl_begin_batch,
+	.commit_batch = objdb_bl_commit_batch,
+	.abort_batch = objdb_bl_abort_batch,
 	.remove = objdb_bl_remove,
 	.branch_create = objdb_bl_branch_create,
 	.branch_create_from = objdb_bl_branch_create_from,
@@ -68,18 +105,84 @@ static const struct objdb_ops baseline_objdb_ops = {
 	.branch_set_head = objdb_bl_branch_set_head,
 	.branch_get_head = objdb_bl_branch_get_head,
 	.branch_ls = objdb_bl_branch_ls,
-	.fsck = NULL,
-	.compress = NULL,
-	.dedup = NULL
+	.fsck = objdb_bl_fsck,
+	.compress = objdb_bl_compress,
+	.dedup = objdb_bl_dedup,
+	.repack = objdb_bl_repack,
+	.gc = objdb_bl_gc
 };
 
-#define N_MAINDIRS	5
+/* larger files are not read into memory by insert_file */
+#define INSERT_MEM_MAX	(8 * 1024 * 1024)
+/* files read at once by insert_files */
+#define INSERT_GROUP	(HASH_LANES * 8)
+
+/* the first three are indexed by enum objtype */
+#define N_MAINDIRS	6
+#define D_PACKS		5
 static const char *main_dirs[] = {
 	"files",
 	"dirs",
 	"commits",
 	"branches",
-	"tags"
+	"tags",
+	"packs"
+};
+
+/*
+ * objects inserted between begin_batch and commit_batch. the first ones
+ * are held in memory, as they are to be stored, and written loose when
+ * the batch is committed. past BATCH_LOOSE_MAX objects or INSERT_MEM_MAX
+ * bytes, they all go to a new pack instead. either way nothing is
+ * visible until the batch is committed.
+ */
+#define BATCH_LOOSE_MAX	64
+
+struct batch_obj {
+	enum objtype type;
+	struct objid id;
+	char *data;
+	size_t len;
+};
+
+struct batch_key {
+	struct objid id;
+	int type;		/* -1 if the slot is free */
+};
+
+struct batch {
+	int depth;
+	int failed;		/* then nothing is written */
+	struct batch_obj *objs;
+	size_t count;
+	size_t mem;
+	struct pack_writer *w;
+	struct batch_key *keys;	/* every object of the batch, by id */
+	size_t nkeys;
+	size_t size;
+	struct graph_commit *commits;	/* added to the graph once visible */
+	size_t ncommits;
+};
+
+struct objdb_bl_priv {
+	int packs_loaded;
+	struct pack *packs;
+	struct midx *midx;	/* NULL if missing or stale */
+	int bloom_loaded;
+	struct bloom *bloom;
+	int graph_loaded;
+	struct graph *graph;
+	struct batch *batch;	/* NULL outside of batches */
+	char **dirty;		/* written since the last group sync */
+	size_t ndirty;
+	size_t maxdirty;
+	int dirty_dirs;		/* bit i set for main_dirs[i] */
+	double sync_time;
+	unsigned int nsyncs;
+	int ioq_loaded;
+	struct ioq *ioq;
+	int locked;
+	int lock_fd;		/* the db dir, see db_lock() */
 };
 
 int
@@ -92,944 +195,3513 @@ objdb_baseline_get_ops(struct objdb_ops **ops)
 	return EXIT_SUCCESS;
 }
 
-/* FIXME */
-static char *
-get_objdb_dir(struct objdb_ctx *ctx)
+static void
+load_packs(struct objdb_ctx *ctx)
 {
-	char *db_dir_name = NULL;
-	int len;
-	if (ctx == NULL)
-		return NULL;
-	/* malloc() + strlcpy() + strlcat() = asprintf() */
-	len = asprintf(&db_dir_name, "%s/%s", ctx->db_path, ctx->db_name);
-	return db_dir_name;
+	char *db_dir_name, *packs_path = NULL, *prefix;
+	char *paths[2];
+	size_t len;
+	struct objdb_bl_priv *priv = ctx->db_priv;
+	struct pack *p;
+	FTS *dir;
+	FTSENT *entry;
+
+	if (priv->packs_loaded)
+		return;
+	priv->packs_loaded = 1;
+	if ((db_dir_name = objdb_dir(ctx)) == NULL)
+		return;
+	asprintf(&packs_path, "%s/packs", db_dir_name);
+	paths[0] = packs_path;
+	paths[1] = NULL;
+	if ((dir = fts_open(paths, FTS_NOCHDIR, 0)) == NULL)
+		goto ret;
+	while ((entry = fts_read(dir)) != NULL) {
+		if (entry->fts_level == FTS_ROOTLEVEL)
+			continue;
+		if (entry->fts_info & FTS_D) {
+			fts_set(dir, entry, FTS_SKIP);
+			continue;
+		}
+		len = entry->fts_namelen;
+		if (len < 4 || strcmp(entry->fts_name + len - 4, ".idx"))
+			continue;
+		asprintf(&prefix, "%.*s", (int)(entry->fts_pathlen - 4), entry->fts_path);
+		if (pack_open(prefix, &p) == EXIT_SUCCESS) {
+			p->next = priv->packs;
+			priv->packs = p;
+		}
+		free(prefix);
+	}
+	fts_close(dir);
+	if (midx_open(packs_path, priv->packs, &priv->midx) == EXIT_FAILURE)
+		priv->midx = NULL;
+ret:
+	free(packs_path);
+	free(db_dir_name);
 }
 
-static int
-read_line(int fd, char *buf, size_t len)
+static void
+unload_packs(struct objdb_ctx *ctx)
 {
-	char ch, *ptr = buf;
-	int nbytes = 0;
-
-	while (read(fd, &ch, 1) > 0) {
-		if (nbytes++ == len - 1) {
-			/* TODO: use err() instead */
-			fprintf(stderr, "line too big\n");
-			return -1;
-		}
-		*ptr++ = (ch == '\n') ? '\0' : ch;
-		if (ch == '\n')
-			break;
+	struct objdb_bl_priv *priv = ctx->db_priv;
+	struct pack *p, *next;
+
+	if (priv == NULL)
+		return;
+	midx_close(priv->midx);
+	priv->midx = NULL;
+	for (p = priv->packs ; p != NULL ; p = next) {
+		next = p->next;
+		pack_close(p);
 	}
-	return nbytes > 0 ? nbytes - 1 : 0;
+	priv->packs = NULL;
+	priv->packs_loaded = 0;
 }
 
+/*
+ * writers hold the db dir shared from their first batch on and gc holds
+ * it exclusive, so that gc never removes an object that a writer found
+ * already stored. the lock goes away with the db, or the process.
+ */
 static int
-is_hex(const char *str)
+db_lock(struct objdb_ctx *ctx, int op)
 {
-	if (str == NULL)
-		return 0;
-	do {
-		if (*str == '\0')
-			break;
-		if ((*str >= '0' && *str <= '9') || (*str >= 'a' && *str <= 'f'))
-			continue;
-		return 0;
-	} while (*str++);
-	return 1;
+	char *db_dir_name;
+	int fd;
+	struct objdb_bl_priv *priv = ctx->db_priv;
+
+	if (priv->locked)
+		return EXIT_SUCCESS;
+	if ((db_dir_name = objdb_dir(ctx)) == NULL)
+		return EXIT_FAILURE;
+	fd = open(db_dir_name, O_RDONLY | O_DIRECTORY);
+	free(db_dir_name);
+	if (fd == -1)
+		return EXIT_FAILURE;
+	if (flock(fd, op) == -1) {
+		close(fd);
+		return EXIT_FAILURE;
+	}
+	priv->lock_fd = fd;
+	priv->locked = 1;
+	return EXIT_SUCCESS;
 }
 
-static int
-is_dec(const char *str)
+/*
+ * the filter is optional, repositories created before it existed get
+ * one on the next repack.
+ */
+static void
+load_bloom(struct objdb_ctx *ctx)
 {
-	if (str == NULL)
-		return 0;
-	do {
-		if (*str == '\0')
-			break;
-		if (*str >= '0' && *str <= '9')
-			continue;
-		return 0;
-	} while (*str++);
-	return 1;
+	char *db_dir_name, *path = NULL;
+	struct objdb_bl_priv *priv = ctx->db_priv;
+
+	if (priv->bloom_loaded)
+		return;
+	priv->bloom_loaded = 1;
+	if ((db_dir_name = objdb_dir(ctx)) == NULL)
+		return;
+	asprintf(&path, "%s/bloom", db_dir_name);
+	if (bloom_open(path, &priv->bloom) == EXIT_FAILURE)
+		priv->bloom = NULL;
+	free(path);
+	free(db_dir_name);
 }
 
-static int
-is_oct(const char *str)
+static void
+unload_bloom(struct objdb_ctx *ctx)
 {
-	if (str == NULL)
-		return 0;
-	do {
-		if (*str == '\0')
-			break;
-		if (*str >= '0' && *str <= '7')
-			continue;
-		return 0;
-	} while (*str++);
-	return 1;
+	struct objdb_bl_priv *priv = ctx->db_priv;
+
+	if (priv == NULL)
+		return;
+	bloom_close(priv->bloom);
+	priv->bloom = NULL;
+	priv->bloom_loaded = 0;
 }
 
 /*
- * converts struct commit to char*
+ * a graph that cannot be read is ignored, log falls back to the commits
  */
-char*
-commit_serialize(struct commit *comm)
+static struct graph *
+get_graph(struct objdb_ctx *ctx)
 {
-	char *raw = NULL;
+	char *db_dir_name, *path = NULL;
+	struct objdb_bl_priv *priv = ctx->db_priv;
 
-	if (comm == NULL)
-		goto ret;
-	if (comm->n_parents == 0)
-		asprintf(&raw, "dir %s\nauthor %s <%s> %llu\ncommitter %s <%s> %llu\n%s\n",
-			comm->dir, comm->author.name, comm->author.email, comm->author.timestamp,
-			comm->committer.name, comm->committer.email, comm->committer.timestamp, comm->message);
-	else if (comm->n_parents == 1)
-		asprintf(&raw, "dir %s\nparent %s\nauthor %s <%s> %llu\ncommitter %s <%s> %llu\n%s\n",
-			comm->dir, comm->parents[0], comm->author.name, comm->author.email, comm->author.timestamp,
-			comm->committer.name, comm->committer.email, comm->committer.timestamp, comm->message);
-	/* TODO: support more than 1 parent */
-ret:
-	return raw;
+	if (priv->graph_loaded)
+		return priv->graph;
+	priv->graph_loaded = 1;
+	if ((db_dir_name = objdb_dir(ctx)) == NULL)
+		return NULL;
+	asprintf(&path, "%s/commit-graph", db_dir_name);
+	if (graph_open(path, &priv->graph) == EXIT_FAILURE)
+		priv->graph = NULL;
+	free(path);
+	free(db_dir_name);
+	return priv->graph;
 }
 
-static int
-commit_deserialize(int fd, struct commit *comm)
+static void
+unload_graph(struct objdb_ctx *ctx)
 {
-	char buf[128], *p1, *p2;
-	off_t end, pos;
-	size_t len;
-	ssize_t n;
+	struct objdb_bl_priv *priv = ctx->db_priv;
 
-	/* 1. */
-	/* find the commit's dir */
-	if (read_line(fd, buf, sizeof(buf)) == -1)
-		return EXIT_FAILURE;
-	/* "dir " + obj id */
-	if (strlen(buf) != 4 + SHA256_DIGEST_LENGTH * 2)
-		goto parse_error;
-	/* check if line starts with "dir " */
-	if (strstr(buf, "dir ") != buf)
-		goto parse_error;
-	/* skip "dir " */
-	p1 = buf + 4;
-	if (!is_hex(p1) || strlen(p1) != SHA256_DIGEST_LENGTH * 2)
-		goto parse_error;
-	comm->dir = strdup(p1);
-
-	/* 2. */
-	/* find the commit's parent */
-	/* TODO: support more than parent */
-	if (read_line(fd, buf, sizeof(buf)) == -1)
-		return EXIT_FAILURE;
-	/* check if line starts with "parent " */
-	if (strstr(buf, "parent ") == buf) {
-		p1 = buf + 7;
-		if (!is_hex(p1) || strlen(p1) != SHA256_DIGEST_LENGTH * 2)
-			goto parse_error;
-		comm->n_parents = 1;
-		comm->parents[0] = strdup(p1);
-
-		/* read the next line */
-		if (read_line(fd, buf, sizeof(buf)) == -1)
-			return EXIT_FAILURE;
-	}
-	else {
-		comm->n_parents = 0;
-	}
-
-	/* 3. */
-	/* find the commit's author */
-	/* check if line starts with "author " */
-	if (strstr(buf, "author ") != buf)
-		goto parse_error;
-	/* skip "author " */
-	p1 = buf + 7;
-	/* find author's name */
-	if ((p2 = strstr(p1, " <")) == NULL)
-		goto parse_error;
-	*p2 = '\0';
-	comm->author.name = strdup(p1);
-	/* find author's email */
-	p1 = ++p2;
-	if (*p1 != '<')
-		goto parse_error;
-	p1++;
-	if ((p2 = strchr(p1, '>')) == NULL)
-		goto parse_error;
-	*p2 = '\0';
-	comm->author.email = strdup(p1);
-	/* find author's timestamp */
-	p1 = ++p2;
-	if (!is_dec(++p1))
-		goto parse_error;
-	/* OpenBSD time_t is now 64-bit */
-	/* FIXME: other POSIX systems still use 32-bit time_t */
-	comm->author.timestamp = atoll(p1);
-
-	/* 4. */
-	/* find the commit's committer */
-	if (read_line(fd, buf, sizeof(buf)) == -1)
-		return EXIT_FAILURE;
-	/* check if line starts with "committer " */
-	if (strstr(buf, "committer ") != buf)
-		goto parse_error;
-	/* skip "committer " */
-	p1 = buf + 10;
-	/* find committer's name */
-	if ((p2 = strstr(p1, " <")) == NULL)
-		goto parse_error;
-	*p2 = '\0';
-	comm->committer.name = strdup(p1);
-	/* find committer's email */
-	p1 = ++p2;
-	if (*p1 != '<')
-		goto parse_error;
-	p1++;
-	if ((p2 = strchr(p1, '>')) == NULL)
-		goto parse_error;
-	*p2 = '\0';
-	comm->committer.email = strdup(p1);
-	/* find committer's timestamp */
-	p1 = ++p2;
-	if (!is_dec(++p1))
-		goto parse_error;
-	/* OpenBSD time_t is now 64-bit */
-	/* FIXME: other POSIX systems still use 32-bit time_t */
-	comm->committer.timestamp = atoll(p1);
-
-	/* 5. */
-	/* find the commit's message */
-	pos = lseek(fd, 0, SEEK_CUR);
-	end = lseek(fd, 0, SEEK_END);
-	/* even if off_t is 64-bits, we would never be able to support messages of size more than 32-bits */
-	len = (size_t)(end - pos);
-	lseek(fd, pos, SEEK_SET);
-	/* for now the max. size of a message is 10 MBytes */
-	if (len < 1048576) {
-		comm->message = (char *)malloc(len);
-		if ((n = read(fd, comm->message, len)) == -1) {
-			fprintf(stderr, "error reading file.\n");
-			return EXIT_FAILURE;
-		}
-		comm->message[n - 1] = '\0';
-	}
-	else {
-		goto bigmsg_error;
+	if (priv == NULL)
+		return;
+	graph_close(priv->graph);
+	priv->graph = NULL;
+	priv->graph_loaded = 0;
+}
+
+static void
+graph_commit_from(struct commit *comm, struct graph_commit *c)
+{
+	memset(c, 0, sizeof(*c));
+	c->id = comm->id;
+	c->dir = comm->dir;
+	if (comm->n_parents > 0) {
+		c->parent = comm->parents[0];
+		c->has_parent = 1;
 	}
+	c->time = comm->committer.timestamp;
+}
 
-	return EXIT_SUCCESS;
+static void
+graph_add_commit(struct objdb_ctx *ctx, struct commit *comm)
+{
+	struct graph_commit c, *tmp;
+	struct batch *b = ((struct objdb_bl_priv *)ctx->db_priv)->batch;
 
-parse_error:
-	fprintf(stderr, "error parsing file, not a valid commit.\n");
-	return EXIT_FAILURE;
-bigmsg_error:
-	fprintf(stderr, "error parsing file, commit message too big.\n");
-	return EXIT_FAILURE;
+	graph_commit_from(comm, &c);
+	if (b == NULL) {
+		graph_add(get_graph(ctx), &c);
+		return;
+	}
+	/* not before the commit is visible */
+	if ((tmp = reallocarray(b->commits, b->ncommits + 1, sizeof(struct graph_commit))) == NULL)
+		return;
+	b->commits = tmp;
+	b->commits[b->ncommits++] = c;
 }
 
-
 /*
- * converts struct dir to char*
+ * one lookup in the multi-pack index, then one in each of the packs it
+ * does not cover
  */
-char*
-dir_serialize(struct dir *dir)
+static const struct pack_idx_entry *
+find_packed(struct objdb_ctx *ctx, enum objtype type, const struct objid *id, struct pack **packp)
 {
-	char *entry = NULL, *raw = NULL, *ptr, ch = ' ';
-	size_t size = 1, newsize;
-	struct dirent *it;
-
-	if (dir == NULL)
-		goto ret;
-	raw = (char *)malloc(sizeof(char));
-	*raw = '\0';
-	if (dir->children == NULL)
-		goto ret;
-	for (it = dir->children ; it != NULL ; it = it->next) {
-		if (it->type == T_FILE)
-			ch = 'F';
-		else if (it->type == T_DIR)
-			ch = 'D';
-		/* assuming asprintf() uses realloc() */
-		/* free(entry); */
-		asprintf(&entry, "%06o %s %s\n", it->mode, it->id, it->name);
-		/* allocation failed, need to do something! */
-		if (entry == NULL)
-			return NULL;
-		newsize = size + strlen(entry);
-		if ((ptr = realloc(raw, newsize)) == NULL) {
-			/* allocation failed, need to do something! */
-			return NULL;
+	struct objdb_bl_priv *priv = ctx->db_priv;
+	struct pack *p;
+	const struct pack_idx_entry *e;
+
+	load_packs(ctx);
+	if ((e = midx_lookup(priv->midx, type, id, packp)) != NULL)
+		return e;
+	for (p = priv->packs ; p != NULL ; p = p->next) {
+		if (p->indexed)
+			continue;
+		if ((e = pack_lookup(p, type, id)) != NULL) {
+			*packp = p;
+			return e;
 		}
-		raw = ptr;
-		size = newsize;
-		strlcat(raw, entry, size);
 	}
-	free(entry);
-ret:
-	return raw;
+	return NULL;
+}
+
+/*
+ * the depth is read from the config, the queue may be a plain loop
+ */
+static struct ioq *
+get_ioq(struct objdb_ctx *ctx)
+{
+	struct objdb_bl_priv *priv = ctx->db_priv;
+
+	if (priv->ioq_loaded)
+		return priv->ioq;
+	priv->ioq_loaded = 1;
+	if (ioq_new(objdb_config_num("iodepth", IOQ_DEPTH, INT_MAX), &priv->ioq) == EXIT_FAILURE)
+		priv->ioq = NULL;
+#ifdef DEBUG
+	else
+		fprintf(stderr, "[DEBUG] I/O queue: %s.\n", ioq_impl(priv->ioq));
+#endif
+	return priv->ioq;
 }
 
+/*
+ * reads a whole loose object file as it is stored, NUL terminated
+ */
 static int
-dir_deserialize(int fd, struct dir *d)
+read_raw(const char *path, char **buf, size_t *len)
 {
-	char buf[512], *id, *name, *p1, *p2;
-	int n;
-	mode_t mode;
-	struct dirent *head = NULL, *tail = NULL, *q = NULL;
+	int fd;
+	size_t off = 0;
+	ssize_t n;
+	struct stat s;
 
-	while (1) {
-		if ((n = read_line(fd, buf, sizeof(buf))) == -1)
-			printf("EXIT\n");
-		if (n == 0)
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return EXIT_FAILURE;
+	if (fstat(fd, &s) == -1) {
+		close(fd);
+		return EXIT_FAILURE;
+	}
+	if ((*buf = malloc((size_t)s.st_size + 1)) == NULL) {
+		close(fd);
+		return EXIT_FAILURE;
+	}
+	while (off < (size_t)s.st_size) {
+		if ((n = read(fd, *buf + off, (size_t)s.st_size - off)) <= 0)
 			break;
-		/* mode + obj id + at least 1 char name */
-		if (n < 9 + SHA256_DIGEST_LENGTH * 2)
-			goto parse_error;
-
-		/* 1. mode */
-		p1 = buf;
-		if ((p2 = strchr(p1, ' ')) == NULL)
-			goto parse_error;
-		*p2 = '\0';
-		if (!is_oct(p1) || strlen(p1) != 6)
-			goto parse_error;
-		/* TODO: find a safer alternative */
-		sscanf(p1, "%6o", &mode);
-
-		/* 2. id */
-		p1 = ++p2;
-		if ((p2 = strchr(p1, ' ')) == NULL)
-			goto parse_error;
-		*p2 = '\0';
-		if (!is_hex(p1) || strlen(p1) != SHA256_DIGEST_LENGTH * 2)
-			goto parse_error;
-		id = p1;
-
-		/* 3. name */
-		p1 = ++p2;
-		if (strlen(p1) == 0)
-			goto parse_error;
-		name = p1;
-
-		q = (struct dirent *)malloc(sizeof(struct dirent));
-		q->mode = mode;
-		q->id = strdup(id);
-		q->name = strdup(name);
-		q->next = NULL;
-		if (head == NULL) {
-			head = q;
-			tail = q;
-		}
-		else {
-			tail->next = q;
-			tail = tail->next;
-		}
+		off += n;
 	}
-
-	d->children = head;
+	close(fd);
+	if (off != (size_t)s.st_size) {
+		free(*buf);
+		*buf = NULL;
+		return EXIT_FAILURE;
+	}
+	(*buf)[off] = '\0';
+	*len = off;
 	return EXIT_SUCCESS;
+}
 
-parse_error:
-	fprintf(stderr, "error parsing file, not a valid directory.\n");
-	return EXIT_FAILURE;
+/*
+ * reads a whole loose object into a NUL terminated buffer
+ */
+static int
+read_object(const char *path, char **buf, size_t *len)
+{
+	if (read_raw(path, buf, len) == EXIT_FAILURE)
+		return EXIT_FAILURE;
+	return compress_decode(*buf, *len, buf, len);
 }
 
-static char *
-file_gen_id(struct file *obj)
+/*
+ * size of a loose object once read by read_object()
+ */
+static int
+loose_object_size(const char *path, off_t st_size, size_t *size)
 {
-	char **objid = NULL, *ptr;
-	char buf[4096];
-	int i, n;
-        off_t offset;
-        u_int8_t digest[SHA256_DIGEST_LENGTH];
-        SHA2_CTX hash_ctx;
+	u_int8_t hdr[OBJ_HDR_LEN];
+	ssize_t n;
+	int fd, kind;
 
-	SHA256Init(&hash_ctx);
-	/* TODO: locking */
-	if (((struct file *)obj)->loc == LOC_FS) {
-		/* save file offset */
-		offset = lseek(obj->fd, 0, SEEK_CUR);
-		do {
-			n = read(obj->fd, buf, sizeof(buf));
-			if (n == -1)
-				return NULL;
-			SHA256Update(&hash_ctx, buf, n);
-			if (n <= sizeof(buf))
-				break;
-		} while (1);
-		/* restore file offset */
-		lseek(obj->fd, offset, SEEK_SET);
-	}
-	else {
-		SHA256Update(&hash_ctx, obj->buffer, strlen(obj->buffer));
-	}
-	objid = &(obj->id);
-	SHA256Final(digest, &hash_ctx);
-	*objid = (char *)malloc(SHA256_DIGEST_LENGTH * 2 + 1);
-	for (i=0, ptr=*objid ; i<SHA256_DIGEST_LENGTH ; i++, ptr+=2) {
-		snprintf(ptr, 3, "%02x", digest[i]);
-	}
-	return *objid;
+	*size = st_size;
+	if (st_size < OBJ_HDR_LEN)
+		return EXIT_SUCCESS;
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return EXIT_FAILURE;
+	n = read(fd, hdr, sizeof(hdr));
+	close(fd);
+	if (n == -1)
+		return EXIT_FAILURE;
+	if (compress_header(hdr, n, &kind, size) == EXIT_SUCCESS && kind != OBJ_DEFLATE)
+		*size = st_size;
+	return EXIT_SUCCESS;
 }
 
+/*
+ * path of a loose object
+ */
 static char *
-commit_gen_id_and_serialize(struct commit *obj, char **raw)
+object_path(struct objdb_ctx *ctx, enum objtype type, const struct objid *id)
 {
-	char **objid = NULL, *ptr, *serialized = NULL;
-	int i;
-	u_int8_t digest[SHA256_DIGEST_LENGTH];
-	SHA2_CTX hash_ctx;
+	char *db_dir_name, *path = NULL, hex[OBJID_HEXLEN + 1];
 
-	SHA256Init(&hash_ctx);
-	serialized = commit_serialize(obj);
-	SHA256Update(&hash_ctx, serialized, strlen(serialized));
-	objid = &(obj->id);
-	SHA256Final(digest, &hash_ctx);
-	*objid = (char *)malloc(SHA256_DIGEST_LENGTH * 2 + 1);
-	for (i=0, ptr=*objid ; i<SHA256_DIGEST_LENGTH ; i++, ptr+=2) {
-		snprintf(ptr, 3, "%02x", digest[i]);
-	}
-	*raw = serialized;
-	return *objid;
+	if ((db_dir_name = objdb_dir(ctx)) == NULL)
+		return NULL;
+	asprintf(&path, "%s/%s/%s", db_dir_name, main_dirs[type], objid_hex(id, hex));
+	free(db_dir_name);
+	return path;
 }
 
-static char *
-commit_gen_id(struct commit *obj)
+/*
+ * packs are searched before falling back to loose objects
+ */
+static int
+load_object(struct objdb_ctx *ctx, enum objtype type, const struct objid *id, char **buf, size_t *len)
 {
-	char *raw;
-	char *id = commit_gen_id_and_serialize(obj, &raw);
-	free(raw);
-	return id;
+	char *full_path;
+	int retval;
+	struct pack *p;
+	const struct pack_idx_entry *e;
+
+	if ((e = find_packed(ctx, type, id, &p)) != NULL)
+		return pack_get(p, e, buf, len);
+	if ((full_path = object_path(ctx, type, id)) == NULL)
+		return EXIT_FAILURE;
+	retval = read_object(full_path, buf, len);
+	free(full_path);
+	return retval;
 }
 
-static char *
-dir_gen_id_and_serialize(struct dir *obj, char **raw)
+static double
+now(void)
 {
-	char **objid = NULL, *ptr, *serialized = NULL;
-	int i;
-	u_int8_t digest[SHA256_DIGEST_LENGTH];
-	SHA2_CTX hash_ctx;
+	struct timespec ts;
 
-	SHA256Init(&hash_ctx);
-	serialized = dir_serialize(obj);
-	SHA256Update(&hash_ctx, serialized, strlen(serialized));
-	objid = &(obj->id);
-	SHA256Final(digest, &hash_ctx);
-	*objid = (char *)malloc(SHA256_DIGEST_LENGTH * 2 + 1);
-	for (i=0, ptr=*objid ; i<SHA256_DIGEST_LENGTH ; i++, ptr+=2) {
-		snprintf(ptr, 3, "%02x", digest[i]);
-	}
-	*raw = serialized;
-	return *objid;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
 }
 
-static char *
-dir_gen_id(struct dir *obj)
+static int
+sync_dir(struct objdb_ctx *ctx, const char *path)
 {
-	char *raw;
-	char *id = dir_gen_id_and_serialize(obj, &raw);
-	free(raw);
-	return id;
+	int retval;
+	double t = now();
+	struct objdb_bl_priv *priv = ctx->db_priv;
+
+	retval = objdb_sync_dir(path);
+	priv->sync_time += now() - t;
+	priv->nsyncs++;
+	return retval;
 }
 
+/*
+ * called on a complete object file before it gets its name, only the
+ * full policy syncs it right away
+ */
 static int
-objdb_bl_open(struct objdb_ctx **ctx, const char *db_name, const char *db_path)
+sync_object(struct objdb_ctx *ctx, int fd)
 {
-	if (ctx == NULL)
-		return EXIT_FAILURE;
-	*ctx = (struct objdb_ctx *)malloc(sizeof(struct objdb_ctx));
-	asprintf(&((*ctx)->db_name), "%s", db_name);
-	asprintf(&((*ctx)->db_path), "%s", db_path);
-	asprintf(&((*ctx)->db_version), "1.0");
-	return EXIT_SUCCESS;
+	int retval = EXIT_SUCCESS;
+	double t;
+	struct objdb_bl_priv *priv = ctx->db_priv;
+
+	if (objdb_fsync(ctx) != OBJDB_FSYNC_FULL)
+		return EXIT_SUCCESS;
+	t = now();
+	if (fdatasync(fd) == -1)
+		retval = EXIT_FAILURE;
+	priv->sync_time += now() - t;
+	priv->nsyncs++;
+	return retval;
 }
 
+/*
+ * called once an object file got its name in main_dirs[dir]. the full
+ * policy syncs the directory right away, the batch one leaves both to
+ * sync_dirty().
+ */
 static int
-objdb_bl_close(struct objdb_ctx *ctx)
+mark_dirty(struct objdb_ctx *ctx, int dir, const char *path)
 {
-	if (ctx == NULL)
-		return EXIT_FAILURE;
-	free(ctx->db_name);
-	free(ctx->db_path);
-	free(ctx->db_version);
-	free(ctx);
+	char *db_dir_name, *dir_path = NULL, **tmp;
+	int retval = EXIT_SUCCESS;
+	struct objdb_bl_priv *priv = ctx->db_priv;
+
+	switch (objdb_fsync(ctx)) {
+	case OBJDB_FSYNC_FULL:
+		if ((db_dir_name = objdb_dir(ctx)) == NULL)
+			return EXIT_FAILURE;
+		asprintf(&dir_path, "%s/%s", db_dir_name, main_dirs[dir]);
+		retval = sync_dir(ctx, dir_path);
+		free(dir_path);
+		free(db_dir_name);
+		return retval;
+	case OBJDB_FSYNC_BATCH:
+		if (priv->ndirty == priv->maxdirty) {
+			priv->maxdirty = priv->maxdirty ? priv->maxdirty * 2 : 256;
+			if ((tmp = reallocarray(priv->dirty, priv->maxdirty, sizeof(char *))) == NULL)
+				return EXIT_FAILURE;
+			priv->dirty = tmp;
+		}
+		if ((priv->dirty[priv->ndirty] = strdup(path)) == NULL)
+			return EXIT_FAILURE;
+		priv->ndirty++;
+		priv->dirty_dirs |= 1 << dir;
+		return EXIT_SUCCESS;
+	}
 	return EXIT_SUCCESS;
 }
 
+/*
+ * the group commit of the batch policy: every object written since the
+ * last call is synced at once, with one syncfs(2) where there is one,
+ * otherwise one fdatasync(2) per file and one fsync(2) per directory.
+ */
 static int
-objdb_bl_init(struct objdb_ctx *ctx)
+sync_dirty(struct objdb_ctx *ctx)
 {
-	char *db_dir_name = NULL, *maindir = NULL;
-	int i, retval = EXIT_FAILURE;
-	struct stat s;
-	/* check if path exists */
-	if (stat(ctx->db_path, &s) == -1)
-		goto ret;
-	db_dir_name = get_objdb_dir(ctx);
-	if (mkdir(db_dir_name, S_IRUSR | S_IWUSR | S_IXUSR) != 0)
-		goto ret;
-	/* try to create main sub-dirs as well */
-	for (i=0 ; i<N_MAINDIRS ; i++) {
-		asprintf(&maindir, "%s/%s", db_dir_name, main_dirs[i]);
-		if (mkdir(maindir, S_IRUSR | S_IWUSR | S_IXUSR) != 0) {
-			free(maindir);
-			goto ret;
+	char *db_dir_name, *dir_path = NULL;
+	int fd, i, retval = EXIT_SUCCESS;
+	size_t k;
+	double t;
+	struct objdb_bl_priv *priv = ctx->db_priv;
+
+	if (priv->ndirty == 0)
+		return EXIT_SUCCESS;
+	if ((db_dir_name = objdb_dir(ctx)) == NULL)
+		return EXIT_FAILURE;
+	t = now();
+#ifdef __linux__
+	if ((fd = open(db_dir_name, O_RDONLY | O_DIRECTORY)) != -1) {
+		if (syncfs(fd) == 0) {
+			close(fd);
+			priv->nsyncs++;
+			goto done;
 		}
-		free(maindir);
+		close(fd);
 	}
-	retval = EXIT_SUCCESS;
-ret:
-	if (db_dir_name != NULL)
-		free(db_dir_name);
+#endif
+	for (k = 0 ; k < priv->ndirty ; k++) {
+		if ((fd = open(priv->dirty[k], O_RDONLY)) == -1 || fdatasync(fd) == -1)
+			retval = EXIT_FAILURE;
+		if (fd != -1)
+			close(fd);
+		priv->nsyncs++;
+	}
+	for (i = 0 ; i < N_MAINDIRS ; i++) {
+		if (!(priv->dirty_dirs & (1 << i)))
+			continue;
+		asprintf(&dir_path, "%s/%s", db_dir_name, main_dirs[i]);
+		if (objdb_sync_dir(dir_path) == EXIT_FAILURE)
+			retval = EXIT_FAILURE;
+		free(dir_path);
+		priv->nsyncs++;
+	}
+done:
+	priv->sync_time += now() - t;
+	for (k = 0 ; k < priv->ndirty ; k++)
+		free(priv->dirty[k]);
+	priv->ndirty = 0;
+	priv->dirty_dirs = 0;
+	free(db_dir_name);
 	return retval;
 }
 
+/*
+ * opens an unnamed temporary file in dir where the system supports it,
+ * so that a failed insert leaves nothing behind. *tmp_name is NULL in
+ * that case.
+ */
 static int
-objdb_bl_insert_file(struct objdb_ctx *ctx, struct file *file)
+tmp_open(const char *dir, char **tmp_name)
 {
-	char *db_dir_name, *full_path, *obj_file_name, *obj_hash, *tmp_file_name;
-	char *buf[4096];
-	int n, retval, tmpfd;
-	off_t offset;
+	int fd;
 
-	db_dir_name = get_objdb_dir(ctx);
-	if (db_dir_name == NULL) {
-		retval = EXIT_FAILURE;
-		goto ret;
-	}
-	asprintf(&full_path, "%s/%s", db_dir_name, "files");
-	obj_hash = file_gen_id(file);
-	/* create a temp file */
-	asprintf(&tmp_file_name, "%s/tmp.XXXXXX", full_path);
-        if ((tmpfd = mkstemp(tmp_file_name)) == -1) {
-		retval =  EXIT_FAILURE;
-		goto ret;
-	}
-	if (file->loc == LOC_FS) {
-		/* save file offset */
-		offset = lseek(file->fd, 0, SEEK_CUR);
-		/* copy file content */
-		while((n = read(file->fd, buf, sizeof(buf))) > 0)
-			write(tmpfd, buf, n);
-		/* restore file offset */
-		lseek(file->fd, offset, SEEK_SET);
-	}
-	else if (file->loc == LOC_MEM) {
-		write(tmpfd, file->buffer, strlen(file->buffer));
-	}
-	close(tmpfd);
-	asprintf(&obj_file_name, "%s/%s", full_path, obj_hash);
-	/* check if file is already there */
-	if (access(obj_file_name, F_OK) != -1) {
-		unlink(tmp_file_name);
-		goto success;
-	}
-	if (rename(tmp_file_name, obj_file_name)) {
-		retval = EXIT_FAILURE;
-		goto ret;
+	*tmp_name = NULL;
+#ifdef O_TMPFILE
+	if ((fd = open(dir, O_TMPFILE | O_RDWR, S_IRUSR | S_IWUSR)) != -1)
+		return fd;
+#endif
+	asprintf(tmp_name, "%s/tmp.XXXXXX", dir);
+	if ((fd = mkstemp(*tmp_name)) == -1) {
+		free(*tmp_name);
+		*tmp_name = NULL;
 	}
+	return fd;
+}
 
-success:
-	retval = EXIT_SUCCESS;
-ret:
-	/* assuming free(NULL) is safe */
-	free(db_dir_name);
-	free(full_path);
-	free(obj_file_name);
-	free(tmp_file_name);
-	return retval;
+static void
+tmp_discard(int fd, char *tmp_name)
+{
+	close(fd);
+	if (tmp_name != NULL) {
+		unlink(tmp_name);
+		free(tmp_name);
+	}
 }
 
+/*
+ * gives the temporary file its final name in main_dirs[dir] and closes
+ * it, an object that showed up in the meantime has the same content.
+ */
 static int
-objdb_bl_insert_dir(struct objdb_ctx *ctx, struct dir *dir)
+tmp_link(struct objdb_ctx *ctx, int dir, int fd, char *tmp_name, const char *path)
 {
-	char *db_dir_name, *full_path, *obj_file_name, *obj_hash, *tmp_file_name;
-	char *data;
-	int retval, tmpfd;
-	FILE *tmpfp;
+	int retval = EXIT_SUCCESS;
+#ifdef O_TMPFILE
+	char proc_path[64];
+#endif
 
-	db_dir_name = get_objdb_dir(ctx);
-	if (db_dir_name == NULL) {
-		retval = EXIT_FAILURE;
-		goto ret;
+	if (sync_object(ctx, fd) == EXIT_FAILURE) {
+		tmp_discard(fd, tmp_name);
+		return EXIT_FAILURE;
 	}
-	asprintf(&full_path, "%s/%s", db_dir_name, "dirs");
-	obj_hash = dir_gen_id_and_serialize(dir, &data);
-
-	/* create a temp file */
-	asprintf(&tmp_file_name, "%s/tmp.XXXXXX", full_path);
-        if ((tmpfd = mkstemp(tmp_file_name)) == -1) {
-                retval =  EXIT_FAILURE;
-		goto ret;
-        }
-	if ((tmpfp = fdopen(tmpfd, "w")) == NULL) {
-                unlink(tmp_file_name);
-                close(tmpfd);
-                retval = EXIT_FAILURE;
-		goto ret;
-        }
-	fwrite(data, sizeof(u_int8_t), strlen(data), tmpfp);
-	fclose(tmpfp);
-	asprintf(&obj_file_name, "%s/%s", full_path, obj_hash);
-	/* check if file is already there */
-	if (access(obj_file_name, F_OK) != -1) {
-		unlink(tmp_file_name);
-		goto success;
-	}
-	if (rename(tmp_file_name, obj_file_name)) {
+#ifdef O_TMPFILE
+	if (tmp_name == NULL) {
+		snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", fd);
+		if (linkat(AT_FDCWD, proc_path, AT_FDCWD, path, AT_SYMLINK_FOLLOW) == -1 &&
+		    errno != EEXIST)
+			retval = EXIT_FAILURE;
+		close(fd);
+		return retval == EXIT_SUCCESS ? mark_dirty(ctx, dir, path) : retval;
+	}
+#endif
+	close(fd);
+	if (rename(tmp_name, path) == -1) {
+		unlink(tmp_name);
 		retval = EXIT_FAILURE;
-		goto ret;
 	}
-
-success:
-	retval = EXIT_SUCCESS;
-ret:
-	/* assuming free(NULL) is safe */
-	free(db_dir_name);
-	free(full_path);
-	free(obj_file_name);
-	free(tmp_file_name);
-	return retval;
+	free(tmp_name);
+	return retval == EXIT_SUCCESS ? mark_dirty(ctx, dir, path) : retval;
 }
 
+/*
+ * whether the object is already in the database, loose or packed. the
+ * filter answers most misses without touching the file system, it may
+ * miss objects inserted while it was rebuilt which then get written
+ * again, so this is only good enough to skip writes.
+ */
 static int
-objdb_bl_insert_commit(struct objdb_ctx *ctx, struct commit *comm)
+object_exists(struct objdb_ctx *ctx, enum objtype type, const struct objid *id)
 {
-	char *db_dir_name, *full_path, *obj_file_name, *obj_hash, *tmp_file_name;
-	char *data;
-	int retval, tmpfd;
-	FILE *tmpfp;
-
-	db_dir_name = get_objdb_dir(ctx);
-	if (db_dir_name == NULL) {
-		retval = EXIT_FAILURE;
-		goto ret;
-	}
-	asprintf(&full_path, "%s/%s", db_dir_name, "commits");
-	obj_hash = commit_gen_id_and_serialize(comm, &data);
-
-	/* create a temp file */
-	asprintf(&tmp_file_name, "%s/tmp.XXXXXX", full_path);
-        if ((tmpfd = mkstemp(tmp_file_name)) == -1) {
-                retval =  EXIT_FAILURE;
-		goto ret;
-        }
-	if ((tmpfp = fdopen(tmpfd, "w")) == NULL) {
-                unlink(tmp_file_name);
-                close(tmpfd);
-                retval = EXIT_FAILURE;
-		goto ret;
-        }
-	fwrite(data, sizeof(u_int8_t), strlen(data), tmpfp);
-	fclose(tmpfp);
-	asprintf(&obj_file_name, "%s/%s", full_path, obj_hash);
-	/* check if file is already there */
-	if (access(obj_file_name, F_OK) != -1) {
-		unlink(tmp_file_name);
-		goto success;
-	}
-	if (rename(tmp_file_name, obj_file_name)) {
-		retval = EXIT_FAILURE;
-		goto ret;
-	}
+	char *path;
+	int found;
+	struct objdb_bl_priv *priv = ctx->db_priv;
+	struct pack *p;
 
-success:
-	retval = EXIT_SUCCESS;
-ret:
-	/* assuming free(NULL) is safe */
-	free(db_dir_name);
-	free(full_path);
-	free(obj_file_name);
-	free(tmp_file_name);
-	return retval;
+	load_bloom(ctx);
+	if (priv->bloom != NULL && !bloom_maybe(priv->bloom, id))
+		return 0;
+	if (find_packed(ctx, type, id, &p) != NULL)
+		return 1;
+	if ((path = object_path(ctx, type, id)) == NULL)
+		return 0;
+	found = (access(path, F_OK) != -1);
+	free(path);
+	return found;
 }
 
 static int
-objdb_bl_remove(struct objdb_ctx *ctx, const char *group_name, const char *obj_name)
+batch_key_insert(struct batch_key *keys, size_t size, enum objtype type, const struct objid *id)
 {
-	return EXIT_SUCCESS;
+	size_t i;
+
+	/* ids are uniformly distributed, any of their bytes is a hash */
+	memcpy(&i, id->bytes, sizeof(i));
+	for (i &= size - 1 ; keys[i].type != -1 ; i = (i + 1) & (size - 1))
+		if (keys[i].type == (int)type && objid_cmp(&keys[i].id, id) == 0)
+			return 1;
+	keys[i].id = *id;
+	keys[i].type = type;
+	return 0;
 }
 
+/*
+ * returns 1 if the object is already in the batch, adds it otherwise
+ */
 static int
-objdb_bl_branch_create(struct objdb_ctx *ctx, const char *branch_name)
+batch_seen(struct batch *b, enum objtype type, const struct objid *id)
 {
-	char *db_dir_name = NULL;
-	char *branch_path = NULL;
-	char *branch_head = NULL;
-	int retval = EXIT_SUCCESS;
-	FILE *fp;
+	size_t i, size;
+	struct batch_key *keys;
 
-	if (branch_name == NULL)
-		return EXIT_FAILURE;
-	/* FIXME: validate branch name & check if already exists */
-	db_dir_name = get_objdb_dir(ctx);
-	asprintf(&branch_path, "%s/branches/%s", db_dir_name, branch_name);
-#ifdef DEBUG
-	printf("creating branch %s\n", branch_path);
-#endif
-	if (mkdir(branch_path, S_IRUSR | S_IWUSR | S_IXUSR) == -1) {
-		retval = EXIT_FAILURE;
-		goto ret;
-	}
-	/* create head */
-	asprintf(&branch_head, "%s/head", branch_path);
-	if ((fp = fopen(branch_head, "w")) == NULL) {
-		retval = EXIT_FAILURE;
-		goto ret;
+	if (b->nkeys * 2 >= b->size) {
+		size = b->size ? b->size * 2 : 1024;
+		if ((keys = reallocarray(NULL, size, sizeof(struct batch_key))) == NULL)
+			return -1;
+		for (i = 0 ; i < size ; i++)
+			keys[i].type = -1;
+		for (i = 0 ; i < b->size ; i++)
+			if (b->keys[i].type != -1)
+				batch_key_insert(keys, size, b->keys[i].type, &b->keys[i].id);
+		free(b->keys);
+		b->keys = keys;
+		b->size = size;
 	}
-	fclose(fp);
-ret:	
-	free(db_dir_name);
-	free(branch_path);
-	free(branch_head);
-	return retval;
+	if (batch_key_insert(b->keys, b->size, type, id))
+		return 1;
+	b->nkeys++;
+	return 0;
+}
+
+static void
+batch_free(struct batch *b)
+{
+	size_t i;
+
+	if (b == NULL)
+		return;
+	for (i = 0 ; i < b->count ; i++)
+		free(b->objs[i].data);
+	free(b->objs);
+	pack_writer_abort(b->w);
+	free(b->keys);
+	free(b->commits);
+	free(b);
 }
 
+/*
+ * moves the objects held in memory to a new pack
+ */
 static int
-objdb_bl_branch_create_from(struct objdb_ctx *ctx, const char *new_branch, const char *orig_branch)
+batch_spill(struct objdb_ctx *ctx, struct batch *b)
 {
-	char *orig_head = NULL;
+	char *db_dir_name, *packs_path = NULL;
 	int retval = EXIT_FAILURE;
+	size_t i;
 
-	if (new_branch == NULL || orig_branch == NULL)
+	if (b->w != NULL)
+		return EXIT_SUCCESS;
+	if ((db_dir_name = objdb_dir(ctx)) == NULL)
 		return EXIT_FAILURE;
-	/* get the original branch's name */
-	if (objdb_bl_branch_get_head(ctx, orig_branch, &orig_head) == EXIT_FAILURE)
+	asprintf(&packs_path, "%s/packs", db_dir_name);
+	/* repositories created before packs existed */
+	if (mkdir(packs_path, S_IRUSR | S_IWUSR | S_IXUSR) == -1 && errno != EEXIST)
 		goto ret;
-	/* create the new branch */
-	if (objdb_bl_branch_create(ctx, new_branch) == EXIT_FAILURE)
-		goto ret;
-	/* set the new branch's head */
-	if (objdb_bl_branch_set_head(ctx, new_branch, orig_head) == EXIT_FAILURE)
+	if (pack_writer_begin(packs_path, objdb_fsync(ctx) == OBJDB_FSYNC_FULL, &b->w) == EXIT_FAILURE) {
+		b->w = NULL;
 		goto ret;
+	}
+	for (i = 0 ; i < b->count ; i++) {
+		if (pack_writer_add(b->w, b->objs[i].type, &b->objs[i].id, b->objs[i].data,
+		    b->objs[i].len) == EXIT_FAILURE)
+			goto ret;
+		free(b->objs[i].data);
+		b->objs[i].data = NULL;
+	}
+	free(b->objs);
+	b->objs = NULL;
+	b->count = 0;
+	b->mem = 0;
 	retval = EXIT_SUCCESS;
 ret:
-	free(orig_head);
+	free(packs_path);
+	free(db_dir_name);
 	return retval;
 }
 
+/*
+ * adds an object to the batch, file objects are compressed as configured
+ * whether they end up loose or in a pack
+ */
 static int
-objdb_bl_branch_if_exists(struct objdb_ctx *ctx, const char *branch_name, int *exist)
+batch_store(struct objdb_ctx *ctx, struct batch *b, enum objtype type, const struct objid *id,
+    const char *data, size_t len)
 {
-	char *db_dir_name = NULL;
-	char *branch_path = NULL;
-	int retval;
-	struct stat s;
+	char *out = NULL;
+	int retval = EXIT_FAILURE;
+	struct batch_obj *o;
 
-	if (branch_name == NULL)
+	switch (batch_seen(b, type, id)) {
+	case 1:
+		return EXIT_SUCCESS;
+	case -1:
+		b->failed = 1;
 		return EXIT_FAILURE;
-	*exist = 0;
-	db_dir_name = get_objdb_dir(ctx);
-	asprintf(&branch_path, "%s/branches/%s", db_dir_name, branch_name);
-	/* TODO: check if path is writable */
-	if (stat(branch_path, &s) == 0) {
-		if (S_ISDIR(s.st_mode)) {
-			*exist = 1;
-			retval = EXIT_SUCCESS;
-		}
-		else {
-			*exist = 0;
-			retval = EXIT_FAILURE;
-		}
 	}
-	else {
-		*exist = 0;
-		retval = EXIT_SUCCESS;
+	if (type == O_FILE) {
+		if (compress_buffer(data, len, objdb_config_num("compresslevel", COMPRESS_LEVEL, 9), &out,
+		    &len) == EXIT_FAILURE)
+			return EXIT_FAILURE;
+		if (out != NULL)
+			data = out;
 	}
-	free(db_dir_name);
-	free(branch_path);
-	return retval;
-}
-
-static int
-objdb_bl_branch_set_head(struct objdb_ctx *ctx, const char *branch_name, const char *head_objid)
-{
-	char *db_dir_name = NULL;
-	char *branch_head = NULL;
-	int retval = EXIT_SUCCESS;
-	FILE *head_fp;
-	db_dir_name = get_objdb_dir(ctx);
-	asprintf(&branch_head, "%s/branches/%s/head", db_dir_name, branch_name);
-	if ((head_fp = fopen(branch_head, "w")) == NULL) {
-		retval = EXIT_FAILURE;
+	if (b->w == NULL && b->count < BATCH_LOOSE_MAX && b->mem + len <= INSERT_MEM_MAX) {
+		if ((o = reallocarray(b->objs, b->count + 1, sizeof(struct batch_obj))) == NULL)
+			goto ret;
+		b->objs = o;
+		o = &b->objs[b->count];
+		o->type = type;
+		o->id = *id;
+		o->len = len;
+		if (out != NULL) {
+			o->data = out;
+			out = NULL;
+		} else if ((o->data = malloc(len ? len : 1)) == NULL)
+			goto ret;
+		else
+			memcpy(o->data, data, len);
+		b->count++;
+		b->mem += len;
+		retval = EXIT_SUCCESS;
 		goto ret;
 	}
-	fprintf(head_fp, "%s", head_objid);
-	fclose(head_fp);
+	if (batch_spill(ctx, b) == EXIT_SUCCESS)
+		retval = pack_writer_add(b->w, type, id, data, len);
 ret:
-	free(db_dir_name);
-	free(branch_head);
+	if (retval == EXIT_FAILURE)
+		b->failed = 1;
+	free(out);
 	return retval;
 }
 
+/*
+ * writes the loose objects of a batch, all are written before any is
+ * given a name.
+ */
 static int
-objdb_bl_branch_get_head(struct objdb_ctx *ctx, const char *branch_name, char **head_objid)
+batch_write_loose(struct objdb_ctx *ctx, struct batch *b)
 {
-	char *db_dir_name = NULL;
-	char *branch_head = NULL;
-	int retval = EXIT_SUCCESS;
-	size_t size = 0;
-	FILE *head_fp;
-
-	if (ctx == NULL || branch_name == NULL || head_objid == NULL)
+	char *db_dir_name, *dir_path = NULL, *path = NULL, **tmp_names = NULL;
+	char hex[OBJID_HEXLEN + 1];
+	int *fds = NULL, retval = EXIT_FAILURE;
+	size_t i, n = 0;
+	struct batch_obj *o;
+	struct ioq *q;
+	struct ioq_req *reqs = NULL;
+
+	if (b->count == 0)
+		return EXIT_SUCCESS;
+	if ((db_dir_name = objdb_dir(ctx)) == NULL)
 		return EXIT_FAILURE;
-	db_dir_name = get_objdb_dir(ctx);
-	asprintf(&branch_head, "%s/branches/%s/head", db_dir_name, branch_name);
-	if ((head_fp = fopen(branch_head, "r")) == NULL) {
-		retval = EXIT_FAILURE;
+	if ((q = get_ioq(ctx)) == NULL ||
+	    (fds = reallocarray(NULL, b->count, sizeof(int))) == NULL ||
+	    (tmp_names = reallocarray(NULL, b->count, sizeof(char *))) == NULL ||
+	    (reqs = calloc(b->count, sizeof(struct ioq_req))) == NULL)
 		goto ret;
+	for (n = 0 ; n < b->count ; n++) {
+		o = &b->objs[n];
+		free(dir_path);
+		asprintf(&dir_path, "%s/%s", db_dir_name, main_dirs[o->type]);
+		if ((fds[n] = tmp_open(dir_path, &tmp_names[n])) == -1)
+			goto ret;
+		reqs[n].op = IOQ_WRITE;
+		reqs[n].fd = fds[n];
+		reqs[n].buf = o->data;
+		reqs[n].len = o->len;
 	}
-	*head_objid = NULL;
-	if (getline(head_objid, &size, head_fp) == -1) {
-		/* assuming the head file is empty */
-		/* FIXME: check for errors */
-		*head_objid = NULL;
+	/* the writes are all in flight at once */
+	if (ioq_run(q, reqs, n) == EXIT_FAILURE)
+		goto ret;
+	for (i = 0 ; i < n ; i++)
+		if (reqs[i].error)
+			goto ret;
+	retval = EXIT_SUCCESS;
+	for (i = 0 ; i < n ; i++) {
+		o = &b->objs[i];
+		asprintf(&path, "%s/%s/%s", db_dir_name, main_dirs[o->type], objid_hex(&o->id, hex));
+		if (tmp_link(ctx, o->type, fds[i], tmp_names[i], path) == EXIT_FAILURE)
+			retval = EXIT_FAILURE;
+		free(path);
 	}
-	fclose(head_fp);
+	n = 0;
 ret:
+	for (i = 0 ; i < n ; i++)
+		tmp_discard(fds[i], tmp_names[i]);
+	free(reqs);
+	free(fds);
+	free(tmp_names);
+	free(dir_path);
 	free(db_dir_name);
-	free(branch_head);
 	return retval;
 }
 
 static int
-objdb_bl_branch_ls(struct objdb_ctx *ctx)
+batch_obj_cmp(const void *a, const void *b)
 {
-	char *branches_path, *db_dir_name;
-	char *paths[2];
-	FTS *dir;
-	FTSENT *entry;
-
-	db_dir_name = get_objdb_dir(ctx);
-	asprintf(&branches_path, "%s/branches", db_dir_name);
+	const struct batch_obj *o1 = a, *o2 = b;
 
-	paths[0] = (char *)branches_path;
-	paths[1] = NULL;
-	if ((dir = fts_open(paths, FTS_NOCHDIR, 0)) == NULL)
-		return EXIT_FAILURE;
-	while ((entry = fts_read(dir)) != NULL) {
-		if (entry->fts_level == FTS_ROOTLEVEL)
-			continue;
-		if (entry->fts_info & FTS_D) {
-			printf("* %s\n", entry->fts_name);
-		}
-		else {
-			if (entry->fts_level >= 1)
-				fts_set(dir, entry, FTS_SKIP);
-		}
-	}
-	fts_close(dir);
-	free(db_dir_name);
-	free(branches_path);
-	return EXIT_SUCCESS;
+	if (o1->type != o2->type)
+		return (int)o1->type - (int)o2->type;
+	return objid_cmp(&o1->id, &o2->id);
 }
 
+/*
+ * gives a complete temporary file its object name, or hands it to the
+ * current batch
+ */
 static int
-objdb_bl_select_commit(struct objdb_ctx *ctx, const char *objid, struct commit *comm)
+link_object(struct objdb_ctx *ctx, enum objtype type, const struct objid *id, int fd, char *tmp_name,
+    const char *path)
 {
-	char *db_dir_name, *full_path;
-	int fd, retval;
+	int retval = EXIT_FAILURE;
+	struct objdb_bl_priv *priv = ctx->db_priv;
+	struct batch *b = priv->batch;
 
-	db_dir_name = get_objdb_dir(ctx);
-	if (db_dir_name == NULL) {
-		retval = EXIT_FAILURE;
-		goto ret;
+	if (b == NULL) {
+		if ((retval = tmp_link(ctx, type, fd, tmp_name, path)) == EXIT_SUCCESS)
+			bloom_add(priv->bloom, id);
+		return retval;
 	}
-	asprintf(&full_path, "%s/%s/%s", db_dir_name, "commits", objid);
-	/* check if file is already there */
-	if (access(full_path, F_OK) == -1) {
-		retval = EXIT_FAILURE;
-		goto ret;
+	switch (batch_seen(b, type, id)) {
+	case 1:
+		retval = EXIT_SUCCESS;
+		break;
+	case 0:
+		if (batch_spill(ctx, b) == EXIT_SUCCESS)
+			retval = pack_writer_add_fd(b->w, type, id, fd);
+		break;
 	}
+	tmp_discard(fd, tmp_name);
+	if (retval == EXIT_FAILURE)
+		b->failed = 1;
+	return retval;
+}
 
-	if ((fd = open(full_path, O_RDONLY)) == -1) {
-		retval = EXIT_FAILURE;
+/*
+ * writes an object held in memory, unless it is already there. file
+ * objects are compressed as configured.
+ */
+static int
+store_object(struct objdb_ctx *ctx, enum objtype type, const struct objid *id, const char *data,
+    size_t len)
+{
+	char *db_dir_name, *dir_path = NULL, *path = NULL, *tmp_name, hex[OBJID_HEXLEN + 1];
+	int fd, retval = EXIT_FAILURE;
+	size_t stored, off;
+	ssize_t n;
+	struct file *f;
+	struct objdb_bl_priv *priv = ctx->db_priv;
+
+	if (object_exists(ctx, type, id))
+		return EXIT_SUCCESS;
+	if (priv->batch != NULL)
+		return batch_store(ctx, priv->batch, type, id, data, len);
+	if ((db_dir_name = objdb_dir(ctx)) == NULL)
+		return EXIT_FAILURE;
+	asprintf(&dir_path, "%s/%s", db_dir_name, main_dirs[type]);
+	asprintf(&path, "%s/%s", dir_path, objid_hex(id, hex));
+	if ((fd = tmp_open(dir_path, &tmp_name)) == -1)
 		goto ret;
+	if (type == O_FILE) {
+		f = baseline_file_new();
+		f->loc = LOC_MEM;
+		f->buffer = (char *)data;
+		f->size = len;
+		retval = compress_write(f, fd, objdb_config_num("compresslevel", COMPRESS_LEVEL, 9), &stored);
+		/* the buffer belongs to the caller */
+		f->buffer = NULL;
+		baseline_file_free(f);
+	} else {
+		for (off = 0 ; off < len ; off += n)
+			if ((n = write(fd, data + off, len - off)) == -1)
+				break;
+		retval = (off == len) ? EXIT_SUCCESS : EXIT_FAILURE;
 	}
-
-	comm->id = strdup(objid);
-	commit_deserialize(fd, comm);
-
-	close(fd);
-
-success:
-	retval = EXIT_SUCCESS;
+	if (retval == EXIT_FAILURE)
+		tmp_discard(fd, tmp_name);
+	else if ((retval = tmp_link(ctx, type, fd, tmp_name, path)) == EXIT_SUCCESS)
+		bloom_add(priv->bloom, id);
 ret:
+	free(path);
+	free(dir_path);
 	free(db_dir_name);
-	free(full_path);
 	return retval;
 }
 
+/*
+ * reassembles a chunked file while it is read
+ */
+struct chunk_stream {
+	struct objdb_ctx *ctx;
+	char *manifest;
+	char *pos;
+	char *end;
+	struct file *cur;
+};
+
+/*
+ * selects the next chunk of the manifest, returns 0 past the last one
+ */
 static int
-objdb_bl_select_dir(struct objdb_ctx *ctx, const char *objid, struct dir *d)
+chunk_open_next(struct chunk_stream *s)
 {
-	char *db_dir_name, *full_path;
-	int fd, retval;
+	char *line, *sp;
+	size_t linelen;
+	struct objid id;
 
-	db_dir_name = get_objdb_dir(ctx);
-	if (db_dir_name == NULL) {
-		retval = EXIT_FAILURE;
-		goto ret;
-	}
-	asprintf(&full_path, "%s/%s/%s", db_dir_name, "dirs", objid);
-	/* check if file is already there */
-	if (access(full_path, F_OK) == -1) {
-		retval = EXIT_FAILURE;
-		goto ret;
+	if ((line = next_line(&s->pos, s->end, &linelen)) == NULL || linelen == 0)
+		return 0;
+	if ((sp = strchr(line, ' ')) == NULL)
+		return -1;
+	*sp = '\0';
+	if (objid_parse(line, &id) == EXIT_FAILURE)
+		return -1;
+	s->cur = baseline_file_new();
+	if (objdb_bl_select_file(s->ctx, &id, s->cur) == EXIT_FAILURE) {
+		baseline_file_free(s->cur);
+		s->cur = NULL;
+		return -1;
 	}
+	return 1;
+}
 
-	if ((fd = open(full_path, O_RDONLY)) == -1) {
-		retval = EXIT_FAILURE;
-		goto ret;
-	}
+static void
+chunk_done(struct chunk_stream *s)
+{
+	baseline_file_close(s->cur);
+	baseline_file_free(s->cur);
+	s->cur = NULL;
+}
 
-	d->id = strdup(objid);
-	dir_deserialize(fd, d);
+static ssize_t
+chunk_read(void *stream, void *buf, size_t len)
+{
+	struct chunk_stream *s = stream;
+	ssize_t n;
+	int r;
 
-	close(fd);
+	do {
+		if (s->cur == NULL && (r = chunk_open_next(s)) != 1)
+			return r;
+		if ((n = baseline_file_read(s->cur, buf, len)) != 0)
+			return n;
+		chunk_done(s);
+	} while (1);
+}
 
-success:
-	retval = EXIT_SUCCESS;
-ret:
-	free(db_dir_name);
-	free(full_path);
-	return retval;
+/*
+ * sends the chunks one after the other, each the cheapest way it can go
+ */
+static off_t
+chunk_send(void *stream, int out)
+{
+	struct chunk_stream *s = stream;
+	off_t n, total = 0;
+	int r;
+
+	do {
+		if (s->cur == NULL && (r = chunk_open_next(s)) != 1)
+			return r == 0 ? total : -1;
+		if ((n = baseline_file_send(s->cur, out)) == -1)
+			return -1;
+		total += n;
+		chunk_done(s);
+	} while (1);
 }
 
-static int
-objdb_bl_select_file(struct objdb_ctx *ctx, const char *objid, struct file *f)
+static void
+chunk_close(void *stream)
 {
-	char *db_dir_name, *full_path;
-	int fd, retval;
+	struct chunk_stream *s = stream;
 
-	db_dir_name = get_objdb_dir(ctx);
-	if (db_dir_name == NULL) {
-		retval = EXIT_FAILURE;
-		goto ret;
+	if (s->cur != NULL)
+		chunk_done(s);
+	free(s->manifest);
+	free(s);
+}
+
+/*
+ * hands out a whole object held in memory, buf is owned by f afterwards
+ */
+static int
+select_buffer(struct objdb_ctx *ctx, struct file *f, char *buf, size_t len)
+{
+	size_t size;
+	int kind;
+	struct chunk_stream *s;
+
+	if (compress_header(buf, len, &kind, &size) == EXIT_FAILURE || kind == OBJ_DEFLATE) {
+		f->loc = LOC_MEM;
+		f->buffer = buf;
+		f->size = len;
+		f->pos = 0;
+		f->mapped = 0;
+		return EXIT_SUCCESS;
 	}
-	asprintf(&full_path, "%s/%s/%s", db_dir_name, "files", objid);
-	/* check if file is already there */
-	if (access(full_path, F_OK) == -1) {
-		retval = EXIT_FAILURE;
-		goto ret;
+	if (kind == OBJ_STORED) {
+		memmove(buf, buf + OBJ_HDR_LEN, len - OBJ_HDR_LEN);
+		f->loc = LOC_MEM;
+		f->buffer = buf;
+		f->size = len - OBJ_HDR_LEN;
+		f->pos = 0;
+		f->mapped = 0;
+		return EXIT_SUCCESS;
 	}
-
-	if ((fd = open(full_path, O_RDONLY)) == -1) {
-		retval = EXIT_FAILURE;
-		goto ret;
+	if ((s = calloc(1, sizeof(struct chunk_stream))) == NULL) {
+		free(buf);
+		return EXIT_FAILURE;
 	}
+	s->ctx = ctx;
+	s->manifest = buf;
+	s->pos = buf + OBJ_HDR_LEN;
+	s->end = buf + len;
+	f->loc = LOC_STREAM;
+	f->stream = s;
+	f->stream_read = chunk_read;
+	f->stream_close = chunk_close;
+	f->stream_send = chunk_send;
+	return EXIT_SUCCESS;
+}
 
-	f->id = strdup(objid);
-	f->loc = LOC_FS;
-	f->fd = fd;
+/*
+ * hands out an object that is stored whole in the mapping of a pack
+ * without copying it, the others have to be unpacked into a buffer
+ */
+static int
+select_mapped(struct file *f, const char *data, size_t len)
+{
+	size_t size;
+	int kind;
 
-	/* the caller should close the file descriptor */
+	if (compress_header(data, len, &kind, &size) == EXIT_SUCCESS) {
+		if (kind != OBJ_STORED)
+			return EXIT_FAILURE;
+		data += OBJ_HDR_LEN;
+		len -= OBJ_HDR_LEN;
+	}
+	f->loc = LOC_MEM;
+	f->buffer = (char *)data;
+	f->size = len;
+	f->pos = 0;
+	f->mapped = 1;
+	return EXIT_SUCCESS;
+}
 
-success:
-	retval = EXIT_SUCCESS;
-ret:
-	free(db_dir_name);
-	free(full_path);
-	return retval;
+/*
+ * stores a chunk as a file object of its own, unless it is already there
+ */
+static int
+store_chunk(struct objdb_ctx *ctx, u_int8_t *data, size_t len, struct objid *id)
+{
+	hash_data(data, len, id->bytes);
+	return store_object(ctx, O_FILE, id, (char *)data, len);
 }
 
+/*
+ * cuts the content of a file object into chunks and writes its manifest
+ * to fd, which must be seekable. the content is also fed to hash_ctx,
+ * if any, so that the id of the file comes with the same read.
+ */
+static int
+write_chunked(struct objdb_ctx *ctx, struct file *f, int fd, size_t *stored, struct hash_ctx *hash_ctx)
+{
+	char hex[OBJID_HEXLEN + 1];
+	u_int8_t *buf = NULL, hdr[OBJ_HDR_LEN];
+	size_t avail = 0, cut, total;
+	u_int64_t size = 0;
+	ssize_t n;
+	int len, eof = 0, retval = EXIT_FAILURE;
+	struct objid id;
+
+	if ((buf = malloc(CHUNK_MAX)) == NULL)
+		return EXIT_FAILURE;
+	compress_put_header(hdr, OBJ_CHUNKED, 0);
+	if (write(fd, hdr, sizeof(hdr)) != sizeof(hdr))
+		goto ret;
+	total = sizeof(hdr);
+	do {
+		/* a cut point can only be chosen with CHUNK_MAX bytes ahead */
+		while (!eof && avail < CHUNK_MAX) {
+			if ((n = baseline_file_read(f, buf + avail, CHUNK_MAX - avail)) == -1)
+				goto ret;
+			if (n == 0)
+				eof = 1;
+			else if (hash_ctx != NULL)
+				hash_update(hash_ctx, buf + avail, n);
+			avail += n;
+		}
+		if (avail == 0)
+			break;
+		cut = chunk_next(buf, avail);
+		if (store_chunk(ctx, buf, cut, &id) == EXIT_FAILURE)
+			goto ret;
+		if ((len = dprintf(fd, "%s %zu\n", objid_hex(&id, hex), cut)) < 0)
+			goto ret;
+		total += len;
+		size += cut;
+		avail -= cut;
+		memmove(buf, buf + cut, avail);
+	} while (1);
+	compress_put_header(hdr, OBJ_CHUNKED, size);
+	if (pwrite(fd, hdr, sizeof(hdr), 0) != sizeof(hdr))
+		goto ret;
+	*stored = total;
+	retval = EXIT_SUCCESS;
+ret:
+	free(buf);
+	return retval;
+}
+
+/*
+ * what is left to read from a file object, 0 if unknown
+ */
+static size_t
+file_size_left(struct file *f)
+{
+	struct stat s;
+	off_t offset;
+
+	if (f->loc == LOC_MEM)
+		return f->size - f->pos;
+	if (f->loc != LOC_FS || fstat(f->fd, &s) == -1 || !S_ISREG(s.st_mode))
+		return 0;
+	if ((offset = lseek(f->fd, 0, SEEK_CUR)) == -1 || offset > s.st_size)
+		return 0;
+	return s.st_size - offset;
+}
+
+static int
+file_gen_id(struct file *obj)
+{
+	char buf[4096];
+	int n;
+        off_t offset;
+        struct hash_ctx hash_ctx;
+
+	hash_init(&hash_ctx);
+	/* TODO: locking */
+	if (((struct file *)obj)->loc == LOC_FS) {
+		/* save file offset */
+		offset = lseek(obj->fd, 0, SEEK_CUR);
+		do {
+			n = read(obj->fd, buf, sizeof(buf));
+			if (n == -1)
+				return EXIT_FAILURE;
+			if (n == 0)
+				break;
+			hash_update(&hash_ctx, buf, n);
+		} while (1);
+		/* restore file offset */
+		lseek(obj->fd, offset, SEEK_SET);
+	}
+	else {
+		hash_update(&hash_ctx, obj->buffer, obj->size);
+	}
+	hash_final(&hash_ctx, obj->id.bytes);
+	return EXIT_SUCCESS;
+}
+
+static int
+commit_gen_id(struct commit *obj)
+{
+	char *raw;
+	size_t len;
+
+	if (commit_gen_id_and_serialize(obj, &raw, &len) == EXIT_FAILURE)
+		return EXIT_FAILURE;
+	free(raw);
+	return EXIT_SUCCESS;
+}
+
+static int
+dir_gen_id(struct dir *obj)
+{
+	char *raw;
+	size_t len;
+
+	if (dir_gen_id_and_serialize(obj, &raw, &len) == EXIT_FAILURE)
+		return EXIT_FAILURE;
+	free(raw);
+	return EXIT_SUCCESS;
+}
+
+static int
+objdb_bl_open(struct objdb_ctx **ctx, const char *db_name, const char *db_path)
+{
+	if (ctx == NULL)
+		return EXIT_FAILURE;
+	*ctx = (struct objdb_ctx *)malloc(sizeof(struct objdb_ctx));
+	asprintf(&((*ctx)->db_name), "%s", db_name);
+	asprintf(&((*ctx)->db_path), "%s", db_path);
+	asprintf(&((*ctx)->db_version), "1.0");
+	/* packs are mapped on first use */
+	(*ctx)->db_priv = calloc(1, sizeof(struct objdb_bl_priv));
+	(*ctx)->cache = NULL;
+	(*ctx)->cache_loaded = 0;
+	(*ctx)->fsync_loaded = 0;
+	return EXIT_SUCCESS;
+}
+
+static int
+objdb_bl_close(struct objdb_ctx *ctx)
+{
+	int retval = EXIT_SUCCESS;
+	size_t k;
+	struct objdb_bl_priv *priv;
+
+	if (ctx == NULL)
+		return EXIT_FAILURE;
+	if ((priv = ctx->db_priv) != NULL) {
+		/* an unfinished batch leaves nothing behind */
+		batch_free(priv->batch);
+		/* objects written without moving a head */
+		retval = sync_dirty(ctx);
+	}
+	unload_packs(ctx);
+	unload_bloom(ctx);
+	unload_graph(ctx);
+	if (priv != NULL) {
+		ioq_free(priv->ioq);
+		if (priv->locked)
+			close(priv->lock_fd);
+	}
+#ifdef DEBUG
+	if (ctx->cache != NULL)
+		fprintf(stderr, "[DEBUG] object cache: %llu hits, %llu misses, %llu evictions, %zu bytes.\n",
+		    ctx->cache->hits, ctx->cache->misses, ctx->cache->evictions, ctx->cache->used);
+	if (priv != NULL)
+		fprintf(stderr, "[DEBUG] fsync: %u calls, %.3f ms.\n", priv->nsyncs,
+		    priv->sync_time * 1000);
+#endif
+	if (priv != NULL) {
+		for (k = 0 ; k < priv->ndirty ; k++)
+			free(priv->dirty[k]);
+		free(priv->dirty);
+	}
+	objcache_free(ctx->cache);
+	free(ctx->db_priv);
+	free(ctx->db_name);
+	free(ctx->db_path);
+	free(ctx->db_version);
+	free(ctx);
+	return retval;
+}
+
+static int
+objdb_bl_init(struct objdb_ctx *ctx)
+{
+	char *db_dir_name = NULL, *maindir = NULL;
+	int i, retval = EXIT_FAILURE;
+	struct stat s;
+	struct bloom *b;
+	/* check if path exists */
+	if (stat(ctx->db_path, &s) == -1)
+		goto ret;
+	db_dir_name = objdb_dir(ctx);
+	if (mkdir(db_dir_name, S_IRUSR | S_IWUSR | S_IXUSR) != 0)
+		goto ret;
+	/* try to create main sub-dirs as well */
+	for (i=0 ; i<N_MAINDIRS ; i++) {
+		asprintf(&maindir, "%s/%s", db_dir_name, main_dirs[i]);
+		if (mkdir(maindir, S_IRUSR | S_IWUSR | S_IXUSR) != 0) {
+			free(maindir);
+			goto ret;
+		}
+		free(maindir);
+	}
+	/* an empty filter, kept up to date by the inserts */
+	if (bloom_new(0, &b) == EXIT_SUCCESS) {
+		asprintf(&maindir, "%s/bloom", db_dir_name);
+		bloom_write(b, maindir);
+		free(maindir);
+		bloom_close(b);
+	}
+	retval = EXIT_SUCCESS;
+ret:
+	if (db_dir_name != NULL)
+		free(db_dir_name);
+	return retval;
+}
+
+/*
+ * reads what is left of a file object into memory, hashing it on the way
+ * unless hash_ctx is NULL
+ */
+static int
+file_read_all(struct file *f, size_t hint, char **buf, size_t *len, struct hash_ctx *hash_ctx)
+{
+	char *p;
+	size_t size = hint + 1, off = 0;
+	ssize_t n;
+
+	if ((*buf = malloc(size)) == NULL)
+		return EXIT_FAILURE;
+	do {
+		if (off == size) {
+			size *= 2;
+			if ((p = realloc(*buf, size)) == NULL)
+				goto fail;
+			*buf = p;
+		}
+		if ((n = baseline_file_read(f, *buf + off, size - off)) == -1)
+			goto fail;
+		if (hash_ctx != NULL)
+			hash_update(hash_ctx, *buf + off, n);
+		off += n;
+	} while (n > 0);
+	*len = off;
+	return EXIT_SUCCESS;
+fail:
+	free(*buf);
+	*buf = NULL;
+	return EXIT_FAILURE;
+}
+
+/*
+ * files are read once: small ones are hashed while read into memory,
+ * large ones while they are chunked, and nothing is written for objects
+ * that are already there. only files too large for memory that are not
+ * chunked are read a second time, when they turn out to be new.
+ */
+static int
+objdb_bl_insert_file(struct objdb_ctx *ctx, struct file *file)
+{
+	char *db_dir_name, *full_path = NULL, *obj_file_name = NULL, *tmp_file_name;
+	char *buf = NULL, hex[OBJID_HEXLEN + 1];
+	int retval = EXIT_FAILURE, tmpfd, threshold;
+	size_t left, len, stored;
+	off_t offset;
+	struct hash_ctx hash_ctx;
+
+	if ((db_dir_name = objdb_dir(ctx)) == NULL)
+		return EXIT_FAILURE;
+	asprintf(&full_path, "%s/%s", db_dir_name, "files");
+	/* save file offset */
+	offset = (file->loc == LOC_FS) ? lseek(file->fd, 0, SEEK_CUR) : file->pos;
+	left = file_size_left(file);
+	threshold = objdb_config_num("dedupthreshold", CHUNK_THRESHOLD, INT_MAX);
+
+	if (file->loc == LOC_MEM && (threshold == 0 || left < (size_t)threshold)) {
+		if (file_gen_id(file) == EXIT_SUCCESS)
+			retval = store_object(ctx, O_FILE, &file->id, file->buffer, file->size);
+	} else if (threshold > 0 && left >= (size_t)threshold) {
+		if ((tmpfd = tmp_open(full_path, &tmp_file_name)) == -1)
+			goto ret;
+		hash_init(&hash_ctx);
+		if (write_chunked(ctx, file, tmpfd, &stored, &hash_ctx) == EXIT_FAILURE) {
+			tmp_discard(tmpfd, tmp_file_name);
+			goto ret;
+		}
+		hash_final(&hash_ctx, file->id.bytes);
+		asprintf(&obj_file_name, "%s/%s", full_path, objid_hex(&file->id, hex));
+		if (object_exists(ctx, O_FILE, &file->id)) {
+			tmp_discard(tmpfd, tmp_file_name);
+			retval = EXIT_SUCCESS;
+		} else
+			retval = link_object(ctx, O_FILE, &file->id, tmpfd, tmp_file_name, obj_file_name);
+	} else if (left <= INSERT_MEM_MAX) {
+		hash_init(&hash_ctx);
+		if (file_read_all(file, left, &buf, &len, &hash_ctx) == EXIT_FAILURE)
+			goto ret;
+		hash_final(&hash_ctx, file->id.bytes);
+		retval = store_object(ctx, O_FILE, &file->id, buf, len);
+	} else {
+		if (file_gen_id(file) == EXIT_FAILURE)
+			goto ret;
+		if (object_exists(ctx, O_FILE, &file->id)) {
+			retval = EXIT_SUCCESS;
+			goto ret;
+		}
+		if ((tmpfd = tmp_open(full_path, &tmp_file_name)) == -1)
+			goto ret;
+		retval = compress_write(file, tmpfd, objdb_config_num("compresslevel", COMPRESS_LEVEL, 9),
+		    &stored);
+		asprintf(&obj_file_name, "%s/%s", full_path, objid_hex(&file->id, hex));
+		if (retval == EXIT_FAILURE)
+			tmp_discard(tmpfd, tmp_file_name);
+		else
+			retval = link_object(ctx, O_FILE, &file->id, tmpfd, tmp_file_name, obj_file_name);
+	}
+ret:
+	/* restore file offset */
+	if (file->loc == LOC_FS)
+		lseek(file->fd, offset, SEEK_SET);
+	else
+		file->pos = offset;
+	/* assuming free(NULL) is safe */
+	free(buf);
+	free(db_dir_name);
+	free(full_path);
+	free(obj_file_name);
+	return retval;
+}
+
+/*
+ * bulk insert of file objects. small files that are not chunked are read
+ * into memory a group at a time through the I/O queue, then hashed
+ * together with hash_many(), which may hash them in parallel lanes. the
+ * rest goes through insert_file one by one.
+ */
+static int
+objdb_bl_insert_files(struct objdb_ctx *ctx, struct file **files, size_t n)
+{
+	const void *data[HASH_LANES];
+	u_int8_t digests[HASH_LANES][OBJID_LEN];
+	int retval = EXIT_SUCCESS, threshold;
+	size_t i = 0, j, k, l, m, left, mem, lens[HASH_LANES];
+	struct file *f, *group[INSERT_GROUP];
+	struct ioq *q;
+	struct ioq_req reqs[INSERT_GROUP];
+
+	if ((q = get_ioq(ctx)) == NULL)
+		return EXIT_FAILURE;
+	threshold = objdb_config_num("dedupthreshold", CHUNK_THRESHOLD, INT_MAX);
+	while (i < n) {
+		/* gather the next group, inserting the others on the way */
+		for (j = 0, mem = 0 ; i < n && j < INSERT_GROUP && mem < INSERT_MEM_MAX ; i++) {
+			f = files[i];
+			left = file_size_left(f);
+			if (f->loc != LOC_FS || left > INSERT_MEM_MAX ||
+			    (threshold > 0 && left >= (size_t)threshold)) {
+				if (objdb_bl_insert_file(ctx, f) == EXIT_FAILURE)
+					retval = EXIT_FAILURE;
+				continue;
+			}
+			/* read in place, the file offset does not move */
+			memset(&reqs[j], 0, sizeof(reqs[j]));
+			reqs[j].op = IOQ_READ;
+			reqs[j].fd = f->fd;
+			reqs[j].off = lseek(f->fd, 0, SEEK_CUR);
+			reqs[j].len = left;
+			group[j++] = f;
+			mem += left;
+		}
+		/* the queue failed as a whole, the reads that completed are dropped */
+		if (ioq_run(q, reqs, j) == EXIT_FAILURE) {
+			for (k = 0 ; k < j ; k++) {
+				free(reqs[k].buf);
+				if (objdb_bl_insert_file(ctx, group[k]) == EXIT_FAILURE)
+					retval = EXIT_FAILURE;
+			}
+			continue;
+		}
+		/* a file that changed size meanwhile is read to its end there */
+		for (k = 0, m = 0 ; k < j ; k++) {
+			if (reqs[k].error) {
+				if (objdb_bl_insert_file(ctx, group[k]) == EXIT_FAILURE)
+					retval = EXIT_FAILURE;
+				continue;
+			}
+			group[m] = group[k];
+			reqs[m++] = reqs[k];
+		}
+		for (k = 0 ; k < m ; k += HASH_LANES) {
+			for (j = 0 ; j < HASH_LANES && k + j < m ; j++) {
+				data[j] = reqs[k + j].buf;
+				lens[j] = reqs[k + j].len;
+			}
+			hash_many(data, lens, j, digests);
+			for (l = 0 ; l < j ; l++) {
+				f = group[k + l];
+				memcpy(f->id.bytes, digests[l], OBJID_LEN);
+				if (store_object(ctx, O_FILE, &f->id, data[l], lens[l]) == EXIT_FAILURE)
+					retval = EXIT_FAILURE;
+				free(reqs[k + l].buf);
+			}
+		}
+	}
+	return retval;
+}
+
+/*
+ * batches nest, only the outermost one is committed. once an inner
+ * batch is aborted, the outermost commit fails and writes nothing.
+ */
+static int
+objdb_bl_begin_batch(struct objdb_ctx *ctx)
+{
+	struct objdb_bl_priv *priv = ctx->db_priv;
+
+	if (db_lock(ctx, LOCK_SH) == EXIT_FAILURE)
+		return EXIT_FAILURE;
+	if (priv->batch == NULL && (priv->batch = calloc(1, sizeof(struct batch))) == NULL)
+		return EXIT_FAILURE;
+	priv->batch->depth++;
+	return EXIT_SUCCESS;
+}
+
+static int
+objdb_bl_commit_batch(struct objdb_ctx *ctx)
+{
+	char *db_dir_name = NULL, *name = NULL, *path;
+	int retval = EXIT_FAILURE;
+	size_t i;
+	struct objdb_bl_priv *priv = ctx->db_priv;
+	struct batch *b = priv->batch;
+
+	if (b == NULL)
+		return EXIT_FAILURE;
+	if (--b->depth > 0)
+		return EXIT_SUCCESS;
+	priv->batch = NULL;
+	if (b->failed)
+		goto ret;
+	if ((db_dir_name = objdb_dir(ctx)) == NULL)
+		goto ret;
+	if (b->w != NULL) {
+		retval = pack_writer_end(b->w, &name);
+		b->w = NULL;
+		if (retval == EXIT_FAILURE)
+			goto ret;
+		/* the full policy synced the pack, the batch one does it later */
+		asprintf(&path, "%s.pack", name);
+		if (mark_dirty(ctx, D_PACKS, path) == EXIT_FAILURE)
+			retval = EXIT_FAILURE;
+		free(path);
+		asprintf(&path, "%s.idx", name);
+		if (objdb_fsync(ctx) == OBJDB_FSYNC_BATCH && mark_dirty(ctx, D_PACKS, path) == EXIT_FAILURE)
+			retval = EXIT_FAILURE;
+		free(path);
+		/* picked up on the next lookup */
+		unload_packs(ctx);
+		if (retval == EXIT_FAILURE)
+			goto ret;
+	} else {
+		qsort(b->objs, b->count, sizeof(struct batch_obj), batch_obj_cmp);
+		if ((retval = batch_write_loose(ctx, b)) == EXIT_FAILURE)
+			goto ret;
+	}
+	load_bloom(ctx);
+	for (i = 0 ; i < b->size ; i++)
+		if (b->keys[i].type != -1)
+			bloom_add(priv->bloom, &b->keys[i].id);
+	for (i = 0 ; i < b->ncommits ; i++)
+		graph_add(get_graph(ctx), &b->commits[i]);
+ret:
+	batch_free(b);
+	free(name);
+	free(db_dir_name);
+	return retval;
+}
+
+static int
+objdb_bl_abort_batch(struct objdb_ctx *ctx)
+{
+	struct objdb_bl_priv *priv = ctx->db_priv;
+	struct batch *b = priv->batch;
+
+	if (b == NULL)
+		return EXIT_FAILURE;
+	/* an inner batch takes the outer ones down with it */
+	b->failed = 1;
+	if (--b->depth > 0)
+		return EXIT_SUCCESS;
+	batch_free(b);
+	priv->batch = NULL;
+	return EXIT_SUCCESS;
+}
+
+static int
+objdb_bl_insert_dir(struct objdb_ctx *ctx, struct dir *dir)
+{
+	char *data;
+	size_t len;
+	int retval;
+
+	if (dir_gen_id_and_serialize(dir, &data, &len) == EXIT_FAILURE)
+		return EXIT_FAILURE;
+	retval = store_object(ctx, O_DIR, &dir->id, data, len);
+	free(data);
+	return retval;
+}
+
+static int
+objdb_bl_insert_commit(struct objdb_ctx *ctx, struct commit *comm)
+{
+	char *data;
+	size_t len;
+	int retval;
+
+	if (commit_gen_id_and_serialize(comm, &data, &len) == EXIT_FAILURE)
+		return EXIT_FAILURE;
+	retval = store_object(ctx, O_COMMIT, &comm->id, data, len);
+	free(data);
+	/* the graph is only a shortcut, it may lag behind */
+	if (retval == EXIT_SUCCESS)
+		graph_add_commit(ctx, comm);
+	return retval;
+}
+
+/*
+ * removes a loose object, packed ones are only dropped by repack
+ */
+static int
+objdb_bl_remove(struct objdb_ctx *ctx, const char *group_name, const char *obj_name)
+{
+	char *db_dir_name, *path = NULL;
+	int t, retval;
+	struct objid id;
+
+	if (group_name == NULL || obj_name == NULL)
+		return EXIT_FAILURE;
+	for (t = O_FILE ; t <= O_COMMIT ; t++)
+		if (!strcmp(group_name, main_dirs[t]))
+			break;
+	/* the name must be an id, not a path */
+	if (t > O_COMMIT || objid_parse(obj_name, &id) == EXIT_FAILURE)
+		return EXIT_FAILURE;
+	if ((db_dir_name = objdb_dir(ctx)) == NULL)
+		return EXIT_FAILURE;
+	asprintf(&path, "%s/%s/%s", db_dir_name, group_name, obj_name);
+	retval = unlink(path) == -1 ? EXIT_FAILURE : EXIT_SUCCESS;
+	free(path);
+	free(db_dir_name);
+	return retval;
+}
+
+static int
+objdb_bl_branch_create(struct objdb_ctx *ctx, const char *branch_name)
+{
+	char *db_dir_name;
+	int retval;
+
+	if (branch_name == NULL || (db_dir_name = objdb_dir(ctx)) == NULL)
+		return EXIT_FAILURE;
+	retval = refs_branch_create(db_dir_name, branch_name, NULL);
+	free(db_dir_name);
+	return retval;
+}
+
+static int
+objdb_bl_branch_create_from(struct objdb_ctx *ctx, const char *new_branch, const char *orig_branch)
+{
+	char *db_dir_name;
+	int retval;
+	struct objid orig_head;
+
+	if (new_branch == NULL || orig_branch == NULL)
+		return EXIT_FAILURE;
+	if (objdb_bl_branch_get_head(ctx, orig_branch, &orig_head) == EXIT_FAILURE)
+		return EXIT_FAILURE;
+	if ((db_dir_name = objdb_dir(ctx)) == NULL)
+		return EXIT_FAILURE;
+	/* the new branch shows up with its head */
+	retval = refs_branch_create(db_dir_name, new_branch, &orig_head);
+	free(db_dir_name);
+	return retval;
+}
+
+static int
+objdb_bl_branch_if_exists(struct objdb_ctx *ctx, const char *branch_name, int *exist)
+{
+	char *db_dir_name;
+	int retval;
+
+	if (branch_name == NULL || (db_dir_name = objdb_dir(ctx)) == NULL)
+		return EXIT_FAILURE;
+	retval = refs_branch_exists(db_dir_name, branch_name, exist);
+	free(db_dir_name);
+	return retval;
+}
+
+static int
+objdb_bl_branch_set_head(struct objdb_ctx *ctx, const char *branch_name, const struct objid *head_objid)
+{
+	char *db_dir_name;
+	int retval = EXIT_FAILURE;
+
+	if ((db_dir_name = objdb_dir(ctx)) == NULL)
+		return EXIT_FAILURE;
+	/* the head must never name a commit that is not on disk */
+	if (sync_dirty(ctx) == EXIT_SUCCESS)
+		retval = refs_branch_set_head(db_dir_name, branch_name, head_objid,
+		    objdb_fsync(ctx) != OBJDB_FSYNC_NONE);
+	free(db_dir_name);
+	return retval;
+}
+
+static int
+objdb_bl_branch_get_head(struct objdb_ctx *ctx, const char *branch_name, struct objid *head_objid)
+{
+	char *db_dir_name;
+	int retval;
+
+	if (ctx == NULL || branch_name == NULL || head_objid == NULL)
+		return EXIT_FAILURE;
+	if ((db_dir_name = objdb_dir(ctx)) == NULL)
+		return EXIT_FAILURE;
+	retval = refs_branch_get_head(db_dir_name, branch_name, head_objid);
+	free(db_dir_name);
+	return retval;
+}
+
+static int
+objdb_bl_branch_ls(struct objdb_ctx *ctx)
+{
+	char *db_dir_name;
+	int retval;
+
+	if ((db_dir_name = objdb_dir(ctx)) == NULL)
+		return EXIT_FAILURE;
+	retval = refs_branch_ls(db_dir_name);
+	free(db_dir_name);
+	return retval;
+}
+
+static int
+objdb_bl_select_commit(struct objdb_ctx *ctx, const struct objid *id, struct commit *comm)
+{
+	char *buf = NULL;
+	size_t len;
+	int retval;
+
+	if (objcache_get_commit(objdb_cache(ctx), id, comm) == EXIT_SUCCESS)
+		return EXIT_SUCCESS;
+	if (load_object(ctx, O_COMMIT, id, &buf, &len) == EXIT_FAILURE)
+		return EXIT_FAILURE;
+	comm->id = *id;
+	if ((retval = commit_deserialize(buf, len, comm)) == EXIT_FAILURE) {
+		free(buf);
+		return retval;
+	}
+	objcache_put_commit(ctx->cache, comm);
+	return retval;
+}
+
+/*
+ * the index of the loose objects, they are listed again when one of their
+ * directories changed since it was written. a listing is only written
+ * back once the directories have been left alone for a while, an object
+ * stored within the same tick as the listing could be missing from it.
+ */
+static struct loose_idx *
+get_loose(struct objdb_ctx *ctx)
+{
+	char *db_dir_name, *path = NULL, *paths[2];
+	int t;
+	size_t n = 0, max = 0;
+	struct loose_entry *ents = NULL, *tmp;
+	struct loose_idx *idx = NULL;
+	struct objid id;
+	struct stat s;
+	struct timespec ts[LOOSE_NDIRS];
+	time_t racy;
+	FTS *dir;
+	FTSENT *entry;
+
+	if ((db_dir_name = objdb_dir(ctx)) == NULL)
+		return NULL;
+	racy = time(NULL) - LOOSE_RACY;
+	for (t = O_FILE ; t <= O_COMMIT ; t++) {
+		free(path);
+		asprintf(&path, "%s/%s", db_dir_name, main_dirs[t]);
+		if (path == NULL || stat(path, &s) == -1)
+			goto ret;
+		ts[t] = s.st_mtim;
+	}
+	free(path);
+	asprintf(&path, "%s/loose-index", db_dir_name);
+	if (path == NULL || loose_open(path, ts, &idx) == EXIT_SUCCESS)
+		goto ret;
+	for (t = O_FILE ; t <= O_COMMIT ; t++) {
+		asprintf(&paths[0], "%s/%s", db_dir_name, main_dirs[t]);
+		paths[1] = NULL;
+		dir = (paths[0] == NULL) ? NULL : fts_open(paths, FTS_NOCHDIR, 0);
+		free(paths[0]);
+		if (dir == NULL)
+			goto ret;
+		while ((entry = fts_read(dir)) != NULL) {
+			if (entry->fts_level == FTS_ROOTLEVEL)
+				continue;
+			if (entry->fts_info & FTS_D) {
+				fts_set(dir, entry, FTS_SKIP);
+				continue;
+			}
+			/* skips temp files */
+			if (!(entry->fts_info & FTS_F) || objid_parse(entry->fts_name, &id) == EXIT_FAILURE)
+				continue;
+			if (n == max) {
+				max = max ? max * 2 : 1024;
+				if ((tmp = reallocarray(ents, max, sizeof(struct loose_entry))) == NULL) {
+					fts_close(dir);
+					goto ret;
+				}
+				ents = tmp;
+			}
+			memset(&ents[n], 0, sizeof(struct loose_entry));
+			memcpy(ents[n].id, id.bytes, OBJID_LEN);
+			ents[n++].type = t;
+		}
+		fts_close(dir);
+	}
+	if (loose_build(ts, ents, n, &idx) == EXIT_FAILURE)
+		goto ret;
+	for (t = O_FILE ; t <= O_COMMIT ; t++)
+		if (ts[t].tv_sec >= racy)
+			break;
+	/* a repository that cannot be written to is listed every time */
+	if (t > O_COMMIT)
+		loose_write(path, idx);
+ret:
+	free(ents);
+	free(path);
+	free(db_dir_name);
+	return idx;
+}
+
+/*
+ * abbreviated ids are looked up in the sorted index of the loose objects
+ * and in the indexes of the packs
+ */
+static int
+objdb_bl_resolve(struct objdb_ctx *ctx, enum objtype type, struct objid_match *m)
+{
+	int retval;
+	struct objdb_bl_priv *priv = ctx->db_priv;
+	struct loose_idx *idx;
+	struct pack *p;
+
+	if (type > O_COMMIT || m == NULL)
+		return EXIT_FAILURE;
+	if ((idx = get_loose(ctx)) == NULL)
+		return EXIT_FAILURE;
+	retval = loose_match(idx, type, m);
+	loose_close(idx);
+	if (retval == EXIT_FAILURE)
+		return EXIT_FAILURE;
+	load_packs(ctx);
+	if (midx_match(priv->midx, type, m) == EXIT_FAILURE)
+		return EXIT_FAILURE;
+	for (p = priv->packs ; p != NULL ; p = p->next)
+		if (!p->indexed && pack_match(p, type, m) == EXIT_FAILURE)
+			return EXIT_FAILURE;
+	return EXIT_SUCCESS;
+}
+
+static int
+objdb_bl_select_commit_graph(struct objdb_ctx *ctx, const struct objid *id, struct graph_commit *c)
+{
+	return graph_lookup(get_graph(ctx), id, c);
+}
+
+static int
+objdb_bl_select_dir(struct objdb_ctx *ctx, const struct objid *id, struct dir *d)
+{
+	char *buf = NULL;
+	size_t len;
+	int retval;
+
+	if (objcache_get_dir(objdb_cache(ctx), id, d) == EXIT_SUCCESS)
+		return EXIT_SUCCESS;
+	if (load_object(ctx, O_DIR, id, &buf, &len) == EXIT_FAILURE)
+		return EXIT_FAILURE;
+	d->id = *id;
+	if ((retval = dir_deserialize(buf, len, d)) == EXIT_FAILURE) {
+		free(buf);
+		return retval;
+	}
+	objcache_put_dir(ctx->cache, d);
+	return retval;
+}
+
+/*
+ * reads the loose dirs among ids that are not cached yet all at once,
+ * through the I/O queue, and caches them for select_dir. without a
+ * cache there is nowhere to keep them.
+ */
+static int
+objdb_bl_prefetch_dirs(struct objdb_ctx *ctx, const struct objid *ids, size_t n)
+{
+	char *buf;
+	int retval = EXIT_FAILURE;
+	size_t i, len, m = 0, *which = NULL;
+	struct dir *d;
+	struct ioq *q;
+	struct ioq_req *reqs = NULL;
+	struct objcache *cache;
+	struct pack *p;
+
+	if ((cache = objdb_cache(ctx)) == NULL || n < 2)
+		return EXIT_SUCCESS;
+	if ((q = get_ioq(ctx)) == NULL ||
+	    (reqs = calloc(n, sizeof(struct ioq_req))) == NULL ||
+	    (which = calloc(n, sizeof(size_t))) == NULL)
+		goto ret;
+	for (i = 0 ; i < n ; i++) {
+		if (objcache_has(cache, O_DIR, &ids[i]) ||
+		    find_packed(ctx, O_DIR, &ids[i], &p) != NULL)
+			continue;
+		reqs[m].op = IOQ_READ;
+		if ((reqs[m].path = object_path(ctx, O_DIR, &ids[i])) == NULL)
+			goto ret;
+		which[m++] = i;
+	}
+	if (ioq_run(q, reqs, m) == EXIT_FAILURE) {
+		/* the buffers are not to be trusted */
+		for (i = 0 ; i < m ; i++)
+			reqs[i].buf = NULL;
+		goto ret;
+	}
+	for (i = 0 ; i < m ; i++) {
+		/* missing ones are reported by select_dir */
+		if (reqs[i].error || objcache_has(cache, O_DIR, &ids[which[i]]))
+			continue;
+		buf = reqs[i].buf;
+		reqs[i].buf = NULL;
+		if (compress_decode(buf, reqs[i].len, &buf, &len) == EXIT_FAILURE)
+			continue;
+		if ((d = baseline_dir_new()) == NULL) {
+			free(buf);
+			continue;
+		}
+		d->id = ids[which[i]];
+		if (dir_deserialize(buf, len, d) == EXIT_SUCCESS)
+			objcache_put_dir(cache, d);
+		else
+			free(buf);
+		baseline_dir_free(d);
+	}
+	retval = EXIT_SUCCESS;
+ret:
+	for (i = 0 ; reqs != NULL && i < m ; i++) {
+		free((char *)reqs[i].path);
+		free(reqs[i].buf);
+	}
+	free(reqs);
+	free(which);
+	return retval;
+}
+
+/*
+ * opens a loose file object, whatever the way it is stored
+ */
+static int
+select_loose(struct objdb_ctx *ctx, const char *full_path, struct file *f)
+{
+	char *buf;
+	u_int8_t hdr[OBJ_HDR_LEN];
+	int fd, kind;
+	size_t len;
+	ssize_t n;
+
+	if ((fd = open(full_path, O_RDONLY)) == -1)
+		return EXIT_FAILURE;
+	/* manifests are small enough to be read at once */
+	if ((n = pread(fd, hdr, sizeof(hdr), 0)) != -1 &&
+	    compress_header(hdr, n, &kind, &len) == EXIT_SUCCESS && kind == OBJ_CHUNKED) {
+		close(fd);
+		if (read_object(full_path, &buf, &len) == EXIT_FAILURE)
+			return EXIT_FAILURE;
+		return select_buffer(ctx, f, buf, len);
+	}
+	/* compressed objects are inflated as they are read */
+	if (compress_open(fd, f) == EXIT_FAILURE) {
+		close(fd);
+		return EXIT_FAILURE;
+	}
+	/* the caller should close the file descriptor */
+	return EXIT_SUCCESS;
+}
+
+static int
+objdb_bl_select_file(struct objdb_ctx *ctx, const struct objid *id, struct file *f)
+{
+	char *full_path, *buf;
+	const char *data;
+	int retval;
+	size_t len;
+	struct pack *p;
+	const struct pack_idx_entry *e;
+
+	/* packed objects are handed out from memory */
+	if ((e = find_packed(ctx, O_FILE, id, &p)) != NULL) {
+		if (pack_map(p, e, &data, &len) == EXIT_SUCCESS &&
+		    select_mapped(f, data, len) == EXIT_SUCCESS) {
+			f->id = *id;
+			return EXIT_SUCCESS;
+		}
+		if (pack_get(p, e, &buf, &len) == EXIT_FAILURE)
+			return EXIT_FAILURE;
+		if (select_buffer(ctx, f, buf, len) == EXIT_FAILURE)
+			return EXIT_FAILURE;
+		f->id = *id;
+		return EXIT_SUCCESS;
+	}
+
+	if ((full_path = object_path(ctx, O_FILE, id)) == NULL)
+		return EXIT_FAILURE;
+	if ((retval = select_loose(ctx, full_path, f)) == EXIT_SUCCESS)
+		f->id = *id;
+	free(full_path);
+	return retval;
+}
+
+/*
+ * compresses the loose file objects written before compression was
+ * enabled, or with compresslevel set to 0.
+ */
+static int
+objdb_bl_compress(struct objdb_ctx *ctx)
+{
+	char *db_dir_name, *files_path = NULL, *tmp_file_name = NULL, *paths[2];
+	u_int8_t hdr[OBJ_HDR_LEN];
+	int fd, tmpfd, kind, level, retval = EXIT_FAILURE;
+	size_t size, stored, n_objs = 0;
+	unsigned long long before = 0, after = 0;
+	ssize_t n;
+	struct objid id;
+	struct file *f;
+	FTS *dir;
+	FTSENT *entry;
+
+	if ((db_dir_name = objdb_dir(ctx)) == NULL)
+		return EXIT_FAILURE;
+	if ((level = objdb_config_num("compresslevel", COMPRESS_LEVEL, 9)) == 0)
+		level = COMPRESS_LEVEL;
+	asprintf(&files_path, "%s/files", db_dir_name);
+	paths[0] = files_path;
+	paths[1] = NULL;
+	if ((dir = fts_open(paths, FTS_NOCHDIR, 0)) == NULL)
+		goto ret;
+	while ((entry = fts_read(dir)) != NULL) {
+		if (entry->fts_level == FTS_ROOTLEVEL)
+			continue;
+		if (entry->fts_info & FTS_D) {
+			fts_set(dir, entry, FTS_SKIP);
+			continue;
+		}
+		if (!(entry->fts_info & FTS_F) || objid_parse(entry->fts_name, &id) == EXIT_FAILURE)
+			continue;
+		if ((fd = open(entry->fts_path, O_RDONLY)) == -1)
+			goto fail;
+		/* already compressed, or stored on purpose */
+		if ((n = read(fd, hdr, sizeof(hdr))) == -1 ||
+		    compress_header(hdr, n, &kind, &size) == EXIT_SUCCESS) {
+			close(fd);
+			continue;
+		}
+		lseek(fd, 0, SEEK_SET);
+		free(tmp_file_name);
+		asprintf(&tmp_file_name, "%s/tmp.XXXXXX", files_path);
+		if ((tmpfd = mkstemp(tmp_file_name)) == -1) {
+			close(fd);
+			goto fail;
+		}
+		f = baseline_file_new();
+		f->fd = fd;
+		retval = compress_write(f, tmpfd, level, &stored);
+		baseline_file_free(f);
+		close(fd);
+		if (retval == EXIT_SUCCESS)
+			retval = sync_object(ctx, tmpfd);
+		close(tmpfd);
+		/* the probe may have decided to leave it raw */
+		if (retval == EXIT_FAILURE || stored >= (size_t)entry->fts_statp->st_size) {
+			unlink(tmp_file_name);
+			if (retval == EXIT_FAILURE)
+				goto fail;
+			continue;
+		}
+		if (rename(tmp_file_name, entry->fts_path) == -1) {
+			unlink(tmp_file_name);
+			goto fail;
+		}
+		if (mark_dirty(ctx, O_FILE, entry->fts_path) == EXIT_FAILURE)
+			goto fail;
+		n_objs++;
+		before += entry->fts_statp->st_size;
+		after += stored;
+	}
+	printf("compressed %zu objects, %llu bytes -> %llu bytes\n", n_objs, before, after);
+	retval = EXIT_SUCCESS;
+	goto done;
+fail:
+	retval = EXIT_FAILURE;
+done:
+	fts_close(dir);
+ret:
+	free(tmp_file_name);
+	free(files_path);
+	free(db_dir_name);
+	return retval;
+}
+
+struct chunk_ref {
+	struct objid id;
+	size_t size;
+};
+
+struct chunk_stats {
+	struct chunk_ref *refs;
+	size_t count;
+	size_t size;
+	size_t files;
+	unsigned long long bytes;
+};
+
+/*
+ * accounts for the chunks listed in a manifest, if buf is one
+ */
+static int
+chunk_stats_add(struct chunk_stats *st, char *buf, size_t len)
+{
+	char *line, *pos, *sp;
+	const char *errstr;
+	size_t size, linelen;
+	int kind;
+	struct chunk_ref *refs;
+
+	if (compress_header(buf, len, &kind, &size) == EXIT_FAILURE || kind != OBJ_CHUNKED)
+		return EXIT_SUCCESS;
+	st->files++;
+	st->bytes += size;
+	pos = buf + OBJ_HDR_LEN;
+	while ((line = next_line(&pos, buf + len, &linelen)) != NULL && linelen > 0) {
+		if ((sp = strchr(line, ' ')) == NULL)
+			return EXIT_FAILURE;
+		*sp++ = '\0';
+		if (st->count == st->size) {
+			st->size = st->size ? st->size * 2 : 1024;
+			if ((refs = reallocarray(st->refs, st->size, sizeof(struct chunk_ref))) == NULL)
+				return EXIT_FAILURE;
+			st->refs = refs;
+		}
+		if (objid_parse(line, &st->refs[st->count].id) == EXIT_FAILURE)
+			return EXIT_FAILURE;
+		st->refs[st->count].size = strtonum(sp, 0, CHUNK_MAX, &errstr);
+		if (errstr != NULL)
+			return EXIT_FAILURE;
+		st->count++;
+	}
+	return EXIT_SUCCESS;
+}
+
+static int
+chunk_ref_cmp(const void *a, const void *b)
+{
+	return objid_cmp(&((const struct chunk_ref *)a)->id, &((const struct chunk_ref *)b)->id);
+}
+
+/*
+ * chunks the loose file objects above dedupthreshold that were stored
+ * whole, then reports how much chunking saves over the whole database.
+ */
+static int
+objdb_bl_dedup(struct objdb_ctx *ctx)
+{
+	char *db_dir_name, *files_path = NULL, *tmp_file_name = NULL, *buf, *paths[2];
+	u_int8_t hdr[OBJ_HDR_LEN];
+	int fd, tmpfd, kind, threshold, retval = EXIT_FAILURE;
+	size_t i, len, size, stored, n_chunked = 0;
+	unsigned long long unique = 0;
+	ssize_t n;
+	u_int32_t k;
+	struct objdb_bl_priv *priv = ctx->db_priv;
+	struct chunk_stats st = { NULL, 0, 0, 0, 0 };
+	struct objid id;
+	struct file *f;
+	struct pack *p;
+	FTS *dir;
+	FTSENT *entry;
+
+	if ((db_dir_name = objdb_dir(ctx)) == NULL)
+		return EXIT_FAILURE;
+	if ((threshold = objdb_config_num("dedupthreshold", CHUNK_THRESHOLD, INT_MAX)) == 0)
+		threshold = CHUNK_THRESHOLD;
+	asprintf(&files_path, "%s/files", db_dir_name);
+	paths[0] = files_path;
+	paths[1] = NULL;
+	if ((dir = fts_open(paths, FTS_NOCHDIR, 0)) == NULL)
+		goto ret;
+	while ((entry = fts_read(dir)) != NULL) {
+		if (entry->fts_level == FTS_ROOTLEVEL)
+			continue;
+		if (entry->fts_info & FTS_D) {
+			fts_set(dir, entry, FTS_SKIP);
+			continue;
+		}
+		if (!(entry->fts_info & FTS_F) || objid_parse(entry->fts_name, &id) == EXIT_FAILURE)
+			continue;
+		if ((fd = open(entry->fts_path, O_RDONLY)) == -1)
+			goto fail;
+		size = entry->fts_statp->st_size;
+		if ((n = pread(fd, hdr, sizeof(hdr), 0)) == -1) {
+			close(fd);
+			goto fail;
+		}
+		if (compress_header(hdr, n, &kind, &size) == EXIT_SUCCESS && kind == OBJ_CHUNKED) {
+			close(fd);
+			continue;
+		}
+		if (size < (size_t)threshold) {
+			close(fd);
+			continue;
+		}
+		f = baseline_file_new();
+		if (compress_open(fd, f) == EXIT_FAILURE) {
+			close(fd);
+			baseline_file_free(f);
+			goto fail;
+		}
+		free(tmp_file_name);
+		asprintf(&tmp_file_name, "%s/tmp.XXXXXX", files_path);
+		if ((tmpfd = mkstemp(tmp_file_name)) == -1) {
+			baseline_file_close(f);
+			baseline_file_free(f);
+			goto fail;
+		}
+		retval = write_chunked(ctx, f, tmpfd, &stored, NULL);
+		baseline_file_close(f);
+		baseline_file_free(f);
+		if (retval == EXIT_SUCCESS)
+			retval = sync_object(ctx, tmpfd);
+		close(tmpfd);
+		if (retval == EXIT_FAILURE || rename(tmp_file_name, entry->fts_path) == -1) {
+			unlink(tmp_file_name);
+			goto fail;
+		}
+		if (mark_dirty(ctx, O_FILE, entry->fts_path) == EXIT_FAILURE)
+			goto fail;
+		n_chunked++;
+	}
+	fts_close(dir);
+
+	/* second pass, every manifest now */
+	if ((dir = fts_open(paths, FTS_NOCHDIR, 0)) == NULL)
+		goto ret;
+	while ((entry = fts_read(dir)) != NULL) {
+		if (entry->fts_level == FTS_ROOTLEVEL)
+			continue;
+		if (entry->fts_info & FTS_D) {
+			fts_set(dir, entry, FTS_SKIP);
+			continue;
+		}
+		if (!(entry->fts_info & FTS_F) || objid_parse(entry->fts_name, &id) == EXIT_FAILURE)
+			continue;
+		if ((fd = open(entry->fts_path, O_RDONLY)) == -1)
+			goto fail;
+		n = read(fd, hdr, sizeof(hdr));
+		close(fd);
+		if (n == -1)
+			goto fail;
+		if (compress_header(hdr, n, &kind, &size) == EXIT_FAILURE || kind != OBJ_CHUNKED)
+			continue;
+		if (read_object(entry->fts_path, &buf, &len) == EXIT_FAILURE)
+			goto fail;
+		retval = chunk_stats_add(&st, buf, len);
+		free(buf);
+		if (retval == EXIT_FAILURE)
+			goto fail;
+	}
+	load_packs(ctx);
+	for (p = priv->packs ; p != NULL ; p = p->next) {
+		for (k = 0 ; k < p->count ; k++) {
+			if (p->entries[k].type != O_FILE)
+				continue;
+			if (pack_get(p, &p->entries[k], &buf, &len) == EXIT_FAILURE)
+				goto fail;
+			retval = chunk_stats_add(&st, buf, len);
+			free(buf);
+			if (retval == EXIT_FAILURE)
+				goto fail;
+		}
+	}
+	/* a file may be both loose and packed, it happens to be counted twice */
+	qsort(st.refs, st.count, sizeof(struct chunk_ref), chunk_ref_cmp);
+	for (i = 0, n = 0 ; i < st.count ; i++) {
+		if (i > 0 && !objid_cmp(&st.refs[i - 1].id, &st.refs[i].id))
+			continue;
+		unique += st.refs[i].size;
+		n++;
+	}
+	printf("chunked %zu files, %zu chunked files in total\n", n_chunked, st.files);
+	printf("%llu bytes in %zu chunks, %zd unique chunks of %llu bytes, dedup ratio %.2f\n",
+	    st.bytes, st.count, n, unique, unique > 0 ? (double)st.bytes / unique : 1.0);
+	retval = EXIT_SUCCESS;
+	goto done;
+fail:
+	retval = EXIT_FAILURE;
+done:
+	fts_close(dir);
+ret:
+	free(st.refs);
+	free(tmp_file_name);
+	free(files_path);
+	free(db_dir_name);
+	return retval;
+}
+
+struct obj_list {
+	struct pack_obj *objs;
+	size_t count;
+	size_t size;
+};
+
+static struct pack_obj *
+obj_list_add(struct obj_list *l)
+{
+	struct pack_obj *p;
+
+	if (l->count == l->size) {
+		l->size = l->size ? l->size * 2 : 1024;
+		if ((p = reallocarray(l->objs, l->size, sizeof(struct pack_obj))) == NULL)
+			return NULL;
+		l->objs = p;
+	}
+	p = &l->objs[l->count++];
+	memset(p, 0, sizeof(*p));
+	return p;
+}
+
+static int
+obj_id_cmp(const void *a, const void *b)
+{
+	const struct pack_obj *o1 = a, *o2 = b;
+	int cmp;
+
+	if ((cmp = objid_cmp(&o1->id, &o2->id)) != 0)
+		return cmp;
+	return (int)o1->type - (int)o2->type;
+}
+
+static int
+repack_load(struct pack_obj *o, char **buf, size_t *len)
+{
+	if (o->path != NULL)
+		return read_object(o->path, buf, len);
+	return pack_get(o->pack, o->entry, buf, len);
+}
+
+/*
+ * adds a whole object to the pack as it is stored, compressed file
+ * objects are not inflated on the way. only a file that was a delta, or
+ * that an older pack kept uncompressed, is unpacked and compressed.
+ */
+static int
+repack_add(struct pack_writer *w, struct pack_obj *o, int level, size_t *stored)
+{
+	char *buf, *data, *out = NULL;
+	size_t len, size;
+	int kind, retval;
+
+	if (o->path == NULL && !(o->entry->flags & PACK_F_DELTA) &&
+	    (o->type != O_FILE || (o->entry->flags & PACK_F_DEFLATE))) {
+		*stored = o->stored;
+		return pack_writer_copy(w, o->pack, o->entry);
+	}
+	if (o->path != NULL) {
+		if (read_raw(o->path, &buf, &len) == EXIT_FAILURE)
+			return EXIT_FAILURE;
+	} else if (pack_get(o->pack, o->entry, &buf, &len) == EXIT_FAILURE)
+		return EXIT_FAILURE;
+	data = buf;
+	if (o->path == NULL && o->type == O_FILE) {
+		if (compress_header(data, len, &kind, &size) == EXIT_FAILURE)
+			kind = 0;
+		if (kind == OBJ_STORED) {
+			data += OBJ_HDR_LEN;
+			len -= OBJ_HDR_LEN;
+		}
+		/* manifests are left as they are */
+		if (kind != OBJ_CHUNKED && compress_buffer(data, len, level, &out, &len) == EXIT_FAILURE) {
+			free(buf);
+			return EXIT_FAILURE;
+		}
+		if (out != NULL)
+			data = out;
+	}
+	retval = pack_writer_add(w, o->type, &o->id, data, len);
+	*stored = len;
+	free(out);
+	free(buf);
+	return retval;
+}
+
+/*
+ * every loose object, the size is the size of its file
+ */
+static int
+list_loose(const char *db_dir_name, struct obj_list *list, size_t *n_loose)
+{
+	char *type_path = NULL, *paths[2];
+	int t, retval = EXIT_FAILURE;
+	struct objid id;
+	struct pack_obj *o;
+	FTS *dir;
+	FTSENT *entry;
+
+	*n_loose = 0;
+	for (t = O_FILE ; t <= O_COMMIT ; t++) {
+		free(type_path);
+		asprintf(&type_path, "%s/%s", db_dir_name, main_dirs[t]);
+		paths[0] = type_path;
+		paths[1] = NULL;
+		if ((dir = fts_open(paths, FTS_NOCHDIR, 0)) == NULL)
+			goto ret;
+		while ((entry = fts_read(dir)) != NULL) {
+			if (entry->fts_level == FTS_ROOTLEVEL)
+				continue;
+			if (entry->fts_info & FTS_D) {
+				fts_set(dir, entry, FTS_SKIP);
+				continue;
+			}
+			/* skips temp files */
+			if (!(entry->fts_info & FTS_F) || objid_parse(entry->fts_name, &id) == EXIT_FAILURE)
+				continue;
+			if ((o = obj_list_add(list)) == NULL) {
+				fts_close(dir);
+				goto ret;
+			}
+			o->type = t;
+			o->id = id;
+			o->path = strdup(entry->fts_path);
+			o->size = o->stored = entry->fts_statp->st_size;
+			(*n_loose)++;
+		}
+		fts_close(dir);
+	}
+	retval = EXIT_SUCCESS;
+ret:
+	free(type_path);
+	return retval;
+}
+
+static int
+list_packed(struct pack *p, struct obj_list *list)
+{
+	u_int32_t k;
+	struct pack_obj *o;
+
+	for (k = 0 ; k < p->count ; k++) {
+		if ((o = obj_list_add(list)) == NULL)
+			return EXIT_FAILURE;
+		o->type = p->entries[k].type;
+		pack_entry_id(&p->entries[k], &o->id);
+		o->pack = p;
+		o->entry = &p->entries[k];
+		o->stored = be64toh(p->entries[k].size);
+	}
+	return EXIT_SUCCESS;
+}
+
+/*
+ * every loose and packed object
+ */
+static int
+list_objects(struct objdb_ctx *ctx, const char *db_dir_name, struct obj_list *list, size_t *n_loose)
+{
+	struct objdb_bl_priv *priv = ctx->db_priv;
+	struct pack *p;
+
+	load_packs(ctx);
+	if (list_loose(db_dir_name, list, n_loose) == EXIT_FAILURE)
+		return EXIT_FAILURE;
+	for (p = priv->packs ; p != NULL ; p = p->next)
+		if (list_packed(p, list) == EXIT_FAILURE)
+			return EXIT_FAILURE;
+	return EXIT_SUCCESS;
+}
+
+static int
+pack_count_cmp(const void *a, const void *b)
+{
+	const struct pack *p1 = *(struct pack * const *)a, *p2 = *(struct pack * const *)b;
+
+	return (p1->count > p2->count) - (p1->count < p2->count);
+}
+
+/*
+ * the number of packs, the smallest first, to merge with the loose
+ * objects so that each pack left and the new one hold at least factor
+ * times as many objects as the next smaller one. an object is then
+ * rewritten a logarithmic number of times, rather than on every repack.
+ */
+static size_t
+geometric_split(struct pack **packs, size_t n, size_t n_loose, int factor)
+{
+	size_t i, split = 0;
+	unsigned long long rollup;
+
+	/* the largest packs already in progression are kept */
+	for (i = n ; i > 1 ; i--)
+		if (packs[i - 1]->count < (unsigned long long)factor * packs[i - 2]->count) {
+			split = i;
+			break;
+		}
+	for (i = 0, rollup = n_loose ; i < split ; i++)
+		rollup += packs[i]->count;
+	/* unless the new pack would not fit below them */
+	while (split < n && packs[split]->count < factor * rollup)
+		rollup += packs[split++]->count;
+	return split;
+}
+
+/*
+ * indexes the packs once there are several of them, the packs are
+ * loaded again on the next lookup
+ */
+static int
+update_midx(struct objdb_ctx *ctx, const char *packs_path)
+{
+	char *path = NULL;
+	int retval = EXIT_SUCCESS;
+	struct objdb_bl_priv *priv = ctx->db_priv;
+
+	unload_packs(ctx);
+	load_packs(ctx);
+	if (priv->packs != NULL && priv->packs->next != NULL) {
+		retval = midx_write(packs_path, priv->packs, objdb_fsync(ctx) != OBJDB_FSYNC_NONE);
+	} else {
+		asprintf(&path, "%s/%s", packs_path, MIDX_FILE);
+		unlink(path);
+		free(path);
+	}
+	unload_packs(ctx);
+	return retval;
+}
+
+/*
+ * with a factor of 0, moves every loose object as well as the content
+ * of the existing packs into a single new pack. otherwise only the
+ * loose objects and the smallest packs are merged, see geometric_split().
+ * files and dirs are stored as deltas against similar objects whenever
+ * that saves at least half the size, and the delta is smaller than the
+ * object compressed. the others are copied as they are stored.
+ */
+static int
+objdb_bl_repack(struct objdb_ctx *ctx, int factor)
+{
+	char *db_dir_name, *packs_path = NULL, *path, *name = NULL;
+	size_t i, j, n, len, n_loose = 0, n_deltas = 0, npacks = 0, nrolled;
+	unsigned long long total = 0, stored = 0;
+	int level, retval = EXIT_FAILURE;
+	struct objdb_bl_priv *priv = ctx->db_priv;
+	struct obj_list list = { NULL, 0, 0 }, dups = { NULL, 0, 0 };
+	struct pack_writer *w = NULL;
+	struct bloom *bloom;
+	struct pack_obj *o, *d;
+	struct pack *p, **packs = NULL;
+
+	if (db_lock(ctx, LOCK_SH) == EXIT_FAILURE)
+		return EXIT_FAILURE;
+	if ((db_dir_name = objdb_dir(ctx)) == NULL)
+		return EXIT_FAILURE;
+	asprintf(&packs_path, "%s/packs", db_dir_name);
+	/* repositories created before packs existed */
+	if (mkdir(packs_path, S_IRUSR | S_IWUSR | S_IXUSR) == -1 && errno != EEXIST)
+		goto ret;
+
+	load_packs(ctx);
+	if (list_loose(db_dir_name, &list, &n_loose) == EXIT_FAILURE)
+		goto ret;
+	for (p = priv->packs ; p != NULL ; p = p->next)
+		npacks++;
+	if (npacks > 0 && (packs = reallocarray(NULL, npacks, sizeof(struct pack *))) == NULL)
+		goto ret;
+	for (p = priv->packs, i = 0 ; p != NULL ; p = p->next)
+		packs[i++] = p;
+	if (factor == 0) {
+		nrolled = npacks;
+	} else {
+		qsort(packs, npacks, sizeof(struct pack *), pack_count_cmp);
+		nrolled = geometric_split(packs, npacks, n_loose, factor);
+	}
+	for (i = 0 ; i < nrolled ; i++)
+		if (list_packed(packs[i], &list) == EXIT_FAILURE)
+			goto ret;
+	if (n_loose == 0 && nrolled < 2) {
+		printf("nothing to repack.\n");
+		/* the packs written by large batches are not indexed yet */
+		for (i = 0 ; i < npacks && packs[i]->indexed ; i++)
+			;
+		retval = (npacks > 1 && i < npacks) ? update_midx(ctx, packs_path) : EXIT_SUCCESS;
+		goto ret;
+	}
+	for (i = 0 ; i < list.count ; i++) {
+		o = &list.objs[i];
+		if (o->path != NULL && loose_object_size(o->path, o->size, &o->size) == EXIT_FAILURE)
+			goto ret;
+		if (o->path == NULL && pack_object_size(o->pack, o->entry, &o->size) == EXIT_FAILURE)
+			goto ret;
+	}
+
+	/*
+	 * an object may be both loose and packed, keep only one. the loose
+	 * copies left out go away with the others, or stay if they cannot
+	 * be remembered.
+	 */
+	qsort(list.objs, list.count, sizeof(struct pack_obj), obj_id_cmp);
+	for (i = 0, n = 0 ; i < list.count ; i++) {
+		o = &list.objs[i];
+		for (j = nrolled ; o->path != NULL && j < npacks ; j++)
+			if (pack_lookup(packs[j], o->type, &o->id) != NULL)
+				break;
+		if ((n > 0 && obj_id_cmp(&list.objs[n - 1], o) == 0) || (o->path != NULL && j < npacks)) {
+			if (o->path != NULL && (d = obj_list_add(&dups)) != NULL)
+				d->path = o->path;
+			else
+				free(o->path);
+			continue;
+		}
+		list.objs[n++] = *o;
+	}
+	list.count = n;
+
+	if (pack_find_deltas(list.objs, list.count, objdb_config_num("packwindow", PACK_WINDOW, 1000),
+	    objdb_config_num("packdepth", PACK_DEPTH, PACK_MAXCHAIN - 1),
+	    objdb_config_num("packthreads", 0, 1024), repack_load) == EXIT_FAILURE)
+		goto ret;
+
+	/* the loose objects go away, the pack must be on disk first */
+	if (list.count > 0) {
+		if (pack_writer_begin(packs_path, objdb_fsync(ctx) != OBJDB_FSYNC_NONE, &w) == EXIT_FAILURE)
+			goto ret;
+		level = objdb_config_num("compresslevel", COMPRESS_LEVEL, 9);
+		for (i = 0 ; i < list.count ; i++) {
+			o = &list.objs[i];
+			total += o->size;
+			/* a delta is not compressed, the object may already be smaller */
+			if (o->delta != NULL && (o->stored > OBJID_LEN + o->delta_len ||
+			    (o->path == NULL && (o->entry->flags & PACK_F_DELTA)))) {
+				if (pack_writer_add_delta(w, o->type, &o->id, &list.objs[o->base].id,
+				    o->delta, o->delta_len) == EXIT_FAILURE)
+					goto ret;
+				stored += OBJID_LEN + o->delta_len;
+				n_deltas++;
+				continue;
+			}
+			if (repack_add(w, o, level, &len) == EXIT_FAILURE)
+				goto ret;
+			stored += len;
+		}
+		retval = pack_writer_end(w, &name);
+		w = NULL;
+		if (retval == EXIT_FAILURE)
+			goto ret;
+		if (objdb_fsync(ctx) != OBJDB_FSYNC_NONE && (retval = sync_dir(ctx, packs_path)) == EXIT_FAILURE)
+			goto ret;
+	}
+
+	/* the new pack is in place, drop what it superseded */
+	for (i = 0 ; i < nrolled ; i++) {
+		p = packs[i];
+		/* repacking a single pack yields the same name */
+		if (name == NULL || strcmp(p->path, name)) {
+			asprintf(&path, "%s.idx", p->path);
+			unlink(path);
+			free(path);
+			asprintf(&path, "%s.pack", p->path);
+			unlink(path);
+			free(path);
+		}
+	}
+	for (i = 0 ; i < list.count ; i++)
+		if (list.objs[i].path != NULL)
+			unlink(list.objs[i].path);
+	for (i = 0 ; i < dups.count ; i++)
+		unlink(dups.objs[i].path);
+	/*
+	 * room for as many new objects before the next repack. an
+	 * incremental one leaves the filter as is, it already holds every
+	 * id.
+	 */
+	if (factor == 0) {
+		unload_bloom(ctx);
+		if (bloom_new(list.count * 2, &bloom) == EXIT_SUCCESS) {
+			for (i = 0 ; i < list.count ; i++)
+				bloom_add(bloom, &list.objs[i].id);
+			asprintf(&path, "%s/bloom", db_dir_name);
+			/* the old filter stays valid otherwise */
+			bloom_write(bloom, path);
+			free(path);
+			bloom_close(bloom);
+		}
+	}
+	if (name != NULL) {
+		printf("repacked %zu objects (%zu loose, %zu deltas) into %s\n",
+		    list.count, n_loose, n_deltas, name);
+		printf("%llu bytes stored in %llu bytes, saved %llu bytes (%.1f%%)\n", total, stored,
+		    total - stored, total > 0 ? 100.0 * (total - stored) / total : 0.0);
+	}
+	if (dups.count > 0)
+		printf("removed %zu loose objects already packed\n", dups.count);
+	if (factor != 0)
+		printf("merged %zu of %zu packs\n", nrolled, npacks);
+	retval = update_midx(ctx, packs_path);
+ret:
+	pack_writer_abort(w);
+	for (i = 0 ; i < list.count ; i++) {
+		free(list.objs[i].path);
+		free(list.objs[i].delta);
+	}
+	free(list.objs);
+	for (i = 0 ; i < dups.count ; i++)
+		free(dups.objs[i].path);
+	free(dups.objs);
+	free(packs);
+	free(name);
+	free(packs_path);
+	free(db_dir_name);
+	return retval;
+}
+
+static int
+graph_list_add(struct objdb_ctx *ctx, const struct objid *id, struct graph_commit **list, size_t *n,
+    size_t *max)
+{
+	char *buf = NULL;
+	size_t len;
+	struct graph_commit *tmp;
+	struct commit comm;
+
+	if (*n == *max) {
+		*max = *max ? *max * 2 : 256;
+		if ((tmp = reallocarray(*list, *max, sizeof(struct graph_commit))) == NULL)
+			return EXIT_FAILURE;
+		*list = tmp;
+	}
+	memset(&comm, 0, sizeof(comm));
+	if (load_object(ctx, O_COMMIT, id, &buf, &len) == EXIT_FAILURE)
+		return EXIT_FAILURE;
+	if (commit_deserialize(buf, len, &comm) == EXIT_FAILURE) {
+		free(buf);
+		return EXIT_FAILURE;
+	}
+	comm.id = *id;
+	graph_commit_from(&comm, &(*list)[(*n)++]);
+	free(buf);
+	return EXIT_SUCCESS;
+}
+
+/*
+ * writes the commit graph of all the commits, loose and packed.
+ */
+static int
+objdb_bl_commit_graph_write(struct objdb_ctx *ctx)
+{
+	char *db_dir_name, *type_path = NULL, *graph_path = NULL, *paths[2];
+	size_t n = 0, max = 0;
+	int retval = EXIT_FAILURE;
+	u_int32_t k;
+	struct objdb_bl_priv *priv = ctx->db_priv;
+	struct graph_commit *list = NULL;
+	struct graph *g;
+	struct objid id;
+	struct pack *p;
+	FTS *dir;
+	FTSENT *entry;
+
+	if ((db_dir_name = objdb_dir(ctx)) == NULL)
+		return EXIT_FAILURE;
+	asprintf(&type_path, "%s/%s", db_dir_name, main_dirs[O_COMMIT]);
+	asprintf(&graph_path, "%s/commit-graph", db_dir_name);
+	paths[0] = type_path;
+	paths[1] = NULL;
+	if ((dir = fts_open(paths, FTS_NOCHDIR, 0)) == NULL)
+		goto ret;
+	while ((entry = fts_read(dir)) != NULL) {
+		if (entry->fts_level == FTS_ROOTLEVEL)
+			continue;
+		if (entry->fts_info & FTS_D) {
+			fts_set(dir, entry, FTS_SKIP);
+			continue;
+		}
+		/* skips temp files */
+		if (!(entry->fts_info & FTS_F) || objid_parse(entry->fts_name, &id) == EXIT_FAILURE)
+			continue;
+		if (graph_list_add(ctx, &id, &list, &n, &max) == EXIT_FAILURE) {
+			fts_close(dir);
+			goto ret;
+		}
+	}
+	fts_close(dir);
+	load_packs(ctx);
+	for (p = priv->packs ; p != NULL ; p = p->next) {
+		for (k = 0 ; k < p->count ; k++) {
+			if (p->entries[k].type != O_COMMIT)
+				continue;
+			pack_entry_id(&p->entries[k], &id);
+			if (graph_list_add(ctx, &id, &list, &n, &max) == EXIT_FAILURE)
+				goto ret;
+		}
+	}
+	unload_graph(ctx);
+	if ((retval = graph_write(graph_path, list, n)) == EXIT_FAILURE)
+		goto ret;
+	if ((g = get_graph(ctx)) != NULL)
+		printf("%u commits written to the graph.\n", g->count);
+ret:
+	free(list);
+	free(graph_path);
+	free(type_path);
+	free(db_dir_name);
+	return retval;
+}
+
+/*
+ * gc marks what the heads of the branches and the roots reach, many
+ * threads walking the trees at once, then removes the loose objects it
+ * did not mark that are older than the grace period. packed objects are
+ * left to repack.
+ */
+#define GC_SHARDS	64	/* of the set of marked objects */
+
+/* threads of gc and fsck, one per online processor up to that */
+#define WORKERS_MAX	16
+
+static const char *fsck_types[] = { "file", "dir", "commit" };
+
+struct gc_shard {
+	pthread_mutex_t lock;
+	struct batch_key *keys;
+	size_t count;
+	size_t size;
+};
+
+struct gc_mark {
+	struct objdb_ctx *ctx;
+	struct gc_shard shards[GC_SHARDS];
+	pthread_mutex_t lock;	/* the fields below */
+	pthread_cond_t cond;
+	struct batch_key *stack;	/* marked, not walked yet */
+	size_t count;
+	size_t size;
+	int busy;		/* threads walking an object */
+	int failed;
+	struct batch_key bad;	/* the first object that could not be walked */
+};
+
+/* the first bytes of an id pick its slot within the shard */
+#define GC_SHARD(m, id)	(&(m)->shards[(id)->bytes[OBJID_LEN - 1] % GC_SHARDS])
+
+/*
+ * returns 1 if the object is marked, marks it otherwise
+ */
+static int
+gc_shard_seen(struct gc_shard *sh, enum objtype type, const struct objid *id)
+{
+	size_t i, size;
+	struct batch_key *keys;
+
+	if (sh->count * 2 >= sh->size) {
+		size = sh->size ? sh->size * 2 : 1024;
+		if ((keys = reallocarray(NULL, size, sizeof(struct batch_key))) == NULL)
+			return -1;
+		for (i = 0 ; i < size ; i++)
+			keys[i].type = -1;
+		for (i = 0 ; i < sh->size ; i++)
+			if (sh->keys[i].type != -1)
+				batch_key_insert(keys, size, sh->keys[i].type, &sh->keys[i].id);
+		free(sh->keys);
+		sh->keys = keys;
+		sh->size = size;
+	}
+	if (batch_key_insert(sh->keys, sh->size, type, id))
+		return 1;
+	sh->count++;
+	return 0;
+}
+
+static int
+gc_marked(struct gc_mark *m, enum objtype type, const struct objid *id)
+{
+	size_t i;
+	struct gc_shard *sh = GC_SHARD(m, id);
+
+	if (sh->size == 0)
+		return 0;
+	memcpy(&i, id->bytes, sizeof(i));
+	for (i &= sh->size - 1 ; sh->keys[i].type != -1 ; i = (i + 1) & (sh->size - 1))
+		if (sh->keys[i].type == (int)type && objid_cmp(&sh->keys[i].id, id) == 0)
+			return 1;
+	return 0;
+}
+
+/*
+ * marks an object and queues it to be walked, unless it already was
+ */
+static int
+gc_visit(struct gc_mark *m, enum objtype type, const struct objid *id)
+{
+	int seen;
+	size_t size;
+	struct gc_shard *sh;
+	struct batch_key *stack;
+
+	if (objid_is_null(id))
+		return EXIT_SUCCESS;
+	sh = GC_SHARD(m, id);
+	pthread_mutex_lock(&sh->lock);
+	seen = gc_shard_seen(sh, type, id);
+	pthread_mutex_unlock(&sh->lock);
+	if (seen == -1)
+		return EXIT_FAILURE;
+	if (seen)
+		return EXIT_SUCCESS;
+	pthread_mutex_lock(&m->lock);
+	if (m->count == m->size) {
+		size = m->size ? m->size * 2 : 1024;
+		if ((stack = reallocarray(m->stack, size, sizeof(struct batch_key))) == NULL) {
+			pthread_mutex_unlock(&m->lock);
+			return EXIT_FAILURE;
+		}
+		m->stack = stack;
+		m->size = size;
+	}
+	m->stack[m->count].id = *id;
+	m->stack[m->count].type = type;
+	m->count++;
+	pthread_cond_signal(&m->cond);
+	pthread_mutex_unlock(&m->lock);
+	return EXIT_SUCCESS;
+}
+
+/*
+ * only the manifests of chunked files reach other objects, their header
+ * is read without loading the whole file
+ */
+static int
+gc_walk_file(struct gc_mark *m, const struct objid *id)
+{
+	char *path, *buf, *pos, *line, *sp;
+	u_int8_t hdr[OBJ_HDR_LEN];
+	int fd, kind, retval;
+	size_t n = sizeof(hdr), size, len, linelen;
+	ssize_t r;
+	struct objid chunk_id;
+	struct pack *p;
+	const struct pack_idx_entry *e;
+
+	if ((e = find_packed(m->ctx, O_FILE, id, &p)) != NULL) {
+		if (pack_peek(p, e, hdr, &n) == EXIT_FAILURE)
+			return EXIT_FAILURE;
+	} else {
+		if ((path = object_path(m->ctx, O_FILE, id)) == NULL)
+			return EXIT_FAILURE;
+		fd = open(path, O_RDONLY);
+		free(path);
+		if (fd == -1)
+			return EXIT_FAILURE;
+		r = pread(fd, hdr, sizeof(hdr), 0);
+		close(fd);
+		if (r == -1)
+			return EXIT_FAILURE;
+		n = r;
+	}
+	if (compress_header(hdr, n, &kind, &size) == EXIT_FAILURE || kind != OBJ_CHUNKED)
+		return EXIT_SUCCESS;
+	if (load_object(m->ctx, O_FILE, id, &buf, &len) == EXIT_FAILURE)
+		return EXIT_FAILURE;
+	retval = EXIT_SUCCESS;
+	pos = buf + OBJ_HDR_LEN;
+	while ((line = next_line(&pos, buf + len, &linelen)) != NULL && linelen > 0) {
+		if ((sp = strchr(line, ' ')) == NULL) {
+			retval = EXIT_FAILURE;
+			break;
+		}
+		*sp = '\0';
+		if (objid_parse(line, &chunk_id) == EXIT_FAILURE ||
+		    gc_visit(m, O_FILE, &chunk_id) == EXIT_FAILURE) {
+			retval = EXIT_FAILURE;
+			break;
+		}
+	}
+	free(buf);
+	return retval;
+}
+
+static int
+gc_walk(struct gc_mark *m, const struct batch_key *k)
+{
+	char *buf;
+	size_t i, len;
+	int retval = EXIT_SUCCESS;
+	struct commit comm;
+	struct dir *d;
+
+	switch (k->type) {
+	case O_FILE:
+		return gc_walk_file(m, &k->id);
+	case O_DIR:
+		if (load_object(m->ctx, O_DIR, &k->id, &buf, &len) == EXIT_FAILURE)
+			return EXIT_FAILURE;
+		if ((d = baseline_dir_new()) == NULL || dir_deserialize(buf, len, d) == EXIT_FAILURE) {
+			free(buf);
+			baseline_dir_free(d);
+			return EXIT_FAILURE;
+		}
+		for (i = 0 ; i < d->n_children && retval == EXIT_SUCCESS ; i++)
+			retval = gc_visit(m, S_ISDIR(d->children[i].mode) ? O_DIR : O_FILE,
+			    &d->children[i].id);
+		baseline_dir_free(d);
+		return retval;
+	case O_COMMIT:
+		memset(&comm, 0, sizeof(comm));
+		if (load_object(m->ctx, O_COMMIT, &k->id, &buf, &len) == EXIT_FAILURE)
+			return EXIT_FAILURE;
+		if (commit_deserialize(buf, len, &comm) == EXIT_FAILURE) {
+			free(buf);
+			return EXIT_FAILURE;
+		}
+		retval = gc_visit(m, O_DIR, &comm.dir);
+		for (i = 0 ; i < comm.n_parents && retval == EXIT_SUCCESS ; i++)
+			retval = gc_visit(m, O_COMMIT, &comm.parents[i]);
+		free(buf);
+		return retval;
+	default:
+		return EXIT_FAILURE;
+	}
+}
+
+static void *
+gc_worker(void *arg)
+{
+	struct gc_mark *m = arg;
+	struct batch_key k;
+	int retval;
+
+	pthread_mutex_lock(&m->lock);
+	for (;;) {
+		while (m->count == 0 && m->busy > 0 && !m->failed)
+			pthread_cond_wait(&m->cond, &m->lock);
+		/* nothing queued and nobody to queue more */
+		if (m->failed || m->count == 0)
+			break;
+		k = m->stack[--m->count];
+		m->busy++;
+		pthread_mutex_unlock(&m->lock);
+		retval = gc_walk(m, &k);
+		pthread_mutex_lock(&m->lock);
+		m->busy--;
+		if (retval == EXIT_FAILURE && !m->failed) {
+			m->failed = 1;
+			m->bad = k;
+		}
+	}
+	pthread_cond_broadcast(&m->cond);
+	pthread_mutex_unlock(&m->lock);
+	return NULL;
+}
+
+/*
+ * the walks of gc and fsck look objects up from several threads, a
+ * damaged index is dropped before they start so that every pack is
+ * searched. returns the number of wrong entries.
+ */
+static size_t
+check_midx(struct objdb_ctx *ctx)
+{
+	size_t n = 0;
+	struct objdb_bl_priv *priv = ctx->db_priv;
+
+	if (priv->midx != NULL && (n = midx_verify(priv->midx)) > 0) {
+		midx_close(priv->midx);
+		priv->midx = NULL;
+	}
+	return n;
+}
+
+static int
+worker_count(void)
+{
+	long ncpu;
+
+	if ((ncpu = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+		return 1;
+	return ncpu < WORKERS_MAX ? (int)ncpu : WORKERS_MAX;
+}
+
+static int
+gc_mark_all(struct gc_mark *m)
+{
+	int t, nthreads = worker_count();
+	pthread_t threads[WORKERS_MAX];
+
+	for (t = 0 ; t < nthreads ; t++)
+		if (pthread_create(&threads[t], NULL, gc_worker, m) != 0)
+			break;
+	/* the calling thread walks too if none could be started */
+	if (t == 0)
+		gc_worker(m);
+	while (t-- > 0)
+		pthread_join(threads[t], NULL);
+	return m->failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static int
+objdb_bl_gc(struct objdb_ctx *ctx, int (*get_roots)(void *, struct objdb_root **, size_t *), void *arg,
+    time_t grace)
+{
+	char *db_dir_name, *type_path = NULL, *path, *paths[2], hex[OBJID_HEXLEN + 1];
+	int t, retval = EXIT_FAILURE;
+	size_t i, n, n_heads = 0, n_roots = 0, n_marked = 0, n_young = 0, n_removed = 0;
+	size_t n_kept = 0, max_kept = 0;
+	unsigned long long freed = 0;
+	u_int32_t k;
+	time_t cutoff;
+	double start;
+	struct objdb_bl_priv *priv = ctx->db_priv;
+	struct objdb_root *roots = NULL;
+	struct objid id, *heads = NULL, *kept = NULL, *tmp;
+	struct gc_mark m;
+	struct bloom *bloom;
+	struct pack *p;
+	FTS *dir;
+	FTSENT *entry;
+
+	memset(&m, 0, sizeof(m));
+	m.ctx = ctx;
+	for (i = 0 ; i < GC_SHARDS ; i++)
+		pthread_mutex_init(&m.shards[i].lock, NULL);
+	pthread_mutex_init(&m.lock, NULL);
+	pthread_cond_init(&m.cond, NULL);
+	if ((db_dir_name = objdb_dir(ctx)) == NULL)
+		goto ret;
+	/* waits for the writers, what they staged is a root by now */
+	if (db_lock(ctx, LOCK_EX) == EXIT_FAILURE) {
+		fprintf(stderr, "error, failed to lock the object database.\n");
+		goto ret;
+	}
+	cutoff = time(NULL) - grace;
+	if (refs_heads(db_dir_name, &heads, &n_heads) == EXIT_FAILURE)
+		goto ret;
+	if (get_roots != NULL && get_roots(arg, &roots, &n_roots) == EXIT_FAILURE)
+		goto ret;
+
+	/* the walk only reads, packs are mapped before it starts */
+	unload_packs(ctx);
+	load_packs(ctx);
+	check_midx(ctx);
+	start = now();
+	for (i = 0 ; i < n_heads ; i++)
+		if (gc_visit(&m, O_COMMIT, &heads[i]) == EXIT_FAILURE)
+			goto ret;
+	for (i = 0 ; i < n_roots ; i++)
+		if (gc_visit(&m, roots[i].type, &roots[i].id) == EXIT_FAILURE)
+			goto ret;
+	/* an object that cannot be walked may hide others, nothing goes */
+	if (gc_mark_all(&m) == EXIT_FAILURE) {
+		fprintf(stderr, "error, %s %s is missing or corrupt, nothing removed.\n",
+		    fsck_types[m.bad.type], objid_hex(&m.bad.id, hex));
+		goto ret;
+	}
+	for (i = 0 ; i < GC_SHARDS ; i++)
+		n_marked += m.shards[i].count;
+	printf("marked %zu objects from %zu heads and %zu roots in %.2f s\n", n_marked, n_heads,
+	    n_roots, now() - start);
+
+	for (t = O_FILE ; t <= O_COMMIT ; t++) {
+		free(type_path);
+		asprintf(&type_path, "%s/%s", db_dir_name, main_dirs[t]);
+		paths[0] = type_path;
+		paths[1] = NULL;
+		if ((dir = fts_open(paths, FTS_NOCHDIR, 0)) == NULL)
+			goto ret;
+		while ((entry = fts_read(dir)) != NULL) {
+			if (entry->fts_level == FTS_ROOTLEVEL)
+				continue;
+			if (entry->fts_info & FTS_D) {
+				fts_set(dir, entry, FTS_SKIP);
+				continue;
+			}
+			/* skips temp files */
+			if (!(entry->fts_info & FTS_F) || objid_parse(entry->fts_name, &id) == EXIT_FAILURE)
+				continue;
+			if (!gc_marked(&m, t, &id)) {
+				if (entry->fts_statp->st_mtime >= cutoff)
+					n_young++;
+				else if (objdb_bl_remove(ctx, main_dirs[t], entry->fts_name) == EXIT_SUCCESS) {
+					freed += entry->fts_statp->st_size;
+					n_removed++;
+					continue;
+				}
+			}
+			if (n_kept == max_kept) {
+				max_kept = max_kept ? max_kept * 2 : 1024;
+				if ((tmp = reallocarray(kept, max_kept, sizeof(struct objid))) == NULL) {
+					fts_close(dir);
+					goto ret;
+				}
+				kept = tmp;
+			}
+			kept[n_kept++] = id;
+		}
+		fts_close(dir);
+	}
+	if (n_removed > 0 && objdb_fsync(ctx) != OBJDB_FSYNC_NONE)
+		for (t = O_FILE ; t <= O_COMMIT ; t++) {
+			asprintf(&path, "%s/%s", db_dir_name, main_dirs[t]);
+			sync_dir(ctx, path);
+			free(path);
+		}
+
+	/* the old filter stays valid, it would only give more false positives */
+	if (n_removed > 0) {
+		n = n_kept;
+		for (p = priv->packs ; p != NULL ; p = p->next)
+			n += p->count;
+		unload_bloom(ctx);
+		if (bloom_new(n * 2, &bloom) == EXIT_SUCCESS) {
+			for (i = 0 ; i < n_kept ; i++)
+				bloom_add(bloom, &kept[i]);
+			for (p = priv->packs ; p != NULL ; p = p->next)
+				for (k = 0 ; k < p->count ; k++) {
+					pack_entry_id(&p->entries[k], &id);
+					bloom_add(bloom, &id);
+				}
+			asprintf(&path, "%s/bloom", db_dir_name);
+			bloom_write(bloom, path);
+			free(path);
+			bloom_close(bloom);
+		}
+	}
+	printf("removed %zu unreachable objects, %llu bytes freed\n", n_removed, freed);
+	if (n_young > 0)
+		printf("kept %zu unreachable objects younger than %lld seconds\n", n_young,
+		    (long long)grace);
+	retval = EXIT_SUCCESS;
+ret:
+	for (i = 0 ; i < GC_SHARDS ; i++) {
+		free(m.shards[i].keys);
+		pthread_mutex_destroy(&m.shards[i].lock);
+	}
+	free(m.stack);
+	pthread_mutex_destroy(&m.lock);
+	pthread_cond_destroy(&m.cond);
+	free(kept);
+	free(roots);
+	free(heads);
+	free(type_path);
+	free(db_dir_name);
+	return retval;
+}
+
+/*
+ * fsck checks every copy of every object, loose and packed, on many
+ * threads: its content hashes to its id, and dirs and commits parse and
+ * only name objects that exist. the connectivity check alone does not
+ * hash anything.
+ */
+#define FSCK_BLOCK	64	/* objects a thread takes at once */
+#define FSCK_BUFSIZE	(64 * 1024)
+
+struct fsck {
+	struct objdb_ctx *ctx;
+	int flags;
+	const struct obj_list *list;	/* sorted, ids are looked up in it */
+	pthread_mutex_t lock;		/* the fields below */
+	size_t next;
+	size_t errors;
+	unsigned long long bytes;
+};
+
+static void
+fsck_error(struct fsck *fk, const struct pack_obj *o, const char *what)
+{
+	char hex[OBJID_HEXLEN + 1];
+
+	pthread_mutex_lock(&fk->lock);
+	fprintf(stderr, "error, %s %s%s %s.\n", fsck_types[o->type], objid_hex(&o->id, hex),
+	    o->path == NULL ? " (packed)" : "", what);
+	fk->errors++;
+	pthread_mutex_unlock(&fk->lock);
+}
+
+static int
+fsck_has(struct fsck *fk, enum objtype type, const struct objid *id)
+{
+	struct pack_obj key;
+
+	key.type = type;
+	key.id = *id;
+	return bsearch(&key, fk->list->objs, fk->list->count, sizeof(struct pack_obj),
+	    obj_id_cmp) != NULL;
+}
+
+static void
+fsck_ref(struct fsck *fk, const struct pack_obj *o, enum objtype type, const struct objid *id)
+{
+	char hex[OBJID_HEXLEN + 1], what[128];
+
+	if (fsck_has(fk, type, id))
+		return;
+	snprintf(what, sizeof(what), "names the missing %s %s", fsck_types[type], objid_hex(id, hex));
+	fsck_error(fk, o, what);
+}
+
+/*
+ * hashes the content of a file as select_file would hand it out, the
+ * chunks of a manifest included
+ */
+static int
+fsck_hash_file(struct fsck *fk, struct pack_obj *o, struct objid *id, size_t *bytes)
+{
+	char *buf;
+	int retval;
+	size_t len;
+	ssize_t n;
+	struct file *f;
+	struct hash_ctx hash_ctx;
+
+	if ((f = baseline_file_new()) == NULL)
+		return EXIT_FAILURE;
+	if (o->path != NULL)
+		retval = select_loose(fk->ctx, o->path, f);
+	else if ((retval = pack_get(o->pack, o->entry, &buf, &len)) == EXIT_SUCCESS)
+		retval = select_buffer(fk->ctx, f, buf, len);
+	if (retval == EXIT_FAILURE) {
+		baseline_file_free(f);
+		return EXIT_FAILURE;
+	}
+	if ((buf = malloc(FSCK_BUFSIZE)) == NULL) {
+		baseline_file_close(f);
+		baseline_file_free(f);
+		return EXIT_FAILURE;
+	}
+	hash_init(&hash_ctx);
+	while ((n = baseline_file_read(f, buf, FSCK_BUFSIZE)) > 0) {
+		hash_update(&hash_ctx, buf, n);
+		*bytes += n;
+	}
+	hash_final(&hash_ctx, id->bytes);
+	free(buf);
+	baseline_file_close(f);
+	baseline_file_free(f);
+	return n == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static void
+fsck_file(struct fsck *fk, struct pack_obj *o, size_t *bytes)
+{
+	char *buf, *pos, *line, *sp;
+	u_int8_t hdr[OBJ_HDR_LEN];
+	int fd, kind;
+	size_t n = sizeof(hdr), size, len, linelen;
+	ssize_t r;
+	struct objid id;
+
+	if (o->path != NULL) {
+		if ((fd = open(o->path, O_RDONLY)) == -1) {
+			fsck_error(fk, o, "cannot be read");
+			return;
+		}
+		r = pread(fd, hdr, sizeof(hdr), 0);
+		close(fd);
+		n = r == -1 ? 0 : r;
+	} else if (pack_peek(o->pack, o->entry, hdr, &n) == EXIT_FAILURE) {
+		fsck_error(fk, o, "cannot be read");
+		return;
+	}
+	if (compress_header(hdr, n, &kind, &size) == EXIT_SUCCESS && kind == OBJ_CHUNKED) {
+		if (repack_load(o, &buf, &len) == EXIT_FAILURE) {
+			fsck_error(fk, o, "cannot be read");
+			return;
+		}
+		pos = buf + OBJ_HDR_LEN;
+		while ((line = next_line(&pos, buf + len, &linelen)) != NULL && linelen > 0) {
+			if ((sp = strchr(line, ' ')) != NULL)
+				*sp = '\0';
+			if (sp == NULL || objid_parse(line, &id) == EXIT_FAILURE) {
+				fsck_error(fk, o, "is a manifest that does not parse");
+				break;
+			}
+			fsck_ref(fk, o, O_FILE, &id);
+		}
+		free(buf);
+	}
+	if (fk->flags & OBJDB_FSCK_CONNECTIVITY)
+		return;
+	if (fsck_hash_file(fk, o, &id, bytes) == EXIT_FAILURE)
+		fsck_error(fk, o, "cannot be read");
+	else if (objid_cmp(&id, &o->id) != 0)
+		fsck_error(fk, o, "does not match its id");
+}
+
+static void
+fsck_tree(struct fsck *fk, struct pack_obj *o, size_t *bytes)
+{
+	char *buf;
+	size_t i, len;
+	struct objid id;
+	struct commit comm;
+	struct dir *d;
+
+	if (repack_load(o, &buf, &len) == EXIT_FAILURE) {
+		fsck_error(fk, o, "cannot be read");
+		return;
+	}
+	*bytes += len;
+	/* the ids of dirs and commits are hashes of their stored form */
+	if (!(fk->flags & OBJDB_FSCK_CONNECTIVITY)) {
+		hash_data(buf, len, id.bytes);
+		if (objid_cmp(&id, &o->id) != 0)
+			fsck_error(fk, o, "does not match its id");
+	}
+	if (o->type == O_DIR) {
+		if ((d = baseline_dir_new()) == NULL || dir_deserialize(buf, len, d) == EXIT_FAILURE) {
+			fsck_error(fk, o, "does not parse");
+			baseline_dir_free(d);
+			free(buf);
+			return;
+		}
+		for (i = 0 ; i < d->n_children ; i++)
+			fsck_ref(fk, o, S_ISDIR(d->children[i].mode) ? O_DIR : O_FILE, &d->children[i].id);
+		baseline_dir_free(d);
+		return;
+	}
+	memset(&comm, 0, sizeof(comm));
+	if (commit_deserialize(buf, len, &comm) == EXIT_FAILURE) {
+		fsck_error(fk, o, "does not parse");
+		free(buf);
+		return;
+	}
+	fsck_ref(fk, o, O_DIR, &comm.dir);
+	for (i = 0 ; i < comm.n_parents ; i++)
+		fsck_ref(fk, o, O_COMMIT, &comm.parents[i]);
+	free(buf);
+}
+
+static void *
+fsck_worker(void *arg)
+{
+	struct fsck *fk = arg;
+	size_t i, end, bytes = 0;
+	struct pack_obj *o;
+
+	for (;;) {
+		pthread_mutex_lock(&fk->lock);
+		i = fk->next;
+		end = fk->next = i + FSCK_BLOCK < fk->list->count ? i + FSCK_BLOCK : fk->list->count;
+		pthread_mutex_unlock(&fk->lock);
+		if (i == end)
+			break;
+		for ( ; i < end ; i++) {
+			o = &fk->list->objs[i];
+			if (o->type == O_FILE)
+				fsck_file(fk, o, &bytes);
+			else
+				fsck_tree(fk, o, &bytes);
+		}
+	}
+	pthread_mutex_lock(&fk->lock);
+	fk->bytes += bytes;
+	pthread_mutex_unlock(&fk->lock);
+	return NULL;
+}
+
+static int
+objdb_bl_fsck(struct objdb_ctx *ctx, int flags)
+{
+	char *db_dir_name, hex[OBJID_HEXLEN + 1];
+	int t, nthreads = worker_count(), retval = EXIT_FAILURE;
+	size_t i, n, n_loose, n_heads = 0;
+	double start, elapsed;
+	struct obj_list list = { NULL, 0, 0 };
+	struct objid *heads = NULL;
+	struct fsck fk;
+	pthread_t threads[WORKERS_MAX];
+
+	memset(&fk, 0, sizeof(fk));
+	fk.ctx = ctx;
+	fk.flags = flags;
+	fk.list = &list;
+	pthread_mutex_init(&fk.lock, NULL);
+	if ((db_dir_name = objdb_dir(ctx)) == NULL)
+		goto ret;
+	/* gc would remove objects under our feet */
+	if (db_lock(ctx, LOCK_SH) == EXIT_FAILURE)
+		goto ret;
+	start = now();
+	if (list_objects(ctx, db_dir_name, &list, &n_loose) == EXIT_FAILURE)
+		goto ret;
+	qsort(list.objs, list.count, sizeof(struct pack_obj), obj_id_cmp);
+	if ((n = check_midx(ctx)) > 0) {
+		fprintf(stderr, "error, the multi-pack index has %zu wrong entr%s.\n", n,
+		    n > 1 ? "ies" : "y");
+		fk.errors++;
+	}
+	for (t = 0 ; t < nthreads ; t++)
+		if (pthread_create(&threads[t], NULL, fsck_worker, &fk) != 0)
+			break;
+	if (t == 0)
+		fsck_worker(&fk);
+	while (t-- > 0)
+		pthread_join(threads[t], NULL);
+
+	if (refs_heads(db_dir_name, &heads, &n_heads) == EXIT_FAILURE) {
+		fprintf(stderr, "error, the branch heads cannot be read.\n");
+		fk.errors++;
+	}
+	for (i = 0 ; i < n_heads ; i++) {
+		if (fsck_has(&fk, O_COMMIT, &heads[i]))
+			continue;
+		fprintf(stderr, "error, a branch head names the missing commit %s.\n",
+		    objid_hex(&heads[i], hex));
+		fk.errors++;
+	}
+	elapsed = now() - start;
+	printf("checked %zu objects (%zu loose), %llu bytes%s in %.2f s, %.1f MB/s on %d thread%s\n",
+	    list.count, n_loose, fk.bytes,
+	    (flags & OBJDB_FSCK_CONNECTIVITY) ? " of dirs and commits" : "", elapsed,
+	    elapsed > 0 ? fk.bytes / elapsed / (1024 * 1024) : 0.0, nthreads, nthreads > 1 ? "s" : "");
+	if (fk.errors > 0)
+		printf("%zu error%s\n", fk.errors, fk.errors > 1 ? "s" : "");
+	else
+		retval = EXIT_SUCCESS;
+ret:
+	for (i = 0 ; i < list.count ; i++)
+		free(list.objs[i].path);
+	free(list.objs);
+	pthread_mutex_destroy(&fk.lock);
+	free(heads);
+	free(db_dir_name);
+	return retval;
+}
@@ -0,0 +1,1479 @@
+/*
+ * Copyright (c) 2014 Mohamed Aslan <maslan@sce.carleton.ca>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * a log-structured objdb: every object is a record appended to a single
+ * file, and found through a hash index. writing an object costs no file
+ * creation, no rename and no directory entry.
+ *
+ * objects.log	a struct log_header, then records back to back, each a
+ *		struct log_record followed by the content. the content of
+ *		files is deflated when LOG_F_DEFLATE is set.
+ * objects.idx	a struct log_idx_header, then a table of struct
+ *		log_idx_slot addressed by the id, with linear probing. it
+ *		covers the records of the log it names up to an offset.
+ *
+ * the records past the index are read back when the log is opened, and
+ * the index is rewritten once there are many of them. a process that
+ * appends holds an exclusive flock(2) on the log until it is closed,
+ * and first cuts what a crash left after the last complete record.
+ * repack compacts the log. branches are kept as in the fs backend.
+ * all integers are big-endian.
+ */
+
+#include <sys/types.h>
+#include <sys/file.h>	/* flock(2) */
+#include <sys/mman.h>	/* mmap(2) */
+#include <sys/stat.h>	/* fstat(2), mkdir(2) */
+
+#include <endian.h>	/* htobe*(3), be*toh(3) */
+#include <fcntl.h>	/* open(2) */
+#include <stddef.h>	/* offsetof() */
+#include <stdint.h>	/* UINT32_MAX */
+#include <stdio.h>	/* asprintf(3), rename(2) */
+#include <stdlib.h>	/* EXIT_*, calloc(3), qsort(3), arc4random_buf(3) */
+#include <string.h>	/* mem*(3) */
+#include <unistd.h>	/* pread(2), pwrite(2), ftruncate(2) */
+#include <zlib.h>	/* crc32() */
+
+#include "defaults.h"
+#include "compress.h"
+#include "config.h"
+#include "hash.h"
+#include "objcache.h"
+#include "objects.h"
+#include "objdb.h"
+#include "refs.h"
+#include "serialize.h"
+
+#define LOG_FILE	"objects.log"
+#define LOG_IDX_FILE	"objects.idx"
+#define LOG_MAGIC	"BLOG"
+#define LOG_IDX_MAGIC	"BLLX"
+#define LOG_REC_MAGIC	"BLRC"
+#define LOG_VERSION	1
+
+#define LOG_F_DEFLATE	0x01
+
+#define LOG_WBUF	(1024 * 1024)		/* appends are written that many bytes at a time */
+#define LOG_MEM_MAX	(8 * 1024 * 1024)	/* larger files are streamed in and out */
+#define LOG_TAIL_MIN	1024	/* records past the index before it is rewritten */
+#define LOG_MIN_SLOTS	256
+
+struct log_header {
+	char magic[4];
+	u_int32_t version;
+	u_int64_t log_id;	/* random, tells a compacted log from the old one */
+};
+
+struct log_record {
+	char magic[4];
+	u_int32_t len;		/* of the content, as stored */
+	u_int32_t crc;		/* crc32 of the content, as stored */
+	u_int8_t type;
+	u_int8_t flags;
+	u_int8_t pad[2];
+	u_int8_t id[OBJID_LEN];
+};
+
+struct log_idx_header {
+	char magic[4];
+	u_int32_t version;
+	u_int64_t log_id;
+	u_int64_t covered;	/* the records before that offset are indexed */
+	u_int32_t nslots;	/* a power of 2 */
+	u_int32_t count;
+};
+
+struct log_idx_slot {
+	u_int8_t id[OBJID_LEN];
+	u_int64_t offset;	/* of the record, 0 for a free slot */
+	u_int32_t len;
+	u_int8_t type;
+	u_int8_t flags;
+	u_int8_t pad[2];
+};
+
+/* a record, in host order */
+struct log_entry {
+	struct objid id;
+	u_int64_t offset;	/* 0 for a free slot */
+	u_int32_t len;
+	u_int8_t type;
+	u_int8_t flags;
+};
+
+struct log_table {
+	struct log_entry *slots;
+	size_t nslots;		/* a power of 2 */
+	size_t count;
+};
+
+struct objdb_log_priv {
+	int loaded;
+	int fd;
+	int rdonly;
+	int locked;
+	u_int64_t log_id;
+	u_int64_t end;		/* past the last complete record */
+	u_int8_t *idx;		/* the mapped index, NULL if unusable */
+	size_t idx_len;
+	u_int32_t idx_nslots;
+	u_int32_t idx_count;
+	struct log_table tail;	/* records past the index */
+	char *wbuf;		/* appended, not written yet */
+	size_t wlen;
+	u_int64_t written;	/* offset of wbuf[0] */
+	int dirty;		/* written since the last sync */
+	int batch_depth;
+	u_int64_t batch_start;
+	unsigned long long nappends;
+	unsigned long long nsyncs;
+};
+
+/* the content of a record past LOG_MEM_MAX, read as it is asked for */
+struct log_stream {
+	int fd;
+	off_t off;
+	size_t left;
+	u_int32_t crc;
+	u_int32_t want;
+};
+
+int objdb_log_get_ops(struct objdb_ops **);
+static int objdb_log_open(struct objdb_ctx **, const char *, const char *);
+static int objdb_log_close(struct objdb_ctx *);
+static int objdb_log_init(struct objdb_ctx *);
+static int objdb_log_insert_file(struct objdb_ctx *, struct file *);
+static int objdb_log_insert_dir(struct objdb_ctx *, struct dir *);
+static int objdb_log_insert_commit(struct objdb_ctx *, struct commit *);
+static int objdb_log_select_file(struct objdb_ctx *, const struct objid *, struct file *);
+static int objdb_log_select_dir(struct objdb_ctx *, const struct objid *, struct dir *);
+static int objdb_log_select_commit(struct objdb_ctx *, const struct objid *, struct commit *);
+static int objdb_log_resolve(struct objdb_ctx *, enum objtype, struct objid_match *);
+static int objdb_log_begin_batch(struct objdb_ctx *);
+static int objdb_log_commit_batch(struct objdb_ctx *);
+static int objdb_log_abort_batch(struct objdb_ctx *);
+static int objdb_log_remove(struct objdb_ctx *, const char *, const char *);
+static int objdb_log_branch_create(struct objdb_ctx *, const char *);
+static int objdb_log_branch_create_from(struct objdb_ctx *, const char *, const char *);
+static int objdb_log_branch_if_exists(struct objdb_ctx *, const char *, int *);
+static int objdb_log_branch_set_head(struct objdb_ctx *, const char *, const struct objid *);
+static int objdb_log_branch_get_head(struct objdb_ctx *, const char *, struct objid *);
+static int objdb_log_branch_ls(struct objdb_ctx *);
+static int objdb_log_repack(struct objdb_ctx *, int);
+
+static const struct objdb_ops log_objdb_ops = {
+	.name = "log",
+	.version = "1.0",
+	.init = objdb_log_init,
+	.open = objdb_log_open,
+	.close = objdb_log_close,
+	.insert_file = objdb_log_insert_file,
+	.insert_files = NULL,
+	.insert_dir = objdb_log_insert_dir,
+	.insert_commit = objdb_log_insert_commit,
+	.select_file = objdb_log_select_file,
+	.select_dir = objdb_log_select_dir,
+	.select_commit = objdb_log_select_commit,
+	.resolve = objdb_log_resolve,
+	.prefetch_dirs = NULL,
+	.select_commit_graph = NULL,
+	.commit_graph_write = NULL,
+	.begin_batch = objdb_log_begin_batch,
+	.commit_batch = objdb_log_commit_batch,
+	.abort_batch = objdb_log_abort_batch,
+	.remove = objdb_log_remove,
+	.branch_create = objdb_log_branch_create,
+	.branch_create_from = objdb_log_branch_create_from,
+	.branch_if_exists = objdb_log_branch_if_exists,
+	.branch_set_head = objdb_log_branch_set_head,
+	.branch_get_head = objdb_log_branch_get_head,
+	.branch_ls = objdb_log_branch_ls,
+	.fsck = NULL,
+	.compress = NULL,
+	.dedup = NULL,
+	.repack = objdb_log_repack,
+	.gc = NULL
+};
+
+int
+objdb_log_get_ops(struct objdb_ops **ops)
+{
+	if (ops == NULL)
+		return EXIT_FAILURE;
+	*ops = (struct objdb_ops *)malloc(sizeof(struct objdb_ops));
+	memcpy(*ops, &log_objdb_ops, sizeof(struct objdb_ops));
+	return EXIT_SUCCESS;
+}
+
+static char *
+log_path(struct objdb_ctx *ctx, const char *name)
+{
+	char *path = NULL;
+
+	if (asprintf(&path, "%s/%s/%s", ctx->db_path, ctx->db_name, name) == -1)
+		return NULL;
+	return path;
+}
+
+static int
+sync_dir(struct objdb_ctx *ctx)
+{
+	char *db_dir_name;
+	int retval;
+
+	if (objdb_fsync(ctx) == OBJDB_FSYNC_NONE)
+		return EXIT_SUCCESS;
+	if ((db_dir_name = objdb_dir(ctx)) == NULL)
+		return EXIT_FAILURE;
+	retval = objdb_sync_dir(db_dir_name);
+	free(db_dir_name);
+	return retval;
+}
+
+static size_t
+slot_of(int type, const struct objid *id)
+{
+	u_int64_t h;
+
+	/* ids are hashes already */
+	memcpy(&h, id->bytes, sizeof(h));
+	return (size_t)(h ^ type);
+}
+
+static struct log_entry *
+table_find(const struct log_table *t, int type, const struct objid *id)
+{
+	struct log_entry *e;
+	size_t i, mask;
+
+	if (t->count == 0)
+		return NULL;
+	mask = t->nslots - 1;
+	for (i = slot_of(type, id) & mask ; ; i = (i + 1) & mask) {
+		e = &t->slots[i];
+		if (e->offset == 0)
+			return NULL;
+		if (e->type == type && !memcmp(e->id.bytes, id->bytes, OBJID_LEN))
+			return e;
+	}
+}
+
+/*
+ * the table is kept at most half full
+ */
+static int
+table_insert(struct log_table *t, const struct log_entry *e)
+{
+	struct log_entry *slots, *old;
+	size_t i, k, mask, nslots;
+
+	if ((t->count + 1) * 2 > t->nslots) {
+		nslots = t->nslots ? t->nslots * 2 : LOG_MIN_SLOTS;
+		if ((slots = calloc(nslots, sizeof(struct log_entry))) == NULL)
+			return EXIT_FAILURE;
+		old = t->slots;
+		k = t->nslots;
+		t->slots = slots;
+		t->nslots = nslots;
+		t->count = 0;
+		for (i = 0 ; i < k ; i++)
+			if (old[i].offset != 0)
+				table_insert(t, &old[i]);
+		free(old);
+	}
+	mask = t->nslots - 1;
+	for (i = slot_of(e->type, &e->id) & mask ; t->slots[i].offset != 0 ; i = (i + 1) & mask)
+		;
+	t->slots[i] = *e;
+	t->count++;
+	return EXIT_SUCCESS;
+}
+
+static void
+table_free(struct log_table *t)
+{
+	free(t->slots);
+	memset(t, 0, sizeof(*t));
+}
+
+static int
+idx_find(const struct objdb_log_priv *priv, int type, const struct objid *id, struct log_entry *e)
+{
+	const struct log_idx_slot *slots, *s;
+	size_t i, n, mask;
+
+	if (priv->idx == NULL)
+		return EXIT_FAILURE;
+	slots = (const struct log_idx_slot *)(priv->idx + sizeof(struct log_idx_header));
+	mask = priv->idx_nslots - 1;
+	i = slot_of(type, id) & mask;
+	for (n = 0 ; n < priv->idx_nslots ; n++, i = (i + 1) & mask) {
+		s = &slots[i];
+		if (s->offset == 0)
+			return EXIT_FAILURE;
+		if (s->type == type && !memcmp(s->id, id->bytes, OBJID_LEN)) {
+			memcpy(e->id.bytes, s->id, OBJID_LEN);
+			e->offset = be64toh(s->offset);
+			e->len = be32toh(s->len);
+			e->type = s->type;
+			e->flags = s->flags;
+			return EXIT_SUCCESS;
+		}
+	}
+	return EXIT_FAILURE;
+}
+
+static int
+log_find(const struct objdb_log_priv *priv, int type, const struct objid *id, struct log_entry *e)
+{
+	struct log_entry *t;
+
+	if ((t = table_find(&priv->tail, type, id)) != NULL) {
+		*e = *t;
+		return EXIT_SUCCESS;
+	}
+	return idx_find(priv, type, id, e);
+}
+
+static int
+read_full(int fd, void *buf, size_t len, off_t off)
+{
+	ssize_t n;
+	size_t done = 0;
+
+	while (done < len) {
+		if ((n = pread(fd, (char *)buf + done, len - done, off + done)) <= 0)
+			return EXIT_FAILURE;
+		done += n;
+	}
+	return EXIT_SUCCESS;
+}
+
+static int
+write_full(int fd, const void *buf, size_t len, off_t off)
+{
+	ssize_t n;
+	size_t done = 0;
+
+	while (done < len) {
+		if ((n = pwrite(fd, (const char *)buf + done, len - done, off + done)) == -1)
+			return EXIT_FAILURE;
+		done += n;
+	}
+	return EXIT_SUCCESS;
+}
+
+/*
+ * reads back the records from priv->end on, stopping at the first one
+ * that is not complete or does not match its crc.
+ */
+static int
+log_replay(struct objdb_log_priv *priv)
+{
+	char *buf = NULL, *p;
+	size_t size = 0;
+	u_int64_t off;
+	struct stat s;
+	struct log_record r;
+	struct log_entry e, old;
+
+	if (fstat(priv->fd, &s) == -1)
+		return EXIT_FAILURE;
+	for (off = priv->end ; off + sizeof(r) <= (u_int64_t)s.st_size ; ) {
+		if (read_full(priv->fd, &r, sizeof(r), off) == EXIT_FAILURE ||
+		    memcmp(r.magic, LOG_REC_MAGIC, sizeof(r.magic)))
+			break;
+		e.len = be32toh(r.len);
+		if (off + sizeof(r) + e.len > (u_int64_t)s.st_size)
+			break;
+		if (e.len > size) {
+			if ((p = realloc(buf, e.len)) == NULL)
+				break;
+			buf = p;
+			size = e.len;
+		}
+		if (read_full(priv->fd, buf, e.len, off + sizeof(r)) == EXIT_FAILURE ||
+		    crc32(crc32(0L, Z_NULL, 0), (Bytef *)buf, e.len) != be32toh(r.crc))
+			break;
+		memcpy(e.id.bytes, r.id, OBJID_LEN);
+		e.offset = off;
+		e.type = r.type;
+		e.flags = r.flags;
+		if (log_find(priv, e.type, &e.id, &old) == EXIT_FAILURE &&
+		    table_insert(&priv->tail, &e) == EXIT_FAILURE)
+			break;
+		off += sizeof(r) + e.len;
+	}
+	free(buf);
+	priv->end = off;
+	return EXIT_SUCCESS;
+}
+
+/*
+ * the index is only used with the log it was written for
+ */
+static void
+map_index(struct objdb_ctx *ctx, u_int64_t size)
+{
+	char *path;
+	int fd;
+	struct stat s;
+	struct log_idx_header *h;
+	struct objdb_log_priv *priv = ctx->db_priv;
+
+	if ((path = log_path(ctx, LOG_IDX_FILE)) == NULL)
+		return;
+	fd = open(path, O_RDONLY);
+	free(path);
+	if (fd == -1)
+		return;
+	if (fstat(fd, &s) == -1 || (size_t)s.st_size < sizeof(*h)) {
+		close(fd);
+		return;
+	}
+	priv->idx = mmap(NULL, s.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (priv->idx == MAP_FAILED) {
+		priv->idx = NULL;
+		return;
+	}
+	priv->idx_len = s.st_size;
+	h = (struct log_idx_header *)priv->idx;
+	priv->idx_nslots = be32toh(h->nslots);
+	priv->idx_count = be32toh(h->count);
+	if (memcmp(h->magic, LOG_IDX_MAGIC, sizeof(h->magic)) ||
+	    be32toh(h->version) != LOG_VERSION || be64toh(h->log_id) != priv->log_id ||
+	    be64toh(h->covered) > size || be64toh(h->covered) < sizeof(struct log_header) ||
+	    priv->idx_nslots == 0 || (priv->idx_nslots & (priv->idx_nslots - 1)) ||
+	    priv->idx_count >= priv->idx_nslots ||
+	    priv->idx_len != sizeof(*h) + (size_t)priv->idx_nslots * sizeof(struct log_idx_slot)) {
+		munmap(priv->idx, priv->idx_len);
+		priv->idx = NULL;
+		return;
+	}
+	priv->end = be64toh(h->covered);
+}
+
+static void
+log_unload(struct objdb_log_priv *priv)
+{
+	if (!priv->loaded)
+		return;
+	if (priv->fd != -1)
+		close(priv->fd);	/* drops the lock */
+	if (priv->idx != NULL)
+		munmap(priv->idx, priv->idx_len);
+	priv->idx = NULL;
+	table_free(&priv->tail);
+	free(priv->wbuf);
+	priv->wbuf = NULL;
+	priv->wlen = 0;
+	priv->fd = -1;
+	priv->locked = 0;
+	priv->loaded = 0;
+}
+
+/*
+ * opens the log and its index on first use
+ */
+static struct objdb_log_priv *
+log_get(struct objdb_ctx *ctx)
+{
+	char *path;
+	struct stat s;
+	struct log_header h;
+	struct objdb_log_priv *priv = ctx->db_priv;
+
+	if (priv->loaded)
+		return priv;
+	if ((path = log_path(ctx, LOG_FILE)) == NULL)
+		return NULL;
+	priv->rdonly = 0;
+	if ((priv->fd = open(path, O_RDWR)) == -1) {
+		priv->rdonly = 1;
+		priv->fd = open(path, O_RDONLY);
+	}
+	free(path);
+	if (priv->fd == -1)
+		return NULL;
+	if (fstat(priv->fd, &s) == -1 ||
+	    read_full(priv->fd, &h, sizeof(h), 0) == EXIT_FAILURE ||
+	    memcmp(h.magic, LOG_MAGIC, sizeof(h.magic)) || be32toh(h.version) != LOG_VERSION) {
+		close(priv->fd);
+		priv->fd = -1;
+		return NULL;
+	}
+	priv->log_id = be64toh(h.log_id);
+	priv->end = sizeof(h);
+	map_index(ctx, s.st_size);
+	priv->loaded = 1;
+	if (log_replay(priv) == EXIT_FAILURE) {
+		log_unload(priv);
+		return NULL;
+	}
+	priv->written = priv->end;
+	return priv;
+}
+
+/*
+ * taken before the first append, and kept until the log is closed
+ */
+static int
+log_lock(struct objdb_ctx *ctx)
+{
+	char *path;
+	int retval = EXIT_FAILURE;
+	struct stat s, t;
+	struct objdb_log_priv *priv = ctx->db_priv;
+
+	if (priv->locked)
+		return EXIT_SUCCESS;
+	if (priv->rdonly || (path = log_path(ctx, LOG_FILE)) == NULL)
+		return EXIT_FAILURE;
+	for (;;) {
+		if (flock(priv->fd, LOCK_EX) == -1 || fstat(priv->fd, &s) == -1 ||
+		    stat(path, &t) == -1)
+			goto ret;
+		if (s.st_dev == t.st_dev && s.st_ino == t.st_ino)
+			break;
+		/* compacted in the meantime */
+		log_unload(priv);
+		if (log_get(ctx) == NULL)
+			goto ret;
+	}
+	/* what was appended in the meantime */
+	if (log_replay(priv) == EXIT_FAILURE)
+		goto ret;
+	/* and what a crash left after the last complete record */
+	if (fstat(priv->fd, &s) == -1 ||
+	    ((u_int64_t)s.st_size > priv->end && ftruncate(priv->fd, priv->end) == -1))
+		goto ret;
+	if (priv->wbuf == NULL && (priv->wbuf = malloc(LOG_WBUF)) == NULL)
+		goto ret;
+	priv->written = priv->end;
+	priv->wlen = 0;
+	priv->locked = 1;
+	retval = EXIT_SUCCESS;
+ret:
+	free(path);
+	return retval;
+}
+
+static int
+log_flush(struct objdb_log_priv *priv)
+{
+	if (priv->wlen == 0)
+		return EXIT_SUCCESS;
+	if (write_full(priv->fd, priv->wbuf, priv->wlen, priv->written) == EXIT_FAILURE)
+		return EXIT_FAILURE;
+	priv->written += priv->wlen;
+	priv->wlen = 0;
+	return EXIT_SUCCESS;
+}
+
+static int
+log_sync(struct objdb_ctx *ctx)
+{
+	struct objdb_log_priv *priv = ctx->db_priv;
+
+	if (!priv->loaded)
+		return EXIT_SUCCESS;
+	if (log_flush(priv) == EXIT_FAILURE)
+		return EXIT_FAILURE;
+	if (!priv->dirty || objdb_fsync(ctx) == OBJDB_FSYNC_NONE)
+		return EXIT_SUCCESS;
+	if (fdatasync(priv->fd) == -1)
+		return EXIT_FAILURE;
+	priv->nsyncs++;
+	priv->dirty = 0;
+	return EXIT_SUCCESS;
+}
+
+static void
+put_record(struct log_record *r, int type, int flags, const struct objid *id, size_t len,
+    u_int32_t crc)
+{
+	memset(r, 0, sizeof(*r));
+	memcpy(r->magic, LOG_REC_MAGIC, sizeof(r->magic));
+	r->len = htobe32(len);
+	r->crc = htobe32(crc);
+	r->type = type;
+	r->flags = flags;
+	memcpy(r->id, id->bytes, OBJID_LEN);
+}
+
+/*
+ * the record of the object was written at priv->end
+ */
+static int
+log_appended(struct objdb_ctx *ctx, int type, int flags, const struct objid *id, size_t len)
+{
+	struct log_entry e;
+	struct objdb_log_priv *priv = ctx->db_priv;
+
+	e.id = *id;
+	e.offset = priv->end;
+	e.len = len;
+	e.type = type;
+	e.flags = flags;
+	if (table_insert(&priv->tail, &e) == EXIT_FAILURE)
+		return EXIT_FAILURE;
+	priv->end += sizeof(struct log_record) + len;
+	priv->dirty = 1;
+	priv->nappends++;
+	if (objdb_fsync(ctx) == OBJDB_FSYNC_FULL)
+		return log_sync(ctx);
+	return EXIT_SUCCESS;
+}
+
+/*
+ * appends an object unless it is already there
+ */
+static int
+log_append(struct objdb_ctx *ctx, int type, int flags, const struct objid *id, const char *data,
+    size_t len)
+{
+	struct log_record r;
+	struct log_entry e;
+	struct objdb_log_priv *priv = ctx->db_priv;
+
+	if (len > UINT32_MAX)
+		return EXIT_FAILURE;
+	if (log_lock(ctx) == EXIT_FAILURE)
+		return EXIT_FAILURE;
+	/* another process may have appended it since it was looked up */
+	if (log_find(priv, type, id, &e) == EXIT_SUCCESS)
+		return EXIT_SUCCESS;
+	put_record(&r, type, flags, id, len, crc32(crc32(0L, Z_NULL, 0), (const Bytef *)data, len));
+	if (priv->wlen + sizeof(r) + len > LOG_WBUF && log_flush(priv) == EXIT_FAILURE)
+		return EXIT_FAILURE;
+	if (sizeof(r) + len > LOG_WBUF) {
+		if (write_full(priv->fd, &r, sizeof(r), priv->end) == EXIT_FAILURE ||
+		    write_full(priv->fd, data, len, priv->end + sizeof(r)) == EXIT_FAILURE)
+			return EXIT_FAILURE;
+		priv->written = priv->end + sizeof(r) + len;
+	} else {
+		memcpy(priv->wbuf + priv->wlen, &r, sizeof(r));
+		memcpy(priv->wbuf + priv->wlen + sizeof(r), data, len);
+		priv->wlen += sizeof(r) + len;
+	}
+	return log_appended(ctx, type, flags, id, len);
+}
+
+/*
+ * reads the content of a record into a NUL terminated buffer, inflated
+ */
+static int
+log_load(struct objdb_ctx *ctx, const struct log_entry *e, char **buf, size_t *len)
+{
+	char *raw;
+	size_t size;
+	int kind;
+	struct log_record r;
+	struct objdb_log_priv *priv = ctx->db_priv;
+
+	if (e->offset + sizeof(r) + e->len > priv->written && log_flush(priv) == EXIT_FAILURE)
+		return EXIT_FAILURE;
+	if ((raw = malloc((size_t)e->len + 1)) == NULL)
+		return EXIT_FAILURE;
+	if (read_full(priv->fd, &r, sizeof(r), e->offset) == EXIT_FAILURE ||
+	    read_full(priv->fd, raw, e->len, e->offset + sizeof(r)) == EXIT_FAILURE ||
+	    memcmp(r.magic, LOG_REC_MAGIC, sizeof(r.magic)) || be32toh(r.len) != e->len ||
+	    memcmp(r.id, e->id.bytes, OBJID_LEN) ||
+	    crc32(crc32(0L, Z_NULL, 0), (Bytef *)raw, e->len) != be32toh(r.crc)) {
+		free(raw);
+		return EXIT_FAILURE;
+	}
+	raw[e->len] = '\0';
+	if (!(e->flags & LOG_F_DEFLATE)) {
+		*buf = raw;
+		*len = e->len;
+		return EXIT_SUCCESS;
+	}
+	if (compress_decode(raw, e->len, buf, len) == EXIT_FAILURE)
+		return EXIT_FAILURE;
+	/* there is no ambiguity to keep a header for */
+	if (compress_header(*buf, *len, &kind, &size) == EXIT_SUCCESS && kind == OBJ_STORED) {
+		memmove(*buf, *buf + OBJ_HDR_LEN, *len - OBJ_HDR_LEN + 1);
+		*len -= OBJ_HDR_LEN;
+	}
+	return EXIT_SUCCESS;
+}
+
+static int
+log_select(struct objdb_ctx *ctx, int type, const struct objid *id, char **buf, size_t *len)
+{
+	struct log_entry e;
+	struct objdb_log_priv *priv;
+
+	if ((priv = log_get(ctx)) == NULL || log_find(priv, type, id, &e) == EXIT_FAILURE)
+		return EXIT_FAILURE;
+	return log_load(ctx, &e, buf, len);
+}
+
+static ssize_t
+log_stream_read(void *stream, void *buf, size_t len)
+{
+	struct log_stream *s = stream;
+	ssize_t n;
+
+	if (len > s->left)
+		len = s->left;
+	if (len == 0)
+		return 0;
+	if ((n = pread(s->fd, buf, len, s->off)) <= 0)
+		return -1;
+	s->crc = crc32(s->crc, buf, n);
+	s->off += n;
+	s->left -= n;
+	if (s->left == 0 && s->crc != s->want)
+		return -1;
+	return n;
+}
+
+static void
+log_stream_close(void *stream)
+{
+	struct log_stream *s = stream;
+
+	close(s->fd);
+	free(s);
+}
+
+/*
+ * the index is rewritten from sorted entries, for a log whose records
+ * before covered are all among them
+ */
+static int
+write_index(struct objdb_ctx *ctx, u_int64_t log_id, u_int64_t covered, struct log_entry *ents,
+    size_t n)
+{
+	char *path = NULL, *tmp_path = NULL;
+	size_t i, j, mask, nslots, size;
+	int fd = -1, retval = EXIT_FAILURE;
+	u_int8_t *buf = NULL;
+	struct log_idx_header *h;
+	struct log_idx_slot *slots;
+
+	if (n > UINT32_MAX / 4)
+		return EXIT_FAILURE;
+	/* at most 3/4 full */
+	for (nslots = LOG_MIN_SLOTS ; nslots < n + n / 3 + 1 ; nslots *= 2)
+		;
+	size = sizeof(*h) + nslots * sizeof(struct log_idx_slot);
+	if ((buf = calloc(1, size)) == NULL)
+		goto ret;
+	h = (struct log_idx_header *)buf;
+	memcpy(h->magic, LOG_IDX_MAGIC, sizeof(h->magic));
+	h->version = htobe32(LOG_VERSION);
+	h->log_id = htobe64(log_id);
+	h->covered = htobe64(covered);
+	h->nslots = htobe32(nslots);
+	h->count = htobe32(n);
+	slots = (struct log_idx_slot *)(buf + sizeof(*h));
+	mask = nslots - 1;
+	for (i = 0 ; i < n ; i++) {
+		for (j = slot_of(ents[i].type, &ents[i].id) & mask ; slots[j].offset != 0 ;
+		    j = (j + 1) & mask)
+			;
+		memcpy(slots[j].id, ents[i].id.bytes, OBJID_LEN);
+		slots[j].offset = htobe64(ents[i].offset);
+		slots[j].len = htobe32(ents[i].len);
+		slots[j].type = ents[i].type;
+		slots[j].flags = ents[i].flags;
+	}
+	if ((path = log_path(ctx, LOG_IDX_FILE)) == NULL ||
+	    asprintf(&tmp_path, "%s.XXXXXX", path) == -1) {
+		tmp_path = NULL;
+		goto ret;
+	}
+	if ((fd = mkstemp(tmp_path)) == -1)
+		goto ret;
+	if (write_full(fd, buf, size, 0) == EXIT_FAILURE ||
+	    (objdb_fsync(ctx) != OBJDB_FSYNC_NONE && fsync(fd) == -1) ||
+	    rename(tmp_path, path) == -1) {
+		unlink(tmp_path);
+		goto ret;
+	}
+	retval = EXIT_SUCCESS;
+ret:
+	if (fd != -1)
+		close(fd);
+	free(buf);
+	free(path);
+	free(tmp_path);
+	return retval;
+}
+
+/*
+ * every object of the log, the index first
+ */
+static int
+log_entries(struct objdb_log_priv *priv, struct log_entry **ents, size_t *n)
+{
+	const struct log_idx_slot *slots;
+	size_t i, k = 0;
+
+	*ents = calloc((size_t)priv->idx_count + priv->tail.count + 1, sizeof(struct log_entry));
+	if (*ents == NULL)
+		return EXIT_FAILURE;
+	if (priv->idx != NULL) {
+		slots = (const struct log_idx_slot *)(priv->idx + sizeof(struct log_idx_header));
+		for (i = 0 ; i < priv->idx_nslots && k < priv->idx_count ; i++) {
+			if (slots[i].offset == 0)
+				continue;
+			memcpy((*ents)[k].id.bytes, slots[i].id, OBJID_LEN);
+			(*ents)[k].offset = be64toh(slots[i].offset);
+			(*ents)[k].len = be32toh(slots[i].len);
+			(*ents)[k].type = slots[i].type;
+			(*ents)[k].flags = slots[i].flags;
+			k++;
+		}
+	}
+	for (i = 0 ; i < priv->tail.nslots ; i++)
+		if (priv->tail.slots[i].offset != 0)
+			(*ents)[k++] = priv->tail.slots[i];
+	*n = k;
+	return EXIT_SUCCESS;
+}
+
+static int
+entry_offset_cmp(const void *a, const void *b)
+{
+	const struct log_entry *x = a, *y = b;
+
+	if (x->offset < y->offset)
+		return -1;
+	return x->offset > y->offset;
+}
+
+static int
+objdb_log_open(struct objdb_ctx **ctx, const char *db_name, const char *db_path)
+{
+	struct objdb_log_priv *priv;
+
+	if (ctx == NULL)
+		return EXIT_FAILURE;
+	*ctx = (struct objdb_ctx *)malloc(sizeof(struct objdb_ctx));
+	asprintf(&((*ctx)->db_name), "%s", db_name);
+	asprintf(&((*ctx)->db_path), "%s", db_path);
+	asprintf(&((*ctx)->db_version), "1.0");
+	/* the log is opened on first use */
+	priv = calloc(1, sizeof(struct objdb_log_priv));
+	priv->fd = -1;
+	(*ctx)->db_priv = priv;
+	(*ctx)->cache = NULL;
+	(*ctx)->cache_loaded = 0;
+	(*ctx)->fsync_loaded = 0;
+	return EXIT_SUCCESS;
+}
+
+static int
+objdb_log_close(struct objdb_ctx *ctx)
+{
+	int retval = EXIT_SUCCESS;
+	size_t n;
+	struct log_entry *ents;
+	struct objdb_log_priv *priv;
+
+	if (ctx == NULL)
+		return EXIT_FAILURE;
+	if ((priv = ctx->db_priv) != NULL && priv->loaded) {
+		retval = log_sync(ctx);
+		/* while the lock keeps the log from growing */
+		if (retval == EXIT_SUCCESS && priv->locked && priv->tail.count >= LOG_TAIL_MIN &&
+		    priv->tail.count * 64 >= priv->idx_count &&
+		    log_entries(priv, &ents, &n) == EXIT_SUCCESS) {
+			write_index(ctx, priv->log_id, priv->end, ents, n);
+			free(ents);
+		}
+#ifdef DEBUG
+		fprintf(stderr, "[DEBUG] log: %llu appends, %llu syncs, %u indexed, %zu past the index.\n",
+		    priv->nappends, priv->nsyncs, priv->idx ? priv->idx_count : 0, priv->tail.count);
+#endif
+		log_unload(priv);
+	}
+#ifdef DEBUG
+	if (ctx->cache != NULL)
+		fprintf(stderr, "[DEBUG] object cache: %llu hits, %llu misses, %llu evictions, %zu bytes.\n",
+		    ctx->cache->hits, ctx->cache->misses, ctx->cache->evictions, ctx->cache->used);
+#endif
+	objcache_free(ctx->cache);
+	free(ctx->db_priv);
+	free(ctx->db_name);
+	free(ctx->db_path);
+	free(ctx->db_version);
+	free(ctx);
+	return retval;
+}
+
+static int
+objdb_log_init(struct objdb_ctx *ctx)
+{
+	char *db_dir_name = NULL, *path = NULL;
+	int fd, retval = EXIT_FAILURE;
+	struct stat s;
+	struct log_header h;
+
+	/* check if path exists */
+	if (stat(ctx->db_path, &s) == -1)
+		goto ret;
+	if ((db_dir_name = objdb_dir(ctx)) == NULL)
+		goto ret;
+	if (mkdir(db_dir_name, S_IRUSR | S_IWUSR | S_IXUSR) != 0)
+		goto ret;
+	asprintf(&path, "%s/branches", db_dir_name);
+	if (mkdir(path, S_IRUSR | S_IWUSR | S_IXUSR) != 0)
+		goto ret;
+	free(path);
+	asprintf(&path, "%s/tags", db_dir_name);
+	if (mkdir(path, S_IRUSR | S_IWUSR | S_IXUSR) != 0)
+		goto ret;
+	free(path);
+	asprintf(&path, "%s/%s", db_dir_name, LOG_FILE);
+	if ((fd = open(path, O_WRONLY | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR)) == -1)
+		goto ret;
+	memcpy(h.magic, LOG_MAGIC, sizeof(h.magic));
+	h.version = htobe32(LOG_VERSION);
+	arc4random_buf(&h.log_id, sizeof(h.log_id));
+	if (write_full(fd, &h, sizeof(h), 0) == EXIT_SUCCESS)
+		retval = EXIT_SUCCESS;
+	close(fd);
+ret:
+	free(db_dir_name);
+	free(path);
+	return retval;
+}
+
+/*
+ * files up to LOG_MEM_MAX are read into memory once, hashed, and
+ * deflated unless they look compressed already. larger ones are stored
+ * as they are, read once to hash them and a second time to copy them
+ * when they turn out to be new.
+ */
+static int
+objdb_log_insert_file(struct objdb_ctx *ctx, struct file *file)
+{
+	char *buf = NULL, *data, *out = NULL, *p;
+	size_t len, size = 0, outlen;
+	ssize_t n;
+	off_t offset;
+	int big = 0, flags = 0, kind, retval = EXIT_FAILURE;
+	u_int32_t crc;
+	u_int64_t copied;
+	struct hash_ctx hash_ctx;
+	struct log_record r;
+	struct log_entry e;
+	struct objdb_log_priv *priv;
+
+	if ((priv = log_get(ctx)) == NULL)
+		return EXIT_FAILURE;
+	/* save file offset */
+	offset = (file->loc == LOC_FS) ? lseek(file->fd, 0, SEEK_CUR) : file->pos;
+	hash_init(&hash_ctx);
+	crc = crc32(0L, Z_NULL, 0);
+	if (file->loc == LOC_MEM) {
+		data = file->buffer;
+		len = file->size;
+		hash_update(&hash_ctx, data, len);
+	} else {
+		len = 0;
+		do {
+			if (!big && len == size) {
+				/* past that, only the hash and the crc are kept */
+				if (file->loc == LOC_FS && len >= LOG_MEM_MAX) {
+					big = 1;
+					crc = crc32(crc, (Bytef *)buf, len);
+				} else if ((p = realloc(buf, size ? size * 2 : 65536)) == NULL)
+					goto ret;
+				else {
+					buf = p;
+					size = size ? size * 2 : 65536;
+				}
+			}
+			if (big) {
+				if ((n = baseline_file_read(file, buf, size)) == -1)
+					goto ret;
+				crc = crc32(crc, (Bytef *)buf, n);
+			} else if ((n = baseline_file_read(file, buf + len, size - len)) == -1)
+				goto ret;
+			hash_update(&hash_ctx, big ? buf : buf + len, n);
+			len += n;
+		} while (n > 0);
+		data = buf;
+	}
+	hash_final(&hash_ctx, file->id.bytes);
+	if (log_find(priv, O_FILE, &file->id, &e) == EXIT_SUCCESS) {
+		retval = EXIT_SUCCESS;
+		goto ret;
+	}
+
+	if (!big) {
+		if (compress_buffer(data, len, objdb_config_num("compresslevel", COMPRESS_LEVEL, 9),
+		    &out, &outlen) == EXIT_FAILURE)
+			goto ret;
+		if (out != NULL && compress_header(out, outlen, &kind, &size) == EXIT_SUCCESS &&
+		    kind == OBJ_DEFLATE) {
+			flags = LOG_F_DEFLATE;
+			data = out;
+			len = outlen;
+		}
+		retval = log_append(ctx, O_FILE, flags, &file->id, data, len);
+		goto ret;
+	}
+
+	/* the crc of what was hashed above is only needed to notice a change */
+	if (len > UINT32_MAX || log_lock(ctx) == EXIT_FAILURE || log_flush(priv) == EXIT_FAILURE)
+		goto ret;
+	if (log_find(priv, O_FILE, &file->id, &e) == EXIT_SUCCESS) {
+		retval = EXIT_SUCCESS;
+		goto ret;
+	}
+	if (file->loc == LOC_FS)
+		lseek(file->fd, offset, SEEK_SET);
+	put_record(&r, O_FILE, 0, &file->id, len, crc);
+	if (write_full(priv->fd, &r, sizeof(r), priv->end) == EXIT_FAILURE)
+		goto fail;
+	copied = 0;
+	crc = crc32(0L, Z_NULL, 0);
+	while ((n = baseline_file_read(file, buf, size)) > 0) {
+		if (copied + n > len ||
+		    write_full(priv->fd, buf, n, priv->end + sizeof(r) + copied) == EXIT_FAILURE)
+			goto fail;
+		crc = crc32(crc, (Bytef *)buf, n);
+		copied += n;
+	}
+	/* changed since it was hashed */
+	if (n == -1 || copied != len || crc != be32toh(r.crc))
+		goto fail;
+	priv->written = priv->end + sizeof(r) + len;
+	retval = log_appended(ctx, O_FILE, 0, &file->id, len);
+	goto ret;
+fail:
+	ftruncate(priv->fd, priv->end);
+ret:
+	/* restore file offset */
+	if (file->loc == LOC_FS)
+		lseek(file->fd, offset, SEEK_SET);
+	else
+		file->pos = offset;
+	free(buf);
+	free(out);
+	return retval;
+}
+
+static int
+objdb_log_insert_dir(struct objdb_ctx *ctx, struct dir *dir)
+{
+	char *data;
+	size_t len;
+	int retval = EXIT_SUCCESS;
+	struct log_entry e;
+	struct objdb_log_priv *priv;
+
+	if ((priv = log_get(ctx)) == NULL)
+		return EXIT_FAILURE;
+	if (dir_gen_id_and_serialize(dir, &data, &len) == EXIT_FAILURE)
+		return EXIT_FAILURE;
+	if (log_find(priv, O_DIR, &dir->id, &e) == EXIT_FAILURE)
+		retval = log_append(ctx, O_DIR, 0, &dir->id, data, len);
+	free(data);
+	return retval;
+}
+
+static int
+objdb_log_insert_commit(struct objdb_ctx *ctx, struct commit *comm)
+{
+	char *data;
+	size_t len;
+	int retval = EXIT_SUCCESS;
+	struct log_entry e;
+	struct objdb_log_priv *priv;
+
+	if ((priv = log_get(ctx)) == NULL)
+		return EXIT_FAILURE;
+	if (commit_gen_id_and_serialize(comm, &data, &len) == EXIT_FAILURE)
+		return EXIT_FAILURE;
+	if (log_find(priv, O_COMMIT, &comm->id, &e) == EXIT_FAILURE)
+		retval = log_append(ctx, O_COMMIT, 0, &comm->id, data, len);
+	free(data);
+	return retval;
+}
+
+static int
+objdb_log_select_file(struct objdb_ctx *ctx, const struct objid *id, struct file *f)
+{
+	char *buf;
+	size_t len;
+	struct log_entry e;
+	struct log_stream *s;
+	struct objdb_log_priv *priv;
+
+	if ((priv = log_get(ctx)) == NULL || log_find(priv, O_FILE, id, &e) == EXIT_FAILURE)
+		return EXIT_FAILURE;
+	if ((e.flags & LOG_F_DEFLATE) || e.len <= LOG_MEM_MAX) {
+		if (log_load(ctx, &e, &buf, &len) == EXIT_FAILURE)
+			return EXIT_FAILURE;
+		f->loc = LOC_MEM;
+		f->buffer = buf;
+		f->size = len;
+		f->pos = 0;
+		f->id = *id;
+		return EXIT_SUCCESS;
+	}
+	/* a descriptor of its own, it outlives the log being compacted */
+	if (log_flush(priv) == EXIT_FAILURE || (s = calloc(1, sizeof(*s))) == NULL)
+		return EXIT_FAILURE;
+	if ((s->fd = dup(priv->fd)) == -1 ||
+	    read_full(s->fd, &s->want, sizeof(s->want),
+	    e.offset + offsetof(struct log_record, crc)) == EXIT_FAILURE) {
+		if (s->fd != -1)
+			close(s->fd);
+		free(s);
+		return EXIT_FAILURE;
+	}
+	s->want = be32toh(s->want);
+	s->crc = crc32(0L, Z_NULL, 0);
+	s->off = e.offset + sizeof(struct log_record);
+	s->left = e.len;
+	f->loc = LOC_STREAM;
+	f->stream = s;
+	f->stream_read = log_stream_read;
+	f->stream_close = log_stream_close;
+	f->stream_send = NULL;
+	f->id = *id;
+	return EXIT_SUCCESS;
+}
+
+static int
+objdb_log_select_dir(struct objdb_ctx *ctx, const struct objid *id, struct dir *d)
+{
+	char *buf = NULL;
+	size_t len;
+	int retval;
+
+	if (objcache_get_dir(objdb_cache(ctx), id, d) == EXIT_SUCCESS)
+		return EXIT_SUCCESS;
+	if (log_select(ctx, O_DIR, id, &buf, &len) == EXIT_FAILURE)
+		return EXIT_FAILURE;
+	d->id = *id;
+	if ((retval = dir_deserialize(buf, len, d)) == EXIT_FAILURE) {
+		free(buf);
+		return retval;
+	}
+	objcache_put_dir(ctx->cache, d);
+	return retval;
+}
+
+static int
+objdb_log_select_commit(struct objdb_ctx *ctx, const struct objid *id, struct commit *comm)
+{
+	char *buf = NULL;
+	size_t len;
+	int retval;
+
+	if (objcache_get_commit(objdb_cache(ctx), id, comm) == EXIT_SUCCESS)
+		return EXIT_SUCCESS;
+	if (log_select(ctx, O_COMMIT, id, &buf, &len) == EXIT_FAILURE)
+		return EXIT_FAILURE;
+	comm->id = *id;
+	if ((retval = commit_deserialize(buf, len, comm)) == EXIT_FAILURE) {
+		free(buf);
+		return retval;
+	}
+	objcache_put_commit(ctx->cache, comm);
+	return retval;
+}
+
+/*
+ * the index is a hash table, abbreviated ids are looked for in all of it
+ * and in what was appended since
+ */
+static int
+objdb_log_resolve(struct objdb_ctx *ctx, enum objtype type, struct objid_match *m)
+{
+	size_t i, n;
+	struct log_entry *ents;
+	struct objdb_log_priv *priv;
+
+	if ((priv = log_get(ctx)) == NULL || m == NULL)
+		return EXIT_FAILURE;
+	if (log_entries(priv, &ents, &n) == EXIT_FAILURE)
+		return EXIT_FAILURE;
+	for (i = 0 ; i < n ; i++)
+		if (ents[i].type == type && objid_match_test(m, ents[i].id.bytes) &&
+		    objid_match_add(m, &ents[i].id) == EXIT_FAILURE) {
+			free(ents);
+			return EXIT_FAILURE;
+		}
+	free(ents);
+	return EXIT_SUCCESS;
+}
+
+/*
+ * appends are already grouped by the write buffer, a batch only marks
+ * where to cut the log if it is aborted
+ */
+static int
+objdb_log_begin_batch(struct objdb_ctx *ctx)
+{
+	struct objdb_log_priv *priv;
+
+	if ((priv = log_get(ctx)) == NULL || log_lock(ctx) == EXIT_FAILURE)
+		return EXIT_FAILURE;
+	if (priv->batch_depth++ == 0)
+		priv->batch_start = priv->end;
+	return EXIT_SUCCESS;
+}
+
+static int
+objdb_log_commit_batch(struct objdb_ctx *ctx)
+{
+	struct objdb_log_priv *priv = ctx->db_priv;
+
+	if (priv->batch_depth == 0)
+		return EXIT_FAILURE;
+	if (--priv->batch_depth > 0)
+		return EXIT_SUCCESS;
+	return log_flush(priv);
+}
+
+static int
+objdb_log_abort_batch(struct objdb_ctx *ctx)
+{
+	size_t i, n;
+	struct log_table old;
+	struct objdb_log_priv *priv = ctx->db_priv;
+
+	if (priv->batch_depth == 0)
+		return EXIT_FAILURE;
+	priv->batch_depth = 0;
+	if (priv->batch_start >= priv->written)
+		priv->wlen = priv->batch_start - priv->written;
+	else {
+		if (ftruncate(priv->fd, priv->batch_start) == -1)
+			return EXIT_FAILURE;
+		priv->written = priv->batch_start;
+		priv->wlen = 0;
+	}
+	priv->end = priv->batch_start;
+	old = priv->tail;
+	memset(&priv->tail, 0, sizeof(priv->tail));
+	for (i = 0, n = 0 ; i < old.nslots ; i++)
+		if (old.slots[i].offset != 0 && old.slots[i].offset < priv->batch_start &&
+		    table_insert(&priv->tail, &old.slots[i]) == EXIT_FAILURE)
+			n++;
+	table_free(&old);
+	return n ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static int
+objdb_log_remove(struct objdb_ctx *ctx, const char *group_name, const char *obj_name)
+{
+	return EXIT_SUCCESS;
+}
+
+static int
+objdb_log_branch_create(struct objdb_ctx *ctx, const char *branch_name)
+{
+	char *db_dir_name;
+	int retval;
+
+	if (branch_name == NULL || (db_dir_name = objdb_dir(ctx)) == NULL)
+		return EXIT_FAILURE;
+	retval = refs_branch_create(db_dir_name, branch_name, NULL);
+	free(db_dir_name);
+	return retval;
+}
+
+static int
+objdb_log_branch_create_from(struct objdb_ctx *ctx, const char *new_branch, const char *orig_branch)
+{
+	char *db_dir_name;
+	int retval;
+	struct objid orig_head;
+
+	if (new_branch == NULL || orig_branch == NULL)
+		return EXIT_FAILURE;
+	if (objdb_log_branch_get_head(ctx, orig_branch, &orig_head) == EXIT_FAILURE)
+		return EXIT_FAILURE;
+	if ((db_dir_name = objdb_dir(ctx)) == NULL)
+		return EXIT_FAILURE;
+	/* the new branch shows up with its head */
+	retval = refs_branch_create(db_dir_name, new_branch, &orig_head);
+	free(db_dir_name);
+	return retval;
+}
+
+static int
+objdb_log_branch_if_exists(struct objdb_ctx *ctx, const char *branch_name, int *exist)
+{
+	char *db_dir_name;
+	int retval;
+
+	if (branch_name == NULL || (db_dir_name = objdb_dir(ctx)) == NULL)
+		return EXIT_FAILURE;
+	retval = refs_branch_exists(db_dir_name, branch_name, exist);
+	free(db_dir_name);
+	return retval;
+}
+
+static int
+objdb_log_branch_set_head(struct objdb_ctx *ctx, const char *branch_name, const struct objid *head_objid)
+{
+	char *db_dir_name;
+	int retval = EXIT_FAILURE;
+
+	if ((db_dir_name = objdb_dir(ctx)) == NULL)
+		return EXIT_FAILURE;
+	/* the head must never name a commit that is not on disk */
+	if (log_sync(ctx) == EXIT_SUCCESS)
+		retval = refs_branch_set_head(db_dir_name, branch_name, head_objid,
+		    objdb_fsync(ctx) != OBJDB_FSYNC_NONE);
+	free(db_dir_name);
+	return retval;
+}
+
+static int
+objdb_log_branch_get_head(struct objdb_ctx *ctx, const char *branch_name, struct objid *head_objid)
+{
+	char *db_dir_name;
+	int retval;
+
+	if (ctx == NULL || branch_name == NULL || head_objid == NULL)
+		return EXIT_FAILURE;
+	if ((db_dir_name = objdb_dir(ctx)) == NULL)
+		return EXIT_FAILURE;
+	retval = refs_branch_get_head(db_dir_name, branch_name, head_objid);
+	free(db_dir_name);
+	return retval;
+}
+
+static int
+objdb_log_branch_ls(struct objdb_ctx *ctx)
+{
+	char *db_dir_name;
+	int retval;
+
+	if ((db_dir_name = objdb_dir(ctx)) == NULL)
+		return EXIT_FAILURE;
+	retval = refs_branch_ls(db_dir_name);
+	free(db_dir_name);
+	return retval;
+}
+
+/*
+ * compaction: the records the log holds an index entry for are copied,
+ * in the order they were appended, into a new log with an id of its
+ * own. duplicates, aborted batches and whatever follows a torn record
+ * are left behind. the new log and its index replace the old ones by
+ * renames, processes still reading the old log keep their descriptor.
+ * the log is always compacted whole, whatever the factor.
+ */
+static int
+objdb_log_repack(struct objdb_ctx *ctx, int factor)
+{
+	char *path = NULL, *tmp_path = NULL, *buf = NULL, *p;
+	size_t i, n, size = 0, dropped = 0;
+	int fd = -1, retval = EXIT_FAILURE;
+	u_int64_t off, old_end;
+	struct log_header h;
+	struct log_record r;
+	struct log_entry *ents = NULL;
+	FILE *fp = NULL;
+	struct objdb_log_priv *priv;
+
+	if ((priv = log_get(ctx)) == NULL || log_lock(ctx) == EXIT_FAILURE ||
+	    log_flush(priv) == EXIT_FAILURE)
+		return EXIT_FAILURE;
+	if (log_entries(priv, &ents, &n) == EXIT_FAILURE)
+		return EXIT_FAILURE;
+	qsort(ents, n, sizeof(struct log_entry), entry_offset_cmp);
+	if ((path = log_path(ctx, LOG_FILE)) == NULL ||
+	    asprintf(&tmp_path, "%s.XXXXXX", path) == -1) {
+		tmp_path = NULL;
+		goto ret;
+	}
+	if ((fd = mkstemp(tmp_path)) == -1)
+		goto ret;
+	if ((fp = fdopen(fd, "w")) == NULL)
+		goto fail;
+	memcpy(h.magic, LOG_MAGIC, sizeof(h.magic));
+	h.version = htobe32(LOG_VERSION);
+	arc4random_buf(&h.log_id, sizeof(h.log_id));
+	if (fwrite(&h, sizeof(h), 1, fp) != 1)
+		goto fail;
+	off = sizeof(h);
+	for (i = 0 ; i < n ; i++) {
+		if (ents[i].len > size) {
+			if ((p = realloc(buf, ents[i].len)) == NULL)
+				goto fail;
+			buf = p;
+			size = ents[i].len;
+		}
+		if (read_full(priv->fd, &r, sizeof(r), ents[i].offset) == EXIT_FAILURE ||
+		    read_full(priv->fd, buf, ents[i].len, ents[i].offset + sizeof(r)) == EXIT_FAILURE ||
+		    memcmp(r.magic, LOG_REC_MAGIC, sizeof(r.magic)) ||
+		    memcmp(r.id, ents[i].id.bytes, OBJID_LEN) || be32toh(r.len) != ents[i].len ||
+		    crc32(crc32(0L, Z_NULL, 0), (Bytef *)buf, ents[i].len) != be32toh(r.crc)) {
+			/* damaged, there is nothing to copy */
+			ents[i].offset = 0;
+			dropped++;
+			continue;
+		}
+		if (fwrite(&r, sizeof(r), 1, fp) != 1 ||
+		    fwrite(buf, 1, ents[i].len, fp) != ents[i].len)
+			goto fail;
+		ents[i].offset = off;
+		off += sizeof(r) + ents[i].len;
+	}
+	if (fflush(fp) == EOF || (objdb_fsync(ctx) != OBJDB_FSYNC_NONE && fsync(fd) == -1))
+		goto fail;
+	/* the damaged ones are sorted first, out of the way */
+	qsort(ents, n, sizeof(struct log_entry), entry_offset_cmp);
+	for (i = 0 ; i < n && ents[i].offset == 0 ; i++)
+		;
+	if (rename(tmp_path, path) == -1)
+		goto fail;
+	/* an index that does not match the new log is ignored */
+	if (write_index(ctx, be64toh(h.log_id), off, ents + i, n - i) == EXIT_FAILURE)
+		goto ret;
+	sync_dir(ctx);
+	old_end = priv->end;
+	printf("compacted %zu objects, %llu bytes -> %llu bytes", n - dropped,
+	    (unsigned long long)old_end, (unsigned long long)off);
+	if (dropped > 0)
+		printf(", %zu damaged objects dropped", dropped);
+	printf("\n");
+	retval = EXIT_SUCCESS;
+	goto ret;
+fail:
+	unlink(tmp_path);
+ret:
+	if (fp != NULL)
+		fclose(fp);
+	else if (fd != -1)
+		close(fd);
+	/* reopened on next use, the old log or the new one */
+	log_unload(priv);
+	free(ents);
+	free(buf);
+	free(path);
+	free(tmp_path);
+	return retval;
+}
@@ -0,0 +1,775 @@
+/*
+ * Copyright (c) 2014 Mohamed Aslan <maslan@sce.carleton.ca>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * an objdb that keeps every object in a hash table in memory, for
+ * throwaway repositories and for timing the rest of baseline without
+ * the cost of the file system.
+ *
+ * unless the "snapshot" variable of the config is "no", the objects
+ * are read from objects.snap in the db dir on first use, and written
+ * back to it when the db is closed if any was added:
+ *
+ *	"BLMS", version (32-bit), count (64-bit), then count times:
+ *	type (8-bit), id, length (64-bit), content
+ *
+ * all integers are big-endian. branches are kept as in the fs backend.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>	/* mkdir(2), stat(2) */
+
+#include <endian.h>	/* htobe*(3), be*toh(3) */
+#include <fcntl.h>	/* open(2) */
+#include <stdint.h>	/* SIZE_MAX */
+#include <stdio.h>	/* asprintf(3), fread(3), rename(2) */
+#include <stdlib.h>	/* EXIT_*, malloc(3), mkstemp(3) */
+#include <string.h>	/* mem*(3), strcmp(3) */
+#include <unistd.h>	/* fsync(2), unlink(2) */
+
+#include "defaults.h"
+#include "config.h"
+#include "hash.h"
+#include "objcache.h"
+#include "objects.h"
+#include "objdb.h"
+#include "refs.h"
+#include "serialize.h"
+
+#define SNAP_FILE	"objects.snap"
+#define SNAP_MAGIC	"BLMS"
+#define SNAP_VERSION	1
+
+#define MEM_MIN_BUCKETS	1024
+
+struct mem_obj {
+	struct mem_obj *next;		/* in its bucket */
+	struct mem_obj *batch_next;	/* inserted by the current batch */
+	enum objtype type;
+	struct objid id;
+	size_t len;
+	char data[];			/* NUL terminated */
+};
+
+struct objdb_mem_priv {
+	int loaded;
+	struct mem_obj **buckets;
+	size_t nbuckets;	/* a power of 2 */
+	size_t count;
+	size_t bytes;
+	int dirty;		/* added to since the snapshot was read */
+	int batch_depth;
+	struct mem_obj *batch;
+};
+
+int objdb_mem_get_ops(struct objdb_ops **);
+static int objdb_mem_open(struct objdb_ctx **, const char *, const char *);
+static int objdb_mem_close(struct objdb_ctx *);
+static int objdb_mem_init(struct objdb_ctx *);
+static int objdb_mem_insert_file(struct objdb_ctx *, struct file *);
+static int objdb_mem_insert_dir(struct objdb_ctx *, struct dir *);
+static int objdb_mem_insert_commit(struct objdb_ctx *, struct commit *);
+static int objdb_mem_select_file(struct objdb_ctx *, const struct objid *, struct file *);
+static int objdb_mem_select_dir(struct objdb_ctx *, const struct objid *, struct dir *);
+static int objdb_mem_select_commit(struct objdb_ctx *, const struct objid *, struct commit *);
+static int objdb_mem_resolve(struct objdb_ctx *, enum objtype, struct objid_match *);
+static int objdb_mem_begin_batch(struct objdb_ctx *);
+static int objdb_mem_commit_batch(struct objdb_ctx *);
+static int objdb_mem_abort_batch(struct objdb_ctx *);
+static int objdb_mem_remove(struct objdb_ctx *, const char *, const char *);
+static int objdb_mem_branch_create(struct objdb_ctx *, const char *);
+static int objdb_mem_branch_create_from(struct objdb_ctx *, const char *, const char *);
+static int objdb_mem_branch_if_exists(struct objdb_ctx *, const char *, int *);
+static int objdb_mem_branch_set_head(struct objdb_ctx *, const char *, const struct objid *);
+static int objdb_mem_branch_get_head(struct objdb_ctx *, const char *, struct objid *);
+static int objdb_mem_branch_ls(struct objdb_ctx *);
+
+static const struct objdb_ops mem_objdb_ops = {
+	.name = "mem",
+	.version = "1.0",
+	.init = objdb_mem_init,
+	.open = objdb_mem_open,
+	.close = objdb_mem_close,
+	.insert_file = objdb_mem_insert_file,
+	.insert_files = NULL,
+	.insert_dir = objdb_mem_insert_dir,
+	.insert_commit = objdb_mem_insert_commit,
+	.select_file = objdb_mem_select_file,
+	.select_dir = objdb_mem_select_dir,
+	.select_commit = objdb_mem_select_commit,
+	.resolve = objdb_mem_resolve,
+	.prefetch_dirs = NULL,
+	.select_commit_graph = NULL,
+	.commit_graph_write = NULL,
+	.begin_batch = objdb_mem_begin_batch,
+	.commit_batch = objdb_mem_commit_batch,
+	.abort_batch = objdb_mem_abort_batch,
+	.remove = objdb_mem_remove,
+	.branch_create = objdb_mem_branch_create,
+	.branch_create_from = objdb_mem_branch_create_from,
+	.branch_if_exists = objdb_mem_branch_if_exists,
+	.branch_set_head = objdb_mem_branch_set_head,
+	.branch_get_head = objdb_mem_branch_get_head,
+	.branch_ls = objdb_mem_branch_ls,
+	.fsck = NULL,
+	.compress = NULL,
+	.dedup = NULL,
+	.repack = NULL,
+	.gc = NULL
+};
+
+int
+objdb_mem_get_ops(struct objdb_ops **ops)
+{
+	if (ops == NULL)
+		return EXIT_FAILURE;
+	*ops = (struct objdb_ops *)malloc(sizeof(struct objdb_ops));
+	memcpy(*ops, &mem_objdb_ops, sizeof(struct objdb_ops));
+	return EXIT_SUCCESS;
+}
+
+static char *
+snap_path(struct objdb_ctx *ctx)
+{
+	char *path = NULL;
+
+	if (asprintf(&path, "%s/%s/%s", ctx->db_path, ctx->db_name, SNAP_FILE) == -1)
+		return NULL;
+	return path;
+}
+
+static int
+snap_enabled(void)
+{
+	const char *val;
+
+	return (val = baseline_config_get_val("snapshot")) == NULL || strcmp(val, "no");
+}
+
+static size_t
+bucket_of(const struct objdb_mem_priv *priv, enum objtype type, const struct objid *id)
+{
+	size_t h;
+
+	/* ids are hashes already */
+	memcpy(&h, id->bytes, sizeof(h));
+	return (h ^ type) & (priv->nbuckets - 1);
+}
+
+static struct mem_obj *
+mem_find(const struct objdb_mem_priv *priv, enum objtype type, const struct objid *id)
+{
+	struct mem_obj *o;
+
+	if (priv->nbuckets == 0)
+		return NULL;
+	for (o = priv->buckets[bucket_of(priv, type, id)] ; o != NULL ; o = o->next)
+		if (o->type == type && !memcmp(o->id.bytes, id->bytes, OBJID_LEN))
+			return o;
+	return NULL;
+}
+
+/*
+ * the table grows to keep one object per bucket on average
+ */
+static int
+mem_link(struct objdb_mem_priv *priv, struct mem_obj *o)
+{
+	struct mem_obj **old, *p, *next;
+	size_t i, n, b;
+
+	if (priv->count + 1 > priv->nbuckets) {
+		n = priv->nbuckets ? priv->nbuckets * 2 : MEM_MIN_BUCKETS;
+		old = priv->buckets;
+		if ((priv->buckets = calloc(n, sizeof(struct mem_obj *))) == NULL) {
+			priv->buckets = old;
+			return EXIT_FAILURE;
+		}
+		i = priv->nbuckets;
+		priv->nbuckets = n;
+		while (i-- > 0)
+			for (p = old[i] ; p != NULL ; p = next) {
+				next = p->next;
+				b = bucket_of(priv, p->type, &p->id);
+				p->next = priv->buckets[b];
+				priv->buckets[b] = p;
+			}
+		free(old);
+	}
+	b = bucket_of(priv, o->type, &o->id);
+	o->next = priv->buckets[b];
+	priv->buckets[b] = o;
+	priv->count++;
+	priv->bytes += o->len;
+	return EXIT_SUCCESS;
+}
+
+static void
+mem_unlink(struct objdb_mem_priv *priv, struct mem_obj *o)
+{
+	struct mem_obj **pp;
+
+	for (pp = &priv->buckets[bucket_of(priv, o->type, &o->id)] ; *pp != NULL ; pp = &(*pp)->next)
+		if (*pp == o) {
+			*pp = o->next;
+			priv->count--;
+			priv->bytes -= o->len;
+			return;
+		}
+}
+
+static struct mem_obj *
+mem_obj_new(enum objtype type, const struct objid *id, size_t len)
+{
+	struct mem_obj *o;
+
+	if ((o = malloc(sizeof(struct mem_obj) + len + 1)) == NULL)
+		return NULL;
+	o->next = o->batch_next = NULL;
+	o->type = type;
+	o->id = *id;
+	o->len = len;
+	o->data[len] = '\0';
+	return o;
+}
+
+static int
+snap_load(struct objdb_ctx *ctx)
+{
+	char *path, magic[4];
+	int retval = EXIT_FAILURE;
+	u_int8_t type;
+	u_int32_t version;
+	u_int64_t count, len, i;
+	struct objid id;
+	struct mem_obj *o;
+	struct objdb_mem_priv *priv = ctx->db_priv;
+	FILE *fp;
+
+	if ((path = snap_path(ctx)) == NULL)
+		return EXIT_FAILURE;
+	fp = fopen(path, "r");
+	free(path);
+	/* nothing was kept */
+	if (fp == NULL)
+		return EXIT_SUCCESS;
+	if (fread(magic, sizeof(magic), 1, fp) != 1 || memcmp(magic, SNAP_MAGIC, sizeof(magic)) ||
+	    fread(&version, sizeof(version), 1, fp) != 1 || be32toh(version) != SNAP_VERSION ||
+	    fread(&count, sizeof(count), 1, fp) != 1)
+		goto ret;
+	count = be64toh(count);
+	for (i = 0 ; i < count ; i++) {
+		if (fread(&type, sizeof(type), 1, fp) != 1 || type > O_COMMIT ||
+		    fread(id.bytes, OBJID_LEN, 1, fp) != 1 || fread(&len, sizeof(len), 1, fp) != 1)
+			goto ret;
+		len = be64toh(len);
+		if (len > SIZE_MAX - sizeof(struct mem_obj) - 1 ||
+		    (o = mem_obj_new(type, &id, len)) == NULL)
+			goto ret;
+		if (fread(o->data, 1, len, fp) != len || mem_link(priv, o) == EXIT_FAILURE) {
+			free(o);
+			goto ret;
+		}
+	}
+	retval = EXIT_SUCCESS;
+ret:
+	fclose(fp);
+	return retval;
+}
+
+/*
+ * replaced by a rename, never seen half written
+ */
+static int
+snap_write(struct objdb_ctx *ctx)
+{
+	char *path = NULL, *tmp_path = NULL;
+	int fd, retval = EXIT_FAILURE;
+	u_int8_t type;
+	u_int32_t version = htobe32(SNAP_VERSION);
+	u_int64_t count, len;
+	size_t i;
+	struct mem_obj *o;
+	struct objdb_mem_priv *priv = ctx->db_priv;
+	FILE *fp;
+
+	if ((path = snap_path(ctx)) == NULL || asprintf(&tmp_path, "%s.XXXXXX", path) == -1) {
+		free(path);
+		return EXIT_FAILURE;
+	}
+	if ((fd = mkstemp(tmp_path)) == -1)
+		goto ret;
+	if ((fp = fdopen(fd, "w")) == NULL) {
+		close(fd);
+		unlink(tmp_path);
+		goto ret;
+	}
+	count = htobe64(priv->count);
+	fwrite(SNAP_MAGIC, 4, 1, fp);
+	fwrite(&version, sizeof(version), 1, fp);
+	fwrite(&count, sizeof(count), 1, fp);
+	for (i = 0 ; i < priv->nbuckets ; i++)
+		for (o = priv->buckets[i] ; o != NULL ; o = o->next) {
+			type = o->type;
+			len = htobe64(o->len);
+			fwrite(&type, sizeof(type), 1, fp);
+			fwrite(o->id.bytes, OBJID_LEN, 1, fp);
+			fwrite(&len, sizeof(len), 1, fp);
+			fwrite(o->data, 1, o->len, fp);
+		}
+	if (fflush(fp) == EOF || ferror(fp) ||
+	    (objdb_fsync(ctx) != OBJDB_FSYNC_NONE && fsync(fd) == -1)) {
+		fclose(fp);
+		unlink(tmp_path);
+		goto ret;
+	}
+	fclose(fp);
+	if (rename(tmp_path, path) == -1) {
+		unlink(tmp_path);
+		goto ret;
+	}
+	retval = EXIT_SUCCESS;
+ret:
+	free(path);
+	free(tmp_path);
+	return retval;
+}
+
+static struct objdb_mem_priv *
+mem_get(struct objdb_ctx *ctx)
+{
+	struct objdb_mem_priv *priv = ctx->db_priv;
+
+	if (priv->loaded)
+		return priv;
+	priv->loaded = 1;
+	if (snap_enabled() && snap_load(ctx) == EXIT_FAILURE)
+		return NULL;
+	return priv;
+}
+
+/*
+ * keeps a copy of data, unless the object is already there
+ */
+static int
+mem_store(struct objdb_ctx *ctx, enum objtype type, const struct objid *id, const char *data,
+    size_t len)
+{
+	struct mem_obj *o;
+	struct objdb_mem_priv *priv;
+
+	if ((priv = mem_get(ctx)) == NULL)
+		return EXIT_FAILURE;
+	if (mem_find(priv, type, id) != NULL)
+		return EXIT_SUCCESS;
+	if ((o = mem_obj_new(type, id, len)) == NULL)
+		return EXIT_FAILURE;
+	memcpy(o->data, data, len);
+	if (mem_link(priv, o) == EXIT_FAILURE) {
+		free(o);
+		return EXIT_FAILURE;
+	}
+	if (priv->batch_depth > 0) {
+		o->batch_next = priv->batch;
+		priv->batch = o;
+	}
+	priv->dirty = 1;
+	return EXIT_SUCCESS;
+}
+
+/*
+ * a copy of the content, NUL terminated
+ */
+static int
+mem_load(struct objdb_ctx *ctx, enum objtype type, const struct objid *id, char **buf, size_t *len)
+{
+	struct mem_obj *o;
+	struct objdb_mem_priv *priv;
+
+	if ((priv = mem_get(ctx)) == NULL || (o = mem_find(priv, type, id)) == NULL)
+		return EXIT_FAILURE;
+	if ((*buf = malloc(o->len + 1)) == NULL)
+		return EXIT_FAILURE;
+	memcpy(*buf, o->data, o->len + 1);
+	*len = o->len;
+	return EXIT_SUCCESS;
+}
+
+static int
+objdb_mem_open(struct objdb_ctx **ctx, const char *db_name, const char *db_path)
+{
+	if (ctx == NULL)
+		return EXIT_FAILURE;
+	*ctx = (struct objdb_ctx *)malloc(sizeof(struct objdb_ctx));
+	asprintf(&((*ctx)->db_name), "%s", db_name);
+	asprintf(&((*ctx)->db_path), "%s", db_path);
+	asprintf(&((*ctx)->db_version), "1.0");
+	/* the snapshot is read on first use */
+	(*ctx)->db_priv = calloc(1, sizeof(struct objdb_mem_priv));
+	(*ctx)->cache = NULL;
+	(*ctx)->cache_loaded = 0;
+	(*ctx)->fsync_loaded = 0;
+	return EXIT_SUCCESS;
+}
+
+static int
+objdb_mem_close(struct objdb_ctx *ctx)
+{
+	int retval = EXIT_SUCCESS;
+	size_t i;
+	struct mem_obj *o, *next;
+	struct objdb_mem_priv *priv;
+
+	if (ctx == NULL)
+		return EXIT_FAILURE;
+	if ((priv = ctx->db_priv) != NULL) {
+		/* an unfinished batch leaves nothing behind */
+		if (priv->batch_depth > 0)
+			objdb_mem_abort_batch(ctx);
+		if (priv->dirty && snap_enabled())
+			retval = snap_write(ctx);
+#ifdef DEBUG
+		fprintf(stderr, "[DEBUG] mem: %zu objects, %zu bytes.\n", priv->count, priv->bytes);
+#endif
+		for (i = 0 ; i < priv->nbuckets ; i++)
+			for (o = priv->buckets[i] ; o != NULL ; o = next) {
+				next = o->next;
+				free(o);
+			}
+		free(priv->buckets);
+	}
+	objcache_free(ctx->cache);
+	free(ctx->db_priv);
+	free(ctx->db_name);
+	free(ctx->db_path);
+	free(ctx->db_version);
+	free(ctx);
+	return retval;
+}
+
+static int
+objdb_mem_init(struct objdb_ctx *ctx)
+{
+	char *db_dir_name = NULL, *path = NULL;
+	int retval = EXIT_FAILURE;
+	struct stat s;
+
+	/* check if path exists */
+	if (stat(ctx->db_path, &s) == -1)
+		goto ret;
+	if ((db_dir_name = objdb_dir(ctx)) == NULL)
+		goto ret;
+	if (mkdir(db_dir_name, S_IRUSR | S_IWUSR | S_IXUSR) != 0)
+		goto ret;
+	asprintf(&path, "%s/branches", db_dir_name);
+	if (mkdir(path, S_IRUSR | S_IWUSR | S_IXUSR) != 0)
+		goto ret;
+	free(path);
+	asprintf(&path, "%s/tags", db_dir_name);
+	if (mkdir(path, S_IRUSR | S_IWUSR | S_IXUSR) != 0)
+		goto ret;
+	retval = EXIT_SUCCESS;
+ret:
+	free(db_dir_name);
+	free(path);
+	return retval;
+}
+
+static int
+objdb_mem_insert_file(struct objdb_ctx *ctx, struct file *file)
+{
+	char *buf = NULL, *p;
+	size_t len = 0, size = 0;
+	ssize_t n;
+	off_t offset;
+	int retval = EXIT_FAILURE;
+	struct hash_ctx hash_ctx;
+
+	/* save file offset */
+	offset = (file->loc == LOC_FS) ? lseek(file->fd, 0, SEEK_CUR) : file->pos;
+	hash_init(&hash_ctx);
+	if (file->loc == LOC_MEM) {
+		hash_update(&hash_ctx, file->buffer, file->size);
+		hash_final(&hash_ctx, file->id.bytes);
+		retval = mem_store(ctx, O_FILE, &file->id, file->buffer, file->size);
+		goto ret;
+	}
+	do {
+		if (len == size) {
+			size = size ? size * 2 : 65536;
+			if ((p = realloc(buf, size)) == NULL)
+				goto ret;
+			buf = p;
+		}
+		if ((n = baseline_file_read(file, buf + len, size - len)) == -1)
+			goto ret;
+		hash_update(&hash_ctx, buf + len, n);
+		len += n;
+	} while (n > 0);
+	hash_final(&hash_ctx, file->id.bytes);
+	retval = mem_store(ctx, O_FILE, &file->id, buf, len);
+ret:
+	/* restore file offset */
+	if (file->loc == LOC_FS)
+		lseek(file->fd, offset, SEEK_SET);
+	else
+		file->pos = offset;
+	free(buf);
+	return retval;
+}
+
+static int
+objdb_mem_insert_dir(struct objdb_ctx *ctx, struct dir *dir)
+{
+	char *data;
+	size_t len;
+	int retval;
+
+	if (dir_gen_id_and_serialize(dir, &data, &len) == EXIT_FAILURE)
+		return EXIT_FAILURE;
+	retval = mem_store(ctx, O_DIR, &dir->id, data, len);
+	free(data);
+	return retval;
+}
+
+static int
+objdb_mem_insert_commit(struct objdb_ctx *ctx, struct commit *comm)
+{
+	char *data;
+	size_t len;
+	int retval;
+
+	if (commit_gen_id_and_serialize(comm, &data, &len) == EXIT_FAILURE)
+		return EXIT_FAILURE;
+	retval = mem_store(ctx, O_COMMIT, &comm->id, data, len);
+	free(data);
+	return retval;
+}
+
+static int
+objdb_mem_select_file(struct objdb_ctx *ctx, const struct objid *id, struct file *f)
+{
+	char *buf;
+	size_t len;
+
+	if (mem_load(ctx, O_FILE, id, &buf, &len) == EXIT_FAILURE)
+		return EXIT_FAILURE;
+	f->loc = LOC_MEM;
+	f->buffer = buf;
+	f->size = len;
+	f->pos = 0;
+	f->id = *id;
+	return EXIT_SUCCESS;
+}
+
+static int
+objdb_mem_select_dir(struct objdb_ctx *ctx, const struct objid *id, struct dir *d)
+{
+	char *buf = NULL;
+	size_t len;
+	int retval;
+
+	if (objcache_get_dir(objdb_cache(ctx), id, d) == EXIT_SUCCESS)
+		return EXIT_SUCCESS;
+	if (mem_load(ctx, O_DIR, id, &buf, &len) == EXIT_FAILURE)
+		return EXIT_FAILURE;
+	d->id = *id;
+	if ((retval = dir_deserialize(buf, len, d)) == EXIT_FAILURE) {
+		free(buf);
+		return retval;
+	}
+	objcache_put_dir(ctx->cache, d);
+	return retval;
+}
+
+static int
+objdb_mem_select_commit(struct objdb_ctx *ctx, const struct objid *id, struct commit *comm)
+{
+	char *buf = NULL;
+	size_t len;
+	int retval;
+
+	if (objcache_get_commit(objdb_cache(ctx), id, comm) == EXIT_SUCCESS)
+		return EXIT_SUCCESS;
+	if (mem_load(ctx, O_COMMIT, id, &buf, &len) == EXIT_FAILURE)
+		return EXIT_FAILURE;
+	comm->id = *id;
+	if ((retval = commit_deserialize(buf, len, comm)) == EXIT_FAILURE) {
+		free(buf);
+		return retval;
+	}
+	objcache_put_commit(ctx->cache, comm);
+	return retval;
+}
+
+/*
+ * the table is in memory, abbreviated ids are looked for in all of it
+ */
+static int
+objdb_mem_resolve(struct objdb_ctx *ctx, enum objtype type, struct objid_match *m)
+{
+	size_t i;
+	struct mem_obj *o;
+	struct objdb_mem_priv *priv;
+
+	if ((priv = mem_get(ctx)) == NULL || m == NULL)
+		return EXIT_FAILURE;
+	for (i = 0 ; i < priv->nbuckets ; i++)
+		for (o = priv->buckets[i] ; o != NULL ; o = o->next)
+			if (o->type == type && objid_match_test(m, o->id.bytes) &&
+			    objid_match_add(m, &o->id) == EXIT_FAILURE)
+				return EXIT_FAILURE;
+	return EXIT_SUCCESS;
+}
+
+/*
+ * the objects of a batch are only remembered, to be dropped if the
+ * batch is aborted
+ */
+static int
+objdb_mem_begin_batch(struct objdb_ctx *ctx)
+{
+	struct objdb_mem_priv *priv = ctx->db_priv;
+
+	priv->batch_depth++;
+	return EXIT_SUCCESS;
+}
+
+static int
+objdb_mem_commit_batch(struct objdb_ctx *ctx)
+{
+	struct objdb_mem_priv *priv = ctx->db_priv;
+
+	if (priv->batch_depth == 0)
+		return EXIT_FAILURE;
+	if (--priv->batch_depth == 0)
+		priv->batch = NULL;
+	return EXIT_SUCCESS;
+}
+
+static int
+objdb_mem_abort_batch(struct objdb_ctx *ctx)
+{
+	struct mem_obj *o, *next;
+	struct objdb_mem_priv *priv = ctx->db_priv;
+
+	if (priv->batch_depth == 0)
+		return EXIT_FAILURE;
+	for (o = priv->batch ; o != NULL ; o = next) {
+		next = o->batch_next;
+		mem_unlink(priv, o);
+		free(o);
+	}
+	priv->batch = NULL;
+	priv->batch_depth = 0;
+	return EXIT_SUCCESS;
+}
+
+static int
+objdb_mem_remove(struct objdb_ctx *ctx, const char *group_name, const char *obj_name)
+{
+	return EXIT_SUCCESS;
+}
+
+static int
+objdb_mem_branch_create(struct objdb_ctx *ctx, const char *branch_name)
+{
+	char *db_dir_name;
+	int retval;
+
+	if (branch_name == NULL || (db_dir_name = objdb_dir(ctx)) == NULL)
+		return EXIT_FAILURE;
+	retval = refs_branch_create(db_dir_name, branch_name, NULL);
+	free(db_dir_name);
+	return retval;
+}
+
+static int
+objdb_mem_branch_create_from(struct objdb_ctx *ctx, const char *new_branch, const char *orig_branch)
+{
+	char *db_dir_name;
+	int retval;
+	struct objid orig_head;
+
+	if (new_branch == NULL || orig_branch == NULL)
+		return EXIT_FAILURE;
+	if (objdb_mem_branch_get_head(ctx, orig_branch, &orig_head) == EXIT_FAILURE)
+		return EXIT_FAILURE;
+	if ((db_dir_name = objdb_dir(ctx)) == NULL)
+		return EXIT_FAILURE;
+	/* the new branch shows up with its head */
+	retval = refs_branch_create(db_dir_name, new_branch, &orig_head);
+	free(db_dir_name);
+	return retval;
+}
+
+static int
+objdb_mem_branch_if_exists(struct objdb_ctx *ctx, const char *branch_name, int *exist)
+{
+	char *db_dir_name;
+	int retval;
+
+	if (branch_name == NULL || (db_dir_name = objdb_dir(ctx)) == NULL)
+		return EXIT_FAILURE;
+	retval = refs_branch_exists(db_dir_name, branch_name, exist);
+	free(db_dir_name);
+	return retval;
+}
+
+/*
+ * the head may name objects only in memory yet, the snapshot is written
+ * at close. a crash in between loses them, like any throwaway repository.
+ */
+static int
+objdb_mem_branch_set_head(struct objdb_ctx *ctx, const char *branch_name, const struct objid *head_objid)
+{
+	char *db_dir_name;
+	int retval;
+
+	if ((db_dir_name = objdb_dir(ctx)) == NULL)
+		return EXIT_FAILURE;
+	retval = refs_branch_set_head(db_dir_name, branch_name, head_objid, 0);
+	free(db_dir_name);
+	return retval;
+}
+
+static int
+objdb_mem_branch_get_head(struct objdb_ctx *ctx, const char *branch_name, struct objid *head_objid)
+{
+	char *db_dir_name;
+	int retval;
+
+	if (ctx == NULL || branch_name == NULL || head_objid == NULL)
+		return EXIT_FAILURE;
+	if ((db_dir_name = objdb_dir(ctx)) == NULL)
+		return EXIT_FAILURE;
+	retval = refs_branch_get_head(db_dir_name, branch_name, head_objid);
+	free(db_dir_name);
+	return retval;
+}
+
+static int
+objdb_mem_branch_ls(struct objdb_ctx *ctx)
+{
+	char *db_dir_name;
+	int retval;
+
+	if ((db_dir_name = objdb_dir(ctx)) == NULL)
+		return EXIT_FAILURE;
+	retval = refs_branch_ls(db_dir_name);
+	free(db_dir_name);
+	return retval;
+}
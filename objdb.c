@@ -0,0 +1,117 @@
+/*
+ * Copyright (c) 2014 Mohamed Aslan <maslan@sce.carleton.ca>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * helpers shared by the objdb backends
+ */
+
+#include <sys/types.h>
+
+#include <fcntl.h>	/* open(2) */
+#include <limits.h>	/* INT_MAX */
+#include <stdio.h>	/* asprintf(3) */
+#include <stdlib.h>	/* EXIT_*, strtonum(3) */
+#include <string.h>	/* strcmp(3) */
+#include <unistd.h>	/* fsync(2) */
+
+#include "config.h"
+#include "objcache.h"
+#include "objdb.h"
+
+char *
+objdb_dir(struct objdb_ctx *ctx)
+{
+	char *db_dir_name = NULL;
+
+	if (ctx == NULL)
+		return NULL;
+	if (asprintf(&db_dir_name, "%s/%s", ctx->db_path, ctx->db_name) == -1)
+		return NULL;
+	return db_dir_name;
+}
+
+/*
+ * numeric configuration variables, def if unset or invalid
+ */
+int
+objdb_config_num(const char *key, int def, int max)
+{
+	const char *val, *errstr;
+	int n;
+
+	if ((val = baseline_config_get_val(key)) == NULL || *val == '\0')
+		return def;
+	n = strtonum(val, 0, max, &errstr);
+	if (errstr != NULL)
+		return def;
+	return n;
+}
+
+/*
+ * the budget is read from the config, which is not loaded yet when the
+ * database is opened.
+ */
+struct objcache *
+objdb_cache(struct objdb_ctx *ctx)
+{
+	int budget;
+
+	if (ctx->cache_loaded)
+		return ctx->cache;
+	ctx->cache_loaded = 1;
+	if ((budget = objdb_config_num("cachesize", OBJCACHE_SIZE, INT_MAX)) == 0)
+		return NULL;
+	if (objcache_new(budget, &ctx->cache) == EXIT_FAILURE)
+		ctx->cache = NULL;
+	return ctx->cache;
+}
+
+/*
+ * the fsync policy, read from the configuration on first use
+ */
+int
+objdb_fsync(struct objdb_ctx *ctx)
+{
+	const char *val;
+
+	if (ctx->fsync_loaded)
+		return ctx->fsync;
+	ctx->fsync_loaded = 1;
+	ctx->fsync = OBJDB_FSYNC_BATCH;
+	if ((val = baseline_config_get_val("fsync")) == NULL || *val == '\0')
+		return ctx->fsync;
+	if (!strcmp(val, "none"))
+		ctx->fsync = OBJDB_FSYNC_NONE;
+	else if (!strcmp(val, "full"))
+		ctx->fsync = OBJDB_FSYNC_FULL;
+	return ctx->fsync;
+}
+
+/*
+ * makes the entries of a directory durable, whatever the policy
+ */
+int
+objdb_sync_dir(const char *path)
+{
+	int fd, retval = EXIT_SUCCESS;
+
+	if ((fd = open(path, O_RDONLY | O_DIRECTORY)) == -1)
+		return EXIT_FAILURE;
+	if (fsync(fd) == -1)
+		retval = EXIT_FAILURE;
+	close(fd);
+	return retval;
+}
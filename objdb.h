@@ -20,12 +20,37 @@
 #include <sys/types.h>
 #include "objects.h"
 
+struct graph_commit;
+struct objcache;
+
 struct objdb_ctx {
 	char *db_name;
 	char *db_path;
 	char *db_version;
+	void *db_priv;		/* backend private data */
+	struct objcache *cache;	/* parsed dirs and commits, may be NULL */
+	int cache_loaded;
+	int fsync_loaded;
+	int fsync;		/* OBJDB_FSYNC_*, see objdb_fsync() */
+};
+
+/*
+ * an object kept by gc whatever the branches reach, such as what is
+ * staged but not yet committed
+ */
+struct objdb_root {
+	enum objtype type;
+	struct objid id;
 };
 
+/* fsync policies */
+#define OBJDB_FSYNC_NONE	0
+#define OBJDB_FSYNC_BATCH	1	/* what was written at once, before a head moves */
+#define OBJDB_FSYNC_FULL	2	/* every object as it is written */
+
+/* fsck flags */
+#define OBJDB_FSCK_CONNECTIVITY	0x01	/* what names what, nothing is rehashed */
+
 struct objdb_ops {
 	char *name;
 	char *version;
@@ -36,23 +61,52 @@ struct objdb_ops {
 	/* file ops */
 	//int (*insert_from_file)(struct objdb_ctx *, enum objdb_type, const char *, char **);
 	int (*insert_file)(struct objdb_ctx *, struct file *);
+	int (*insert_files)(struct objdb_ctx *, struct file **, size_t);	/* optional */
 	int (*insert_dir)(struct objdb_ctx *, struct dir *);
 	int (*insert_commit)(struct objdb_ctx *, struct commit *);
-	int (*select_file)(struct objdb_ctx *, const char *, struct file *);
-	int (*select_dir)(struct objdb_ctx *, const char *, struct dir *);
-	int (*select_commit)(struct objdb_ctx *, const char *, struct commit *);
+	int (*select_file)(struct objdb_ctx *, const struct objid *, struct file *);
+	int (*select_dir)(struct objdb_ctx *, const struct objid *, struct dir *);
+	int (*select_commit)(struct objdb_ctx *, const struct objid *, struct commit *);
+	/* optional, adds the objects of a type whose ids start with a prefix */
+	int (*resolve)(struct objdb_ctx *, enum objtype, struct objid_match *);
+	/* optional, a hint that these dirs are about to be selected */
+	int (*prefetch_dirs)(struct objdb_ctx *, const struct objid *, size_t);
+	/*
+	 * optional, the objects inserted in a batch are only visible, and
+	 * can only be selected, once it is committed
+	 */
+	int (*begin_batch)(struct objdb_ctx *);
+	int (*commit_batch)(struct objdb_ctx *);
+	int (*abort_batch)(struct objdb_ctx *);
+	/* commit graph, optional */
+	int (*select_commit_graph)(struct objdb_ctx *, const struct objid *, struct graph_commit *);
+	int (*commit_graph_write)(struct objdb_ctx *);
 	/* branch ops */
 	int (*branch_create)(struct objdb_ctx *, const char *);
 	int (*branch_create_from)(struct objdb_ctx *, const char *, const char *);
 	int (*branch_if_exists)(struct objdb_ctx *, const char *, int *);
-	int (*branch_set_head)(struct objdb_ctx *, const char *, const char *);
-	int (*branch_get_head)(struct objdb_ctx *, const char *, char **);
+	int (*branch_set_head)(struct objdb_ctx *, const char *, const struct objid *);
+	int (*branch_get_head)(struct objdb_ctx *, const char *, struct objid *);	/* null id if no commits */
 	int (*branch_ls)(struct objdb_ctx *);
 	/**/
 	int (*remove)(struct objdb_ctx *, const char *, const char *);
-	int (*fsck)(struct objdb_ctx *);
+	int (*fsck)(struct objdb_ctx *, int);
 	int (*compress)(struct objdb_ctx *);
 	int (*dedup)(struct objdb_ctx *);
+	int (*repack)(struct objdb_ctx *, int);	/* geometric factor, 0 packs everything */
+	/*
+	 * optional, drops the objects older than the grace period that
+	 * neither the branches nor the roots reach. the roots are asked for
+	 * once writers are locked out.
+	 */
+	int (*gc)(struct objdb_ctx *, int (*)(void *, struct objdb_root **, size_t *), void *, time_t);
 };
 
+/* shared by the backends, see objdb.c */
+char *objdb_dir(struct objdb_ctx *);
+int objdb_config_num(const char *, int, int);
+struct objcache *objdb_cache(struct objdb_ctx *);
+int objdb_fsync(struct objdb_ctx *);
+int objdb_sync_dir(const char *);
+
 #endif
@@ -14,16 +14,180 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <sys/types.h>
+#include <sys/mman.h>	/* mmap(2) */
+#include <sys/stat.h>	/* fstat(2) */
+#ifdef __linux__
+#include <sys/sendfile.h>	/* sendfile(2) */
+#endif
+
+#include <errno.h>	/* errno */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>	/* mem*(3) */
+#include <unistd.h>	/* read(2), write(2), close(2) */
 
+#include "arena.h"
 #include "objects.h"
 
+#define SEND_BUFSIZE	(64 * 1024)
+#define SEND_MAX	(1 << 30)	/* per system call */
+#define MAP_MIN		(256 * 1024)	/* smaller files are just read */
+
+static const char hex_digits[] = "0123456789abcdef";
+
+/*
+ * spells out id in buf, which holds at least OBJID_HEXLEN + 1 chars
+ */
+char *
+objid_hex(const struct objid *id, char *buf)
+{
+	int i;
+
+	for (i = 0 ; i < OBJID_LEN ; i++) {
+		buf[2 * i] = hex_digits[id->bytes[i] >> 4];
+		buf[2 * i + 1] = hex_digits[id->bytes[i] & 0x0f];
+	}
+	buf[OBJID_HEXLEN] = '\0';
+	return buf;
+}
+
+static int
+hex_value(int c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+/*
+ * str has to be exactly OBJID_HEXLEN hex digits
+ */
+int
+objid_parse(const char *str, struct objid *id)
+{
+	int i, hi, lo;
+
+	if (str == NULL)
+		return EXIT_FAILURE;
+	for (i = 0 ; i < OBJID_LEN ; i++) {
+		if ((hi = hex_value(str[2 * i])) == -1 || (lo = hex_value(str[2 * i + 1])) == -1)
+			return EXIT_FAILURE;
+		id->bytes[i] = (hi << 4) | lo;
+	}
+	if (str[OBJID_HEXLEN] != '\0')
+		return EXIT_FAILURE;
+	return EXIT_SUCCESS;
+}
+
+int
+objid_cmp(const struct objid *id1, const struct objid *id2)
+{
+	return memcmp(id1->bytes, id2->bytes, OBJID_LEN);
+}
+
+/*
+ * the all zeros id stands for no object, e.g. the head of an empty branch
+ */
+int
+objid_is_null(const struct objid *id)
+{
+	int i;
+
+	for (i = 0 ; i < OBJID_LEN ; i++)
+		if (id->bytes[i] != 0)
+			return 0;
+	return 1;
+}
+
+/*
+ * takes an abbreviated id, OBJID_ABBREV_MIN to OBJID_HEXLEN hex digits
+ */
+int
+objid_match_init(struct objid_match *m, const char *str)
+{
+	int v;
+	size_t i;
+
+	if (str == NULL)
+		return EXIT_FAILURE;
+	memset(m, 0, sizeof(struct objid_match));
+	for (i = 0 ; str[i] != '\0' ; i++) {
+		if (i == OBJID_HEXLEN || (v = hex_value(str[i])) == -1)
+			return EXIT_FAILURE;
+		m->prefix.bytes[i / 2] |= (i % 2) ? v : v << 4;
+	}
+	if (i < OBJID_ABBREV_MIN)
+		return EXIT_FAILURE;
+	m->len = i;
+	return EXIT_SUCCESS;
+}
+
+/*
+ * whether the id starts with the prefix, ids are sorted so that the
+ * first one that could is found by comparing them with the prefix itself
+ */
+int
+objid_match_test(const struct objid_match *m, const u_int8_t *id)
+{
+	size_t n = m->len / 2;
+
+	if (memcmp(id, m->prefix.bytes, n) != 0)
+		return 0;
+	if ((m->len % 2) && (id[n] & 0xf0) != m->prefix.bytes[n])
+		return 0;
+	return 1;
+}
+
+/*
+ * adds an object that starts with the prefix, the same object may be
+ * found in more than one place but is only counted once
+ */
+int
+objid_match_add(struct objid_match *m, const struct objid *id)
+{
+	size_t i, size;
+	struct objid *ids;
+
+	for (i = 0 ; i < m->count ; i++)
+		if (objid_cmp(&m->ids[i], id) == 0)
+			return EXIT_SUCCESS;
+	if (m->count == m->size) {
+		size = (m->size == 0) ? OBJID_MATCH_MAX : m->size * 2;
+		if ((ids = reallocarray(m->ids, size, sizeof(struct objid))) == NULL)
+			return EXIT_FAILURE;
+		m->ids = ids;
+		m->size = size;
+	}
+	m->ids[m->count++] = *id;
+	return EXIT_SUCCESS;
+}
+
+void
+objid_match_free(struct objid_match *m)
+{
+	free(m->ids);
+	m->ids = NULL;
+	m->count = m->size = 0;
+}
+
 struct file*
 baseline_file_new()
 {
 	struct file *file = (struct file *)malloc(sizeof(struct file));
-	file->id = NULL;
+	memset(&file->id, 0, sizeof(file->id));
+	file->loc = LOC_FS;
+	file->fd = -1;
+	file->size = 0;
+	file->pos = 0;
+	file->mapped = 0;
+	file->stream_read = NULL;
+	file->stream_close = NULL;
+	file->stream_send = NULL;
 	return file;
 }
 
@@ -32,82 +196,331 @@ baseline_file_free(struct file *file)
 {
 	if (file == NULL)
 		return;
-	free(file->id);
-	if (file->loc == LOC_MEM)
+	if (file->loc == LOC_MEM && !file->mapped)
 		free(file->buffer);
+	/* file descriptors are left to the caller, streams are not */
+	if (file->loc == LOC_STREAM)
+		baseline_file_close(file);
 	free(file);
 }
 
+/*
+ * reads the content of a file object regardless of where it lives
+ */
+ssize_t
+baseline_file_read(struct file *file, void *buf, size_t len)
+{
+	if (file == NULL || buf == NULL)
+		return -1;
+	if (file->loc == LOC_FS)
+		return read(file->fd, buf, len);
+	if (file->loc == LOC_STREAM)
+		return file->stream_read(file->stream, buf, len);
+	if (len > file->size - file->pos)
+		len = file->size - file->pos;
+	memcpy(buf, file->buffer + file->pos, len);
+	file->pos += len;
+	return len;
+}
+
+static int
+write_all(int out, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		if ((n = write(out, buf, len)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return EXIT_FAILURE;
+		}
+		buf += n;
+		len -= n;
+	}
+	return EXIT_SUCCESS;
+}
+
+/*
+ * has the kernel copy what is left of fd to out, without it going through
+ * user space. fails with ENOSYS, having sent nothing, when it cannot.
+ */
+static off_t
+send_fd(int fd, int out)
+{
+#ifdef __linux__
+	off_t total = 0;
+	ssize_t n;
+	int range = 1;
+
+	for (;;) {
+		/* file to file first, it may share the blocks or copy them on the device */
+		if (range)
+			n = copy_file_range(fd, NULL, out, NULL, SEND_MAX, 0);
+		else
+			n = sendfile(out, fd, NULL, SEND_MAX);
+		if (n == 0)
+			return total;
+		if (n > 0) {
+			total += n;
+			continue;
+		}
+		if (errno == EINTR)
+			continue;
+		if (total != 0)
+			return -1;
+		/* a pipe, a terminal, another file system or an appending out */
+		if (range && (errno == EINVAL || errno == EXDEV || errno == EBADF ||
+		    errno == ENOSYS || errno == EOPNOTSUPP)) {
+			range = 0;
+			continue;
+		}
+		if (errno == EINVAL || errno == ENOSYS) {
+			errno = ENOSYS;
+			return -1;
+		}
+		return -1;
+	}
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+/*
+ * writes what is left of fd to out straight from a mapping of the file,
+ * fails with ENOSYS, having sent nothing, when it is not worth one.
+ */
+static off_t
+map_fd(int fd, int out)
+{
+	char *p;
+	off_t off, base;
+	size_t len;
+	int retval;
+	struct stat st;
+
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) ||
+	    (off = lseek(fd, 0, SEEK_CUR)) == -1 || st.st_size - off < MAP_MIN) {
+		errno = ENOSYS;
+		return -1;
+	}
+	base = off & ~((off_t)sysconf(_SC_PAGESIZE) - 1);
+	len = st.st_size - base;
+	if ((p = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, base)) == MAP_FAILED) {
+		errno = ENOSYS;
+		return -1;
+	}
+	madvise(p, len, MADV_SEQUENTIAL);
+	retval = write_all(out, p + (off - base), st.st_size - off);
+	munmap(p, len);
+	if (retval == EXIT_FAILURE || lseek(fd, st.st_size, SEEK_SET) == -1)
+		return -1;
+	return st.st_size - off;
+}
+
+static off_t
+copy_file(struct file *file, int out)
+{
+	char *buf;
+	ssize_t n;
+	off_t total = 0;
+
+	if ((buf = malloc(SEND_BUFSIZE)) == NULL)
+		return -1;
+	while ((n = baseline_file_read(file, buf, SEND_BUFSIZE)) > 0) {
+		if (write_all(out, buf, n) == EXIT_FAILURE) {
+			n = -1;
+			break;
+		}
+		total += n;
+	}
+	free(buf);
+	return n == -1 ? -1 : total;
+}
+
+/*
+ * writes the rest of the content of a file object to out, returns how many
+ * bytes were written. files on disk are copied by the kernel or from a
+ * mapping, those in memory are written as they are, and streams that know
+ * better send themselves, only the others are read into a buffer.
+ */
+off_t
+baseline_file_send(struct file *file, int out)
+{
+	off_t n;
+	size_t len;
+
+	if (file == NULL)
+		return -1;
+	switch (file->loc) {
+	case LOC_MEM:
+		len = file->size - file->pos;
+		if (write_all(out, file->buffer + file->pos, len) == EXIT_FAILURE)
+			return -1;
+		file->pos += len;
+		return len;
+	case LOC_FS:
+		if ((n = send_fd(file->fd, out)) != -1 || errno != ENOSYS)
+			return n;
+		if ((n = map_fd(file->fd, out)) != -1 || errno != ENOSYS)
+			return n;
+		break;
+	case LOC_STREAM:
+		if (file->stream_send != NULL)
+			return file->stream_send(file->stream, out);
+		break;
+	}
+	return copy_file(file, out);
+}
+
+/*
+ * closes the file descriptor or the stream of a selected file object, if any
+ */
+void
+baseline_file_close(struct file *file)
+{
+	if (file == NULL)
+		return;
+	if (file->loc == LOC_FS && file->fd != -1) {
+		close(file->fd);
+		file->fd = -1;
+	}
+	if (file->loc == LOC_STREAM && file->stream != NULL) {
+		file->stream_close(file->stream);
+		file->stream = NULL;
+	}
+}
+
 struct commit*
 baseline_commit_new()
 {
 	struct commit *comm = (struct commit *)malloc(sizeof(struct commit));
-	comm->id = NULL;
-	comm->dir = NULL;
+	memset(&comm->id, 0, sizeof(comm->id));
+	memset(&comm->dir, 0, sizeof(comm->dir));
 	comm->author.name = NULL;
 	comm->author.email = NULL;
+	comm->committer.name = NULL;
+	comm->committer.email = NULL;
 	comm->n_parents = 0;
 	comm->message = NULL;
+	comm->strings = NULL;
 	return comm;
 }
 
 void
 baseline_commit_free(struct commit *comm)
 {
-	int i;
 	if (comm == NULL)
 		return;
-	free(comm->id);
-	free(comm->dir);
-	for (i=0 ; i<comm->n_parents ; i++)
-		free(comm->parents[i]);
-	free(comm->message);
+	if (comm->strings != NULL)
+		free(comm->strings);
+	else
+		free(comm->message);
 	free(comm);
 }
 
+/*
+ * the names of the entries of a dir live in an arena, either its own or
+ * one shared by all the dirs of a walk and released at its end.
+ */
 struct dir*
 baseline_dir_new()
+{
+	return baseline_dir_new_in(NULL);
+}
+
+struct dir*
+baseline_dir_new_in(struct arena *arena)
 {
 	struct dir *dir = (struct dir *)malloc(sizeof(struct dir));
-	dir->id = NULL;
+	memset(&dir->id, 0, sizeof(dir->id));
 	dir->parent = NULL;
 	dir->children = NULL;
+	dir->n_children = 0;
+	dir->max_children = 0;
+	dir->names = NULL;
+	dir->arena = arena;
+	dir->own_arena = (arena == NULL);
 	return dir;
 }
 
 void
 baseline_dir_free(struct dir *dir)
 {
-	struct dirent *it, *ptr;
-
 	if (dir == NULL)
 		return;
-	if (dir->children == NULL) {
-		free(dir);
-		return;
-	}
-	for (it = dir->children ; it != NULL ;) {
-		ptr = it;
-		it = it->next;
-		free(ptr);
-	}
+	free(dir->children);
+	free(dir->names);
+	if (dir->own_arena)
+		arena_free(dir->arena);
 	free(dir);
 }
 
-void
-baseline_dir_append(struct dir *dir, struct dirent *ent)
+int
+baseline_dir_reserve(struct dir *dir, size_t n)
 {
-	struct dirent *it;
+	struct dirent *children;
 
-	if (dir == NULL || ent == NULL)
-		return;
-	if (dir->children == NULL) {
-		dir->children = ent;
-	}
-	else {
-		for (it = dir->children ; it->next != NULL ; it = it->next);
-		it->next = ent;
+	if (n <= dir->max_children)
+		return EXIT_SUCCESS;
+	if ((children = reallocarray(dir->children, n, sizeof(struct dirent))) == NULL)
+		return EXIT_FAILURE;
+	dir->children = children;
+	dir->max_children = n;
+	return EXIT_SUCCESS;
+}
+
+/*
+ * a zeroed entry at the end, name is copied unless NULL. it is only
+ * valid until the next one is added.
+ */
+struct dirent*
+baseline_dir_add(struct dir *dir, const char *name)
+{
+	struct dirent *ent;
+
+	if (dir->n_children == dir->max_children &&
+	    baseline_dir_reserve(dir, dir->max_children ? dir->max_children * 2 : 16) == EXIT_FAILURE)
+		return NULL;
+	ent = &dir->children[dir->n_children];
+	memset(ent, 0, sizeof(struct dirent));
+	if (name != NULL) {
+		if (dir->arena == NULL && arena_new(&dir->arena) == EXIT_FAILURE)
+			return NULL;
+		if ((ent->name = arena_strdup(dir->arena, name)) == NULL)
+			return NULL;
 	}
-	ent->next = NULL;
+	dir->n_children++;
+	return ent;
 }
 
+static int
+dirent_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct dirent *)a)->name, ((const struct dirent *)b)->name);
+}
+
+/*
+ * puts the entries in the canonical order, only needed once all of
+ * them were added. parsed dirs come sorted.
+ */
+void
+baseline_dir_sort(struct dir *dir)
+{
+	size_t i;
+
+	for (i = 1 ; i < dir->n_children ; i++)
+		if (strcmp(dir->children[i - 1].name, dir->children[i].name) > 0)
+			break;
+	if (i < dir->n_children)
+		qsort(dir->children, dir->n_children, sizeof(struct dirent), dirent_cmp);
+}
+
+struct dirent*
+baseline_dir_lookup(const struct dir *dir, const char *name)
+{
+	struct dirent key;
+
+	key.name = (char *)name;
+	return bsearch(&key, dir->children, dir->n_children, sizeof(struct dirent), dirent_cmp);
+}
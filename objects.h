@@ -17,11 +17,41 @@
 #ifndef _OBJECTS_H_
 #define _OBJECTS_H_
 
+#include <sys/types.h>
+
 #include <fcntl.h>
 #include <time.h>
 
 #define MAX_PARENTS	1
 
+struct arena;
+
+#define OBJID_LEN	32	/* SHA-256 */
+#define OBJID_HEXLEN	(OBJID_LEN * 2)
+
+/*
+ * ids are kept binary in memory, they are spelled out in hex only in
+ * serialized objects, file names and on the command line.
+ */
+struct objid {
+	u_int8_t bytes[OBJID_LEN];
+};
+
+#define OBJID_ABBREV_MIN	4	/* hex digits of the shortest prefix */
+#define OBJID_MATCH_MAX		8	/* matches listed of an ambiguous prefix */
+
+/*
+ * the objects whose ids start with a prefix of len hex digits, the
+ * bytes of the prefix past them are zero.
+ */
+struct objid_match {
+	struct objid prefix;
+	size_t len;
+	struct objid *ids;	/* distinct, count of them */
+	size_t count;
+	size_t size;
+};
+
 enum objtype {
 	O_FILE,
 	O_DIR,
@@ -36,17 +66,18 @@ struct user {
 };
 
 struct commit {
-	char *id;
-	char *dir;
+	struct objid id;
+	struct objid dir;
 	struct user author;
 	struct user committer;
 	u_int8_t n_parents;
-	char *parents[MAX_PARENTS];
+	struct objid parents[MAX_PARENTS];
 	char *message;
+	char *strings;	/* holds the strings above if not NULL */
 };
 
 struct dirent {
-	char *id;
+	struct objid id;
 	char *name;
 	/* TODO: get rid of type */
 	enum {
@@ -54,36 +85,67 @@ struct dirent {
 		T_DIR
 	} type;
 	mode_t mode;
-	struct dirent *next;
 };
 
+/*
+ * children are kept sorted by name, as they are stored
+ */
 struct dir {
-	char *id;
+	struct objid id;
 	struct dir *parent;
 	struct dirent *children;
+	size_t n_children;
+	size_t max_children;
+	char *names;	/* the parsed object, names may point into it */
+	struct arena *arena;	/* holds the other names */
+	int own_arena;
 };
 
 struct file {
-	char *id;
+	struct objid id;
 	enum {
 		LOC_FS,
-		LOC_MEM
+		LOC_MEM,
+		LOC_STREAM
 	} loc;
 	union {
 		int fd;
 		char *buffer;
+		void *stream;
 	};
+	size_t size;	/* LOC_MEM only */
+	size_t pos;	/* LOC_MEM only */
+	int mapped;	/* LOC_MEM only, buffer is borrowed from a mapping */
+	/* LOC_STREAM only */
+	ssize_t (*stream_read)(void *, void *, size_t);
+	void (*stream_close)(void *);
+	off_t (*stream_send)(void *, int);	/* optional */
 };
 
 /* file ops */
+char *objid_hex(const struct objid *, char *);
+int objid_parse(const char *, struct objid *);
+int objid_cmp(const struct objid *, const struct objid *);
+int objid_is_null(const struct objid *);
+int objid_match_init(struct objid_match *, const char *);
+int objid_match_test(const struct objid_match *, const u_int8_t *);
+int objid_match_add(struct objid_match *, const struct objid *);
+void objid_match_free(struct objid_match *);
 struct file* baseline_file_new();
 void baseline_file_free(struct file *);
+ssize_t baseline_file_read(struct file *, void *, size_t);
+off_t baseline_file_send(struct file *, int);
+void baseline_file_close(struct file *);
 /* commit ops */
 struct commit* baseline_commit_new();
 void baseline_commit_free(struct commit *);
 /* dir ops */
 struct dir* baseline_dir_new();
+struct dir* baseline_dir_new_in(struct arena *);
 void baseline_dir_free(struct dir *);
-void baseline_dir_append(struct dir *, struct dirent *);
+int baseline_dir_reserve(struct dir *, size_t);
+struct dirent* baseline_dir_add(struct dir *, const char *);
+void baseline_dir_sort(struct dir *);
+struct dirent* baseline_dir_lookup(const struct dir *, const char *);
 
 #endif
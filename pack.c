@@ -0,0 +1,967 @@
+/*
+ * Copyright (c) 2014 Mohamed Aslan <maslan@sce.carleton.ca>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>	/* mmap(2) */
+#include <sys/stat.h>	/* fstat(2) */
+
+#include <endian.h>	/* htobe*(3), be*toh(3) */
+#include <fcntl.h>	/* open(2) */
+#include <pthread.h>	/* pthread_*(3) */
+#include <stdint.h>	/* uintptr_t */
+#include <stdio.h>	/* asprintf(3), rename(2) */
+#include <stdlib.h>	/* malloc(3), qsort(3) */
+#include <string.h>	/* mem*(3) */
+#include <unistd.h>	/* close(2), unlink(2) */
+
+#include "compress.h"
+#include "delta.h"
+#include "hash.h"
+#include "objects.h"
+#include "pack.h"
+
+#define DELTA_MIN_SIZE	64			/* not worth it below */
+#define COPY_BUF	(1024 * 1024)
+#define DELTA_MAX_SIZE	(64 * 1024 * 1024)	/* too costly above */
+
+#define IDX_SIZE(n)	(sizeof(struct pack_header) + PACK_FANOUT * sizeof(u_int32_t) + \
+			(n) * sizeof(struct pack_idx_entry))
+
+/*
+ * objects rebuilt from deltas while resolving a chain are kept in a
+ * small LRU, so that siblings sharing a base do not rebuild it again.
+ */
+#define CACHE_BUCKETS	1024
+
+struct cache_ent {
+	const struct pack *pack;
+	u_int64_t offset;
+	char *buf;
+	size_t len;
+	struct cache_ent *prev, *next;		/* LRU, most recent first */
+	struct cache_ent *hnext;
+};
+
+static struct {
+	struct cache_ent *buckets[CACHE_BUCKETS];
+	struct cache_ent *head, *tail;
+	size_t used;
+	pthread_mutex_t lock;
+} delta_cache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+struct delta_job {
+	struct pack_obj *objs;
+	size_t start;
+	size_t end;
+	int window;
+	int depth;
+	int (*load)(struct pack_obj *, char **, size_t *);
+};
+
+struct window_ent {
+	size_t idx;
+	char *buf;
+	size_t len;
+};
+
+struct pack_writer {
+	char *dir;
+	char *tmp_path;
+	int sync;		/* fsync both files before naming them */
+	FILE *fp;
+	u_int64_t offset;
+	struct pack_idx_entry *entries;		/* host byte order until written */
+	u_int32_t count;
+	u_int32_t size;
+};
+
+static u_int32_t
+cache_hash(const struct pack *p, u_int64_t offset)
+{
+	return (u_int32_t)(((uintptr_t)p >> 4) ^ offset ^ (offset >> 17)) % CACHE_BUCKETS;
+}
+
+static void
+cache_unlink(struct cache_ent *ce)
+{
+	struct cache_ent **pp;
+
+	for (pp = &delta_cache.buckets[cache_hash(ce->pack, ce->offset)] ; *pp != ce ; pp = &(*pp)->hnext)
+		;
+	*pp = ce->hnext;
+	if (ce->prev != NULL)
+		ce->prev->next = ce->next;
+	else
+		delta_cache.head = ce->next;
+	if (ce->next != NULL)
+		ce->next->prev = ce->prev;
+	else
+		delta_cache.tail = ce->prev;
+	delta_cache.used -= ce->len;
+	free(ce->buf);
+	free(ce);
+}
+
+/*
+ * returns a private copy of a cached object
+ */
+static int
+cache_get(const struct pack *p, u_int64_t offset, char **buf, size_t *len)
+{
+	struct cache_ent *ce;
+	int retval = EXIT_FAILURE;
+
+	pthread_mutex_lock(&delta_cache.lock);
+	for (ce = delta_cache.buckets[cache_hash(p, offset)] ; ce != NULL ; ce = ce->hnext)
+		if (ce->pack == p && ce->offset == offset)
+			break;
+	if (ce == NULL || (*buf = malloc(ce->len + 1)) == NULL)
+		goto ret;
+	memcpy(*buf, ce->buf, ce->len + 1);
+	*len = ce->len;
+	/* move to the front */
+	if (ce != delta_cache.head) {
+		ce->prev->next = ce->next;
+		if (ce->next != NULL)
+			ce->next->prev = ce->prev;
+		else
+			delta_cache.tail = ce->prev;
+		ce->prev = NULL;
+		ce->next = delta_cache.head;
+		delta_cache.head->prev = ce;
+		delta_cache.head = ce;
+	}
+	retval = EXIT_SUCCESS;
+ret:
+	pthread_mutex_unlock(&delta_cache.lock);
+	return retval;
+}
+
+static void
+cache_put(const struct pack *p, u_int64_t offset, const char *buf, size_t len)
+{
+	u_int32_t h;
+	struct cache_ent *ce;
+
+	if (len > PACK_CACHE_SIZE / 4)
+		return;
+	pthread_mutex_lock(&delta_cache.lock);
+	h = cache_hash(p, offset);
+	for (ce = delta_cache.buckets[h] ; ce != NULL ; ce = ce->hnext)
+		if (ce->pack == p && ce->offset == offset)
+			goto ret;
+	while (delta_cache.used + len > PACK_CACHE_SIZE && delta_cache.tail != NULL)
+		cache_unlink(delta_cache.tail);
+	if ((ce = malloc(sizeof(struct cache_ent))) == NULL)
+		goto ret;
+	if ((ce->buf = malloc(len + 1)) == NULL) {
+		free(ce);
+		goto ret;
+	}
+	memcpy(ce->buf, buf, len + 1);
+	ce->len = len;
+	ce->pack = p;
+	ce->offset = offset;
+	ce->hnext = delta_cache.buckets[h];
+	delta_cache.buckets[h] = ce;
+	ce->prev = NULL;
+	ce->next = delta_cache.head;
+	if (delta_cache.head != NULL)
+		delta_cache.head->prev = ce;
+	delta_cache.head = ce;
+	if (delta_cache.tail == NULL)
+		delta_cache.tail = ce;
+	delta_cache.used += len;
+ret:
+	pthread_mutex_unlock(&delta_cache.lock);
+}
+
+static void
+cache_evict_pack(const struct pack *p)
+{
+	struct cache_ent *ce, *next;
+
+	pthread_mutex_lock(&delta_cache.lock);
+	for (ce = delta_cache.head ; ce != NULL ; ce = next) {
+		next = ce->next;
+		if (ce->pack == p)
+			cache_unlink(ce);
+	}
+	pthread_mutex_unlock(&delta_cache.lock);
+}
+
+static int
+map_file(const char *path, u_int8_t **addr, size_t *len)
+{
+	int fd;
+	struct stat s;
+
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return EXIT_FAILURE;
+	if (fstat(fd, &s) == -1 || s.st_size < sizeof(struct pack_header)) {
+		close(fd);
+		return EXIT_FAILURE;
+	}
+	*len = (size_t)s.st_size;
+	*addr = mmap(NULL, *len, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (*addr == MAP_FAILED)
+		return EXIT_FAILURE;
+	return EXIT_SUCCESS;
+}
+
+static int
+check_header(const u_int8_t *addr, const char *magic, u_int32_t *count)
+{
+	const struct pack_header *hdr = (const struct pack_header *)addr;
+
+	if (memcmp(hdr->magic, magic, sizeof(hdr->magic)))
+		return EXIT_FAILURE;
+	if (be32toh(hdr->version) < 1 || be32toh(hdr->version) > PACK_VERSION)
+		return EXIT_FAILURE;
+	*count = be32toh(hdr->count);
+	return EXIT_SUCCESS;
+}
+
+/*
+ * maps pack <path>.pack and its index <path>.idx
+ */
+int
+pack_open(const char *path, struct pack **packp)
+{
+	char *data_path = NULL, *idx_path = NULL;
+	u_int32_t count;
+	struct pack *p;
+
+	if (path == NULL || packp == NULL)
+		return EXIT_FAILURE;
+	if ((p = calloc(1, sizeof(struct pack))) == NULL)
+		return EXIT_FAILURE;
+	p->data = p->idx = MAP_FAILED;
+	p->path = strdup(path);
+	asprintf(&data_path, "%s.pack", path);
+	asprintf(&idx_path, "%s.idx", path);
+	if (map_file(idx_path, &p->idx, &p->idx_len) == EXIT_FAILURE)
+		goto fail;
+	if (map_file(data_path, &p->data, &p->data_len) == EXIT_FAILURE)
+		goto fail;
+	if (check_header(p->idx, PACK_IDX_MAGIC, &p->count) == EXIT_FAILURE)
+		goto fail;
+	if (check_header(p->data, PACK_MAGIC, &count) == EXIT_FAILURE || count != p->count)
+		goto fail;
+	if (p->idx_len != IDX_SIZE(p->count))
+		goto fail;
+	p->fanout = (const u_int32_t *)(p->idx + sizeof(struct pack_header));
+	p->entries = (const struct pack_idx_entry *)(p->fanout + PACK_FANOUT);
+	if (be32toh(p->fanout[PACK_FANOUT - 1]) != p->count)
+		goto fail;
+	free(data_path);
+	free(idx_path);
+	*packp = p;
+	return EXIT_SUCCESS;
+fail:
+	free(data_path);
+	free(idx_path);
+	pack_close(p);
+	return EXIT_FAILURE;
+}
+
+void
+pack_close(struct pack *p)
+{
+	if (p == NULL)
+		return;
+	cache_evict_pack(p);
+	if (p->idx != MAP_FAILED)
+		munmap(p->idx, p->idx_len);
+	if (p->data != MAP_FAILED)
+		munmap(p->data, p->data_len);
+	free(p->path);
+	free(p);
+}
+
+/*
+ * binary search in the fan-out bucket of the id's first byte
+ */
+static const struct pack_idx_entry *
+lookup_bin(struct pack *p, enum objtype type, const u_int8_t *id)
+{
+	u_int32_t lo, hi, mid;
+	int cmp;
+	const struct pack_idx_entry *e;
+
+	lo = (id[0] == 0) ? 0 : be32toh(p->fanout[id[0] - 1]);
+	hi = be32toh(p->fanout[id[0]]);
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		e = &p->entries[mid];
+		cmp = memcmp(id, e->id, SHA256_DIGEST_LENGTH);
+		if (cmp == 0)
+			cmp = (int)type - (int)e->type;
+		if (cmp == 0)
+			return e;
+		if (cmp < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return NULL;
+}
+
+const struct pack_idx_entry *
+pack_lookup(struct pack *p, enum objtype type, const struct objid *id)
+{
+	if (p == NULL || id == NULL)
+		return NULL;
+	return lookup_bin(p, type, id->bytes);
+}
+
+/*
+ * adds the objects of the type whose ids start with the prefix, they
+ * follow the first id not lower than the prefix
+ */
+int
+pack_match(struct pack *p, enum objtype type, struct objid_match *m)
+{
+	u_int32_t lo, hi, mid;
+	const u_int8_t *prefix = m->prefix.bytes;
+	struct objid id;
+
+	if (p == NULL)
+		return EXIT_SUCCESS;
+	lo = (prefix[0] == 0) ? 0 : be32toh(p->fanout[prefix[0] - 1]);
+	hi = be32toh(p->fanout[prefix[0]]);
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (memcmp(p->entries[mid].id, prefix, SHA256_DIGEST_LENGTH) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	for ( ; lo < p->count && objid_match_test(m, p->entries[lo].id) ; lo++) {
+		if (p->entries[lo].type != type)
+			continue;
+		pack_entry_id(&p->entries[lo], &id);
+		if (objid_match_add(m, &id) == EXIT_FAILURE)
+			return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+/*
+ * finds the stored bytes of an entry within the mapped pack
+ */
+static const char *
+entry_data(struct pack *p, const struct pack_idx_entry *e, size_t *size)
+{
+	u_int64_t offset, len;
+
+	offset = be64toh(e->offset);
+	len = be64toh(e->size);
+	if (offset < sizeof(struct pack_header) || offset > p->data_len ||
+	    len > p->data_len - offset)
+		return NULL;
+	if ((e->flags & PACK_F_DELTA) && len < SHA256_DIGEST_LENGTH)
+		return NULL;
+	*size = len;
+	return (const char *)p->data + offset;
+}
+
+static int
+unpack(struct pack *p, const struct pack_idx_entry *e, int depth, int is_base, char **buf, size_t *len)
+{
+	char *base = NULL;
+	const char *data;
+	size_t size, base_len;
+	int retval;
+	const struct pack_idx_entry *be;
+
+	if ((data = entry_data(p, e, &size)) == NULL)
+		return EXIT_FAILURE;
+	if (!(e->flags & (PACK_F_DELTA | PACK_F_DEFLATE))) {
+		if ((*buf = malloc(size + 1)) == NULL)
+			return EXIT_FAILURE;
+		memcpy(*buf, data, size);
+		(*buf)[size] = '\0';
+		*len = size;
+		return EXIT_SUCCESS;
+	}
+	if (cache_get(p, be64toh(e->offset), buf, len) == EXIT_SUCCESS)
+		return EXIT_SUCCESS;
+	if (e->flags & PACK_F_DEFLATE) {
+		if (compress_inflate(data, size, buf, len) == EXIT_FAILURE)
+			return EXIT_FAILURE;
+		if (is_base)
+			cache_put(p, be64toh(e->offset), *buf, *len);
+		return EXIT_SUCCESS;
+	}
+	if (depth >= PACK_MAXCHAIN)
+		return EXIT_FAILURE;
+	if ((be = lookup_bin(p, e->type, (const u_int8_t *)data)) == NULL || be == e)
+		return EXIT_FAILURE;
+	if (unpack(p, be, depth + 1, 1, &base, &base_len) == EXIT_FAILURE)
+		return EXIT_FAILURE;
+	retval = delta_apply(base, base_len, data + SHA256_DIGEST_LENGTH,
+	    size - SHA256_DIGEST_LENGTH, buf, len);
+	free(base);
+	if (retval == EXIT_SUCCESS && is_base)
+		cache_put(p, be64toh(e->offset), *buf, *len);
+	return retval;
+}
+
+/*
+ * copies the object out of the pack, resolving deltas on the way. the
+ * buffer is NUL terminated for the convenience of the parsers but len
+ * does not account for it.
+ */
+int
+pack_get(struct pack *p, const struct pack_idx_entry *e, char **buf, size_t *len)
+{
+	if (p == NULL || e == NULL || buf == NULL || len == NULL)
+		return EXIT_FAILURE;
+	return unpack(p, e, 0, 0, buf, len);
+}
+
+/*
+ * size of the object once unpacked, without unpacking it
+ */
+int
+pack_object_size(struct pack *p, const struct pack_idx_entry *e, size_t *size)
+{
+	const char *data;
+	size_t len;
+	int kind;
+
+	if (p == NULL || e == NULL || size == NULL)
+		return EXIT_FAILURE;
+	if ((data = entry_data(p, e, &len)) == NULL)
+		return EXIT_FAILURE;
+	if (e->flags & PACK_F_DEFLATE)
+		return compress_header(data, len, &kind, size);
+	if (!(e->flags & PACK_F_DELTA)) {
+		*size = len;
+		return EXIT_SUCCESS;
+	}
+	return delta_result_size(data + SHA256_DIGEST_LENGTH, len - SHA256_DIGEST_LENGTH, size);
+}
+
+/*
+ * the first bytes of an object, only deltas are unpacked to read them
+ * and only the start of a compressed object is inflated
+ */
+int
+pack_peek(struct pack *p, const struct pack_idx_entry *e, void *buf, size_t *len)
+{
+	const char *data;
+	char *obj;
+	size_t size;
+
+	if (p == NULL || e == NULL || buf == NULL || len == NULL)
+		return EXIT_FAILURE;
+	if ((data = entry_data(p, e, &size)) == NULL)
+		return EXIT_FAILURE;
+	if (e->flags & PACK_F_DEFLATE)
+		return compress_peek(data, size, buf, len);
+	if (!(e->flags & PACK_F_DELTA)) {
+		if (size < *len)
+			*len = size;
+		memcpy(buf, data, *len);
+		return EXIT_SUCCESS;
+	}
+	if (unpack(p, e, 0, 0, &obj, &size) == EXIT_FAILURE)
+		return EXIT_FAILURE;
+	if (size < *len)
+		*len = size;
+	memcpy(buf, obj, *len);
+	free(obj);
+	return EXIT_SUCCESS;
+}
+
+/*
+ * the object as it lies in the mapping of the pack, valid until the pack is
+ * closed. objects stored as deltas or compressed have to be unpacked by
+ * pack_get().
+ */
+int
+pack_map(struct pack *p, const struct pack_idx_entry *e, const char **data, size_t *len)
+{
+	if (p == NULL || e == NULL || data == NULL || len == NULL)
+		return EXIT_FAILURE;
+	if (e->flags & (PACK_F_DELTA | PACK_F_DEFLATE))
+		return EXIT_FAILURE;
+	if ((*data = entry_data(p, e, len)) == NULL)
+		return EXIT_FAILURE;
+	return EXIT_SUCCESS;
+}
+
+void
+pack_entry_id(const struct pack_idx_entry *e, struct objid *id)
+{
+	memcpy(id->bytes, e->id, OBJID_LEN);
+}
+
+/*
+ * the name of a pack, the hash of the ids it holds, from its path
+ */
+int
+pack_name(const struct pack *p, struct objid *name)
+{
+	const char *base;
+
+	if ((base = strrchr(p->path, '/')) == NULL)
+		base = p->path;
+	else
+		base++;
+	if (strncmp(base, "pack-", 5))
+		return EXIT_FAILURE;
+	return objid_parse(base + 5, name);
+}
+
+int
+pack_writer_begin(const char *dir, int sync, struct pack_writer **wp)
+{
+	int fd;
+	struct pack_header hdr;
+	struct pack_writer *w;
+
+	if (dir == NULL || wp == NULL)
+		return EXIT_FAILURE;
+	if ((w = calloc(1, sizeof(struct pack_writer))) == NULL)
+		return EXIT_FAILURE;
+	w->dir = strdup(dir);
+	w->sync = sync;
+	asprintf(&w->tmp_path, "%s/tmp.XXXXXX", dir);
+	if ((fd = mkstemp(w->tmp_path)) == -1) {
+		free(w->tmp_path);
+		w->tmp_path = NULL;
+		pack_writer_abort(w);
+		return EXIT_FAILURE;
+	}
+	if ((w->fp = fdopen(fd, "w")) == NULL) {
+		close(fd);
+		pack_writer_abort(w);
+		return EXIT_FAILURE;
+	}
+	/* the count is filled in by pack_writer_end() */
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, PACK_MAGIC, sizeof(hdr.magic));
+	hdr.version = htobe32(PACK_VERSION);
+	if (fwrite(&hdr, sizeof(hdr), 1, w->fp) != 1) {
+		pack_writer_abort(w);
+		return EXIT_FAILURE;
+	}
+	w->offset = sizeof(hdr);
+	*wp = w;
+	return EXIT_SUCCESS;
+}
+
+/*
+ * makes room for one more entry, filled in by the caller
+ */
+static struct pack_idx_entry *
+writer_entry(struct pack_writer *w, enum objtype type, u_int8_t flags, const u_int8_t *id)
+{
+	struct pack_idx_entry *e;
+
+	if (w->count == w->size) {
+		w->size = w->size ? w->size * 2 : 1024;
+		if ((e = reallocarray(w->entries, w->size, sizeof(struct pack_idx_entry))) == NULL)
+			return NULL;
+		w->entries = e;
+	}
+	e = &w->entries[w->count];
+	memset(e, 0, sizeof(*e));
+	memcpy(e->id, id, SHA256_DIGEST_LENGTH);
+	e->type = type;
+	e->flags = flags;
+	e->offset = w->offset;
+	return e;
+}
+
+static int
+writer_add(struct pack_writer *w, enum objtype type, u_int8_t flags, const u_int8_t *id,
+    const char *prefix, size_t plen, const char *data, size_t len)
+{
+	struct pack_idx_entry *e;
+
+	if (w == NULL || (data == NULL && len > 0))
+		return EXIT_FAILURE;
+	if ((e = writer_entry(w, type, flags, id)) == NULL)
+		return EXIT_FAILURE;
+	if (plen > 0 && fwrite(prefix, plen, 1, w->fp) != 1)
+		return EXIT_FAILURE;
+	if (len > 0 && fwrite(data, len, 1, w->fp) != 1)
+		return EXIT_FAILURE;
+	e->size = plen + len;
+	w->offset += plen + len;
+	w->count++;
+	return EXIT_SUCCESS;
+}
+
+/*
+ * PACK_F_DEFLATE for a file object that starts with an OBJ_DEFLATE header
+ */
+static u_int8_t
+deflate_flag(enum objtype type, const void *hdr, size_t len)
+{
+	size_t size;
+	int kind;
+
+	if (type != O_FILE || compress_header(hdr, len, &kind, &size) == EXIT_FAILURE)
+		return 0;
+	return kind == OBJ_DEFLATE ? PACK_F_DEFLATE : 0;
+}
+
+/*
+ * data is in the form kept in packs, or for file objects as written
+ * loose
+ */
+int
+pack_writer_add(struct pack_writer *w, enum objtype type, const struct objid *id, const char *data,
+    size_t len)
+{
+	return writer_add(w, type, deflate_flag(type, data, len), id->bytes, NULL, 0, data, len);
+}
+
+/*
+ * copies the whole content of fd, an object too large to be held in
+ * memory
+ */
+int
+pack_writer_add_fd(struct pack_writer *w, enum objtype type, const struct objid *id, int fd)
+{
+	char *buf, hdr[OBJ_HDR_LEN];
+	off_t off = 0;
+	ssize_t n;
+	struct pack_idx_entry *e;
+
+	if (w == NULL || (n = pread(fd, hdr, sizeof(hdr), 0)) == -1)
+		return EXIT_FAILURE;
+	if ((e = writer_entry(w, type, deflate_flag(type, hdr, n), id->bytes)) == NULL)
+		return EXIT_FAILURE;
+	if ((buf = malloc(COPY_BUF)) == NULL)
+		return EXIT_FAILURE;
+	while ((n = pread(fd, buf, COPY_BUF, off)) > 0) {
+		if (fwrite(buf, n, 1, w->fp) != 1)
+			break;
+		off += n;
+	}
+	free(buf);
+	if (n != 0)
+		return EXIT_FAILURE;
+	e->size = off;
+	w->offset += off;
+	w->count++;
+	return EXIT_SUCCESS;
+}
+
+/*
+ * the base has to be added to the same pack as well
+ */
+int
+pack_writer_add_delta(struct pack_writer *w, enum objtype type, const struct objid *id,
+    const struct objid *base, const char *delta, size_t len)
+{
+	return writer_add(w, type, PACK_F_DELTA, id->bytes, (const char *)base->bytes, OBJID_LEN, delta,
+	    len);
+}
+
+/*
+ * copies an object from another pack as is, the base of a delta has
+ * to be copied as well.
+ */
+int
+pack_writer_copy(struct pack_writer *w, struct pack *p, const struct pack_idx_entry *src)
+{
+	const char *data;
+	size_t size;
+
+	if (w == NULL || p == NULL || src == NULL)
+		return EXIT_FAILURE;
+	if ((data = entry_data(p, src, &size)) == NULL)
+		return EXIT_FAILURE;
+	return writer_add(w, src->type, src->flags, src->id, NULL, 0, data, size);
+}
+
+static int
+entry_cmp(const void *a, const void *b)
+{
+	const struct pack_idx_entry *e1 = a, *e2 = b;
+	int cmp;
+
+	if ((cmp = memcmp(e1->id, e2->id, sizeof(e1->id))) != 0)
+		return cmp;
+	return (int)e1->type - (int)e2->type;
+}
+
+/*
+ * sorts the index, writes it out and moves both files into place.
+ * the index is renamed last, a pack without an index is never opened.
+ */
+int
+pack_writer_end(struct pack_writer *w, char **name)
+{
+	char hex[OBJID_HEXLEN + 1];
+	char *data_path = NULL, *idx_path = NULL, *idx_tmp = NULL;
+	int fd, retval = EXIT_FAILURE;
+	u_int32_t i, n, fanout[PACK_FANOUT];
+	struct objid digest;
+	struct pack_header hdr;
+	struct hash_ctx hash_ctx;
+	FILE *fp = NULL;
+
+	if (w == NULL)
+		return EXIT_FAILURE;
+	/* sort and drop duplicates */
+	qsort(w->entries, w->count, sizeof(struct pack_idx_entry), entry_cmp);
+	for (i = 0, n = 0 ; i < w->count ; i++) {
+		if (n > 0 && entry_cmp(&w->entries[n - 1], &w->entries[i]) == 0)
+			continue;
+		w->entries[n++] = w->entries[i];
+	}
+	w->count = n;
+
+	memset(fanout, 0, sizeof(fanout));
+	hash_init(&hash_ctx);
+	for (i = 0 ; i < w->count ; i++) {
+		fanout[w->entries[i].id[0]]++;
+		hash_update(&hash_ctx, w->entries[i].id, SHA256_DIGEST_LENGTH);
+	}
+	hash_final(&hash_ctx, digest.bytes);
+	objid_hex(&digest, hex);
+	for (i = 1 ; i < PACK_FANOUT ; i++)
+		fanout[i] += fanout[i - 1];
+	for (i = 0 ; i < PACK_FANOUT ; i++)
+		fanout[i] = htobe32(fanout[i]);
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, PACK_MAGIC, sizeof(hdr.magic));
+	hdr.version = htobe32(PACK_VERSION);
+	hdr.count = htobe32(w->count);
+	if (fseeko(w->fp, 0, SEEK_SET) == -1 || fwrite(&hdr, sizeof(hdr), 1, w->fp) != 1)
+		goto ret;
+	/* both files are on disk before any of them has a name */
+	if (fflush(w->fp) != 0 || (w->sync && fsync(fileno(w->fp)) == -1))
+		goto ret;
+	if (fclose(w->fp) != 0) {
+		w->fp = NULL;
+		goto ret;
+	}
+	w->fp = NULL;
+
+	/* write the index */
+	asprintf(&idx_tmp, "%s/tmp.XXXXXX", w->dir);
+	if ((fd = mkstemp(idx_tmp)) == -1)
+		goto ret;
+	if ((fp = fdopen(fd, "w")) == NULL) {
+		close(fd);
+		goto ret;
+	}
+	memcpy(hdr.magic, PACK_IDX_MAGIC, sizeof(hdr.magic));
+	if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1)
+		goto ret;
+	if (fwrite(fanout, sizeof(fanout), 1, fp) != 1)
+		goto ret;
+	for (i = 0 ; i < w->count ; i++) {
+		w->entries[i].offset = htobe64(w->entries[i].offset);
+		w->entries[i].size = htobe64(w->entries[i].size);
+	}
+	if (w->count > 0 && fwrite(w->entries, sizeof(struct pack_idx_entry), w->count, fp) != w->count)
+		goto ret;
+	if (fflush(fp) != 0 || (w->sync && fsync(fileno(fp)) == -1))
+		goto ret;
+	if (fclose(fp) != 0) {
+		fp = NULL;
+		goto ret;
+	}
+	fp = NULL;
+
+	asprintf(&data_path, "%s/pack-%s.pack", w->dir, hex);
+	asprintf(&idx_path, "%s/pack-%s.idx", w->dir, hex);
+	if (rename(w->tmp_path, data_path) == -1)
+		goto ret;
+	free(w->tmp_path);
+	w->tmp_path = NULL;
+	if (rename(idx_tmp, idx_path) == -1) {
+		unlink(data_path);
+		goto ret;
+	}
+	free(idx_tmp);
+	idx_tmp = NULL;
+	if (name != NULL)
+		asprintf(name, "%s/pack-%s", w->dir, hex);
+	retval = EXIT_SUCCESS;
+ret:
+	if (fp != NULL)
+		fclose(fp);
+	if (idx_tmp != NULL) {
+		unlink(idx_tmp);
+		free(idx_tmp);
+	}
+	free(data_path);
+	free(idx_path);
+	pack_writer_abort(w);
+	return retval;
+}
+
+void
+pack_writer_abort(struct pack_writer *w)
+{
+	if (w == NULL)
+		return;
+	if (w->fp != NULL)
+		fclose(w->fp);
+	if (w->tmp_path != NULL) {
+		unlink(w->tmp_path);
+		free(w->tmp_path);
+	}
+	free(w->entries);
+	free(w->dir);
+	free(w);
+}
+
+static int
+obj_cmp(const void *a, const void *b)
+{
+	const struct pack_obj *o1 = a, *o2 = b;
+
+	if (o1->type != o2->type)
+		return (int)o1->type - (int)o2->type;
+	/* bigger first, deleting is cheaper to encode than adding */
+	if (o1->size != o2->size)
+		return o1->size < o2->size ? 1 : -1;
+	return objid_cmp(&o1->id, &o2->id);
+}
+
+/*
+ * tries every object against the ones just before it in the window and
+ * keeps the smallest delta, if any is at most half the object.
+ */
+static void *
+delta_worker(void *arg)
+{
+	char *buf, *delta;
+	size_t i, len, dlen, maxlen, n = 0;
+	int k;
+	struct delta_job *job = arg;
+	struct pack_obj *o, *b;
+	struct window_ent *win, *we;
+
+	if ((win = calloc(job->window, sizeof(struct window_ent))) == NULL)
+		return NULL;
+	for (i = job->start ; i < job->end ; i++) {
+		o = &job->objs[i];
+		if (o->type == O_COMMIT || o->size < DELTA_MIN_SIZE || o->size > DELTA_MAX_SIZE)
+			continue;
+		/* an object that can not be loaded is simply stored whole */
+		if (job->load(o, &buf, &len) == EXIT_FAILURE)
+			continue;
+		maxlen = len / 2;
+		for (k = 0 ; k < job->window ; k++) {
+			we = &win[k];
+			if (we->buf == NULL)
+				continue;
+			b = &job->objs[we->idx];
+			if (b->type != o->type || b->depth >= job->depth)
+				continue;
+			if (delta_create(we->buf, we->len, buf, len, maxlen, &delta, &dlen) == EXIT_FAILURE)
+				continue;
+			free(o->delta);
+			o->delta = delta;
+			o->delta_len = dlen;
+			o->base = we->idx;
+			o->depth = b->depth + 1;
+			maxlen = dlen - 1;
+			if (maxlen == 0)
+				break;
+		}
+		we = &win[n++ % job->window];
+		free(we->buf);
+		we->idx = i;
+		we->buf = buf;
+		we->len = len;
+	}
+	for (k = 0 ; k < job->window ; k++)
+		free(win[k].buf);
+	free(win);
+	return NULL;
+}
+
+/*
+ * sorts the objects by type and size, then splits them in contiguous
+ * runs searched for deltas in parallel. bases always come before their
+ * deltas in the sorted order.
+ */
+int
+pack_find_deltas(struct pack_obj *objs, size_t count, int window, int depth, int nthreads,
+    int (*load)(struct pack_obj *, char **, size_t *))
+{
+	size_t i, chunk;
+	int t;
+	long ncpu;
+	pthread_t *threads;
+	struct delta_job *jobs;
+
+	if (objs == NULL || load == NULL)
+		return EXIT_FAILURE;
+	qsort(objs, count, sizeof(struct pack_obj), obj_cmp);
+	for (i = 0 ; i < count ; i++) {
+		objs[i].base = -1;
+		objs[i].depth = 0;
+		objs[i].delta = NULL;
+		objs[i].delta_len = 0;
+	}
+	if (window <= 0 || depth <= 0 || count < 2)
+		return EXIT_SUCCESS;
+	if (nthreads <= 0) {
+		ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		nthreads = ncpu > 0 ? (int)ncpu : 1;
+	}
+	/* runs too short would lose most of their window at the edges */
+	while (nthreads > 1 && count / nthreads < (size_t)window * 4)
+		nthreads--;
+	jobs = calloc(nthreads, sizeof(struct delta_job));
+	threads = calloc(nthreads, sizeof(pthread_t));
+	if (jobs == NULL || threads == NULL) {
+		free(jobs);
+		free(threads);
+		return EXIT_FAILURE;
+	}
+	chunk = (count + nthreads - 1) / nthreads;
+	for (t = 0 ; t < nthreads ; t++) {
+		jobs[t].objs = objs;
+		jobs[t].start = t * chunk < count ? t * chunk : count;
+		jobs[t].end = (t + 1) * chunk < count ? (t + 1) * chunk : count;
+		jobs[t].window = window;
+		jobs[t].depth = depth;
+		jobs[t].load = load;
+	}
+	if (nthreads == 1)
+		delta_worker(&jobs[0]);
+	else {
+		for (t = 0 ; t < nthreads ; t++)
+			if (pthread_create(&threads[t], NULL, delta_worker, &jobs[t]) != 0)
+				break;
+		/* whatever could not get a thread runs here */
+		for (i = t ; i < (size_t)nthreads ; i++)
+			delta_worker(&jobs[i]);
+		while (t-- > 0)
+			pthread_join(threads[t], NULL);
+	}
+	free(jobs);
+	free(threads);
+	return EXIT_SUCCESS;
+}
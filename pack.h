@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) 2014 Mohamed Aslan <maslan@sce.carleton.ca>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _PACK_H_
+#define _PACK_H_
+
+#include <sys/types.h>
+
+#include <sha2.h>	/* SHA256_DIGEST_LENGTH */
+
+#include "objects.h"
+
+#define PACK_MAGIC	"BLPK"
+#define PACK_IDX_MAGIC	"BLIX"
+#define PACK_VERSION	2	/* 1 had no compressed entries, still read */
+#define PACK_FANOUT	256
+
+#define PACK_F_DELTA	0x01	/* base id followed by a delta, see delta.c */
+#define PACK_F_DEFLATE	0x02	/* a compressed loose object, see compress.h */
+
+#define PACK_WINDOW	10	/* default delta search window */
+#define PACK_DEPTH	50	/* default cap on delta chains */
+#define PACK_MAXCHAIN	4096	/* chains longer than that are corrupt */
+#define PACK_CACHE_SIZE	(32 * 1024 * 1024)	/* delta base cache */
+
+/*
+ * on-disk format, all integers are big-endian.
+ *
+ * pack-<hex>.pack:	struct pack_header, then the objects back to back.
+ * pack-<hex>.idx:	struct pack_header, 256 cumulative counters indexed
+ *			by the first byte of the object id (fan-out), then
+ *			one struct pack_idx_entry per object sorted by id.
+ *
+ * the name of a pack is the SHA-256 of the sorted ids it contains.
+ * the base of a delta is always an object of the same type in the same
+ * pack. a file object handed to the writer as an OBJ_DEFLATE loose
+ * object is kept compressed, pack_get() inflates it.
+ */
+struct pack_header {
+	char magic[4];
+	u_int32_t version;
+	u_int32_t count;
+	u_int32_t reserved;	/* keeps the entries 8-byte aligned */
+};
+
+struct pack_idx_entry {
+	u_int8_t id[SHA256_DIGEST_LENGTH];
+	u_int64_t offset;
+	u_int64_t size;
+	u_int8_t type;
+	u_int8_t flags;
+	u_int8_t pad[6];
+};
+
+struct pack {
+	char *path;		/* without the .pack/.idx suffix */
+	u_int8_t *data;
+	size_t data_len;
+	u_int8_t *idx;
+	size_t idx_len;
+	u_int32_t count;
+	const u_int32_t *fanout;
+	const struct pack_idx_entry *entries;
+	int indexed;		/* covered by the multi-pack index */
+	struct pack *next;
+};
+
+/*
+ * an object to be written by repack, the delta search fills in the
+ * last four fields.
+ */
+struct pack_obj {
+	enum objtype type;
+	struct objid id;
+	size_t size;
+	size_t stored;				/* as kept, compressed or not */
+	char *path;				/* loose object */
+	struct pack *pack;			/* or packed object */
+	const struct pack_idx_entry *entry;
+	ssize_t base;
+	int depth;
+	char *delta;
+	size_t delta_len;
+};
+
+struct pack_writer;
+
+int pack_open(const char *, struct pack **);
+void pack_close(struct pack *);
+const struct pack_idx_entry* pack_lookup(struct pack *, enum objtype, const struct objid *);
+int pack_match(struct pack *, enum objtype, struct objid_match *);
+int pack_get(struct pack *, const struct pack_idx_entry *, char **, size_t *);
+int pack_object_size(struct pack *, const struct pack_idx_entry *, size_t *);
+int pack_peek(struct pack *, const struct pack_idx_entry *, void *, size_t *);
+int pack_map(struct pack *, const struct pack_idx_entry *, const char **, size_t *);
+void pack_entry_id(const struct pack_idx_entry *, struct objid *);
+int pack_name(const struct pack *, struct objid *);
+int pack_find_deltas(struct pack_obj *, size_t, int, int, int, int (*)(struct pack_obj *, char **, size_t *));
+int pack_writer_begin(const char *, int, struct pack_writer **);
+int pack_writer_add(struct pack_writer *, enum objtype, const struct objid *, const char *, size_t);
+int pack_writer_add_fd(struct pack_writer *, enum objtype, const struct objid *, int);
+int pack_writer_add_delta(struct pack_writer *, enum objtype, const struct objid *, const struct objid *, const char *,
+    size_t);
+int pack_writer_copy(struct pack_writer *, struct pack *, const struct pack_idx_entry *);
+int pack_writer_end(struct pack_writer *, char **);
+void pack_writer_abort(struct pack_writer *);
+
+#endif
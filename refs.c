@@ -0,0 +1,867 @@
+/*
+ * Copyright (c) 2014 Mohamed Aslan <maslan@sce.carleton.ca>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>	/* mmap(2) */
+#include <sys/stat.h>	/* mkdir(2), fstat(2) */
+
+#include <endian.h>	/* htobe32(3), be32toh(3) */
+#include <err.h>	/* warnx(3) */
+#include <errno.h>	/* errno */
+#include <fcntl.h>	/* open(2) */
+#include <fts.h>	/* fts_*(3) */
+#include <stdint.h>	/* UINT32_MAX */
+#include <stdio.h>	/* asprintf(3), rename(2) */
+#include <stdlib.h>	/* EXIT_*, mkstemp(3), qsort(3) */
+#include <string.h>	/* str*(3), mem*(3) */
+#include <time.h>	/* nanosleep(2) */
+#include <unistd.h>	/* fsync(2), unlink(2) */
+
+#include "objects.h"
+#include "refs.h"
+
+#define PACKED_FILE	"packed-refs"
+#define LOCK_FILE	"packed-refs.lock"
+#define LOCK_TRIES	500
+#define LOCK_WAIT	10	/* milliseconds between two tries */
+
+struct ref {
+	char *name;	/* with its namespace */
+	struct objid id;
+	int loose;
+};
+
+struct packed {
+	u_int8_t *map;
+	size_t len;
+	u_int32_t count;
+	const struct refs_entry *entries;
+	const char *names;
+	size_t names_len;
+};
+
+struct refs_update {
+	char *name;
+	int create;	/* the ref must not exist */
+	int check;	/* the ref must name old */
+	struct objid old;
+	struct objid new;
+};
+
+struct refs_tx {
+	char *db_dir;
+	struct refs_update *updates;
+	size_t n;
+	size_t max;
+};
+
+/*
+ * a name is a single path component that can be typed on a command line
+ */
+int
+refs_name_valid(const char *name)
+{
+	const char *p;
+
+	if (name == NULL || *name == '\0' || *name == '.' || strlen(name) > REFS_NAME_MAX)
+		return 0;
+	for (p = name ; *p != '\0' ; p++)
+		if (*p == '/' || *p <= ' ' || *p == 0x7f)
+			return 0;
+	return 1;
+}
+
+static char *
+loose_path(const char *db_dir, const char *ref)
+{
+	char *path = NULL;
+
+	if (!strncmp(ref, REFS_BRANCHES "/", sizeof(REFS_BRANCHES)))
+		asprintf(&path, "%s/%s/head", db_dir, ref);
+	else
+		asprintf(&path, "%s/%s", db_dir, ref);
+	return path;
+}
+
+/*
+ * 1 if the loose ref is there, 0 if it is not, -1 if it can not be read
+ */
+static int
+read_loose(const char *path, struct objid *id)
+{
+	char buf[OBJID_HEXLEN + 2];
+	ssize_t n;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return (errno == ENOENT || errno == ENOTDIR) ? 0 : -1;
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n == -1)
+		return -1;
+	buf[n] = '\0';
+	if (n > 0 && buf[n - 1] == '\n')
+		buf[--n] = '\0';
+	/* an empty head is a branch without commits */
+	memset(id, 0, sizeof(*id));
+	if (n > 0 && objid_parse(buf, id) == EXIT_FAILURE)
+		return -1;
+	return 1;
+}
+
+/*
+ * a missing packed-refs has no refs
+ */
+static int
+packed_open(const char *db_dir, struct packed *p)
+{
+	char *path = NULL;
+	int fd;
+	struct stat s;
+	const struct refs_header *hdr;
+
+	memset(p, 0, sizeof(struct packed));
+	asprintf(&path, "%s/%s", db_dir, PACKED_FILE);
+	if (path == NULL)
+		return EXIT_FAILURE;
+	fd = open(path, O_RDONLY);
+	free(path);
+	if (fd == -1)
+		return (errno == ENOENT) ? EXIT_SUCCESS : EXIT_FAILURE;
+	if (fstat(fd, &s) == -1 || (size_t)s.st_size < sizeof(struct refs_header)) {
+		close(fd);
+		return EXIT_FAILURE;
+	}
+	p->len = s.st_size;
+	p->map = mmap(NULL, p->len, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p->map == MAP_FAILED) {
+		p->map = NULL;
+		return EXIT_FAILURE;
+	}
+	hdr = (const struct refs_header *)p->map;
+	p->count = be32toh(hdr->count);
+	p->names_len = be32toh(hdr->names_len);
+	p->entries = (const struct refs_entry *)(p->map + sizeof(struct refs_header));
+	p->names = (const char *)(p->entries + p->count);
+	if (memcmp(hdr->magic, REFS_MAGIC, sizeof(hdr->magic)) ||
+	    be32toh(hdr->version) != REFS_VERSION ||
+	    p->len != sizeof(struct refs_header) + (size_t)p->count * sizeof(struct refs_entry) +
+	    p->names_len) {
+		munmap(p->map, p->len);
+		memset(p, 0, sizeof(struct packed));
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+static void
+packed_close(struct packed *p)
+{
+	if (p->map != NULL)
+		munmap(p->map, p->len);
+	memset(p, 0, sizeof(struct packed));
+}
+
+static const char *
+packed_name(const struct packed *p, u_int32_t i)
+{
+	size_t off, len;
+
+	off = be32toh(p->entries[i].name);
+	len = be32toh(p->entries[i].len);
+	if (off >= p->names_len || len >= p->names_len - off || p->names[off + len] != '\0')
+		return NULL;
+	return p->names + off;
+}
+
+/*
+ * 1 if the ref is packed, 0 if it is not, -1 if packed-refs is damaged
+ */
+static int
+packed_find(const struct packed *p, const char *ref, struct objid *id)
+{
+	u_int32_t lo = 0, hi = p->count, mid;
+	const char *name;
+	int cmp;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if ((name = packed_name(p, mid)) == NULL)
+			return -1;
+		if ((cmp = strcmp(ref, name)) == 0) {
+			memcpy(id->bytes, p->entries[mid].id, OBJID_LEN);
+			return 1;
+		}
+		if (cmp < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return 0;
+}
+
+/*
+ * the loose ref if there is one, the packed one otherwise
+ */
+static int
+ref_get(const char *db_dir, const char *ref, struct objid *id, int *found)
+{
+	char *path;
+	int r;
+	struct packed p;
+
+	if ((path = loose_path(db_dir, ref)) == NULL)
+		return EXIT_FAILURE;
+	r = read_loose(path, id);
+	free(path);
+	if (r == 0) {
+		if (packed_open(db_dir, &p) == EXIT_FAILURE)
+			return EXIT_FAILURE;
+		r = packed_find(&p, ref, id);
+		packed_close(&p);
+	}
+	if (r == -1)
+		return EXIT_FAILURE;
+	*found = r;
+	return EXIT_SUCCESS;
+}
+
+static int
+ref_cmp(const void *a, const void *b)
+{
+	const struct ref *x = a, *y = b;
+	int cmp;
+
+	if ((cmp = strcmp(x->name, y->name)) != 0)
+		return cmp;
+	/* loose refs first, they override the packed ones */
+	return y->loose - x->loose;
+}
+
+static int
+refs_add(struct ref **refs, size_t *n, size_t *max, const char *name, const struct objid *id,
+    int loose)
+{
+	struct ref *tmp;
+
+	if (*n == *max) {
+		*max = *max ? *max * 2 : 64;
+		if ((tmp = reallocarray(*refs, *max, sizeof(struct ref))) == NULL)
+			return EXIT_FAILURE;
+		*refs = tmp;
+	}
+	if (((*refs)[*n].name = strdup(name)) == NULL)
+		return EXIT_FAILURE;
+	(*refs)[*n].id = *id;
+	(*refs)[*n].loose = loose;
+	(*n)++;
+	return EXIT_SUCCESS;
+}
+
+static void
+refs_free(struct ref *refs, size_t n)
+{
+	size_t i;
+
+	for (i = 0 ; i < n ; i++)
+		free(refs[i].name);
+	free(refs);
+}
+
+static int
+collect_loose(const char *db_dir, const char *ns, struct ref **refs, size_t *n, size_t *max)
+{
+	char *ns_path = NULL, *ref = NULL, *path, *paths[2];
+	int r, retval = EXIT_FAILURE;
+	struct objid id;
+	FTS *dir;
+	FTSENT *entry;
+
+	asprintf(&ns_path, "%s/%s", db_dir, ns);
+	paths[0] = ns_path;
+	paths[1] = NULL;
+	if (ns_path == NULL || (dir = fts_open(paths, FTS_NOCHDIR, 0)) == NULL) {
+		free(ns_path);
+		return EXIT_FAILURE;
+	}
+	while ((entry = fts_read(dir)) != NULL) {
+		if (entry->fts_level == FTS_ROOTLEVEL)
+			continue;
+		if (entry->fts_info == FTS_D)
+			fts_set(dir, entry, FTS_SKIP);
+		/* branches are directories, tags are files, temp files start with a dot */
+		if (entry->fts_info != (strcmp(ns, REFS_BRANCHES) ? FTS_F : FTS_D) ||
+		    !refs_name_valid(entry->fts_name))
+			continue;
+		free(ref);
+		asprintf(&ref, "%s/%s", ns, entry->fts_name);
+		if (ref == NULL || (path = loose_path(db_dir, ref)) == NULL)
+			goto ret;
+		r = read_loose(path, &id);
+		free(path);
+		if (r == -1)
+			goto ret;
+		if (r == 1 && refs_add(refs, n, max, ref, &id, 1) == EXIT_FAILURE)
+			goto ret;
+	}
+	retval = EXIT_SUCCESS;
+ret:
+	fts_close(dir);
+	free(ref);
+	free(ns_path);
+	return retval;
+}
+
+/*
+ * every ref, sorted by name, loose refs in place of their packed copies
+ */
+static int
+refs_collect(const char *db_dir, struct ref **refs, size_t *n)
+{
+	const char *name;
+	size_t i, k, max = 0;
+	u_int32_t j;
+	struct objid id;
+	struct packed p;
+
+	*refs = NULL;
+	*n = 0;
+	if (packed_open(db_dir, &p) == EXIT_FAILURE)
+		return EXIT_FAILURE;
+	for (j = 0 ; j < p.count ; j++) {
+		memcpy(id.bytes, p.entries[j].id, OBJID_LEN);
+		if ((name = packed_name(&p, j)) == NULL ||
+		    refs_add(refs, n, &max, name, &id, 0) == EXIT_FAILURE)
+			goto fail;
+	}
+	packed_close(&p);
+	if (collect_loose(db_dir, REFS_BRANCHES, refs, n, &max) == EXIT_FAILURE ||
+	    collect_loose(db_dir, REFS_TAGS, refs, n, &max) == EXIT_FAILURE)
+		goto fail;
+	if (*n == 0)
+		return EXIT_SUCCESS;
+	qsort(*refs, *n, sizeof(struct ref), ref_cmp);
+	for (i = 1, k = 1 ; i < *n ; i++) {
+		if (strcmp((*refs)[k - 1].name, (*refs)[i].name) == 0)
+			free((*refs)[i].name);
+		else
+			(*refs)[k++] = (*refs)[i];
+	}
+	*n = k;
+	return EXIT_SUCCESS;
+fail:
+	packed_close(&p);
+	refs_free(*refs, *n);
+	*refs = NULL;
+	*n = 0;
+	return EXIT_FAILURE;
+}
+
+static int
+ref_name_cmp(const void *key, const void *elem)
+{
+	return strcmp(key, ((const struct ref *)elem)->name);
+}
+
+static struct ref *
+refs_find(struct ref *refs, size_t n, const char *name)
+{
+	return bsearch(name, refs, n, sizeof(struct ref), ref_name_cmp);
+}
+
+/*
+ * waits for the other writers, the lock is released by refs_unlock()
+ */
+static char *
+refs_lock(const char *db_dir)
+{
+	char *path = NULL;
+	int fd, i;
+	struct timespec ts = { 0, LOCK_WAIT * 1000000L };
+
+	asprintf(&path, "%s/%s", db_dir, LOCK_FILE);
+	if (path == NULL)
+		return NULL;
+	for (i = 0 ; i < LOCK_TRIES ; i++) {
+		if ((fd = open(path, O_WRONLY | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR)) != -1) {
+			close(fd);
+			return path;
+		}
+		if (errno != EEXIST)
+			break;
+		nanosleep(&ts, NULL);
+	}
+	if (errno == EEXIST)
+		warnx("error, %s is taken, remove it if no other command is running.", path);
+	free(path);
+	return NULL;
+}
+
+static void
+refs_unlock(char *lock)
+{
+	unlink(lock);
+	free(lock);
+}
+
+static int
+sync_dir(const char *path)
+{
+	int fd, retval = EXIT_SUCCESS;
+
+	if ((fd = open(path, O_RDONLY | O_DIRECTORY)) == -1)
+		return EXIT_FAILURE;
+	if (fsync(fd) == -1)
+		retval = EXIT_FAILURE;
+	close(fd);
+	return retval;
+}
+
+/*
+ * replaces packed-refs with the n sorted refs
+ */
+static int
+packed_write(const char *db_dir, const struct ref *refs, size_t n, int sync)
+{
+	char *path = NULL, *tmp = NULL, *names;
+	u_int8_t *buf = NULL;
+	size_t i, len, names_len = 0, off;
+	ssize_t nw;
+	int fd = -1, retval = EXIT_FAILURE;
+	struct refs_header *hdr;
+	struct refs_entry *e;
+
+	for (i = 0 ; i < n ; i++)
+		names_len += strlen(refs[i].name) + 1;
+	if (n > UINT32_MAX || names_len > UINT32_MAX)
+		return EXIT_FAILURE;
+	len = sizeof(struct refs_header) + n * sizeof(struct refs_entry) + names_len;
+	if ((buf = calloc(1, len)) == NULL)
+		return EXIT_FAILURE;
+	hdr = (struct refs_header *)buf;
+	memcpy(hdr->magic, REFS_MAGIC, sizeof(hdr->magic));
+	hdr->version = htobe32(REFS_VERSION);
+	hdr->count = htobe32(n);
+	hdr->names_len = htobe32(names_len);
+	e = (struct refs_entry *)(hdr + 1);
+	names = (char *)(e + n);
+	for (i = 0, off = 0 ; i < n ; i++) {
+		e[i].name = htobe32(off);
+		e[i].len = htobe32(strlen(refs[i].name));
+		memcpy(e[i].id, refs[i].id.bytes, OBJID_LEN);
+		memcpy(names + off, refs[i].name, strlen(refs[i].name) + 1);
+		off += strlen(refs[i].name) + 1;
+	}
+
+	asprintf(&path, "%s/%s", db_dir, PACKED_FILE);
+	asprintf(&tmp, "%s/.%s.XXXXXX", db_dir, PACKED_FILE);
+	if (path == NULL || tmp == NULL || (fd = mkstemp(tmp)) == -1)
+		goto ret;
+	for (off = 0 ; off < len ; off += nw)
+		if ((nw = write(fd, buf + off, len - off)) == -1)
+			break;
+	if (off != len || (sync && fsync(fd) == -1)) {
+		close(fd);
+		unlink(tmp);
+		goto ret;
+	}
+	close(fd);
+	/* readers see either the old refs or the new ones */
+	if (rename(tmp, path) == -1) {
+		unlink(tmp);
+		goto ret;
+	}
+	if (sync && sync_dir(db_dir) == EXIT_FAILURE)
+		goto ret;
+	retval = EXIT_SUCCESS;
+ret:
+	free(buf);
+	free(path);
+	free(tmp);
+	return retval;
+}
+
+/*
+ * folds the loose refs into packed-refs, then drops them: until they
+ * are gone they name what packed-refs does. the lock is held.
+ */
+static int
+pack_locked(const char *db_dir, int sync)
+{
+	char *path, *dir;
+	size_t i, n_loose = 0;
+	int retval = EXIT_FAILURE;
+	struct ref *refs;
+	size_t n;
+
+	if (refs_collect(db_dir, &refs, &n) == EXIT_FAILURE)
+		return EXIT_FAILURE;
+	for (i = 0 ; i < n ; i++)
+		n_loose += refs[i].loose;
+	if (n_loose == 0) {
+		retval = EXIT_SUCCESS;
+		goto ret;
+	}
+	if (packed_write(db_dir, refs, n, sync) == EXIT_FAILURE)
+		goto ret;
+	for (i = 0 ; i < n ; i++) {
+		if (!refs[i].loose || (path = loose_path(db_dir, refs[i].name)) == NULL)
+			continue;
+		unlink(path);
+		free(path);
+		if (strncmp(refs[i].name, REFS_BRANCHES "/", sizeof(REFS_BRANCHES)))
+			continue;
+		asprintf(&dir, "%s/%s", db_dir, refs[i].name);
+		if (dir != NULL)
+			rmdir(dir);
+		free(dir);
+	}
+	retval = EXIT_SUCCESS;
+ret:
+	refs_free(refs, n);
+	return retval;
+}
+
+int
+refs_pack(const char *db_dir, int sync)
+{
+	char *lock;
+	int retval;
+
+	if ((lock = refs_lock(db_dir)) == NULL)
+		return EXIT_FAILURE;
+	retval = pack_locked(db_dir, sync);
+	refs_unlock(lock);
+	return retval;
+}
+
+struct refs_tx *
+refs_tx_begin(const char *db_dir)
+{
+	struct refs_tx *tx;
+
+	if ((tx = calloc(1, sizeof(struct refs_tx))) == NULL)
+		return NULL;
+	if ((tx->db_dir = strdup(db_dir)) == NULL) {
+		free(tx);
+		return NULL;
+	}
+	return tx;
+}
+
+static struct refs_update *
+tx_add(struct refs_tx *tx, const char *ns, const char *name)
+{
+	struct refs_update *tmp, *u;
+
+	if (!refs_name_valid(name))
+		return NULL;
+	if (tx->n == tx->max) {
+		tx->max = tx->max ? tx->max * 2 : 8;
+		if ((tmp = reallocarray(tx->updates, tx->max, sizeof(struct refs_update))) == NULL)
+			return NULL;
+		tx->updates = tmp;
+	}
+	u = &tx->updates[tx->n];
+	memset(u, 0, sizeof(struct refs_update));
+	asprintf(&u->name, "%s/%s", ns, name);
+	if (u->name == NULL)
+		return NULL;
+	tx->n++;
+	return u;
+}
+
+/*
+ * the ref must not exist yet, a null id makes a branch without commits
+ */
+int
+refs_tx_create(struct refs_tx *tx, const char *ns, const char *name, const struct objid *id)
+{
+	struct refs_update *u;
+
+	if (tx == NULL || (u = tx_add(tx, ns, name)) == NULL)
+		return EXIT_FAILURE;
+	u->create = 1;
+	u->new = *id;
+	return EXIT_SUCCESS;
+}
+
+/*
+ * the ref must name old, if old is given
+ */
+int
+refs_tx_update(struct refs_tx *tx, const char *ns, const char *name, const struct objid *old,
+    const struct objid *new)
+{
+	struct refs_update *u;
+
+	if (tx == NULL || (u = tx_add(tx, ns, name)) == NULL)
+		return EXIT_FAILURE;
+	if (old != NULL) {
+		u->check = 1;
+		u->old = *old;
+	}
+	u->new = *new;
+	return EXIT_SUCCESS;
+}
+
+void
+refs_tx_abort(struct refs_tx *tx)
+{
+	size_t i;
+
+	if (tx == NULL)
+		return;
+	for (i = 0 ; i < tx->n ; i++)
+		free(tx->updates[i].name);
+	free(tx->updates);
+	free(tx->db_dir);
+	free(tx);
+}
+
+/*
+ * all the updates land in packed-refs with a single rename, once every
+ * loose ref is folded into it so that none of them can shadow an update.
+ * nothing changes if one of them does not hold.
+ */
+int
+refs_tx_commit(struct refs_tx *tx, int sync)
+{
+	char *lock;
+	size_t i, n = 0, max;
+	int retval = EXIT_FAILURE;
+	struct ref *refs = NULL, *r;
+	struct refs_update *u;
+
+	if (tx == NULL)
+		return EXIT_FAILURE;
+	if ((lock = refs_lock(tx->db_dir)) == NULL)
+		goto ret;
+	if (pack_locked(tx->db_dir, sync) == EXIT_FAILURE ||
+	    refs_collect(tx->db_dir, &refs, &n) == EXIT_FAILURE)
+		goto unlock;
+	max = n;
+	for (i = 0 ; i < tx->n ; i++) {
+		u = &tx->updates[i];
+		r = refs_find(refs, n, u->name);
+		if ((u->create && r != NULL) || (u->check && (r == NULL || objid_cmp(&r->id, &u->old))))
+			goto unlock;
+		if (r != NULL)
+			r->id = u->new;
+		else if (refs_add(&refs, &n, &max, u->name, &u->new, 0) == EXIT_FAILURE)
+			goto unlock;
+		else
+			qsort(refs, n, sizeof(struct ref), ref_cmp);
+	}
+	retval = packed_write(tx->db_dir, refs, n, sync);
+unlock:
+	refs_unlock(lock);
+ret:
+	refs_free(refs, n);
+	refs_tx_abort(tx);
+	return retval;
+}
+
+int
+refs_branch_create(const char *db_dir, const char *branch_name, const struct objid *head)
+{
+	struct objid null_id;
+	struct refs_tx *tx;
+
+	memset(&null_id, 0, sizeof(null_id));
+	if ((tx = refs_tx_begin(db_dir)) == NULL)
+		return EXIT_FAILURE;
+	if (refs_tx_create(tx, REFS_BRANCHES, branch_name, head ? head : &null_id) == EXIT_FAILURE) {
+		refs_tx_abort(tx);
+		return EXIT_FAILURE;
+	}
+	return refs_tx_commit(tx, 0);
+}
+
+int
+refs_branch_exists(const char *db_dir, const char *branch_name, int *exist)
+{
+	char *ref = NULL;
+	int retval;
+	struct objid id;
+
+	*exist = 0;
+	if (!refs_name_valid(branch_name))
+		return EXIT_SUCCESS;
+	asprintf(&ref, "%s/%s", REFS_BRANCHES, branch_name);
+	if (ref == NULL)
+		return EXIT_FAILURE;
+	retval = ref_get(db_dir, ref, &id, exist);
+	free(ref);
+	return retval;
+}
+
+/*
+ * the head is written loose and replaced by a rename, synced first if
+ * asked to
+ */
+int
+refs_branch_set_head(const char *db_dir, const char *branch_name, const struct objid *head_objid,
+    int sync)
+{
+	char *lock, *ref = NULL, *branch_dir = NULL, *tmp_name = NULL;
+	char *branch_head = NULL, hex[OBJID_HEXLEN + 1];
+	int fd, found, created = 0, retval = EXIT_FAILURE;
+	struct objid id;
+	FILE *head_fp;
+
+	if (!refs_name_valid(branch_name) || (lock = refs_lock(db_dir)) == NULL)
+		return EXIT_FAILURE;
+	asprintf(&ref, "%s/%s", REFS_BRANCHES, branch_name);
+	asprintf(&branch_dir, "%s/%s", db_dir, ref);
+	asprintf(&branch_head, "%s/head", branch_dir);
+	asprintf(&tmp_name, "%s/head.XXXXXX", branch_dir);
+	if (ref == NULL || branch_dir == NULL || branch_head == NULL || tmp_name == NULL)
+		goto ret;
+	/* a packed branch has no directory */
+	if (ref_get(db_dir, ref, &id, &found) == EXIT_FAILURE || !found)
+		goto ret;
+	if (mkdir(branch_dir, S_IRUSR | S_IWUSR | S_IXUSR) == 0)
+		created = 1;
+	else if (errno != EEXIST)
+		goto ret;
+	if ((fd = mkstemp(tmp_name)) == -1)
+		goto ret;
+	if ((head_fp = fdopen(fd, "w")) == NULL) {
+		close(fd);
+		unlink(tmp_name);
+		goto ret;
+	}
+	/* an empty head file is a branch without commits */
+	if (!objid_is_null(head_objid))
+		fprintf(head_fp, "%s", objid_hex(head_objid, hex));
+	if (fflush(head_fp) == EOF || (sync && fsync(fd) == -1)) {
+		fclose(head_fp);
+		unlink(tmp_name);
+		goto ret;
+	}
+	fclose(head_fp);
+	/* readers see either the old head or the new one */
+	if (rename(tmp_name, branch_head) == -1) {
+		unlink(tmp_name);
+		goto ret;
+	}
+	if (sync && sync_dir(branch_dir) == EXIT_FAILURE)
+		goto ret;
+	free(branch_dir);
+	asprintf(&branch_dir, "%s/%s", db_dir, REFS_BRANCHES);
+	if (sync && created && (branch_dir == NULL || sync_dir(branch_dir) == EXIT_FAILURE))
+		goto ret;
+	retval = EXIT_SUCCESS;
+ret:
+	refs_unlock(lock);
+	free(ref);
+	free(branch_dir);
+	free(tmp_name);
+	free(branch_head);
+	return retval;
+}
+
+int
+refs_branch_get_head(const char *db_dir, const char *branch_name, struct objid *head_objid)
+{
+	char *ref = NULL;
+	int found, retval;
+
+	if (branch_name == NULL || head_objid == NULL || !refs_name_valid(branch_name))
+		return EXIT_FAILURE;
+	asprintf(&ref, "%s/%s", REFS_BRANCHES, branch_name);
+	if (ref == NULL)
+		return EXIT_FAILURE;
+	retval = ref_get(db_dir, ref, head_objid, &found);
+	free(ref);
+	if (retval == EXIT_FAILURE || !found)
+		return EXIT_FAILURE;
+	return EXIT_SUCCESS;
+}
+
+int
+refs_tag_get(const char *db_dir, const char *tag_name, struct objid *id)
+{
+	char *ref = NULL;
+	int found, retval;
+
+	if (!refs_name_valid(tag_name))
+		return EXIT_FAILURE;
+	asprintf(&ref, "%s/%s", REFS_TAGS, tag_name);
+	if (ref == NULL)
+		return EXIT_FAILURE;
+	retval = ref_get(db_dir, ref, id, &found);
+	free(ref);
+	if (retval == EXIT_FAILURE || !found)
+		return EXIT_FAILURE;
+	return EXIT_SUCCESS;
+}
+
+static int
+refs_ls(const char *db_dir, const char *ns, const char *fmt)
+{
+	size_t i, len = strlen(ns);
+	struct ref *refs;
+	size_t n;
+
+	if (refs_collect(db_dir, &refs, &n) == EXIT_FAILURE)
+		return EXIT_FAILURE;
+	for (i = 0 ; i < n ; i++)
+		if (!strncmp(refs[i].name, ns, len) && refs[i].name[len] == '/')
+			printf(fmt, refs[i].name + len + 1);
+	refs_free(refs, n);
+	return EXIT_SUCCESS;
+}
+
+int
+refs_branch_ls(const char *db_dir)
+{
+	return refs_ls(db_dir, REFS_BRANCHES, "* %s\n");
+}
+
+int
+refs_tag_ls(const char *db_dir)
+{
+	return refs_ls(db_dir, REFS_TAGS, "%s\n");
+}
+
+/*
+ * the commits the refs name, the heads of the branches and the tags,
+ * branches without commits are left out
+ */
+int
+refs_heads(const char *db_dir, struct objid **heads, size_t *n)
+{
+	size_t i;
+	struct ref *refs;
+	size_t n_refs;
+
+	*heads = NULL;
+	*n = 0;
+	if (refs_collect(db_dir, &refs, &n_refs) == EXIT_FAILURE)
+		return EXIT_FAILURE;
+	if ((*heads = calloc(n_refs + 1, sizeof(struct objid))) == NULL) {
+		refs_free(refs, n_refs);
+		return EXIT_FAILURE;
+	}
+	for (i = 0 ; i < n_refs ; i++)
+		if (!objid_is_null(&refs[i].id))
+			(*heads)[(*n)++] = refs[i].id;
+	refs_free(refs, n_refs);
+	return EXIT_SUCCESS;
+}
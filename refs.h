@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2014 Mohamed Aslan <maslan@sce.carleton.ca>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _REFS_H_
+#define _REFS_H_
+
+#include <sys/types.h>
+
+#include "objects.h"
+
+#define REFS_BRANCHES	"branches"
+#define REFS_TAGS	"tags"
+
+#define REFS_MAGIC	"BLRF"
+#define REFS_VERSION	1
+#define REFS_NAME_MAX	255
+
+/*
+ * refs live in the db dir of a repository whatever its objdb backend,
+ * named by a namespace and a name: a branch names its last commit, or
+ * nothing before the first one, a tag names a commit.
+ *
+ * most of them are kept in packed-refs, sorted by their full name
+ * ("branches/master") so that one is found by a binary search. a loose
+ * ref overrides its packed copy: branches/<name>/head or tags/<name>,
+ * the hex id of the commit or nothing. the head of a branch is written
+ * loose, transactions and refs_pack() fold the loose refs into
+ * packed-refs. every writer holds packed-refs.lock, and packed-refs is
+ * only ever replaced by a rename.
+ *
+ * packed-refs, integers are big-endian:
+ *	struct refs_header
+ *	count struct refs_entry, sorted by name
+ *	names_len bytes of names, each one NUL terminated
+ */
+struct refs_header {
+	char magic[4];
+	u_int32_t version;
+	u_int32_t count;
+	u_int32_t names_len;
+};
+
+struct refs_entry {
+	u_int32_t name;		/* offset in the names */
+	u_int32_t len;
+	u_int8_t id[OBJID_LEN];
+};
+
+/* refs updated all at once, or not at all */
+struct refs_tx;
+
+int refs_name_valid(const char *);
+int refs_branch_create(const char *, const char *, const struct objid *);
+int refs_branch_exists(const char *, const char *, int *);
+int refs_branch_set_head(const char *, const char *, const struct objid *, int);
+int refs_branch_get_head(const char *, const char *, struct objid *);
+int refs_branch_ls(const char *);
+int refs_tag_get(const char *, const char *, struct objid *);
+int refs_tag_ls(const char *);
+int refs_heads(const char *, struct objid **, size_t *);
+int refs_pack(const char *, int);
+struct refs_tx *refs_tx_begin(const char *);
+int refs_tx_create(struct refs_tx *, const char *, const char *, const struct objid *);
+int refs_tx_update(struct refs_tx *, const char *, const char *, const struct objid *,
+    const struct objid *);
+int refs_tx_commit(struct refs_tx *, int);
+void refs_tx_abort(struct refs_tx *);
+
+#endif
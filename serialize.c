@@ -0,0 +1,383 @@
+/*
+ * Copyright (c) 2014 Mohamed Aslan <maslan@sce.carleton.ca>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+
+#include <stdio.h>	/* fprintf(3), snprintf(3) */
+#include <stdlib.h>	/* EXIT_*, malloc(3), strtol(3) */
+#include <string.h>	/* str*(3), mem*(3) */
+
+#include "hash.h"
+#include "objects.h"
+#include "serialize.h"
+
+/*
+ * cuts the next line of an in-memory object in place, NULL at the end.
+ * objects are loaded NUL terminated, so end itself may be written.
+ */
+char *
+next_line(char **pos, char *end, size_t *len)
+{
+	char *line = *pos, *nl;
+
+	if (line >= end)
+		return NULL;
+	if ((nl = memchr(line, '\n', end - line)) == NULL)
+		nl = end;
+	*nl = '\0';
+	*len = nl - line;
+	*pos = (nl == end) ? end : nl + 1;
+	return line;
+}
+
+static int
+is_dec(const char *str)
+{
+	if (str == NULL)
+		return 0;
+	do {
+		if (*str == '\0')
+			break;
+		if (*str >= '0' && *str <= '9')
+			continue;
+		return 0;
+	} while (*str++);
+	return 1;
+}
+
+static int
+is_oct(const char *str)
+{
+	if (str == NULL)
+		return 0;
+	do {
+		if (*str == '\0')
+			break;
+		if (*str >= '0' && *str <= '7')
+			continue;
+		return 0;
+	} while (*str++);
+	return 1;
+}
+
+/*
+ * objects are serialized from a list of pieces: the exact size is known
+ * before anything is copied, and each piece is hashed as it is copied.
+ */
+#define MAX_PIECES	24
+
+struct pieces {
+	const char *ptr[MAX_PIECES];
+	size_t len[MAX_PIECES];
+	int count;
+};
+
+static void
+piece_add(struct pieces *p, const char *ptr, size_t len)
+{
+	p->ptr[p->count] = ptr;
+	p->len[p->count] = len;
+	p->count++;
+}
+
+static void
+piece_str(struct pieces *p, const char *str)
+{
+	piece_add(p, str, (str == NULL) ? 0 : strlen(str));
+}
+
+static char *
+pieces_join(struct pieces *p, size_t *len, struct hash_ctx *hash)
+{
+	char *raw, *pos;
+	size_t size = 0;
+	int i;
+
+	for (i = 0 ; i < p->count ; i++)
+		size += p->len[i];
+	if ((raw = malloc(size + 1)) == NULL)
+		return NULL;
+	for (pos = raw, i = 0 ; i < p->count ; pos += p->len[i], i++) {
+		memcpy(pos, p->ptr[i], p->len[i]);
+		if (hash != NULL)
+			hash_update(hash, pos, p->len[i]);
+	}
+	*pos = '\0';
+	*len = size;
+	return raw;
+}
+
+/*
+ * converts struct commit to char*, hashing it on the way if hash is not NULL
+ */
+char*
+commit_serialize(struct commit *comm, size_t *len, struct hash_ctx *hash)
+{
+	char dir[OBJID_HEXLEN + 1], parent[OBJID_HEXLEN + 1];
+	char author_ts[24], committer_ts[24];
+	struct pieces p;
+
+	if (comm == NULL)
+		return NULL;
+	p.count = 0;
+	piece_str(&p, "dir ");
+	piece_add(&p, objid_hex(&comm->dir, dir), OBJID_HEXLEN);
+	/* TODO: support more than 1 parent */
+	if (comm->n_parents == 1) {
+		piece_str(&p, "\nparent ");
+		piece_add(&p, objid_hex(&comm->parents[0], parent), OBJID_HEXLEN);
+	}
+	else if (comm->n_parents != 0)
+		return NULL;
+	snprintf(author_ts, sizeof(author_ts), "%llu", (unsigned long long)comm->author.timestamp);
+	snprintf(committer_ts, sizeof(committer_ts), "%llu", (unsigned long long)comm->committer.timestamp);
+	piece_str(&p, "\nauthor ");
+	piece_str(&p, comm->author.name);
+	piece_str(&p, " <");
+	piece_str(&p, comm->author.email);
+	piece_str(&p, "> ");
+	piece_str(&p, author_ts);
+	piece_str(&p, "\ncommitter ");
+	piece_str(&p, comm->committer.name);
+	piece_str(&p, " <");
+	piece_str(&p, comm->committer.email);
+	piece_str(&p, "> ");
+	piece_str(&p, committer_ts);
+	piece_str(&p, "\n");
+	piece_str(&p, comm->message);
+	piece_str(&p, "\n");
+	return pieces_join(&p, len, hash);
+}
+
+/*
+ * parses "<name> <<email>> <timestamp>" in place
+ */
+static int
+user_deserialize(char *p1, struct user *u)
+{
+	char *p2;
+
+	/* find the name */
+	if ((p2 = strstr(p1, " <")) == NULL)
+		return EXIT_FAILURE;
+	*p2 = '\0';
+	u->name = p1;
+	/* find the email */
+	p1 = p2 + 2;
+	if ((p2 = strchr(p1, '>')) == NULL)
+		return EXIT_FAILURE;
+	*p2 = '\0';
+	u->email = p1;
+	/* find the timestamp */
+	p1 = p2 + 1;
+	if (*p1++ != ' ' || !is_dec(p1))
+		return EXIT_FAILURE;
+	/* OpenBSD time_t is now 64-bit */
+	/* FIXME: other POSIX systems still use 32-bit time_t */
+	u->timestamp = atoll(p1);
+	return EXIT_SUCCESS;
+}
+
+/*
+ * the commit is parsed in place, its strings point into raw which it
+ * owns afterwards on success
+ */
+int
+commit_deserialize(char *raw, size_t rawlen, struct commit *comm)
+{
+	char *line, *pos = raw, *end = raw + rawlen;
+	size_t len;
+
+	/* 1. */
+	/* find the commit's dir, "dir " + obj id */
+	if ((line = next_line(&pos, end, &len)) == NULL)
+		goto parse_error;
+	if (len != 4 + OBJID_HEXLEN || strncmp(line, "dir ", 4) != 0)
+		goto parse_error;
+	if (objid_parse(line + 4, &comm->dir) == EXIT_FAILURE)
+		goto parse_error;
+
+	/* 2. */
+	/* find the commit's parent */
+	/* TODO: support more than parent */
+	if ((line = next_line(&pos, end, &len)) == NULL)
+		goto parse_error;
+	if (strncmp(line, "parent ", 7) == 0) {
+		if (objid_parse(line + 7, &comm->parents[0]) == EXIT_FAILURE)
+			goto parse_error;
+		comm->n_parents = 1;
+
+		/* read the next line */
+		if ((line = next_line(&pos, end, &len)) == NULL)
+			goto parse_error;
+	}
+	else {
+		comm->n_parents = 0;
+	}
+
+	/* 3. */
+	/* find the commit's author */
+	if (strncmp(line, "author ", 7) != 0)
+		goto parse_error;
+	if (user_deserialize(line + 7, &comm->author) == EXIT_FAILURE)
+		goto parse_error;
+
+	/* 4. */
+	/* find the commit's committer */
+	if ((line = next_line(&pos, end, &len)) == NULL)
+		goto parse_error;
+	if (strncmp(line, "committer ", 10) != 0)
+		goto parse_error;
+	if (user_deserialize(line + 10, &comm->committer) == EXIT_FAILURE)
+		goto parse_error;
+
+	/* 5. */
+	/* find the commit's message, the rest of the object */
+	len = (size_t)(end - pos);
+	/* for now the max. size of a message is 1 MByte */
+	if (len >= 1048576)
+		goto bigmsg_error;
+	comm->message = pos;
+	/* drop the trailing new line added by commit_serialize() */
+	if (len > 0 && pos[len - 1] == '\n')
+		len--;
+	pos[len] = '\0';
+	comm->strings = raw;
+
+	return EXIT_SUCCESS;
+
+parse_error:
+	fprintf(stderr, "error parsing file, not a valid commit.\n");
+	return EXIT_FAILURE;
+bigmsg_error:
+	fprintf(stderr, "error parsing file, commit message too big.\n");
+	return EXIT_FAILURE;
+}
+
+/*
+ * converts struct dir to char*, hashing it on the way if hash is not
+ * NULL. every entry is written once at its place in a buffer of the
+ * exact size.
+ */
+char*
+dir_serialize(struct dir *dir, size_t *len, struct hash_ctx *hash)
+{
+	char *raw, *pos, *ent;
+	size_t i, namelen, size = 0;
+	mode_t mode;
+	int k;
+	struct dirent *it;
+
+	if (dir == NULL)
+		return NULL;
+	/* "<mode> <id> <name>\n", the mode takes 6 octal digits */
+	for (i = 0 ; i < dir->n_children ; i++)
+		size += 9 + OBJID_HEXLEN + strlen(dir->children[i].name);
+	if ((raw = malloc(size + 1)) == NULL)
+		return NULL;
+	for (pos = raw, i = 0 ; i < dir->n_children ; i++) {
+		it = &dir->children[i];
+		if (it->mode > 0777777) {
+			free(raw);
+			return NULL;
+		}
+		ent = pos;
+		for (mode = it->mode, k = 5 ; k >= 0 ; k--, mode >>= 3)
+			pos[k] = '0' + (mode & 07);
+		pos[6] = ' ';
+		objid_hex(&it->id, pos + 7);
+		pos[7 + OBJID_HEXLEN] = ' ';
+		pos += 8 + OBJID_HEXLEN;
+		namelen = strlen(it->name);
+		memcpy(pos, it->name, namelen);
+		pos += namelen;
+		*pos++ = '\n';
+		if (hash != NULL)
+			hash_update(hash, ent, pos - ent);
+	}
+	*pos = '\0';
+	*len = size;
+	return raw;
+}
+
+/*
+ * lines are "<mode> <id> <name>", with the mode and the id of fixed
+ * width. the dir is parsed in place, the names of its entries point
+ * into raw which it owns afterwards on success.
+ */
+int
+dir_deserialize(char *raw, size_t rawlen, struct dir *d)
+{
+	char *line, *pos = raw, *end = raw + rawlen;
+	size_t n;
+	struct dirent *q;
+
+	/* one entry per line */
+	for (n = 0 ; pos < end && (pos = memchr(pos, '\n', end - pos)) != NULL ; pos++)
+		n++;
+	if (baseline_dir_reserve(d, d->n_children + n + 1) == EXIT_FAILURE)
+		goto parse_error;
+	pos = raw;
+	while ((line = next_line(&pos, end, &n)) != NULL && n > 0) {
+		/* mode + obj id + at least 1 char name */
+		if (n < 9 + OBJID_HEXLEN || line[6] != ' ' || line[7 + OBJID_HEXLEN] != ' ')
+			goto parse_error;
+		line[6] = '\0';
+		line[7 + OBJID_HEXLEN] = '\0';
+		if (!is_oct(line))
+			goto parse_error;
+		if ((q = baseline_dir_add(d, NULL)) == NULL)
+			goto parse_error;
+		q->mode = strtol(line, NULL, 8);
+		if (objid_parse(line + 7, &q->id) == EXIT_FAILURE)
+			goto parse_error;
+		q->name = line + 8 + OBJID_HEXLEN;
+	}
+
+	d->names = raw;
+	/* dirs stored before they were sorted */
+	baseline_dir_sort(d);
+	return EXIT_SUCCESS;
+
+parse_error:
+	d->n_children = 0;
+	fprintf(stderr, "error parsing file, not a valid directory.\n");
+	return EXIT_FAILURE;
+}
+
+int
+commit_gen_id_and_serialize(struct commit *obj, char **raw, size_t *len)
+{
+	struct hash_ctx hash;
+
+	hash_init(&hash);
+	if ((*raw = commit_serialize(obj, len, &hash)) == NULL)
+		return EXIT_FAILURE;
+	hash_final(&hash, obj->id.bytes);
+	return EXIT_SUCCESS;
+}
+
+int
+dir_gen_id_and_serialize(struct dir *obj, char **raw, size_t *len)
+{
+	struct hash_ctx hash;
+
+	hash_init(&hash);
+	if ((*raw = dir_serialize(obj, len, &hash)) == NULL)
+		return EXIT_FAILURE;
+	hash_final(&hash, obj->id.bytes);
+	return EXIT_SUCCESS;
+}
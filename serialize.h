@@ -0,0 +1,38 @@
+/*
+ * Copyright (c) 2014 Mohamed Aslan <maslan@sce.carleton.ca>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _SERIALIZE_H_
+#define _SERIALIZE_H_
+
+#include <sys/types.h>
+
+#include "hash.h"
+#include "objects.h"
+
+/*
+ * the stored form of dirs and commits, the same for every objdb backend
+ * since ids are hashes of it. deserializing parses the raw object in
+ * place, the object owns it afterwards on success.
+ */
+char *next_line(char **, char *, size_t *);
+char *commit_serialize(struct commit *, size_t *, struct hash_ctx *);
+int commit_deserialize(char *, size_t, struct commit *);
+char *dir_serialize(struct dir *, size_t *, struct hash_ctx *);
+int dir_deserialize(char *, size_t, struct dir *);
+int commit_gen_id_and_serialize(struct commit *, char **, size_t *);
+int dir_gen_id_and_serialize(struct dir *, char **, size_t *);
+
+#endif
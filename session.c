@@ -16,23 +16,51 @@
 
 #include <stdio.h>		/* asprintf(3) */
 #include <stdlib.h>		/* EXIT_* */
+#include <string.h>		/* strcmp(3) */
 #include <limits.h>		/* PATH_MAX */
 #include <unistd.h>		/* getcwd(3) */
-#include <err.h>		/* errx(3) */
+#include <err.h>		/* errx(3), warnx(3) */
 
 #include "defaults.h"
 #include "config.h"
+#include "refs.h"
 #include "session.h"
 
 extern int objdb_baseline_get_ops(struct objdb_ops **);
+extern int objdb_log_get_ops(struct objdb_ops **);
+extern int objdb_mem_get_ops(struct objdb_ops **);
 extern int dircache_simple_get_ops(struct dircache_ops **);
 
+/* objdb backends, by the name the "objdb" variable of the config gives */
+static const struct {
+	const char *name;
+	int (*get_ops)(struct objdb_ops **);
+} backends[] = {
+	{"fs", objdb_baseline_get_ops},
+	{"log", objdb_log_get_ops},
+	{"mem", objdb_mem_get_ops}
+};
+
+int
+baseline_session_objdb(const char *name, struct objdb_ops **ops)
+{
+	size_t i;
+
+	if (name == NULL || *name == '\0')
+		name = BASELINE_OBJDB;
+	for (i = 0 ; i < sizeof(backends) / sizeof(backends[0]) ; i++)
+		if (!strcmp(backends[i].name, name))
+			return backends[i].get_ops(ops);
+	return EXIT_FAILURE;
+}
+
 int
 baseline_session_begin(struct session *s, u_int8_t options)
 {
 	char *config = NULL;
 
-	objdb_baseline_get_ops(&(s->db_ops));
+	/* until a repository says otherwise */
+	baseline_session_objdb(BASELINE_OBJDB, &(s->db_ops));
 	dircache_simple_get_ops(&(s->dc_ops));
 
 	if (getcwd((char *)s->cwd, sizeof(s->cwd)) == NULL)
@@ -47,16 +75,20 @@ baseline_session_begin(struct session *s, u_int8_t options)
 
 	if (s->repo_rootdir == NULL)
 		errx(EXIT_FAILURE, "error, no repository was found.");
-	if (s->db_ops->open(&(s->db_ctx), BASELINE_DB, s->repo_baselinedir) == EXIT_FAILURE)
-		return EXIT_FAILURE;
-	if (s->dc_ops->open(&(s->dc_ctx), s->db_ctx, s->db_ops, s->repo_rootdir, s->repo_baselinedir) == EXIT_FAILURE)
-		return EXIT_FAILURE;
 
-	/* load configurations */
+	/* load configurations, they name the objdb backend */
 	asprintf(&config, "%s/%s", s->repo_baselinedir, BASELINE_CONFIGFILE);
 	if (baseline_config_load(config) == EXIT_FAILURE)
 		errx(EXIT_FAILURE, "failed to load configurations.");
 	free(config);
+	free(s->db_ops);
+	if (baseline_session_objdb(baseline_config_get_val("objdb"), &(s->db_ops)) == EXIT_FAILURE)
+		errx(EXIT_FAILURE, "error, unknown objdb '%s'.", baseline_config_get_val("objdb"));
+
+	if (s->db_ops->open(&(s->db_ctx), BASELINE_DB, s->repo_baselinedir) == EXIT_FAILURE)
+		return EXIT_FAILURE;
+	if (s->dc_ops->open(&(s->dc_ctx), s->db_ctx, s->db_ops, s->repo_rootdir, s->repo_baselinedir) == EXIT_FAILURE)
+		return EXIT_FAILURE;
 
 	/* get current branch */
 	s->dc_ops->branch_get(s->dc_ctx, (char **)&(s->branch));
@@ -74,3 +106,57 @@ baseline_session_end(struct session *s)
 	return EXIT_SUCCESS;
 }
 
+/*
+ * where the refs live, whatever the objdb backend
+ */
+char *
+baseline_session_db_dir(struct session *s)
+{
+	char *db_dir = NULL;
+
+	asprintf(&db_dir, "%s/%s", s->db_ctx->db_path, s->db_ctx->db_name);
+	return db_dir;
+}
+
+/*
+ * the id of an object named by its full id or by a prefix of it that no
+ * other object of the same type shares, exits listing the candidates of
+ * an ambiguous one. a commit can also be named by a tag, or by a branch
+ * for its head.
+ */
+int
+baseline_session_resolve(struct session *s, enum objtype type, const char *name, struct objid *id)
+{
+	static const char *names[] = {"file", "dir", "commit"};
+	char hex[OBJID_HEXLEN + 1], *db_dir;
+	size_t i;
+	int found = 0;
+	struct objid_match m;
+
+	if (objid_parse(name, id) == EXIT_SUCCESS)
+		return EXIT_SUCCESS;
+	if (type == O_COMMIT && refs_name_valid(name) && (db_dir = baseline_session_db_dir(s)) != NULL) {
+		found = refs_tag_get(db_dir, name, id) == EXIT_SUCCESS ||
+		    (refs_branch_get_head(db_dir, name, id) == EXIT_SUCCESS && !objid_is_null(id));
+		free(db_dir);
+		if (found)
+			return EXIT_SUCCESS;
+	}
+	if (s->db_ops->resolve == NULL || objid_match_init(&m, name) == EXIT_FAILURE)
+		return EXIT_FAILURE;
+	if (s->db_ops->resolve(s->db_ctx, type, &m) == EXIT_FAILURE || m.count == 0) {
+		objid_match_free(&m);
+		return EXIT_FAILURE;
+	}
+	if (m.count == 1) {
+		*id = m.ids[0];
+		objid_match_free(&m);
+		return EXIT_SUCCESS;
+	}
+	warnx("error, \'%s\' names more than one %s:", name, names[type]);
+	for (i = 0 ; i < m.count && i < OBJID_MATCH_MAX ; i++)
+		fprintf(stderr, "\t%s\n", objid_hex(&m.ids[i], hex));
+	if (m.count > OBJID_MATCH_MAX)
+		fprintf(stderr, "\tand %zu more\n", m.count - OBJID_MATCH_MAX);
+	exit(EXIT_FAILURE);
+}
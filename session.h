@@ -40,7 +40,10 @@ struct session {
 	const char *branch;
 };
 
+int baseline_session_objdb(const char *, struct objdb_ops **);
 int baseline_session_begin(struct session *, u_int8_t);
 int baseline_session_end(struct session *);
+char *baseline_session_db_dir(struct session *);
+int baseline_session_resolve(struct session *, enum objtype, const char *, struct objid *);
 
 #endif